@@ -34,6 +34,7 @@
 
 #include <stdint.h>
 #include "iohandle.h"
+#include "engine.h"
 
 /* forward declare internally used structures */
 typedef struct coolmic_enc coolmic_enc_t;
@@ -59,10 +60,29 @@ typedef enum coolmic_enc_op {
 
     /* get and set quality
      * Argument is (double) in range -0.1 to 1.0.
+     * Opus applies a new value with the next packet. Vorbis applies it with the next restart.
      */
     COOLMIC_ENC_OP_GET_QUALITY = COOLMIC_ENC_OPCODE_GET(64),
     COOLMIC_ENC_OP_SET_QUALITY = COOLMIC_ENC_OPCODE_SET(64),
 
+    /* get and set frame size
+     * Argument is (double) frame duration in [ms].
+     * This is only supported by Opus. Valid values are 2.5, 5, 10, 20, 40, and 60 (the default).
+     * A new value takes effect with the next packet.
+     * With 20ms or less pages are flushed once they hold 20ms of audio to keep latency low.
+     */
+    COOLMIC_ENC_OP_GET_FRAME_SIZE = COOLMIC_ENC_OPCODE_GET(65),
+    COOLMIC_ENC_OP_SET_FRAME_SIZE = COOLMIC_ENC_OPCODE_SET(65),
+
+    /* get and set target bitrate
+     * Argument is (long int) bitrate in [bit/s] for all channels. 0 (the default) selects the bitrate by quality.
+     * Opus applies a new value with the next packet without restarting the stream.
+     * Vorbis uses managed bitrate (ABR) and applies it with the next restart.
+     * Setting it while Vorbis is running stores the value and returns COOLMIC_ERROR_NOSYS.
+     */
+    COOLMIC_ENC_OP_GET_BITRATE = COOLMIC_ENC_OPCODE_GET(66),
+    COOLMIC_ENC_OP_SET_BITRATE = COOLMIC_ENC_OPCODE_SET(66),
+
     /* Meta data: 128-191 */
 
     /* get and set metadata object
@@ -75,9 +95,22 @@ typedef enum coolmic_enc_op {
 /* Management of the encoder object */
 coolmic_enc_t      *coolmic_enc_new(const char *name, igloo_ro_t associated, const char *codec, uint_least32_t rate, unsigned int channels);
 
-/* Reset the encoder state */
+/* This returns the sample rate the codec needs to be fed with when the input has the given rate.
+ * If this differs from rate the input must be resampled. Returns 0 if the codec is unknown.
+ */
+uint_least32_t      coolmic_enc_get_native_rate(const char *codec, uint_least32_t rate);
+
+/* This returns 1 if the codec applies a new bitrate while running and 0 if it needs a restart or is unknown. */
+int                 coolmic_enc_can_update_bitrate(const char *codec);
+
+/* Reset the encoder state.
+ * The next data read is the start of a new stream. In asynchronous mode queued pages not yet read are dropped.
+ */
 int                 coolmic_enc_reset(coolmic_enc_t *self);
-/* control the encoder */
+/* control the encoder.
+ * In asynchronous mode changes are applied by the encoder thread before it's next page so this does not wait for it.
+ * Errors of resets, restarts, and stops are then logged and not returned. Requests specific to the codec still wait.
+ */
 int                 coolmic_enc_ctl(coolmic_enc_t *self, coolmic_enc_op_t op, ...);
 
 /* This is to attach the IO Handle of the PCM data stream that is to be passed to the encoder */
@@ -86,4 +119,21 @@ int                 coolmic_enc_attach_iohandle(coolmic_enc_t *self, coolmic_ioh
 /* This function is to get the IO Handle to read the encoded data from */
 coolmic_iohandle_t *coolmic_enc_get_iohandle(coolmic_enc_t *self);
 
+/* Asynchronous mode */
+/* In asynchronous mode the encoder runs on it's own thread and encodes into a queue of up to queue_size Ogg pages.
+ * Reads on the IO handle take the data from the queue so a slow reader does not delay encoding
+ * until the queue is full. Reads block until the encoder thread produced a page or failed to do so.
+ * This must be called before the first read. Asynchronous mode can not be disabled again.
+ */
+int                 coolmic_enc_set_async(coolmic_enc_t *self, size_t queue_size);
+
+/* This is like coolmic_enc_set_async() but the encoder runs as a task of the engine instead of it's own thread.
+ * Reads on the IO handle do not block but return 0 if the queue is empty.
+ * Reading the input should not block as that blocks a worker thread of the engine.
+ */
+int                 coolmic_enc_set_async_engine(coolmic_enc_t *self, size_t queue_size, coolmic_engine_t *engine);
+
+/* This returns the number of pages currently in the queue. */
+ssize_t             coolmic_enc_get_queue_fill(coolmic_enc_t *self);
+
 #endif
@@ -0,0 +1,55 @@
+/*
+ *      Copyright (C) Jordan Erickson                     - 2014-2020,
+ *      Copyright (C) Löwenfelsen UG (haftungsbeschränkt) - 2015-2020
+ *       on behalf of Jordan Erickson.
+ */
+
+/*
+ * This file is part of Cool Mic.
+ * 
+ * Cool Mic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Cool Mic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Cool Mic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file defines the API for the engine. The engine runs the work of many
+ * objects (e.g. many coolmic_simple_t) on a fixed set of worker threads.
+ *
+ * Each worker thread has it's own queue of tasks. A worker that runs out of tasks
+ * steals from the queues of the others. Tasks waiting for time to pass or for
+ * a file descriptor to become readable are handled by one additional thread.
+ */
+
+#ifndef __COOLMIC_DSP_ENGINE_H__
+#define __COOLMIC_DSP_ENGINE_H__
+
+#include <sys/types.h>
+#include <igloo/ro.h>
+
+/* forward declare internally used structures */
+typedef struct coolmic_engine coolmic_engine_t;
+
+/* Management of the engine object */
+/* threads is the number of worker threads. If 0 the number of CPUs is used.
+ * The threads are started right away and stopped when the last reference is released.
+ * All objects using the engine hold a reference to it.
+ */
+coolmic_engine_t   *coolmic_engine_new(const char *name, igloo_ro_t associated, size_t threads);
+
+/* This returns the number of worker threads. */
+ssize_t             coolmic_engine_get_threads(coolmic_engine_t *self);
+
+/* This returns the number of tasks currently attached to the engine. */
+ssize_t             coolmic_engine_get_tasks(coolmic_engine_t *self);
+
+#endif
@@ -31,12 +31,32 @@
 #ifndef __COOLMIC_DSP_IOHANDLE_H__
 #define __COOLMIC_DSP_IOHANDLE_H__
 
+#include <stdint.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <igloo/ro.h>
 
 /* forward declare internally used structures */
 typedef struct coolmic_iohandle coolmic_iohandle_t;
 
+/* Sample formats of PCM streams */
+typedef enum coolmic_iohandle_sample_format {
+    /* unknown or not a PCM stream */
+    COOLMIC_IOHANDLE_SAMPLE_FORMAT_NONE    = 0,
+    /* signed 16 bit, host byte order, interleaved */
+    COOLMIC_IOHANDLE_SAMPLE_FORMAT_S16     = 1
+} coolmic_iohandle_sample_format_t;
+
+/* Format of PCM streams */
+typedef struct coolmic_iohandle_format {
+    /* sample rate in [Hz] */
+    uint_least32_t rate;
+    /* number of channels */
+    unsigned int channels;
+    /* sample format */
+    coolmic_iohandle_sample_format_t sample_format;
+} coolmic_iohandle_format_t;
+
 /* Management of the IO Handle object */
 /* The constructor takes the following arguments:
  *
@@ -59,6 +79,75 @@ coolmic_iohandle_t *coolmic_iohandle_new(const char *name, igloo_ro_t associated
  */
 ssize_t             coolmic_iohandle_read(coolmic_iohandle_t *self, void *buffer, size_t len);
 
+/* Zero-copy interface */
+/* This sets the optional peek and consume callbacks of the backend.
+ * The peek function pointer is called to get a pointer to up to len bytes of data without
+ * consuming them. It returns the number of bytes available at the pointer with the same
+ * conventions as the read function. The data stays valid until the consume function is called.
+ * The consume function pointer is called to mark len bytes of the data returned by the last
+ * peek as used. It returns COOLMIC_ERROR_NONE on success.
+ * Both function pointers must be set or NULL.
+ */
+int                 coolmic_iohandle_set_peek(coolmic_iohandle_t *self, ssize_t(*peek)(void*,const void**,size_t), int(*consume)(void*,size_t));
+
+/* This function is to borrow a pointer to up to len bytes of data from the IO Handle.
+ * Short peeks can occur. The return value is as with coolmic_iohandle_read().
+ * The data stays valid until coolmic_iohandle_consume() or any other function is called on the handle.
+ * If the backend does not support peeking data is copied into an internal buffer.
+ */
+ssize_t             coolmic_iohandle_peek(coolmic_iohandle_t *self, const void **buffer, size_t len);
+
+/* This function marks len bytes of the data returned by the last coolmic_iohandle_peek() as used.
+ * len must not be larger than the value returned by coolmic_iohandle_peek().
+ * Calling it with len set to zero releases the data without consuming any of it.
+ */
+int                 coolmic_iohandle_consume(coolmic_iohandle_t *self, size_t len);
+
+/* This sets the optional scatter peek callback of the backend. It requires the peek and consume callbacks to be set.
+ * The peekv function pointer works like the peek function pointer but may return the data in up to *iovcnt buffers.
+ * It sets *iovcnt to the number of buffers used and returns the total number of bytes.
+ * Backends should split the data at natural boundaries such as Ogg pages.
+ */
+int                 coolmic_iohandle_set_peekv(coolmic_iohandle_t *self, ssize_t(*peekv)(void*,struct iovec*,size_t*,size_t));
+
+/* This function works like coolmic_iohandle_peek() but may return the data in up to *iovcnt buffers.
+ * *iovcnt is set to the number of buffers returned. The data is consumed with coolmic_iohandle_consume().
+ * If the backend does not support this a single buffer is returned.
+ */
+ssize_t             coolmic_iohandle_peekv(coolmic_iohandle_t *self, struct iovec *iov, size_t *iovcnt, size_t len);
+
+/* Readiness */
+/* This sets the optional callback of the backend returning a file descriptor for poll().
+ * The file descriptor must be readable when data is available or the backend reached EOF or failed.
+ * It must not be read from or written to by the caller.
+ */
+int                 coolmic_iohandle_set_pollfd(coolmic_iohandle_t *self, int(*pollfd)(void*));
+
+/* This gets a file descriptor to wait for data with poll().
+ * Returns COOLMIC_ERROR_NOSYS if the backend does not support this.
+ * Data already buffered by the IO Handle itself is not taken into account.
+ */
+int                 coolmic_iohandle_get_pollfd(coolmic_iohandle_t *self);
+
+/* PCM streams */
+/* This sets and gets the format of the stream.
+ * The format is set by the producer of the handle. Getting the format fails with COOLMIC_ERROR_INVAL if it is unknown.
+ */
+int                 coolmic_iohandle_set_format(coolmic_iohandle_t *self, const coolmic_iohandle_format_t *format);
+int                 coolmic_iohandle_get_format(coolmic_iohandle_t *self, coolmic_iohandle_format_t *format);
+/* This is used by consumers to check the format of a handle they are attached to.
+ * If the handle has no format yet it is set to format. Returns COOLMIC_ERROR_INVAL if the formats differ.
+ */
+int                 coolmic_iohandle_check_format(coolmic_iohandle_t *self, const coolmic_iohandle_format_t *format);
+
+/* These functions work like their byte based counterparts but in whole frames.
+ * They require the format to be set. The return values are in [Frame].
+ * Partial frames returned by the backend are kept in the handle for the next call.
+ */
+ssize_t             coolmic_iohandle_read_frames(coolmic_iohandle_t *self, void *buffer, size_t frames);
+ssize_t             coolmic_iohandle_peek_frames(coolmic_iohandle_t *self, const void **buffer, size_t frames);
+int                 coolmic_iohandle_consume_frames(coolmic_iohandle_t *self, size_t frames);
+
 /* This function is to test if we hit EOF while reading.
  * This is to test for EOF as the read function may return zero in some cases
  * such as non-blocking operation that is not to signal EOF.
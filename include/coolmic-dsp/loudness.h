@@ -0,0 +1,97 @@
+/*
+ *      Copyright (C) Jordan Erickson                     - 2014-2020,
+ *      Copyright (C) Löwenfelsen UG (haftungsbeschränkt) - 2015-2020
+ *       on behalf of Jordan Erickson.
+ */
+
+/*
+ * This file is part of Cool Mic.
+ * 
+ * Cool Mic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Cool Mic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Cool Mic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file defines the API for the loudness meter part of this library.
+ *
+ * The loudness meter measures loudness as defined by ITU-R BS.1770 and EBU R128.
+ * It works like the VU-Meter: set it up, attach a IO handle
+ * for the backend, call the read function and then the result function
+ * whenever you want to have the current information.
+ */
+
+#ifndef __COOLMIC_DSP_LOUDNESS_H__
+#define __COOLMIC_DSP_LOUDNESS_H__
+
+#include <stdint.h>
+#include <igloo/ro.h>
+#include "iohandle.h"
+
+/* maximum number of channels */
+#define COOLMIC_DSP_LOUDNESS_MAX_CHANNELS 16
+
+/* forward declare internally used structures */
+typedef struct coolmic_loudness coolmic_loudness_t;
+
+/* Delcare type for result */
+typedef struct {
+    /* General information about the stream */
+    /* Sample rate in [Hz] */
+    uint_least32_t rate;
+    /* Number of channels */
+    unsigned int channels;
+
+    /* Number of frames taken into account since the last reset. */
+    uint64_t frames;
+
+    /* All loudness values are in [LUFS]. They are -HUGE_VAL if not enough data is available. */
+    /* Momentary loudness (400ms window). */
+    double momentary;
+    /* Short-term loudness (3s window). */
+    double short_term;
+    /* Integrated (gated) loudness since the last reset. */
+    double integrated;
+    /* Loudness range in [LU] since the last reset. */
+    double range;
+} coolmic_loudness_result_t;
+
+/* Management of the loudness meter object */
+/* The channel weights default to 1.0. For 6 channels the Vorbis 5.1 order is assumed:
+ * the surround channels are weighted 1.41 and the LFE channel is ignored.
+ */
+coolmic_loudness_t *coolmic_loudness_new(const char *name, igloo_ro_t associated, uint_least32_t rate, unsigned int channels);
+
+/* Reset the loudness meter state. This discards all the allready collected data */
+int                 coolmic_loudness_reset(coolmic_loudness_t *self);
+
+/* This sets the weight of a channel as defined by ITU-R BS.1770. A weight of 0 excludes the channel. */
+int                 coolmic_loudness_set_channel_weight(coolmic_loudness_t *self, unsigned int channel, double weight);
+
+/* This is to attach the IO Handle of the PCM data stream that is to be passed to the analyzer */
+int                 coolmic_loudness_attach_iohandle(coolmic_loudness_t *self, coolmic_iohandle_t *handle);
+
+/* Read data from the IO Handle.
+ * This reads until reaching any error or maxlen bytes.
+ * If maxbytes is -1 a unspecified internal default is used.
+ * The data is directly processed and the internal state is updated.
+ * Returns the number of bytes actually read.
+ */
+ssize_t             coolmic_loudness_read(coolmic_loudness_t *self, ssize_t maxlen);
+
+/* Read the result into the structure pointed to by *result.
+ * Other than with the VU-Meter the internal state is not reset.
+ * Use coolmic_loudness_reset() to start a new measurement.
+ */
+int                 coolmic_loudness_result(coolmic_loudness_t *self, coolmic_loudness_result_t *result);
+
+#endif
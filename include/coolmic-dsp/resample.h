@@ -0,0 +1,65 @@
+/*
+ *      Copyright (C) Jordan Erickson                     - 2014-2020,
+ *      Copyright (C) Löwenfelsen UG (haftungsbeschränkt) - 2015-2020
+ *       on behalf of Jordan Erickson.
+ */
+
+/*
+ * This file is part of Cool Mic.
+ * 
+ * Cool Mic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Cool Mic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Cool Mic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file defines the API for the sample rate converter.
+ */
+
+#ifndef __COOLMIC_DSP_RESAMPLE_H__
+#define __COOLMIC_DSP_RESAMPLE_H__
+
+#include <stdint.h>
+#include <igloo/ro.h>
+#include "iohandle.h"
+
+#define COOLMIC_DSP_RESAMPLE_MAX_CHANNELS  16
+
+/* forward declare internally used structures */
+typedef struct coolmic_resample coolmic_resample_t;
+
+/* Quality presets, trading quality against CPU.
+ * When lowering the rate the number of taps is multiplied by rate_in/rate_out rounded up.
+ */
+typedef enum coolmic_resample_quality {
+    /* 16 taps per output sample, about 60dB stop band attenuation */
+    COOLMIC_RESAMPLE_QUALITY_LOW    = 0,
+    /* 32 taps per output sample, about 90dB stop band attenuation */
+    COOLMIC_RESAMPLE_QUALITY_MEDIUM = 1,
+    /* 64 taps per output sample, about 100dB stop band attenuation and a wider pass band */
+    COOLMIC_RESAMPLE_QUALITY_HIGH   = 2
+} coolmic_resample_quality_t;
+
+/* Management of the resampler object */
+/* This converts from rate_in to rate_out. Returns NULL if the ratio of the rates is not supported.
+ * rate_in must not be more than 24 times rate_out and rate_out divided by the greatest common divisor
+ * of both rates must not be more than 2560. This covers all pairs of the common rates from 8kHz to 192kHz.
+ */
+coolmic_resample_t    *coolmic_resample_new(const char *name, igloo_ro_t associated, uint_least32_t rate_in, uint_least32_t rate_out, unsigned int channels, coolmic_resample_quality_t quality);
+
+/* This is to attach the IO Handle to read the input signal from */
+int                    coolmic_resample_attach_iohandle(coolmic_resample_t *self, coolmic_iohandle_t *handle);
+
+/* This function is to get the IO Handle to read the resampled signal from */
+coolmic_iohandle_t    *coolmic_resample_get_iohandle(coolmic_resample_t *self);
+
+#endif
@@ -33,6 +33,7 @@
 #ifndef __COOLMIC_DSP_SHOUT_H__
 #define __COOLMIC_DSP_SHOUT_H__
 
+#include <stdint.h>
 #include "iohandle.h"
 
 /* forward declare internally used structures */
@@ -64,6 +65,16 @@ typedef struct coolmic_shout_config {
 /* configure remote connection */
 int              coolmic_shout_set_config(coolmic_shout_t *self, const coolmic_shout_config_t *conf);
 
+/* This adds a mirror. The stream is sent to all mirrors as well as to the server configured with
+ * coolmic_shout_set_config(). Each mirror has it's own send queue and connects, and reconnects on it's own.
+ * A slow or unreachable mirror does not hold back the others. A mirror falling too far behind is reconnected.
+ * This includes the server configured with coolmic_shout_set_config(): mirrors keep running while it is not connected
+ * as long as coolmic_shout_iter() or coolmic_shout_buffer() are called.
+ * Errors of mirrors are not reported by coolmic_shout_start() and coolmic_shout_iter().
+ * Returns the index of the new mirror. The server configured with coolmic_shout_set_config() has index 0.
+ */
+ssize_t          coolmic_shout_add_config(coolmic_shout_t *self, const coolmic_shout_config_t *conf);
+
 /* This allows setting station metadata. Station metadata must be set before coolmic_shout_start() is called.
  * key must be one of SHOUT_META_*.
  */
@@ -72,15 +83,55 @@ int              coolmic_shout_set_meta(coolmic_shout_t *self, const char *key,
 /* This is to attach the IO Handle of the Ogg data stream that is to be passed to the Icecast server */
 int              coolmic_shout_attach_iohandle(coolmic_shout_t *self, coolmic_iohandle_t *handle);
 
-/* Those two functions start and stop the connection to the server */
+/* Those two functions start and stop the connection to the server. Mirrors are not stopped. */
 int              coolmic_shout_start(coolmic_shout_t *self);
 int              coolmic_shout_stop(coolmic_shout_t *self);
+/* This disconnects all mirrors at the end of a session. They are connected again by the next call to coolmic_shout_iter() or coolmic_shout_buffer(). */
+int              coolmic_shout_stop_mirrors(coolmic_shout_t *self);
 
 /* This function is to iterate. It will check internal state and try to send more data
  * to the Icecast server. If needed it will read more encoded data from the IO Handle that was attached.
+ * If not connected this does the same as coolmic_shout_buffer() and returns COOLMIC_ERROR_UNCONNECTED.
  */
 int              coolmic_shout_iter(coolmic_shout_t *self);
 
+/* Event driven operation */
+/* This sets whether coolmic_shout_iter() waits to pace the stream, which is the default.
+ * If disabled coolmic_shout_iter() never waits. The caller then waits itself before the next iteration:
+ * for coolmic_shout_get_delay() ms if that is non-zero, otherwise until the file descriptor
+ * returned by coolmic_shout_get_pollfd() becomes readable.
+ */
+int              coolmic_shout_set_sync(coolmic_shout_t *self, int sync);
+
+/* This returns the time in [ms] until the next iteration is due. */
+int              coolmic_shout_get_delay(coolmic_shout_t *self);
+
+/* This returns a file descriptor for poll() that is readable when there is new data to send.
+ * Returns COOLMIC_ERROR_NOSYS if the attached IO Handle does not support this, see coolmic_iohandle_get_pollfd().
+ */
+int              coolmic_shout_get_pollfd(coolmic_shout_t *self);
+
 int              coolmic_shout_need_next_segment(coolmic_shout_t *self, int *need);
 
+/* Replay buffer */
+/* This sets the replay backlog in [ms]. 0 disables the replay buffer, which is the default.
+ * With the replay buffer the stream is kept for backlog ms. After a reconnect the stream is
+ * resumed with the headers of the stream followed by the data that did not reach the server,
+ * faster than real time. Data older than the backlog is dropped.
+ * Setting the backlog discards the buffered stream.
+ */
+int              coolmic_shout_set_replay(coolmic_shout_t *self, uint64_t backlog);
+
+/* This reads data from the IO Handle into the replay buffer and sends it to the mirrors without sending it to the server.
+ * Without replay buffer and mirrors the data is dropped.
+ * Call this regularly while not connected so no data is lost, the mirrors keep running, and the source is not held back.
+ */
+int              coolmic_shout_buffer(coolmic_shout_t *self);
+
+/* This gets statistics of the connection.
+ * backlog is the number of bytes queued for sending and sent is the total number of bytes passed to libshout.
+ * Both may be NULL.
+ */
+int              coolmic_shout_get_stats(coolmic_shout_t *self, size_t *backlog, uint64_t *sent);
+
 #endif
@@ -34,7 +34,10 @@
 #include <igloo/list.h>
 #include "shout.h"
 #include "transform.h"
+#include "resample.h"
+#include "vumeter.h"
 #include "simple-segment.h"
+#include "engine.h"
 
 /* forward declare internally used structures */
 typedef struct coolmic_simple coolmic_simple_t;
@@ -122,8 +125,25 @@ typedef enum coolmic_simple_event {
      * YOU MUST NOT ALTER THOSE VALUES.
      */
     COOLMIC_SIMPLE_EVENT_SEGMENT_DISCONNECT= 10,
+    /* The adaptive bitrate controller changed the bitrate.
+     * arg0 is a pointer to a const coolmic_simple_abr_decision_t.
+     * arg1 is undefined.
+     * YOU MUST NOT ALTER THOSE VALUES.
+     */
+    COOLMIC_SIMPLE_EVENT_BITRATE_CHANGED   = 11,
 } coolmic_simple_event_t;
 
+/* A decision of the adaptive bitrate controller */
+typedef struct coolmic_simple_abr_decision {
+    /* old and new bitrate in [bit/s] */
+    long int bitrate_old;
+    long int bitrate_new;
+    /* number of bytes queued for sending */
+    size_t backlog;
+    /* measured throughput of the connection in [bit/s] */
+    long int throughput;
+} coolmic_simple_abr_decision_t;
+
 /* Generic callback for events.
  *
  * Parameters:
@@ -152,27 +172,96 @@ coolmic_simple_t   *coolmic_simple_new(const char *name, igloo_ro_t associated,
 int                 coolmic_simple_start(coolmic_simple_t *self);
 int                 coolmic_simple_stop(coolmic_simple_t *self);
 
+/* Engine */
+/* This runs the worker, the encoders and the senders of the additional outputs as tasks of the engine
+ * instead of their own threads. This allows running many instances on a fixed number of threads.
+ * NULL returns to threads. This must be set while the worker is not running.
+ * Encoders take the setting with the next segment.
+ * The events are emitted from the worker threads of the engine. The thread pointer passed to the callback
+ * still identifies the worker of this instance. coolmic_simple_stop() must not be called from the callback.
+ * The input should not block on reads as that blocks a worker thread of the engine.
+ */
+int                 coolmic_simple_set_engine(coolmic_simple_t *self, coolmic_engine_t *engine);
+
 /* status callbacks */
 int                 coolmic_simple_set_callback(coolmic_simple_t *self, coolmic_simple_callback_t callback, void *userdata);
 
 /* VU-Meter control */
-/* This sets the VU-Meter interval.
- * Useful values are in range of [10:400].
- * Setting this to 0 disables regular VU-Meter events.
- * Setting this to any value may cause a out of sync event to update values to the new interval.
+/* This sets the VU-Meter interval in [ms] of audio. The default is 100ms.
+ * Useful values are in range of [10:1000].
+ * Setting this to 0 disables regular VU-Meter results.
+ * A new result is published by the worker thread and emitted as COOLMIC_SIMPLE_EVENT_VUMETER_RESULT
+ * every interval.
  */
 int                 coolmic_simple_set_vumeter_interval(coolmic_simple_t *self, size_t vumeter_interval);
 /* This sets the current VU-Meter interval.
  */
 ssize_t             coolmic_simple_get_vumeter_interval(coolmic_simple_t *self);
+/* This reads the last published VU-Meter result.
+ * This can be called from any thread at any rate. It does not lock and never blocks the worker thread.
+ * Returns COOLMIC_ERROR_INVAL if no result was published yet.
+ */
+int                 coolmic_simple_get_vumeter_result(coolmic_simple_t *self, coolmic_vumeter_result_t *result);
 
 /* Quality level */
 /* This sets quality level for quality based codecs such as Vorbis.
  * Range is from -0.1 to 1.0.
+ * Opus applies the new quality immediately. Vorbis needs coolmic_simple_restart_encoder().
  */
 int                 coolmic_simple_set_quality(coolmic_simple_t *self, double quality);
 double              coolmic_simple_get_quality(coolmic_simple_t *self);
 
+/* Bitrate */
+/* This sets the target bitrate in [bit/s]. 0 selects the bitrate by the quality level.
+ * Opus applies the new bitrate immediately. Vorbis needs coolmic_simple_restart_encoder(),
+ * while it is running the bitrate is stored and COOLMIC_ERROR_NOSYS is returned.
+ */
+int                 coolmic_simple_set_bitrate(coolmic_simple_t *self, long int bitrate);
+int                 coolmic_simple_get_bitrate(coolmic_simple_t *self, long int *bitrate);
+
+/* Adaptive bitrate */
+/* This enables the adaptive bitrate controller. It watches the backlog and throughput of the connection
+ * and steps the bitrate down when the connection is congested and slowly up again when it recovered.
+ * The bitrate is kept in range of [min_bitrate:max_bitrate] in [bit/s] and starts at max_bitrate.
+ * Every change is emitted as COOLMIC_SIMPLE_EVENT_BITRATE_CHANGED once the encoder applied it.
+ * Setting max_bitrate to 0 disables the controller. It is disabled by default.
+ * This needs a codec that changes the bitrate while running, see coolmic_enc_can_update_bitrate().
+ * For others, such as Vorbis, COOLMIC_ERROR_NOSYS is returned.
+ */
+int                 coolmic_simple_set_abr(coolmic_simple_t *self, long int min_bitrate, long int max_bitrate);
+int                 coolmic_simple_get_abr(coolmic_simple_t *self, long int *min_bitrate, long int *max_bitrate);
+
+/* Replay buffer */
+/* This sets the replay backlog in [ms]. 0 disables the replay buffer, which is the default.
+ * With the replay buffer the audio is kept encoded while the connection is lost.
+ * After reconnecting the stream resumes where the server lost it and catches up faster than real time.
+ * At most backlog ms of audio are kept, older audio is dropped.
+ * This needs a reconnection profile. The backlog must be set while the worker is not running.
+ */
+int                 coolmic_simple_set_replay(coolmic_simple_t *self, uint64_t backlog);
+int                 coolmic_simple_get_replay(coolmic_simple_t *self, uint64_t *backlog);
+
+/* Mirrors */
+/* This adds a mirror to the main output, see coolmic_shout_add_config().
+ * The encoded stream is sent to the mirror as well without encoding it again.
+ * Mirrors keep running when the main connection is lost, even if it is not reconnected, until coolmic_simple_stop() is called.
+ * Mirrors must be added while the worker is not running.
+ * Returns the index of the new mirror.
+ */
+ssize_t             coolmic_simple_add_mirror(coolmic_simple_t *self, const coolmic_shout_config_t *conf);
+
+/* Simulcast */
+/* This adds an additional output. The captured audio is passed through the same transform
+ * and then encoded using codec, quality, and bitrate (see above) and sent to the server
+ * configured by conf. Each output runs it's own encoder and connection in parallel.
+ * Additional outputs only carry live segments. An output falling behind drops audio and
+ * does not hold back the others. If it loses it's connection it reconnects on it's own.
+ * Outputs keep running when the main connection is lost, even if it is not reconnected, until coolmic_simple_stop() is called.
+ * Outputs must be added while the worker is not running. They are connected with the next segment.
+ * Returns the index of the new output. The output given to coolmic_simple_new() has index 0.
+ */
+ssize_t             coolmic_simple_add_output(coolmic_simple_t *self, const char *codec, double quality, long int bitrate, const coolmic_shout_config_t *conf);
+
 /* Simple metadata function */
 /* This allows very simple manipulation of the meta data.
  * If replace is false the value is added to the key. If true the value is replaced by the new one.
@@ -198,10 +287,27 @@ int                 coolmic_simple_restart_encoder(coolmic_simple_t *self);
  */
 coolmic_transform_t *coolmic_simple_get_transform(coolmic_simple_t *self);
 
+/* Resampling */
+/* If the codec needs a different sample rate than the input (e.g. Opus always runs at 48kHz)
+ * a resampler is inserted in front of the encoder automatically.
+ * This sets the quality of that resampler. The default is COOLMIC_RESAMPLE_QUALITY_MEDIUM.
+ * A new value takes effect with the next segment.
+ */
+int                 coolmic_simple_set_resample_quality(coolmic_simple_t *self, coolmic_resample_quality_t quality);
+int                 coolmic_simple_get_resample_quality(coolmic_simple_t *self, coolmic_resample_quality_t *quality);
+
 
 /* Auto-Reconnect support */
 /* This sets and gets the reconnection profile.
  * The profile returned by the getter is valid only until altered using the setter or destruction of the object.
+ * Known profiles are:
+ *  "disabled"     Do not reconnect. This is the default.
+ *  "flat"         Reconnect after 10 seconds. "enabled" is an alias.
+ *  "exponential"  Reconnect after 1 second, doubling the delay with each attempt up to 60 seconds.
+ *  "jittered"     Like "exponential" but with each delay randomly shortened by up to half.
+ *                 This avoids many clients reconnecting to the same server at once.
+ *  "immediate"    Reconnect right away first, then like "jittered".
+ * The delay starts over after a successful connect.
  */
 int                 coolmic_simple_set_reconnection_profile(coolmic_simple_t *self, const char *profile);
 int                 coolmic_simple_get_reconnection_profile(coolmic_simple_t *self, const char **profile);
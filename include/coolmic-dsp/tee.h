@@ -29,17 +29,90 @@
 #ifndef __COOLMIC_DSP_TEE_H__
 #define __COOLMIC_DSP_TEE_H__
 
+#include <stdint.h>
 #include "iohandle.h"
 
 typedef struct coolmic_tee coolmic_tee_t;
 
+/* Policies for readers falling behind by more than the buffer size */
+typedef enum coolmic_tee_overflow_policy {
+    /* The reader holds back the input until it consumed the data. This is the default. */
+    COOLMIC_TEE_OVERFLOW_BLOCK      = 0,
+    /* The reader does not hold back the input. If overrun the oldest data is dropped for this reader. */
+    COOLMIC_TEE_OVERFLOW_DROP       = 1,
+    /* The reader does not hold back the input. If overrun the reader is detached. */
+    COOLMIC_TEE_OVERFLOW_DETACH     = 2
+} coolmic_tee_overflow_policy_t;
+
 /* Management of the tee object */
+/* readers is the number of readers to set up at creation time.
+ * Those readers hold all data from the start of the stream until their IO handle is requested.
+ * More readers can be added at any time using coolmic_tee_get_iohandle(self, -1).
+ */
 coolmic_tee_t      *coolmic_tee_new(const char *name, igloo_ro_t associated, size_t readers);
 
+/* This sets the size of the internal ring buffer in [Byte].
+ * The size is rounded up to the next power of two.
+ * The buffer must be big enough to hold all the data the fastest reader is ahead of the slowest one.
+ * Returns COOLMIC_ERROR_BUSY if the buffer currently holds more data than would fit the new size.
+ * Only readers using COOLMIC_TEE_OVERFLOW_BLOCK are taken into account for this.
+ */
+int                 coolmic_tee_set_buffer_size(coolmic_tee_t *self, size_t size);
+size_t              coolmic_tee_get_buffer_size(coolmic_tee_t *self);
+
 /* This is to attach the IO Handle the tee module should read from */
 int                 coolmic_tee_attach_iohandle(coolmic_tee_t *self, coolmic_iohandle_t *handle);
 
-/* This function is to get the IO Handles users can read from */
+/* This function is to get the IO Handles users can read from.
+ * If index is -1 the first reader without a IO handle is used. If there is none a new reader is attached.
+ * A reader added at runtime starts reading at the current position of the stream.
+ * When the last IO handle of a reader is released the reader is detached.
+ * The IO handles inherit the format of the input IO handle if it is known.
+ * The cost of a read does not depend on the number of readers.
+ */
 coolmic_iohandle_t *coolmic_tee_get_iohandle(coolmic_tee_t *self, ssize_t index);
 
+/* This detaches a reader at runtime.
+ * The reader no longer holds back the other readers. Reads on it's IO handles will fail.
+ * Requesting a IO handle for the reader again will attach it at the current position of the stream.
+ */
+int                 coolmic_tee_detach_reader(coolmic_tee_t *self, size_t index);
+
+/* This returns the number of currently attached readers. */
+size_t              coolmic_tee_get_readers(coolmic_tee_t *self);
+
+/* Concurrent mode */
+/* All functions of the tee and it's IO handles are thread safe.
+ * By default reads on the IO handles pull data from the input as needed.
+ * In concurrent mode the readers never read from the input. Instead a producer thread
+ * calls coolmic_tee_iter() in a loop to fill the buffer. Each reader can then be drained from
+ * it's own thread.
+ * The tee is not lock-free: a mutex protects it's state and waiting threads use condition variables.
+ * Only copying data into and out of the buffer is done without holding the lock.
+ */
+int                 coolmic_tee_set_concurrent(coolmic_tee_t *self, int concurrent);
+
+/* This reads one chunk from the input into the buffer. It must only be called in concurrent mode.
+ * If the buffer is full it blocks until the slowest reader made room.
+ * Returns COOLMIC_ERROR_BUSY if not in concurrent mode or another thread is already producing.
+ */
+int                 coolmic_tee_iter(coolmic_tee_t *self);
+
+/* This sets whether reads on a reader block until data is available (the default).
+ * Non-blocking reads return 0 if no data is available.
+ * Outside of concurrent mode a non-blocking reader never reads from the input itself
+ * but only gets the data read by the other readers.
+ */
+int                 coolmic_tee_set_reader_blocking(coolmic_tee_t *self, size_t index, int blocking);
+
+/* Overflow handling */
+/* This sets the overflow policy of a reader, see coolmic_tee_overflow_policy_t. */
+int                 coolmic_tee_set_reader_overflow_policy(coolmic_tee_t *self, size_t index, coolmic_tee_overflow_policy_t policy);
+
+/* This gets the number of bytes a reader lost because of overflows. */
+int                 coolmic_tee_get_reader_dropped(coolmic_tee_t *self, size_t index, uint64_t *dropped);
+
+/* This sets the frame size in [Byte]. Readers only drop full frames. Defaults to 1. */
+int                 coolmic_tee_set_frame_size(coolmic_tee_t *self, size_t frame_size);
+
 #endif
@@ -52,4 +52,11 @@ coolmic_iohandle_t    *coolmic_transform_get_iohandle(coolmic_transform_t *self)
  */
 int                    coolmic_transform_set_master_gain(coolmic_transform_t *self, unsigned int channels, uint16_t scale, const uint16_t *gain);
 
+/* This sets the time in [ms] gain changes are ramped over. Defaults to 0 (instant).
+ * The ramp applies to gain changes set after this call. A change during a ramp continues from the current gain.
+ * The gain is passed to the audio path without locking it, so this can be called from any thread at any time.
+ */
+int                    coolmic_transform_set_master_gain_ramp(coolmic_transform_t *self, unsigned int ramp);
+unsigned int           coolmic_transform_get_master_gain_ramp(coolmic_transform_t *self);
+
 #endif
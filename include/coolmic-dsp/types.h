@@ -35,9 +35,12 @@ igloo_RO_FORWARD_TYPE(coolmic_shout_t);
 igloo_RO_FORWARD_TYPE(coolmic_simple_t);
 igloo_RO_FORWARD_TYPE(coolmic_tee_t);
 igloo_RO_FORWARD_TYPE(coolmic_vumeter_t);
+igloo_RO_FORWARD_TYPE(coolmic_loudness_t);
+igloo_RO_FORWARD_TYPE(coolmic_resample_t);
 igloo_RO_FORWARD_TYPE(coolmic_enc_t);
 igloo_RO_FORWARD_TYPE(coolmic_metadata_t);
 igloo_RO_FORWARD_TYPE(coolmic_simple_segment_t);
+igloo_RO_FORWARD_TYPE(coolmic_engine_t);
 
 #define COOLMIC_DSP_TYPES \
     igloo_RO_TYPE(coolmic_iohandle_t) \
@@ -45,8 +48,11 @@ igloo_RO_FORWARD_TYPE(coolmic_simple_segment_t);
     igloo_RO_TYPE(coolmic_simple_t) \
     igloo_RO_TYPE(coolmic_tee_t) \
     igloo_RO_TYPE(coolmic_vumeter_t) \
+    igloo_RO_TYPE(coolmic_loudness_t) \
+    igloo_RO_TYPE(coolmic_resample_t) \
     igloo_RO_TYPE(coolmic_enc_t) \
     igloo_RO_TYPE(coolmic_metadata_t) \
-    igloo_RO_TYPE(coolmic_simple_segment_t)
+    igloo_RO_TYPE(coolmic_simple_segment_t) \
+    igloo_RO_TYPE(coolmic_engine_t)
 
 #endif
@@ -80,6 +80,14 @@ typedef struct {
      * maximum sample value on this channel all the time.
      */
     double channel_power[COOLMIC_DSP_VUMETER_MAX_CHANNELS];
+
+    /* True peak (only if enabled with coolmic_vumeter_set_true_peak()).
+     * This is the peak of the signal after 4x oversampling as per ITU-R BS.1770
+     * and also catches peaks between samples.
+     * The values are in [dBTP]. They are -HUGE_VAL if true peak metering is disabled.
+     */
+    double global_true_peak;
+    double channel_true_peak[COOLMIC_DSP_VUMETER_MAX_CHANNELS];
 } coolmic_vumeter_result_t;
 
 /* Management of the VU-Meter object */
@@ -88,6 +96,10 @@ coolmic_vumeter_t  *coolmic_vumeter_new(const char *name, igloo_ro_t associated,
 /* Reset the VU-Meter state. This discards all the allready collected data */
 int                 coolmic_vumeter_reset(coolmic_vumeter_t *self);
 
+/* This enables or disables true peak metering. It is disabled by default. */
+int                 coolmic_vumeter_set_true_peak(coolmic_vumeter_t *self, int enable);
+int                 coolmic_vumeter_get_true_peak(coolmic_vumeter_t *self);
+
 /* This is to attach the IO Handle of the PCM data stream that is to be passed to the analyzer */
 int                 coolmic_vumeter_attach_iohandle(coolmic_vumeter_t *self, coolmic_iohandle_t *handle);
 
@@ -100,6 +112,20 @@ int                 coolmic_vumeter_attach_iohandle(coolmic_vumeter_t *self, coo
  */
 ssize_t             coolmic_vumeter_read(coolmic_vumeter_t *self, ssize_t maxlen);
 
+/* Snapshots */
+/* This sets the interval in [ms] of audio at which coolmic_vumeter_read() publishes a snapshot
+ * of the result. Publishing resets the internal state like coolmic_vumeter_result() does.
+ * Setting this to 0 disables snapshots. This is the default.
+ */
+int                 coolmic_vumeter_set_interval(coolmic_vumeter_t *self, unsigned int interval);
+ssize_t             coolmic_vumeter_get_interval(coolmic_vumeter_t *self);
+
+/* This reads the last published snapshot. It can be called from any thread and does not lock.
+ * If serial is not NULL it is set to the number of snapshots published so far.
+ * Returns COOLMIC_ERROR_INVAL if no snapshot was published yet.
+ */
+int                 coolmic_vumeter_get_snapshot(coolmic_vumeter_t *self, coolmic_vumeter_result_t *result, unsigned int *serial);
+
 /* Read the result into the structure pointed to by *result.
  * On successful call the internal state is reset after the result is read
  * such as by calling coolmic_vumeter_reset().
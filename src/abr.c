@@ -0,0 +1,135 @@
+/*
+ *      Copyright (C) Jordan Erickson                     - 2014-2020,
+ *      Copyright (C) Löwenfelsen UG (haftungsbeschränkt) - 2015-2020
+ *       on behalf of Jordan Erickson.
+ */
+
+/*
+ * This file is part of Cool Mic.
+ * 
+ * Cool Mic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Cool Mic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Cool Mic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Please see the corresponding header file for details of this API. */
+
+#include <stdint.h>
+#include "abr_private.h"
+
+/* length of a measuring interval in [ms] */
+#define INTERVAL            1000
+/* backlog in [ms] of audio above which the connection is congested */
+#define BACKLOG_HIGH        1500
+/* backlog in [ms] of audio below which the connection is fine */
+#define BACKLOG_LOW         250
+/* encoder queue fill above which the connection is congested or below which it is fine */
+#define QUEUE_FILL_HIGH     0.5
+#define QUEUE_FILL_LOW      0.125
+/* intervals without congestion before stepping up, doubled after every failed step up */
+#define UP_HOLD             10
+#define UP_HOLD_MAX         160
+/* step sizes */
+#define STEP_DOWN           0.75
+#define STEP_UP             1.125
+/* fraction of the measured throughput to aim for when stepping down */
+#define THROUGHPUT_MARGIN   0.85
+
+void coolmic_abr_init(coolmic_abr_t *self, long int min_bitrate, long int max_bitrate)
+{
+    self->min_bitrate = min_bitrate;
+    self->max_bitrate = max_bitrate;
+    self->bitrate = max_bitrate;
+    self->last_time = 0;
+    self->last_sent = 0;
+    self->last_backlog = 0;
+    self->good = 0;
+    self->up_hold = UP_HOLD;
+    self->probing = 0;
+}
+
+int  coolmic_abr_update(coolmic_abr_t *self, uint64_t now, uint64_t sent, size_t backlog, double queue_fill, coolmic_simple_abr_decision_t *decision)
+{
+    uint64_t duration;
+    int64_t wire;
+    int draining;
+    long int throughput;
+    long int backlog_time;
+    long int bitrate = self->bitrate;
+
+    if (!self->last_time || sent < self->last_sent) {
+        /* first call or the connection was restarted */
+        self->last_time = now;
+        self->last_sent = sent;
+        self->last_backlog = backlog;
+        return 0;
+    }
+
+    duration = now - self->last_time;
+    if (duration < INTERVAL)
+        return 0;
+
+    /* bytes that actually left the queue */
+    wire = (int64_t)(sent - self->last_sent) - ((int64_t)backlog - (int64_t)self->last_backlog);
+    if (wire < 0)
+        wire = 0;
+    throughput = wire * 8 * 1000 / duration;
+    backlog_time = (long int)((uint64_t)backlog * 8 * 1000 / self->bitrate);
+    /* the backlog shrinks after a step down, do not step down again while it does */
+    draining = backlog < self->last_backlog;
+
+    self->last_time = now;
+    self->last_sent = sent;
+    self->last_backlog = backlog;
+
+    if ((backlog_time > BACKLOG_HIGH && !draining) || queue_fill > QUEUE_FILL_HIGH) {
+        /* congested: step down, at least below what the connection delivered */
+        bitrate = self->bitrate * STEP_DOWN;
+        if (throughput && (throughput * THROUGHPUT_MARGIN) < bitrate)
+            bitrate = throughput * THROUGHPUT_MARGIN;
+        /* the last step up did not work out, wait longer before the next one */
+        if (self->probing && self->up_hold < UP_HOLD_MAX)
+            self->up_hold *= 2;
+        self->probing = 0;
+        self->good = 0;
+    } else if (backlog_time < BACKLOG_LOW && queue_fill < QUEUE_FILL_LOW) {
+        self->good++;
+        if (self->good >= self->up_hold) {
+            /* the last step up worked out */
+            if (self->probing)
+                self->up_hold = UP_HOLD;
+            bitrate = self->bitrate * STEP_UP;
+            self->probing = 1;
+            self->good = 0;
+        }
+    } else {
+        /* in between: keep the bitrate */
+        self->good = 0;
+    }
+
+    if (bitrate < self->min_bitrate)
+        bitrate = self->min_bitrate;
+    if (bitrate > self->max_bitrate)
+        bitrate = self->max_bitrate;
+
+    if (bitrate == self->bitrate)
+        return 0;
+
+    decision->bitrate_old = self->bitrate;
+    decision->bitrate_new = bitrate;
+    decision->backlog = backlog;
+    decision->throughput = throughput;
+
+    self->bitrate = bitrate;
+
+    return 1;
+}
@@ -0,0 +1,66 @@
+/*
+ *      Copyright (C) Jordan Erickson                     - 2014-2020,
+ *      Copyright (C) Löwenfelsen UG (haftungsbeschränkt) - 2015-2020
+ *       on behalf of Jordan Erickson.
+ */
+
+/*
+ * This file is part of Cool Mic.
+ * 
+ * Cool Mic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Cool Mic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Cool Mic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file defines the adaptive bitrate controller used by the simple API.
+ * It watches the backlog and the throughput of the connection and steps
+ * the bitrate down on congestion and slowly up again when the connection is fine.
+ */
+
+#ifndef __COOLMIC_DSP_ABR_PRIVATE_H__
+#define __COOLMIC_DSP_ABR_PRIVATE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <coolmic-dsp/simple.h>
+
+typedef struct coolmic_abr {
+    /* bitrate range and current bitrate in [bit/s] */
+    long int min_bitrate;
+    long int max_bitrate;
+    long int bitrate;
+
+    /* values at the start of the current interval */
+    uint64_t last_time;
+    uint64_t last_sent;
+    size_t last_backlog;
+
+    /* number of intervals without congestion */
+    unsigned int good;
+    /* number of intervals without congestion needed for the next step up */
+    unsigned int up_hold;
+    /* the last change was a step up */
+    int probing;
+} coolmic_abr_t;
+
+/* This sets up the controller. The bitrate starts at max_bitrate. */
+void coolmic_abr_init(coolmic_abr_t *self, long int min_bitrate, long int max_bitrate);
+
+/* This updates the controller.
+ * now is the current time in [ms], sent is the total number of bytes passed to the network layer,
+ * backlog is the number of bytes queued for sending, and queue_fill is the fill of the encoder's queue in range 0 to 1.
+ * Returns 1 and fills decision if the bitrate was changed, 0 otherwise.
+ */
+int  coolmic_abr_update(coolmic_abr_t *self, uint64_t now, uint64_t sent, size_t backlog, double queue_fill, coolmic_simple_abr_decision_t *decision);
+
+#endif
@@ -31,12 +31,15 @@
 #ifdef HAVE_ENC_OPUS
 #ifdef HAVE_ENC_OPUS_BROKEN_INCLUDE_PATH
 #include <opus.h>
+#include <opus_multistream.h>
 #else
 #include <opus/opus.h>
+#include <opus/opus_multistream.h>
 #endif
 #endif
 
 #define COMMON_OPUS_RATE            48000U
+#define COMMON_OPUS_MAX_CHANNELS    255
 #define COMMON_OPUS_MAGIC_HEAD      "OpusHead"
 #define COMMON_OPUS_MAGIC_HEAD_LEN  8
 #define COMMON_OPUS_MAGIC_TAGS      "OpusTags"
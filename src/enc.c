@@ -30,21 +30,65 @@
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <igloo/timing.h>
 #include "types_private.h"
 #include <coolmic-dsp/coolmic-dsp.h>
 #include <coolmic-dsp/enc.h>
 #include "enc_private.h"
 
+/* time the encoder thread waits before trying again if no input is available, in [ms] */
+#define ASYNC_RETRY_DELAY   10
+/* number of pages encoded by a task of an engine before it gives the worker to others */
+#define ASYNC_TASK_PAGES    4
+
+/* control requests queued in asynchronous mode, see coolmic_enc_ctl() */
+#define ASYNC_CTL_BITRATE   0x01
+#define ASYNC_CTL_METADATA  0x02
+#define ASYNC_CTL_RESET     0x04
+#define ASYNC_CTL_RESTART   0x08
+#define ASYNC_CTL_STOP      0x10
+
 static int __stop(coolmic_enc_t *self);
+static void __async_apply(coolmic_enc_t *self, unsigned int *drops);
 
 static void __free(igloo_ro_t self)
 {
     coolmic_enc_t *enc = igloo_RO_TO_TYPE(self, coolmic_enc_t);
+    size_t i;
+
+    if (enc->async.enabled) {
+        if (enc->async.task) {
+            coolmic_engine_task_free(enc->async.task);
+        } else {
+            pthread_mutex_lock(&(enc->async.lock));
+            enc->async.stop = 1;
+            pthread_cond_broadcast(&(enc->async.cond));
+            pthread_mutex_unlock(&(enc->async.lock));
+            pthread_join(enc->async.thread, NULL);
+        }
+
+        for (i = 0; i < enc->async.queue_size; i++)
+            free(enc->async.queue[i].data);
+        free(enc->async.queue);
+    }
+
+    if (enc->async.pipe[0] != -1) {
+        close(enc->async.pipe[0]);
+        close(enc->async.pipe[1]);
+    }
 
     __stop(enc);
 
     igloo_ro_unref(enc->in);
     igloo_ro_unref(enc->metadata);
+    igloo_ro_unref(enc->async.ctl_metadata);
+
+    pthread_cond_destroy(&(enc->async.cond));
+    pthread_mutex_destroy(&(enc->async.lock));
+    pthread_mutex_destroy(&(enc->lock));
 }
 
 igloo_RO_PUBLIC_TYPE(coolmic_enc_t,
@@ -160,23 +204,269 @@ static int __need_new_page(coolmic_enc_t *self)
     return 0;
 }
 
-static ssize_t __read(void *userdata, void *buffer, size_t len)
+/* Gets the next page. Returns the same as __need_new_page(). */
+static int __next_page(coolmic_enc_t *self)
+{
+    int ret = __need_new_page(self);
+
+    if (ogg_page_eos(&(self->og))) {
+        self->state = STATE_EOF;
+    }
+
+    return ret;
+}
+
+/* Makes the pipe readable while there are pages or the encoder thread waits for a read. Must be called with the async lock held. */
+static void __async_signal(coolmic_enc_t *self)
+{
+    int ready = self->async.queue_fill || self->async.idle;
+    char c = 0;
+
+    if (self->async.pipe[0] == -1 || ready == self->async.signaled)
+        return;
+
+    if (ready) {
+        if (write(self->async.pipe[1], &c, 1) == 1)
+            self->async.signaled = 1;
+    } else {
+        if (read(self->async.pipe[0], &c, 1) == 1)
+            self->async.signaled = 0;
+    }
+}
+
+/* Copies the current page into the queue entry after the last one. The entry is only ever written by the encoder thread. */
+static int __async_store(coolmic_enc_t *self, size_t tail)
+{
+    coolmic_enc_page_t *page = &(self->async.queue[tail]);
+    size_t len = self->og.header_len + self->og.body_len;
+    unsigned char *data;
+
+    if (page->alloc < len) {
+        data = realloc(page->data, len);
+        if (!data)
+            return COOLMIC_ERROR_NOMEM;
+        page->data = data;
+        page->alloc = len;
+    }
+
+    memcpy(page->data, self->og.header, self->og.header_len);
+    memcpy(page->data + self->og.header_len, self->og.body, self->og.body_len);
+    page->len = len;
+
+    return COOLMIC_ERROR_NONE;
+}
+
+/* Encodes the next page into the queue. Must be called with the async lock held, it is released while encoding.
+ * Returns 1 if there is more to do, 0 if the encoder waits for the reader, or -1 if no input was available.
+ */
+static int __async_step(coolmic_enc_t *self)
+{
+    const size_t tail = self->async.queue_tail;
+    unsigned int drops;
+    int full;
+    int ret;
+    int eof;
+    int error;
+    int running;
+
+    if (self->async.idle)
+        return 0;
+    /* resets and restarts are applied even if the queue is full */
+    full = self->async.queue_fill == self->async.queue_size;
+    if (full && !(self->async.ctl_pending & (ASYNC_CTL_RESET|ASYNC_CTL_RESTART)))
+        return 0;
+    /* queue_fill only shrinks while we are unlocked so the entry at tail stays ours */
+    pthread_mutex_unlock(&(self->async.lock));
+
+    pthread_mutex_lock(&(self->lock));
+    __async_apply(self, &drops);
+    if (full) {
+        running = self->state != STATE_NEED_INIT;
+        pthread_mutex_unlock(&(self->lock));
+        pthread_mutex_lock(&(self->async.lock));
+        self->async.running = running;
+        return 0;
+    }
+    ret = __next_page(self);
+    eof = ret == -2 && self->state == STATE_EOF;
+    error = ret == -1 && self->offset_in_page == -1;
+    if (ret == 0 && __async_store(self, tail) != COOLMIC_ERROR_NONE) {
+        ret = -1;
+        error = 1;
+    }
+    running = self->state != STATE_NEED_INIT;
+    pthread_mutex_unlock(&(self->lock));
+
+    pthread_mutex_lock(&(self->async.lock));
+    self->async.attempts++;
+    self->async.running = running;
+    /* if a reset dropped the queue while we encoded the page belongs to the old stream */
+    if (ret == 0 && drops == self->async.drops) {
+        self->async.queue_tail = (self->async.queue_tail + 1) % self->async.queue_size;
+        self->async.queue_fill++;
+    } else if (eof || error) {
+        self->async.idle = 1;
+        self->async.eof = eof;
+        self->async.error = error;
+    }
+    __async_signal(self);
+    pthread_cond_broadcast(&(self->async.cond));
+
+    /* no input available */
+    if (ret == -1 && !error)
+        return -1;
+
+    return 1;
+}
+
+static void *__async_run(void *userdata)
+{
+    coolmic_enc_t *self = userdata;
+    int ret;
+
+    pthread_mutex_lock(&(self->async.lock));
+    while (!self->async.stop) {
+        ret = __async_step(self);
+        if (ret == 0) {
+            pthread_cond_wait(&(self->async.cond), &(self->async.lock));
+        } else if (ret < 0) {
+            pthread_mutex_unlock(&(self->async.lock));
+            igloo_timing_sleep(ASYNC_RETRY_DELAY);
+            pthread_mutex_lock(&(self->async.lock));
+        }
+    }
+    pthread_mutex_unlock(&(self->async.lock));
+
+    return NULL;
+}
+
+/* the encoder as a task of an engine, see coolmic_enc_set_async_engine() */
+static int __async_task(void *userdata, int *fd)
+{
+    coolmic_enc_t *self = userdata;
+    size_t i;
+    int ret = 0;
+
+    (void)fd;
+
+    /* do not hog the worker, others are waiting */
+    pthread_mutex_lock(&(self->async.lock));
+    for (i = 0; i < ASYNC_TASK_PAGES; i++)
+        if ((ret = __async_step(self)) != 1)
+            break;
+    pthread_mutex_unlock(&(self->async.lock));
+
+    if (ret == 0)
+        return COOLMIC_ENGINE_TASK_SLEEP;
+    if (ret < 0)
+        return ASYNC_RETRY_DELAY;
+    return 0;
+}
+
+static ssize_t __peekv_async(coolmic_enc_t *self, struct iovec *iov, size_t *iovcnt, size_t len)
+{
+    const coolmic_enc_page_t *page;
+    unsigned int attempts;
+    size_t offset;
+    size_t chunk;
+    size_t i;
+    ssize_t ret = 0;
+
+    pthread_mutex_lock(&(self->async.lock));
+    /* the encoder thread starts with the first read */
+    if (self->async.idle && !self->async.eof && !self->async.error) {
+        self->async.idle = 0;
+        __async_signal(self);
+        pthread_cond_broadcast(&(self->async.cond));
+        coolmic_engine_task_wake(self->async.task);
+    }
+    /* wait until the encoder thread did something, a task of an engine must not be waited for as the reader may be one as well */
+    attempts = self->async.attempts;
+    while (!self->async.task && !self->async.queue_fill && !self->async.idle && !self->async.stop && attempts == self->async.attempts)
+        pthread_cond_wait(&(self->async.cond), &(self->async.lock));
+
+    /* hand out whole pages, the first one starting at the offset of the reader */
+    offset = self->async.offset;
+    for (i = 0; i < self->async.queue_fill && i < *iovcnt && (size_t)ret < len; i++) {
+        page = &(self->async.queue[(self->async.queue_head + i) % self->async.queue_size]);
+        chunk = page->len - offset;
+        if (chunk > (len - ret))
+            chunk = len - ret;
+        iov[i].iov_base = page->data + offset;
+        iov[i].iov_len = chunk;
+        ret += chunk;
+        offset = 0;
+    }
+    *iovcnt = i;
+    self->async.peeked = i;
+
+    if (!i && self->async.error)
+        ret = COOLMIC_ERROR_GENERIC;
+    pthread_mutex_unlock(&(self->async.lock));
+
+    return ret;
+}
+
+static int __consume_async(coolmic_enc_t *self, size_t len)
+{
+    const coolmic_enc_page_t *page;
+    size_t chunk;
+    int ret = COOLMIC_ERROR_NONE;
+
+    pthread_mutex_lock(&(self->async.lock));
+    while (len) {
+        if (!self->async.queue_fill) {
+            ret = COOLMIC_ERROR_INVAL;
+            break;
+        }
+
+        page = &(self->async.queue[self->async.queue_head]);
+        chunk = page->len - self->async.offset;
+        if (chunk > len)
+            chunk = len;
+
+        self->async.offset += chunk;
+        len -= chunk;
+
+        if (self->async.offset == page->len) {
+            self->async.offset = 0;
+            self->async.queue_head = (self->async.queue_head + 1) % self->async.queue_size;
+            self->async.queue_fill--;
+            pthread_cond_broadcast(&(self->async.cond));
+            coolmic_engine_task_wake(self->async.task);
+        }
+    }
+    self->async.peeked = 0;
+    __async_signal(self);
+    pthread_mutex_unlock(&(self->async.lock));
+
+    return ret;
+}
+
+static ssize_t __peek(void *userdata, const void **buffer, size_t len)
 {
     coolmic_enc_t *self = userdata;
     size_t offset;
     size_t max_len;
     int ret;
 
-    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Read request, buffer=%p, len=%zu byte", buffer, len);
+    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Peek request, len=%zu byte", len);
+
+    if (self->async.enabled) {
+        struct iovec iov;
+        size_t iovcnt = 1;
+
+        ret = __peekv_async(self, &iov, &iovcnt, len);
+        if (ret > 0)
+            *buffer = iov.iov_base;
+        return ret;
+    }
 
     if (self->offset_in_page == -1)
         return COOLMIC_ERROR_GENERIC;
 
     if (self->state == STATE_NEED_INIT || self->offset_in_page == (self->og.header_len + self->og.body_len)) {
-        ret = __need_new_page(self);
-        if (ogg_page_eos(&(self->og))) {
-            self->state = STATE_EOF;
-        }
+        ret = __next_page(self);
         if (ret == -2) {
             return 0;
         } else if (ret == -1) {
@@ -186,25 +476,114 @@ static ssize_t __read(void *userdata, void *buffer, size_t len)
 
     if (self->offset_in_page < self->og.header_len) {
         max_len = self->og.header_len - self->offset_in_page;
-        len = (len > max_len) ? max_len : len;
-        memcpy(buffer, self->og.header + self->offset_in_page, len);
-        self->offset_in_page += len;
-        return len;
+        *buffer = self->og.header + self->offset_in_page;
+    } else {
+        offset = self->offset_in_page - self->og.header_len;
+        max_len = self->og.body_len - offset;
+        *buffer = self->og.body + offset;
     }
 
-    offset = self->offset_in_page - self->og.header_len;
-    max_len = self->og.body_len - offset;
     len = (len > max_len) ? max_len : len;
-    memcpy(buffer, self->og.body + offset, len);
-    self->offset_in_page += len;
-    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Read request satisfied, returned %zu byte", len);
+    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Peek request satisfied, returned %zu byte", len);
     return len;
 }
 
+static int __consume(void *userdata, size_t len)
+{
+    coolmic_enc_t *self = userdata;
+
+    if (self->async.enabled)
+        return __consume_async(self, len);
+
+    if (self->offset_in_page == -1)
+        return COOLMIC_ERROR_GENERIC;
+
+    if (len > (size_t)(self->og.header_len + self->og.body_len - self->offset_in_page))
+        return COOLMIC_ERROR_INVAL;
+
+    self->offset_in_page += len;
+    return COOLMIC_ERROR_NONE;
+}
+
+/* This returns the rest of the current page as header and body or queued pages as a whole. */
+static ssize_t __peekv(void *userdata, struct iovec *iov, size_t *iovcnt, size_t len)
+{
+    coolmic_enc_t *self = userdata;
+    const void *buffer;
+    ssize_t ret;
+
+    if (self->async.enabled)
+        return __peekv_async(self, iov, iovcnt, len);
+
+    ret = __peek(userdata, &buffer, len);
+    if (ret < 1) {
+        *iovcnt = 0;
+        return ret;
+    }
+
+    iov[0].iov_base = (void*)buffer;
+    iov[0].iov_len = ret;
+
+    /* add the body if we returned all of the header */
+    if (*iovcnt > 1 && buffer == (self->og.header + self->offset_in_page) && (self->offset_in_page + ret) == self->og.header_len && (size_t)ret < len && self->og.body_len) {
+        iov[1].iov_base = self->og.body;
+        iov[1].iov_len = len - ret;
+        if (iov[1].iov_len > (size_t)self->og.body_len)
+            iov[1].iov_len = self->og.body_len;
+        ret += iov[1].iov_len;
+        *iovcnt = 2;
+    } else {
+        *iovcnt = 1;
+    }
+
+    return ret;
+}
+
+static ssize_t __read(void *userdata, void *buffer, size_t len)
+{
+    struct iovec iov[8];
+    size_t iovcnt = sizeof(iov)/sizeof(*iov);
+    ssize_t ret;
+    size_t i;
+
+    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Read request, buffer=%p, len=%zu byte", buffer, len);
+
+    ret = __peekv(userdata, iov, &iovcnt, len);
+    if (ret < 1)
+        return ret;
+
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(buffer, iov[i].iov_base, iov[i].iov_len);
+        buffer += iov[i].iov_len;
+    }
+    __consume(userdata, ret);
+
+    return ret;
+}
+
+static int __pollfd(void *userdata)
+{
+    coolmic_enc_t *self = userdata;
+
+    if (!self->async.enabled || self->async.pipe[0] == -1)
+        return COOLMIC_ERROR_NOSYS;
+
+    return self->async.pipe[0];
+}
+
 static int __eof(void *userdata)
 {
     coolmic_enc_t *self = userdata;
 
+    int ret;
+
+    if (self->async.enabled) {
+        pthread_mutex_lock(&(self->async.lock));
+        ret = !self->async.queue_fill && self->async.eof;
+        pthread_mutex_unlock(&(self->async.lock));
+        return ret; /* bool */
+    }
+
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "self=%p{.offset_in_page=%i, .og.header_len=%i, .og.body_len=%i, .state=%i, ...} = ?", (int)self->offset_in_page, (int)self->og.header_len, (int)self->og.body_len, (int)self->state);
 
     if (self->offset_in_page == (self->og.header_len + self->og.body_len) && self->state == STATE_EOF)
@@ -243,15 +622,48 @@ coolmic_enc_t      *coolmic_enc_new(const char *name, igloo_ro_t associated, con
     ret->quality  = 0.1;
     ret->cb = cb;
 
+    pthread_mutex_init(&(ret->lock), NULL);
+    pthread_mutex_init(&(ret->async.lock), NULL);
+    pthread_cond_init(&(ret->async.cond), NULL);
+    ret->async.pipe[0] = -1;
+    ret->async.pipe[1] = -1;
+
     return ret;
 }
 
-int                 coolmic_enc_reset(coolmic_enc_t *self)
+uint_least32_t      coolmic_enc_get_native_rate(const char *codec, uint_least32_t rate)
+{
+    if (!codec || !rate)
+        return 0;
+
+    if (strcasecmp(codec, COOLMIC_DSP_CODEC_VORBIS) == 0) {
+        return rate;
+#ifdef HAVE_ENC_OPUS
+    } else if (strcasecmp(codec, COOLMIC_DSP_CODEC_OPUS) == 0) {
+        return COMMON_OPUS_RATE;
+#endif
+    }
+
+    return 0;
+}
+
+int                 coolmic_enc_can_update_bitrate(const char *codec)
+{
+    if (!codec)
+        return 0;
+
+#ifdef HAVE_ENC_OPUS
+    if (strcasecmp(codec, COOLMIC_DSP_CODEC_OPUS) == 0)
+        return 1;
+#endif
+
+    return 0;
+}
+
+static int __reset(coolmic_enc_t *self)
 {
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_INFO, COOLMIC_ERROR_NONE, "Restart request");
 
-    if (!self)
-        return COOLMIC_ERROR_FAULT;
     if (self->state != STATE_RUNNING && self->state != STATE_EOF)
         return COOLMIC_ERROR_GENERIC;
 
@@ -269,6 +681,11 @@ int                 coolmic_enc_reset(coolmic_enc_t *self)
     return COOLMIC_ERROR_NONE;
 }
 
+int                 coolmic_enc_reset(coolmic_enc_t *self)
+{
+    return coolmic_enc_ctl(self, COOLMIC_ENC_OP_RESET);
+}
+
 static inline int __restart(coolmic_enc_t *self)
 {
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_INFO, COOLMIC_ERROR_NONE, "Reset request");
@@ -282,12 +699,187 @@ static inline int __restart(coolmic_enc_t *self)
     return COOLMIC_ERROR_NONE;
 }
 
+static inline int __request_stop(coolmic_enc_t *self)
+{
+    if (self->state == STATE_RUNNING    || self->state == STATE_EOF ||
+        self->state == STATE_NEED_RESET || self->state == STATE_NEED_RESTART) {
+        self->state = STATE_NEED_STOP;
+        return COOLMIC_ERROR_NONE;
+    }
+
+    return COOLMIC_ERROR_BUSY;
+}
+
+/* Passes changes of quality or bitrate to the running codec.
+ * Returns COOLMIC_ERROR_NOSYS if the codec can not change them while running, it then uses them from the next restart on.
+ */
+static inline int __update_bitrate(coolmic_enc_t *self)
+{
+    if (self->state == STATE_NEED_INIT)
+        return COOLMIC_ERROR_NONE;
+    if (!self->cb.update_bitrate)
+        return COOLMIC_ERROR_NOSYS;
+
+    return self->cb.update_bitrate(self);
+}
+
+/* Applies the control requests queued in asynchronous mode. Must be called by the encoder thread with the encoder lock held.
+ * drops is set to the number of drops of the queue the next page is encoded after.
+ */
+static void __async_apply(coolmic_enc_t *self, unsigned int *drops)
+{
+    unsigned int pending;
+    int ret;
+
+    pthread_mutex_lock(&(self->async.lock));
+    *drops = self->async.drops;
+    pending = self->async.ctl_pending;
+    self->async.ctl_pending = 0;
+    if (pending & ASYNC_CTL_BITRATE) {
+        self->quality = self->async.ctl_quality;
+        self->bitrate = self->async.ctl_bitrate;
+    }
+    if (pending & ASYNC_CTL_METADATA) {
+        igloo_ro_unref(self->metadata);
+        /* ignore errors here as the metadata is allowed to be NULL */
+        igloo_ro_ref(self->metadata = self->async.ctl_metadata);
+    }
+    pthread_mutex_unlock(&(self->async.lock));
+
+    if (!pending)
+        return;
+
+    /* COOLMIC_ERROR_NOSYS was already returned by coolmic_enc_ctl() */
+    if ((pending & ASYNC_CTL_BITRATE) && (ret = __update_bitrate(self)) != COOLMIC_ERROR_NONE && ret != COOLMIC_ERROR_NOSYS)
+        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_WARNING, ret, "Can not change bitrate");
+    if ((pending & ASYNC_CTL_RESET) && (ret = __reset(self)) != COOLMIC_ERROR_NONE)
+        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_WARNING, ret, "Can not reset encoder");
+    if ((pending & ASYNC_CTL_RESTART) && (ret = __restart(self)) != COOLMIC_ERROR_NONE)
+        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_WARNING, ret, "Can not restart encoder");
+    if ((pending & ASYNC_CTL_STOP) && (ret = __request_stop(self)) != COOLMIC_ERROR_NONE)
+        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_WARNING, ret, "Can not stop encoder");
+}
+
+/* Drops the queued pages not handed out to the reader, so after a reset the reader gets the new segment from it's headers on.
+ * Must be called with the async lock held.
+ */
+static void __async_drop(coolmic_enc_t *self)
+{
+    const size_t keep = self->async.peeked;
+
+    /* the rest of a partly read page is dropped as well unless the reader still holds it */
+    if (!keep)
+        self->async.offset = 0;
+
+    self->async.queue_fill = keep;
+    self->async.queue_tail = (self->async.queue_head + keep) % self->async.queue_size;
+    self->async.drops++;
+    __async_signal(self);
+}
+
+/* Handles a control request in asynchronous mode without waiting for the encoder thread.
+ * Changes are queued and applied between pages. Returns COOLMIC_ERROR_BADRQC for requests of the codec.
+ */
+static int __ctl_async(coolmic_enc_t *self, coolmic_enc_op_t op, va_list ap)
+{
+    int ret = COOLMIC_ERROR_NONE;
+    unsigned int request = 0;
+    union {
+        double *fp;
+        long int *lp;
+        long int l;
+        coolmic_metadata_t *md;
+        coolmic_metadata_t **mdp;
+    } tmp;
+
+    pthread_mutex_lock(&(self->async.lock));
+
+    switch (op) {
+        case COOLMIC_ENC_OP_INVALID:
+            ret = COOLMIC_ERROR_INVAL;
+        break;
+        case COOLMIC_ENC_OP_NONE:
+        break;
+        case COOLMIC_ENC_OP_RESET:
+            request = ASYNC_CTL_RESET;
+        break;
+        case COOLMIC_ENC_OP_RESTART:
+            request = ASYNC_CTL_RESTART;
+        break;
+        case COOLMIC_ENC_OP_STOP:
+            request = ASYNC_CTL_STOP;
+        break;
+        case COOLMIC_ENC_OP_GET_QUALITY:
+            tmp.fp = va_arg(ap, double*);
+            *(tmp.fp) = self->async.ctl_quality;
+        break;
+        case COOLMIC_ENC_OP_SET_QUALITY:
+            self->async.ctl_quality = va_arg(ap, double);
+            self->async.ctl_pending |= ASYNC_CTL_BITRATE;
+        break;
+        case COOLMIC_ENC_OP_GET_BITRATE:
+            tmp.lp = va_arg(ap, long int*);
+            *(tmp.lp) = self->async.ctl_bitrate;
+        break;
+        case COOLMIC_ENC_OP_SET_BITRATE:
+            tmp.l = va_arg(ap, long int);
+            if (tmp.l < 0) {
+                ret = COOLMIC_ERROR_INVAL;
+            } else {
+                self->async.ctl_bitrate = tmp.l;
+                self->async.ctl_pending |= ASYNC_CTL_BITRATE;
+                if (self->async.running && !self->cb.update_bitrate)
+                    ret = COOLMIC_ERROR_NOSYS;
+            }
+        break;
+        case COOLMIC_ENC_OP_GET_METADATA:
+            tmp.mdp = va_arg(ap, coolmic_metadata_t**);
+            ret = igloo_ro_ref(*(tmp.mdp) = self->async.ctl_metadata);
+        break;
+        case COOLMIC_ENC_OP_SET_METADATA:
+            tmp.md = va_arg(ap, coolmic_metadata_t*);
+            if (tmp.md)
+                ret = igloo_ro_ref(tmp.md);
+            if (ret == COOLMIC_ERROR_NONE) {
+                igloo_ro_unref(self->async.ctl_metadata);
+                self->async.ctl_metadata = tmp.md;
+                self->async.ctl_pending |= ASYNC_CTL_METADATA;
+            }
+        break;
+        default:
+            ret = COOLMIC_ERROR_BADRQC;
+        break;
+    }
+
+    /* Resets, restarts, and stops continue an encoder that reached EOF or waits for room in the queue.
+     * Other changes wait for the next page, an encoder waiting for the first read keeps waiting.
+     */
+    if (request) {
+        if (request == ASYNC_CTL_RESET)
+            __async_drop(self);
+        self->async.ctl_pending |= request;
+        if (self->async.eof) {
+            self->async.idle = 0;
+            self->async.eof = 0;
+            __async_signal(self);
+        }
+        pthread_cond_broadcast(&(self->async.cond));
+        coolmic_engine_task_wake(self->async.task);
+    }
+
+    pthread_mutex_unlock(&(self->async.lock));
+
+    return ret;
+}
+
 int                 coolmic_enc_ctl(coolmic_enc_t *self, coolmic_enc_op_t op, ...)
 {
     va_list ap;
     int ret = COOLMIC_ERROR_BADRQC;
     union {
         double *fp;
+        long int *lp;
+        long int l;
         coolmic_metadata_t *md;
         coolmic_metadata_t **mdp;
     } tmp;
@@ -297,6 +889,21 @@ int                 coolmic_enc_ctl(coolmic_enc_t *self, coolmic_enc_op_t op, ..
 
     va_start(ap, op);
 
+    /* in asynchronous mode the encoder thread holds the lock while it waits for input */
+    if (self->async.enabled) {
+        va_list aq;
+
+        va_copy(aq, ap);
+        ret = __ctl_async(self, op, aq);
+        va_end(aq);
+        if (ret != COOLMIC_ERROR_BADRQC) {
+            va_end(ap);
+            return ret;
+        }
+    }
+
+    pthread_mutex_lock(&(self->lock));
+
     switch (op) {
         case COOLMIC_ENC_OP_INVALID:
             ret = COOLMIC_ERROR_INVAL;
@@ -305,19 +912,13 @@ int                 coolmic_enc_ctl(coolmic_enc_t *self, coolmic_enc_op_t op, ..
             ret = COOLMIC_ERROR_NONE;
         break;
         case COOLMIC_ENC_OP_RESET:
-            ret = coolmic_enc_reset(self);
+            ret = __reset(self);
         break;
         case COOLMIC_ENC_OP_RESTART:
             ret = __restart(self);
         break;
         case COOLMIC_ENC_OP_STOP:
-            if (self->state == STATE_RUNNING    || self->state == STATE_EOF ||
-                self->state == STATE_NEED_RESET || self->state == STATE_NEED_RESTART) {
-                self->state = STATE_NEED_STOP;
-                ret = COOLMIC_ERROR_NONE;
-            } else {
-                ret = COOLMIC_ERROR_BUSY;
-            }
+            ret = __request_stop(self);
         break;
         case COOLMIC_ENC_OP_GET_QUALITY:
             tmp.fp = va_arg(ap, double*);
@@ -326,8 +927,25 @@ int                 coolmic_enc_ctl(coolmic_enc_t *self, coolmic_enc_op_t op, ..
         break;
         case COOLMIC_ENC_OP_SET_QUALITY:
             self->quality = va_arg(ap, double);
+            ret = __update_bitrate(self);
+            /* quality changes always waited for the next restart with codecs that can not update it */
+            if (ret == COOLMIC_ERROR_NOSYS)
+                ret = COOLMIC_ERROR_NONE;
+        break;
+        case COOLMIC_ENC_OP_GET_BITRATE:
+            tmp.lp = va_arg(ap, long int*);
+            *(tmp.lp) = self->bitrate;
             ret = COOLMIC_ERROR_NONE;
         break;
+        case COOLMIC_ENC_OP_SET_BITRATE:
+            tmp.l = va_arg(ap, long int);
+            if (tmp.l < 0) {
+                ret = COOLMIC_ERROR_INVAL;
+            } else {
+                self->bitrate = tmp.l;
+                ret = __update_bitrate(self);
+            }
+        break;
         case COOLMIC_ENC_OP_GET_METADATA:
             tmp.mdp = va_arg(ap, coolmic_metadata_t**);
             ret = igloo_ro_ref(*(tmp.mdp) = self->metadata);
@@ -346,8 +964,14 @@ int                 coolmic_enc_ctl(coolmic_enc_t *self, coolmic_enc_op_t op, ..
                 ret = COOLMIC_ERROR_NONE;
             }
         break;
+        default:
+            if (self->cb.ctl)
+                ret = self->cb.ctl(self, op, ap);
+        break;
     }
 
+    pthread_mutex_unlock(&(self->lock));
+
     va_end(ap);
 
     return ret;
@@ -355,15 +979,126 @@ int                 coolmic_enc_ctl(coolmic_enc_t *self, coolmic_enc_op_t op, ..
 
 int                 coolmic_enc_attach_iohandle(coolmic_enc_t *self, coolmic_iohandle_t *handle)
 {
+    coolmic_iohandle_format_t format;
+
     if (!self)
         return COOLMIC_ERROR_FAULT;
+    if (handle) {
+        format.rate = self->rate;
+        format.channels = self->channels;
+        format.sample_format = COOLMIC_IOHANDLE_SAMPLE_FORMAT_S16;
+        if (coolmic_iohandle_check_format(handle, &format) != COOLMIC_ERROR_NONE)
+            return COOLMIC_ERROR_INVAL;
+    }
+    pthread_mutex_lock(&(self->lock));
     if (self->in)
         igloo_ro_unref(self->in);
     /* ignore errors here as handle is allowed to be NULL */
     igloo_ro_ref(self->in = handle);
+    pthread_mutex_unlock(&(self->lock));
     return COOLMIC_ERROR_NONE;
 }
 
+static int __set_async(coolmic_enc_t *self, size_t queue_size, coolmic_engine_t *engine)
+{
+    int started;
+
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+    if (!queue_size)
+        return COOLMIC_ERROR_INVAL;
+
+    pthread_mutex_lock(&(self->lock));
+    if (self->async.enabled || self->state != STATE_NEED_INIT) {
+        pthread_mutex_unlock(&(self->lock));
+        return COOLMIC_ERROR_BUSY;
+    }
+
+    self->async.queue = calloc(queue_size, sizeof(*self->async.queue));
+    if (!self->async.queue) {
+        pthread_mutex_unlock(&(self->lock));
+        return COOLMIC_ERROR_NOMEM;
+    }
+    self->async.queue_size = queue_size;
+    /* wait for the first read */
+    self->async.idle = 1;
+    /* from now on control requests are passed by coolmic_enc_ctl() */
+    self->async.ctl_quality = self->quality;
+    self->async.ctl_bitrate = self->bitrate;
+    /* ignore errors here as the metadata is allowed to be NULL */
+    igloo_ro_ref(self->async.ctl_metadata = self->metadata);
+
+    /* polling is optional, so just go without if the pipe can not be created */
+    if (pipe(self->async.pipe) == 0) {
+        fcntl(self->async.pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(self->async.pipe[1], F_SETFL, O_NONBLOCK);
+        fcntl(self->async.pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(self->async.pipe[1], F_SETFD, FD_CLOEXEC);
+        /* the first read starts the encoder thread */
+        __async_signal(self);
+    } else {
+        self->async.pipe[0] = -1;
+        self->async.pipe[1] = -1;
+    }
+
+    /* a task does not run before it is woken up by the first read */
+    if (engine) {
+        started = (self->async.task = coolmic_engine_task_new(engine, __async_task, self)) != NULL;
+    } else {
+        started = pthread_create(&(self->async.thread), NULL, __async_run, self) == 0;
+    }
+
+    if (!started) {
+        if (self->async.pipe[0] != -1) {
+            close(self->async.pipe[0]);
+            close(self->async.pipe[1]);
+            self->async.pipe[0] = -1;
+            self->async.pipe[1] = -1;
+            self->async.signaled = 0;
+        }
+        free(self->async.queue);
+        self->async.queue = NULL;
+        self->async.queue_size = 0;
+        igloo_ro_unref(self->async.ctl_metadata);
+        self->async.ctl_metadata = NULL;
+        pthread_mutex_unlock(&(self->lock));
+        return COOLMIC_ERROR_GENERIC;
+    }
+    self->async.enabled = 1;
+    pthread_mutex_unlock(&(self->lock));
+
+    return COOLMIC_ERROR_NONE;
+}
+
+int                 coolmic_enc_set_async(coolmic_enc_t *self, size_t queue_size)
+{
+    return __set_async(self, queue_size, NULL);
+}
+
+int                 coolmic_enc_set_async_engine(coolmic_enc_t *self, size_t queue_size, coolmic_engine_t *engine)
+{
+    if (!engine)
+        return COOLMIC_ERROR_FAULT;
+
+    return __set_async(self, queue_size, engine);
+}
+
+ssize_t             coolmic_enc_get_queue_fill(coolmic_enc_t *self)
+{
+    ssize_t ret;
+
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+    if (!self->async.enabled)
+        return COOLMIC_ERROR_INVAL;
+
+    pthread_mutex_lock(&(self->async.lock));
+    ret = self->async.queue_fill;
+    pthread_mutex_unlock(&(self->async.lock));
+
+    return ret;
+}
+
 static int __free_enc_iohandle(void *arg)
 {
     coolmic_enc_t *enc = arg;
@@ -373,8 +1108,16 @@ static int __free_enc_iohandle(void *arg)
 
 coolmic_iohandle_t *coolmic_enc_get_iohandle(coolmic_enc_t *self)
 {
+    coolmic_iohandle_t *ret;
+
     if (!self)
         return NULL;
     igloo_ro_ref(self);
-    return coolmic_iohandle_new(NULL, igloo_RO_NULL, self, __free_enc_iohandle, __read, __eof);
+    ret = coolmic_iohandle_new(NULL, igloo_RO_NULL, self, __free_enc_iohandle, __read, __eof);
+    if (ret) {
+        coolmic_iohandle_set_peek(ret, __peek, __consume);
+        coolmic_iohandle_set_peekv(ret, __peekv);
+        coolmic_iohandle_set_pollfd(ret, __pollfd);
+    }
+    return ret;
 }
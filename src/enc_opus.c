@@ -27,12 +27,21 @@
 #include <strings.h>
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
 #include "types_private.h"
 #include <coolmic-dsp/coolmic-dsp.h>
 #include <coolmic-dsp/enc.h>
 #include <coolmic-dsp/metadata.h>
 #include "enc_private.h"
 
+/* default frames per packet: 60ms */
+#define DEFAULT_FRAMES      2880
+/* With packets of this size or smaller pages are flushed once they hold this many frames: 20ms */
+#define PAGE_FLUSH_FRAMES   960
+
+/* frame sizes supported by Opus: 2.5, 5, 10, 20, 40, and 60ms */
+static const size_t valid_frames[] = {120, 240, 480, 960, 1920, 2880};
+
 static void __opus_write_uint32(unsigned char buf[4], uint32_t val)
 {
     buf[0] = (val & 0x000000FF) >>  0;
@@ -41,7 +50,8 @@ static void __opus_write_uint32(unsigned char buf[4], uint32_t val)
     buf[3] = (val & 0xFF000000) >> 24;
 }
 
-static int __opus_build_header(unsigned char header[19], coolmic_enc_t *self)
+/* header is 19 bytes long for mapping family 0 and 21 + channels bytes for all others. */
+static size_t __opus_build_header(unsigned char header[21 + COMMON_OPUS_MAX_CHANNELS], coolmic_enc_t *self)
 {
     memcpy(header, COMMON_OPUS_MAGIC_HEAD, COMMON_OPUS_MAGIC_HEAD_LEN); /* magic */
     header[8] = 1; /* version */
@@ -51,22 +61,27 @@ static int __opus_build_header(unsigned char header[19], coolmic_enc_t *self)
     __opus_write_uint32(header+12, self->rate);
     header[16] = 0; /* Output Gain LSB */
     header[17] = 0; /* Output Gain MSB */
-    header[18] = 0; /* Channel Mapping Family */
-    return COOLMIC_ERROR_NONE;
+    header[18] = self->codec.opus.mapping_family; /* Channel Mapping Family */
+
+    if (!self->codec.opus.mapping_family)
+        return 19;
+
+    header[19] = self->codec.opus.streams; /* Stream Count */
+    header[20] = self->codec.opus.coupled_streams; /* Coupled Count */
+    memcpy(header + 21, self->codec.opus.mapping, self->channels); /* Channel Mapping */
+    return 21 + self->channels;
 }
 
 static int __opus_packetin_header(coolmic_enc_t *self)
 {
-    unsigned char header[19];
-    int err;
+    unsigned char header[21 + COMMON_OPUS_MAX_CHANNELS];
+    size_t len;
 
-    err = __opus_build_header(header, self);
-    if (err != COOLMIC_ERROR_NONE)
-        return err;
+    len = __opus_build_header(header, self);
 
     memset(&(self->op), 0, sizeof(self->op));
     self->op.packet = header;
-    self->op.bytes = 19;
+    self->op.bytes = len;
     self->op.b_o_s = 1;
     self->op.e_o_s = 0;
     self->op.granulepos = self->codec.opus.granulepos;
@@ -202,7 +217,7 @@ static void* __opus_read_data(coolmic_enc_t *self, size_t frames)
 
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "New data requested, %zu frames (%zu bytes)", frames, len);
 
-    if (len > sizeof(self->codec.opus.buffer)) {
+    if (len > self->codec.opus.buffer_len) {
         coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, COOLMIC_ERROR_INVAL, "Request bigger than buffer");
         return NULL;
     }
@@ -234,21 +249,54 @@ static void* __opus_read_data(coolmic_enc_t *self, size_t frames)
     }
 }
 
+/* This sizes the input buffer for the given number of frames per packet. */
+static int __opus_set_frames(coolmic_enc_t *self, size_t frames)
+{
+    size_t len = frames * self->channels * 2;
+    char *buffer;
+
+    if (self->codec.opus.buffer_fill)
+        return COOLMIC_ERROR_BUSY;
+
+    if (len != self->codec.opus.buffer_len) {
+        buffer = realloc(self->codec.opus.buffer, len);
+        if (!buffer)
+            return COOLMIC_ERROR_NOMEM;
+        self->codec.opus.buffer = buffer;
+        self->codec.opus.buffer_len = len;
+    }
+
+    self->codec.opus.frames = frames;
+
+    return COOLMIC_ERROR_NONE;
+}
+
 static int __opus_packetin_data(coolmic_enc_t *self)
 {
-    size_t frames = 2880;
-    void *data = __opus_read_data(self, frames);
+    size_t frames;
+    void *data;
     opus_int32 len;
-    unsigned char buffer[4096];
     int err;
 
+    /* a new frame size takes effect at the start of a packet */
+    if (!self->codec.opus.buffer_fill && self->codec.opus.frames != self->codec.opus.frames_requested) {
+        err = __opus_set_frames(self, self->codec.opus.frames_requested);
+        if (err != COOLMIC_ERROR_NONE) {
+            coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, err, "Can not change frame size");
+            return err;
+        }
+    }
+
+    frames = self->codec.opus.frames;
+    data = __opus_read_data(self, frames);
+
     if (!data) {
         err = COOLMIC_ERROR_RETRY;
         coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, err, "No input data");
         return err;
     }
 
-    len = opus_encode(self->codec.opus.enc, data, frames, buffer, sizeof(buffer));
+    len = opus_multistream_encode(self->codec.opus.enc, data, frames, self->codec.opus.packet, self->codec.opus.packet_len);
 
     if (len < 0) {
         err = coolmic_common_opus_libopuserror2error(len);
@@ -258,8 +306,13 @@ static int __opus_packetin_data(coolmic_enc_t *self)
 
     self->codec.opus.granulepos += frames;
 
+    if (frames <= PAGE_FLUSH_FRAMES && (self->codec.opus.granulepos - self->codec.opus.page_granulepos) >= PAGE_FLUSH_FRAMES) {
+        self->codec.opus.page_granulepos = self->codec.opus.granulepos;
+        self->use_page_flush = 1;
+    }
+
     memset(&(self->op), 0, sizeof(self->op));
-    self->op.packet = buffer;
+    self->op.packet = self->codec.opus.packet;
     self->op.bytes = len;
     self->op.b_o_s = 0;
     self->op.e_o_s = 0;
@@ -277,7 +330,7 @@ static int __opus_packetin_data(coolmic_enc_t *self)
     return COOLMIC_ERROR_NONE;
 }
 
-static long int __opus_get_bitrate(coolmic_enc_t *self)
+static long int __opus_get_bitrate_by_quality(coolmic_enc_t *self)
 {
     register float q = self->quality;
 
@@ -312,15 +365,57 @@ static long int __opus_get_bitrate(coolmic_enc_t *self)
     }
 }
 
+static long int __opus_get_bitrate(coolmic_enc_t *self)
+{
+    long int bitrate;
+
+    if (self->bitrate)
+        return self->bitrate;
+
+    /* the quality table is for stereo, scale it for more channels */
+    bitrate = __opus_get_bitrate_by_quality(self);
+    if (self->channels > 2)
+        bitrate = bitrate * self->channels / 2;
+
+    return bitrate;
+}
+
+static int __opus_update_bitrate(coolmic_enc_t *self)
+{
+    long int bitrate;
+    int error;
+
+    if (!self->codec.opus.enc)
+        return COOLMIC_ERROR_NONE;
+
+    bitrate = __opus_get_bitrate(self);
+    error = opus_multistream_encoder_ctl(self->codec.opus.enc, OPUS_SET_BITRATE(bitrate));
+    if (error != OPUS_OK)
+        return coolmic_common_opus_libopuserror2error(error);
+
+    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_INFO, COOLMIC_ERROR_NONE, "Bitrate set to %li bit/s", bitrate);
+    return COOLMIC_ERROR_NONE;
+}
+
 static int __opus_stop_encoder(coolmic_enc_t *self)
 {
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_INFO, COOLMIC_ERROR_NONE, "Stop callback called");
 
     if (self->codec.opus.enc) {
-        opus_encoder_destroy(self->codec.opus.enc);
+        opus_multistream_encoder_destroy(self->codec.opus.enc);
         self->codec.opus.enc = NULL;
     }
 
+    free(self->codec.opus.packet);
+    self->codec.opus.packet = NULL;
+    self->codec.opus.packet_len = 0;
+
+    free(self->codec.opus.buffer);
+    self->codec.opus.buffer = NULL;
+    self->codec.opus.buffer_len = 0;
+    self->codec.opus.buffer_fill = 0;
+    self->codec.opus.frames = 0;
+
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_INFO, COOLMIC_ERROR_NONE, "Stop successful");
     return COOLMIC_ERROR_NONE;
 }
@@ -332,9 +427,9 @@ static int __opus_start_encoder(coolmic_enc_t *self)
 
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_INFO, COOLMIC_ERROR_NONE, "Start callback called");
 
-    if (self->channels < 1 || self->channels > 2) {
+    if (self->channels < 1 || self->channels > COMMON_OPUS_MAX_CHANNELS) {
         ret = COOLMIC_ERROR_INVAL;
-        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, ret, "Start failed: bad number of channels (supported: 1, 2): %u", self->channels);
+        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, ret, "Start failed: bad number of channels (supported: 1 to %u): %u", COMMON_OPUS_MAX_CHANNELS, self->channels);
         return ret;
     }
 
@@ -344,24 +439,59 @@ static int __opus_start_encoder(coolmic_enc_t *self)
         return ret;
     }
 
-    self->codec.opus.enc = opus_encoder_create(self->rate, self->channels, OPUS_APPLICATION_AUDIO, &error);
+    /* Mono and stereo use family 0. Up to 8 channels are taken as Vorbis order surround (family 1).
+     * More channels are encoded as independent mono streams (family 255).
+     */
+    if (self->channels <= 2) {
+        self->codec.opus.mapping_family = 0;
+    } else if (self->channels <= 8) {
+        self->codec.opus.mapping_family = 1;
+    } else {
+        self->codec.opus.mapping_family = 255;
+    }
+
+    self->codec.opus.enc = opus_multistream_surround_encoder_create(self->rate, self->channels, self->codec.opus.mapping_family,
+            &(self->codec.opus.streams), &(self->codec.opus.coupled_streams), self->codec.opus.mapping, OPUS_APPLICATION_AUDIO, &error);
     if (!self->codec.opus.enc) {
         ret = coolmic_common_opus_libopuserror2error(error);
         coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, ret, "Start failed: can not create encoder");
         return ret;
     }
 
-    error = opus_encoder_ctl(self->codec.opus.enc, OPUS_SET_BITRATE(__opus_get_bitrate(self)));
-    if (error != OPUS_OK) {
+    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_INFO, COOLMIC_ERROR_NONE, "Channel mapping family %i, %i streams, %i coupled",
+            self->codec.opus.mapping_family, self->codec.opus.streams, self->codec.opus.coupled_streams);
+
+    /* worst case for a 60ms packet per stream plus the self delimiting framing */
+    self->codec.opus.packet_len = self->codec.opus.streams * (3 * 1275 + 7 + 2);
+    self->codec.opus.packet = malloc(self->codec.opus.packet_len);
+    if (!self->codec.opus.packet) {
+        __opus_stop_encoder(self);
+        ret = COOLMIC_ERROR_NOMEM;
+        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, ret, "Start failed: can not allocate packet buffer");
+        return ret;
+    }
+
+    ret = __opus_update_bitrate(self);
+    if (ret != COOLMIC_ERROR_NONE) {
         __opus_stop_encoder(self);
-        ret = coolmic_common_opus_libopuserror2error(error);
         coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, ret, "Start failed: can not set bitrate");
         return ret;
     }
 
+    if (!self->codec.opus.frames_requested)
+        self->codec.opus.frames_requested = DEFAULT_FRAMES;
+
+    error = __opus_set_frames(self, self->codec.opus.frames_requested);
+    if (error != COOLMIC_ERROR_NONE) {
+        __opus_stop_encoder(self);
+        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, error, "Start failed: can not allocate buffer");
+        return error;
+    }
+
     self->codec.opus.state = COOLMIC_ENC_OPUS_STATE_HEAD;
     self->codec.opus.granulepos = 0;
     self->codec.opus.packetno = 0;
+    self->codec.opus.page_granulepos = 0;
 
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_INFO, COOLMIC_ERROR_NONE, "Start successful");
     return COOLMIC_ERROR_NONE;
@@ -415,8 +545,40 @@ static int __opus_process(coolmic_enc_t *self)
     return -1;
 }
 
+static int __opus_ctl(coolmic_enc_t *self, coolmic_enc_op_t op, va_list ap)
+{
+    double duration;
+    size_t frames;
+    size_t i;
+
+    switch (op) {
+        case COOLMIC_ENC_OP_GET_FRAME_SIZE:
+            frames = self->codec.opus.frames_requested ? self->codec.opus.frames_requested : DEFAULT_FRAMES;
+            *(va_arg(ap, double*)) = frames * 1000. / COMMON_OPUS_RATE;
+            return COOLMIC_ERROR_NONE;
+        break;
+        case COOLMIC_ENC_OP_SET_FRAME_SIZE:
+            duration = va_arg(ap, double);
+            for (i = 0; i < (sizeof(valid_frames)/sizeof(*valid_frames)); i++) {
+                if (fabs(valid_frames[i] * 1000. / COMMON_OPUS_RATE - duration) < 0.001) {
+                    self->codec.opus.frames_requested = valid_frames[i];
+                    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_INFO, COOLMIC_ERROR_NONE, "Frame size set to %zu frames", valid_frames[i]);
+                    return COOLMIC_ERROR_NONE;
+                }
+            }
+            coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, COOLMIC_ERROR_INVAL, "Invalid frame size: %fms", duration);
+            return COOLMIC_ERROR_INVAL;
+        break;
+        default:
+            return COOLMIC_ERROR_BADRQC;
+        break;
+    }
+}
+
 const coolmic_enc_cb_t __coolmic_enc_cb_opus = {
     .start = __opus_start_encoder,
     .stop = __opus_stop_encoder,
-    .process = __opus_process
+    .process = __opus_process,
+    .ctl = __opus_ctl,
+    .update_bitrate = __opus_update_bitrate
 };
@@ -29,11 +29,15 @@
 #define __COOLMIC_DSP_ENC_PRIVATE_H__
 
 #include <stdint.h>
+#include <stdarg.h>
+#include <pthread.h>
 #include <vorbis/vorbisenc.h>
 #include <coolmic-dsp/iohandle.h>
+#include <coolmic-dsp/enc.h>
 #include <coolmic-dsp/metadata.h>
 #include <coolmic-dsp/logging.h>
 #include "common_opus.h"
+#include "engine_private.h"
 
 typedef enum coolmic_enc_state {
     STATE_NEED_INIT = 0,
@@ -57,8 +61,24 @@ typedef struct coolmic_enc_cb {
      * Returns: 0 on success, -1 on error and -2 on recoverable error.
      */
     int (*process)(coolmic_enc_t *self);
+    /* Called for control requests not handled by the generic code. This is optional.
+     * Returns a COOLMIC_ERROR_*, COOLMIC_ERROR_BADRQC if the request is not supported.
+     */
+    int (*ctl)(coolmic_enc_t *self, coolmic_enc_op_t op, va_list ap);
+    /* Called when quality or bitrate was changed while the codec is running. This is optional.
+     * If not set the change takes effect with the next restart.
+     * Returns a COOLMIC_ERROR_*.
+     */
+    int (*update_bitrate)(coolmic_enc_t *self);
 } coolmic_enc_cb_t;
 
+/* A page in the queue used in asynchronous mode */
+typedef struct coolmic_enc_page {
+    unsigned char *data;
+    size_t len;
+    size_t alloc;
+} coolmic_enc_page_t;
+
 typedef enum coolmic_enc_opus_state {
     COOLMIC_ENC_OPUS_STATE_HEAD,
     COOLMIC_ENC_OPUS_STATE_TAGS,
@@ -95,6 +115,55 @@ struct coolmic_enc {
     /* Callbacks: */
     coolmic_enc_cb_t cb;
 
+    /* Protects the encoder state. In asynchronous mode this is held by the encoder thread while encoding. */
+    pthread_mutex_t lock;
+
+    /* Asynchronous mode, see coolmic_enc_set_async() */
+    struct {
+        int enabled;
+        pthread_t thread;
+        /* set if the encoder runs as a task of an engine instead of it's own thread */
+        coolmic_engine_task_t *task;
+        /* protects all the members below */
+        pthread_mutex_t lock;
+        /* signaled when a page is added or removed or the state of the encoder thread changes */
+        pthread_cond_t cond;
+        /* set to stop the encoder thread */
+        int stop;
+        /* set when the encoder thread waits for the first read or for a reset or restart */
+        int idle;
+        /* the encoder reached EOF */
+        int eof;
+        /* the encoder failed */
+        int error;
+        /* the codec is running, so changes of quality or bitrate need cb.update_bitrate */
+        int running;
+        /* number of attempts of the encoder thread to get a page, used to wake up readers */
+        unsigned int attempts;
+        /* ring of pages */
+        coolmic_enc_page_t *queue;
+        size_t queue_size;
+        size_t queue_head;
+        size_t queue_fill;
+        /* next entry to be written, only used by the encoder thread and when pages are dropped */
+        size_t queue_tail;
+        /* offset of the reader in the first page */
+        size_t offset;
+        /* number of pages handed out by the last peek and not yet consumed */
+        size_t peeked;
+        /* incremented each time queued pages are dropped by a reset */
+        unsigned int drops;
+        /* pipe that is readable while there is something to read, see coolmic_iohandle_get_pollfd() */
+        int pipe[2];
+        int signaled;
+        /* control requests queued by coolmic_enc_ctl(), applied by the encoder thread between pages */
+        unsigned int ctl_pending;
+        /* the values last set, returned by coolmic_enc_ctl() */
+        float ctl_quality;
+        long int ctl_bitrate;
+        coolmic_metadata_t *ctl_metadata;
+    } async;
+
     /* Codec private data: */
     union {
         /* Vorbis: */
@@ -109,17 +178,32 @@ struct coolmic_enc {
 #ifdef HAVE_ENC_OPUS
         /* Opus: */
         struct {
-            OpusEncoder   *enc;
+            OpusMSEncoder *enc;
             coolmic_enc_opus_state_t state;
+            /* channel mapping as written to the OpusHead packet */
+            int mapping_family;
+            int streams;
+            int coupled_streams;
+            unsigned char mapping[COMMON_OPUS_MAX_CHANNELS];
+            /* buffer for encoded packets */
+            unsigned char *packet;
+            size_t packet_len;
             ogg_int64_t granulepos;
             ogg_int64_t packetno;
+            /* granulepos at the end of the last page flushed */
+            ogg_int64_t page_granulepos;
+            /* frames per packet: current and requested */
+            size_t frames;
+            size_t frames_requested;
             size_t buffer_fill;
-            char buffer[2880*2*2];
+            size_t buffer_len;
+            char *buffer;
         } opus;
 #endif
     } codec;
 
     float quality;       /* quality level, -0.1 to 1.0 */
+    long int bitrate;    /* target bitrate in [bit/s], 0 to use the quality level */
 
     coolmic_metadata_t *metadata;
 };
@@ -38,8 +38,14 @@ static int __vorbis_start_encoder(coolmic_enc_t *self)
     ogg_packet header_code;
 
     vorbis_info_init(&(self->codec.vorbis.vi));
-    if (vorbis_encode_init_vbr(&(self->codec.vorbis.vi), self->channels, self->rate, self->quality) != 0)
-        return -1;
+    if (self->bitrate) {
+        /* libvorbis does not allow changing the bitrate management after setup so this is only done here */
+        if (vorbis_encode_init(&(self->codec.vorbis.vi), self->channels, self->rate, -1, self->bitrate, -1) != 0)
+            return -1;
+    } else {
+        if (vorbis_encode_init_vbr(&(self->codec.vorbis.vi), self->channels, self->rate, self->quality) != 0)
+            return -1;
+    }
 
     vorbis_comment_init(&(self->codec.vorbis.vc));
     vorbis_comment_add_tag(&(self->codec.vorbis.vc), "ENCODER", "libcoolmic-dsp");
@@ -75,12 +81,12 @@ static int __vorbis_stop_encoder(coolmic_enc_t *self)
 
 static int __vorbis_read_data(coolmic_enc_t *self)
 {
-    char buffer[1024];
+    int16_t buffer[512];
     ssize_t ret;
     float **vbuffer;
-    const int16_t *in = (int16_t*)buffer;
+    const int16_t *in = buffer;
     unsigned int c;
-    size_t i = 0;
+    ssize_t i;
 
     if (self->state == STATE_EOF || self->state == STATE_NEED_RESET || self->state == STATE_NEED_RESTART || self->state == STATE_NEED_STOP) {
         coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Reached EOF.");
@@ -88,7 +94,7 @@ static int __vorbis_read_data(coolmic_enc_t *self)
         return 0;
     }
 
-    ret = coolmic_iohandle_read(self->in, buffer, sizeof(buffer));
+    ret = coolmic_iohandle_read_frames(self->in, buffer, (sizeof(buffer) / sizeof(*buffer)) / self->channels);
 
     if (ret < 1) {
         if (coolmic_iohandle_eof(self->in) == 1) {
@@ -99,22 +105,14 @@ static int __vorbis_read_data(coolmic_enc_t *self)
         return -2;
     }
 
-    /* Have we got a strange nummber of bytes? */
-    if (ret % (2 * self->channels)) {
-        self->offset_in_page = -1;
-        return -1;
-    }
-
-    vbuffer = vorbis_analysis_buffer(&(self->codec.vorbis.vd), ret / (2 * self->channels));
+    vbuffer = vorbis_analysis_buffer(&(self->codec.vorbis.vd), ret);
 
-    while (ret) {
+    for (i = 0; i < ret; i++) {
         for (c = 0; c < self->channels; c++)
             vbuffer[c][i] = *(in++) / 32768.f;
-        i++;
-        ret -= 2 * self->channels;
     }
 
-    vorbis_analysis_wrote(&(self->codec.vorbis.vd), i);
+    vorbis_analysis_wrote(&(self->codec.vorbis.vd), ret);
 
     return 0;
 }
@@ -0,0 +1,701 @@
+/*
+ *      Copyright (C) Jordan Erickson                     - 2014-2020,
+ *      Copyright (C) Löwenfelsen UG (haftungsbeschränkt) - 2015-2020
+ *       on behalf of Jordan Erickson.
+ */
+
+/*
+ * This file is part of Cool Mic.
+ * 
+ * Cool Mic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Cool Mic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Cool Mic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Please see the corresponding header file for details of this API. */
+
+#define COOLMIC_COMPONENT "libcoolmic-dsp/engine"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <igloo/timing.h>
+#include "types_private.h"
+#include "engine_private.h"
+#include <coolmic-dsp/coolmic-dsp.h>
+#include <coolmic-dsp/logging.h>
+
+/* initial number of entries of a queue, it grows with the number of tasks */
+#define QUEUE_ALLOC 16
+
+enum coolmic_engine_task_state {
+    /* new, finished or cancelled */
+    TASK_IDLE = 0,
+    /* in the queue of a worker */
+    TASK_QUEUED,
+    /* the callback is running */
+    TASK_RUNNING,
+    /* waiting for it's delay or file descriptor */
+    TASK_WAITING
+};
+
+struct coolmic_engine_task {
+    coolmic_engine_t *engine;
+    coolmic_engine_task_cb_t cb;
+    void *userdata;
+
+    /* all members below are protected by the lock of the engine */
+    enum coolmic_engine_task_state state;
+    /* woken up while running */
+    int woken;
+    /* to be cancelled */
+    int cancel;
+    /* the worker running the callback */
+    pthread_t runner;
+
+    /* while waiting: the time it is due, or UINT64_MAX, and the file descriptor or -1 */
+    uint64_t due;
+    int fd;
+    /* set if the file descriptor became readable */
+    int ready;
+    /* index in the list of waiting tasks */
+    size_t wait_index;
+    /* the file descriptor's entry in the poll set, valid if poll_gen matches the engine's */
+    unsigned int poll_gen;
+    size_t poll_index;
+};
+
+/* The queue of a worker.
+ * The owner takes the task added last as it is likely still in the cache, others steal the oldest one.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    coolmic_engine_task_t **tasks;
+    size_t alloc;
+    size_t head;
+    size_t fill;
+} coolmic_engine_queue_t;
+
+typedef struct {
+    coolmic_engine_t *engine;
+    size_t index;
+    pthread_t thread;
+    coolmic_engine_queue_t queue;
+} coolmic_engine_worker_t;
+
+struct coolmic_engine {
+    /* base type */
+    igloo_ro_base_t __base;
+
+    /* protects the state of all tasks and the members below, must be taken before the lock of a queue */
+    pthread_mutex_t lock;
+    /* signaled when a task is queued, or to stop the workers */
+    pthread_cond_t work;
+    /* signaled when a task stopped running */
+    pthread_cond_t done;
+    int stop;
+
+    coolmic_engine_worker_t *workers;
+    size_t workers_len;
+    /* number of tasks in the queues */
+    size_t pending;
+    /* queue used next for tasks woken up from outside of the workers */
+    size_t next;
+    /* number of tasks attached */
+    size_t tasks;
+
+    /* tasks waiting for their delay or file descriptor */
+    coolmic_engine_task_t **waiting;
+    size_t waiting_len;
+    size_t waiting_alloc;
+
+    /* the thread watching the waiting tasks and the pipe to wake it up */
+    pthread_t poller;
+    int poller_running;
+    int pipe[2];
+    /* only used by the poller */
+    struct pollfd *fds;
+    size_t fds_alloc;
+    unsigned int poll_gen;
+};
+
+static void __free(igloo_ro_t self);
+
+igloo_RO_PUBLIC_TYPE(coolmic_engine_t,
+        igloo_RO_TYPEDECL_FREE(__free)
+        );
+
+/* makes room for size tasks, so the queue can hold all tasks of the engine and a push never fails */
+static int __queue_reserve(coolmic_engine_queue_t *queue, size_t size)
+{
+    coolmic_engine_task_t **tasks;
+    size_t alloc;
+    size_t i;
+
+    pthread_mutex_lock(&(queue->lock));
+    if (size > queue->alloc) {
+        for (alloc = queue->alloc ? queue->alloc : QUEUE_ALLOC; alloc < size; alloc *= 2);
+        tasks = malloc(sizeof(*tasks) * alloc);
+        if (!tasks) {
+            pthread_mutex_unlock(&(queue->lock));
+            return COOLMIC_ERROR_NOMEM;
+        }
+        for (i = 0; i < queue->fill; i++)
+            tasks[i] = queue->tasks[(queue->head + i) % queue->alloc];
+        free(queue->tasks);
+        queue->tasks = tasks;
+        queue->alloc = alloc;
+        queue->head = 0;
+    }
+    pthread_mutex_unlock(&(queue->lock));
+
+    return COOLMIC_ERROR_NONE;
+}
+
+static void __queue_push(coolmic_engine_queue_t *queue, coolmic_engine_task_t *task)
+{
+    pthread_mutex_lock(&(queue->lock));
+    queue->tasks[(queue->head + queue->fill) % queue->alloc] = task;
+    queue->fill++;
+    pthread_mutex_unlock(&(queue->lock));
+}
+
+/* takes the task added last */
+static coolmic_engine_task_t *__queue_pop(coolmic_engine_queue_t *queue)
+{
+    coolmic_engine_task_t *task = NULL;
+
+    pthread_mutex_lock(&(queue->lock));
+    if (queue->fill) {
+        queue->fill--;
+        task = queue->tasks[(queue->head + queue->fill) % queue->alloc];
+    }
+    pthread_mutex_unlock(&(queue->lock));
+
+    return task;
+}
+
+/* takes the task added first */
+static coolmic_engine_task_t *__queue_steal(coolmic_engine_queue_t *queue)
+{
+    coolmic_engine_task_t *task = NULL;
+
+    pthread_mutex_lock(&(queue->lock));
+    if (queue->fill) {
+        task = queue->tasks[queue->head];
+        queue->head = (queue->head + 1) % queue->alloc;
+        queue->fill--;
+    }
+    pthread_mutex_unlock(&(queue->lock));
+
+    return task;
+}
+
+/* removes the task from the queue, returns 0 if it is not in the queue */
+static int __queue_remove(coolmic_engine_queue_t *queue, coolmic_engine_task_t *task)
+{
+    size_t i;
+    int found = 0;
+
+    pthread_mutex_lock(&(queue->lock));
+    for (i = 0; i < queue->fill; i++) {
+        if (found) {
+            queue->tasks[(queue->head + i - 1) % queue->alloc] = queue->tasks[(queue->head + i) % queue->alloc];
+        } else if (queue->tasks[(queue->head + i) % queue->alloc] == task) {
+            found = 1;
+        }
+    }
+    if (found)
+        queue->fill--;
+    pthread_mutex_unlock(&(queue->lock));
+
+    return found;
+}
+
+/* returns the worker of the engine the calling thread is, or NULL */
+static coolmic_engine_worker_t *__current_worker(coolmic_engine_t *self)
+{
+    pthread_t thread = pthread_self();
+    size_t i;
+
+    for (i = 0; i < self->workers_len; i++)
+        if (pthread_equal(self->workers[i].thread, thread))
+            return &(self->workers[i]);
+
+    return NULL;
+}
+
+/* puts the task into a queue, must be called locked */
+static void __queue_task(coolmic_engine_t *self, coolmic_engine_task_t *task, coolmic_engine_worker_t *worker)
+{
+    /* tasks woken up by a worker are kept on that worker, others are spread over all workers */
+    if (!worker) {
+        worker = &(self->workers[self->next]);
+        self->next = (self->next + 1) % self->workers_len;
+    }
+
+    task->state = TASK_QUEUED;
+    task->woken = 0;
+    __queue_push(&(worker->queue), task);
+    self->pending++;
+    pthread_cond_signal(&(self->work));
+}
+
+static void __poller_wakeup(coolmic_engine_t *self)
+{
+    char c = 0;
+
+    /* if the pipe is full the poller is going to wake up anyway */
+    if (write(self->pipe[1], &c, 1) != 1)
+        return;
+}
+
+/* removes a task from the list of waiting tasks, must be called locked */
+static void __waiting_remove(coolmic_engine_t *self, coolmic_engine_task_t *task)
+{
+    coolmic_engine_task_t *last = self->waiting[--self->waiting_len];
+
+    self->waiting[task->wait_index] = last;
+    last->wait_index = task->wait_index;
+}
+
+/* adds a task to the list of waiting tasks, must be called locked */
+static void __waiting_add(coolmic_engine_t *self, coolmic_engine_task_t *task)
+{
+    task->state = TASK_WAITING;
+    task->ready = 0;
+    task->wait_index = self->waiting_len;
+    self->waiting[self->waiting_len++] = task;
+    __poller_wakeup(self);
+}
+
+static void *__worker_run(void *userdata)
+{
+    coolmic_engine_worker_t *worker = userdata;
+    coolmic_engine_t *self = worker->engine;
+    coolmic_engine_task_t *task;
+    size_t i;
+    int delay;
+    int fd;
+
+    pthread_mutex_lock(&(self->lock));
+    while (!self->stop) {
+        if (!self->pending) {
+            pthread_cond_wait(&(self->work), &(self->lock));
+            continue;
+        }
+        pthread_mutex_unlock(&(self->lock));
+
+        /* our own tasks first, then steal starting with our neighbour */
+        task = __queue_pop(&(worker->queue));
+        for (i = 1; !task && i < self->workers_len; i++)
+            task = __queue_steal(&(self->workers[(worker->index + i) % self->workers_len].queue));
+
+        pthread_mutex_lock(&(self->lock));
+        if (!task)
+            continue;
+
+        self->pending--;
+        if (task->cancel) {
+            task->state = TASK_IDLE;
+            task->cancel = 0;
+            pthread_cond_broadcast(&(self->done));
+            continue;
+        }
+
+        task->state = TASK_RUNNING;
+        task->runner = worker->thread;
+        task->woken = 0;
+        pthread_mutex_unlock(&(self->lock));
+
+        fd = -1;
+        delay = task->cb(task->userdata, &fd);
+
+        pthread_mutex_lock(&(self->lock));
+        if (task->cancel || (delay == COOLMIC_ENGINE_TASK_DONE && !task->woken)) {
+            task->state = TASK_IDLE;
+            task->cancel = 0;
+            pthread_cond_broadcast(&(self->done));
+        } else if (task->woken || delay == 0) {
+            __queue_task(self, task, worker);
+        } else {
+            task->due = delay > 0 ? igloo_timing_get_time() + delay : UINT64_MAX;
+            task->fd = fd;
+            __waiting_add(self, task);
+        }
+    }
+    pthread_mutex_unlock(&(self->lock));
+
+    return NULL;
+}
+
+static void *__poller_run(void *userdata)
+{
+    coolmic_engine_t *self = userdata;
+    coolmic_engine_task_t *task;
+    struct pollfd *fds;
+    size_t fds_len;
+    size_t alloc;
+    size_t i;
+    uint64_t now;
+    uint64_t due;
+    int timeout;
+    char buffer[64];
+
+    pthread_mutex_lock(&(self->lock));
+    while (!self->stop) {
+        /* queue all tasks that are due */
+        now = igloo_timing_get_time();
+        due = UINT64_MAX;
+        for (i = 0; i < self->waiting_len;) {
+            task = self->waiting[i];
+            if (task->ready || task->due <= now) {
+                __waiting_remove(self, task);
+                __queue_task(self, task, NULL);
+            } else {
+                if (task->due < due)
+                    due = task->due;
+                i++;
+            }
+        }
+
+        /* build the poll set, the first entry is our pipe */
+        if (self->fds_alloc < (self->waiting_len + 1)) {
+            alloc = self->waiting_len + 1 + QUEUE_ALLOC;
+            fds = realloc(self->fds, sizeof(*fds) * alloc);
+            if (fds) {
+                self->fds = fds;
+                self->fds_alloc = alloc;
+            }
+        }
+        self->poll_gen++;
+        self->fds[0].fd = self->pipe[0];
+        self->fds[0].events = POLLIN;
+        self->fds[0].revents = 0;
+        fds_len = 1;
+        for (i = 0; i < self->waiting_len && fds_len < self->fds_alloc; i++) {
+            task = self->waiting[i];
+            if (task->fd < 0)
+                continue;
+            task->poll_gen = self->poll_gen;
+            task->poll_index = fds_len;
+            self->fds[fds_len].fd = task->fd;
+            self->fds[fds_len].events = POLLIN;
+            self->fds[fds_len].revents = 0;
+            fds_len++;
+        }
+
+        timeout = due == UINT64_MAX ? -1 : (due - now > INT32_MAX ? INT32_MAX : (int)(due - now));
+        pthread_mutex_unlock(&(self->lock));
+
+        poll(self->fds, fds_len, timeout);
+        if (self->fds[0].revents)
+            while (read(self->pipe[0], buffer, sizeof(buffer)) > 0);
+
+        pthread_mutex_lock(&(self->lock));
+        /* tasks added or removed meanwhile are not in this poll set */
+        for (i = 0; i < self->waiting_len; i++) {
+            task = self->waiting[i];
+            if (task->fd >= 0 && task->poll_gen == self->poll_gen && self->fds[task->poll_index].revents)
+                task->ready = 1;
+        }
+    }
+    pthread_mutex_unlock(&(self->lock));
+
+    return NULL;
+}
+
+static void __stop(coolmic_engine_t *self)
+{
+    size_t i;
+
+    pthread_mutex_lock(&(self->lock));
+    self->stop = 1;
+    pthread_cond_broadcast(&(self->work));
+    if (self->poller_running)
+        __poller_wakeup(self);
+    pthread_mutex_unlock(&(self->lock));
+
+    for (i = 0; i < self->workers_len; i++)
+        pthread_join(self->workers[i].thread, NULL);
+
+    if (self->poller_running)
+        pthread_join(self->poller, NULL);
+    self->poller_running = 0;
+}
+
+static void __free(igloo_ro_t self)
+{
+    coolmic_engine_t *engine = igloo_RO_TO_TYPE(self, coolmic_engine_t);
+    size_t i;
+
+    __stop(engine);
+
+    for (i = 0; i < engine->workers_len; i++) {
+        pthread_mutex_destroy(&(engine->workers[i].queue.lock));
+        free(engine->workers[i].queue.tasks);
+    }
+    free(engine->workers);
+    free(engine->waiting);
+    free(engine->fds);
+
+    if (engine->pipe[0] != -1) {
+        close(engine->pipe[0]);
+        close(engine->pipe[1]);
+    }
+
+    pthread_mutex_destroy(&(engine->lock));
+    pthread_cond_destroy(&(engine->work));
+    pthread_cond_destroy(&(engine->done));
+}
+
+coolmic_engine_t   *coolmic_engine_new(const char *name, igloo_ro_t associated, size_t threads)
+{
+    coolmic_engine_t *ret;
+    long cpus;
+    size_t i;
+
+    if (!threads) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? cpus : 1;
+    }
+
+    ret = igloo_ro_new_raw(coolmic_engine_t, name, associated);
+    if (!ret)
+        return NULL;
+
+    pthread_mutex_init(&(ret->lock), NULL);
+    pthread_cond_init(&(ret->work), NULL);
+    pthread_cond_init(&(ret->done), NULL);
+    ret->pipe[0] = -1;
+    ret->pipe[1] = -1;
+
+    do {
+        if (pipe(ret->pipe) != 0) {
+            ret->pipe[0] = -1;
+            ret->pipe[1] = -1;
+            break;
+        }
+        fcntl(ret->pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(ret->pipe[1], F_SETFL, O_NONBLOCK);
+        fcntl(ret->pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(ret->pipe[1], F_SETFD, FD_CLOEXEC);
+
+        if ((ret->fds = calloc(QUEUE_ALLOC, sizeof(*ret->fds))) == NULL)
+            break;
+        ret->fds_alloc = QUEUE_ALLOC;
+
+        if ((ret->workers = calloc(threads, sizeof(*ret->workers))) == NULL)
+            break;
+        for (i = 0; i < threads; i++) {
+            ret->workers[i].engine = ret;
+            ret->workers[i].index = i;
+            pthread_mutex_init(&(ret->workers[i].queue.lock), NULL);
+        }
+
+        /* hold the lock so no worker looks at the list of workers before it is complete */
+        pthread_mutex_lock(&(ret->lock));
+        for (i = 0; i < threads; i++) {
+            if (pthread_create(&(ret->workers[i].thread), NULL, __worker_run, &(ret->workers[i])) != 0)
+                break;
+            ret->workers_len++;
+        }
+        if (i == threads && pthread_create(&(ret->poller), NULL, __poller_run, ret) == 0)
+            ret->poller_running = 1;
+        pthread_mutex_unlock(&(ret->lock));
+
+        if (!ret->poller_running)
+            break;
+
+        return ret;
+    } while (0);
+
+    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, COOLMIC_ERROR_GENERIC, "Can not set up engine with %zu threads", threads);
+    igloo_ro_unref(ret);
+    return NULL;
+}
+
+ssize_t             coolmic_engine_get_threads(coolmic_engine_t *self)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    return self->workers_len;
+}
+
+ssize_t             coolmic_engine_get_tasks(coolmic_engine_t *self)
+{
+    ssize_t ret;
+
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    pthread_mutex_lock(&(self->lock));
+    ret = self->tasks;
+    pthread_mutex_unlock(&(self->lock));
+
+    return ret;
+}
+
+coolmic_engine_task_t  *coolmic_engine_task_new(coolmic_engine_t *engine, coolmic_engine_task_cb_t cb, void *userdata)
+{
+    coolmic_engine_task_t *task;
+    coolmic_engine_task_t **waiting;
+    size_t alloc;
+    size_t i;
+
+    if (!engine || !cb)
+        return NULL;
+
+    task = calloc(1, sizeof(*task));
+    if (!task)
+        return NULL;
+
+    if (igloo_ro_ref(engine) != 0) {
+        free(task);
+        return NULL;
+    }
+
+    task->engine = engine;
+    task->cb = cb;
+    task->userdata = userdata;
+    task->fd = -1;
+
+    /* make room for the task everywhere so queueing it never fails */
+    pthread_mutex_lock(&(engine->lock));
+    for (i = 0; i < engine->workers_len; i++)
+        if (__queue_reserve(&(engine->workers[i].queue), engine->tasks + 1) != COOLMIC_ERROR_NONE)
+            break;
+    if (i == engine->workers_len && engine->waiting_alloc <= engine->tasks) {
+        alloc = engine->waiting_alloc ? engine->waiting_alloc * 2 : QUEUE_ALLOC;
+        if ((waiting = realloc(engine->waiting, sizeof(*waiting) * alloc)) != NULL) {
+            engine->waiting = waiting;
+            engine->waiting_alloc = alloc;
+        }
+    }
+    if (i != engine->workers_len || engine->waiting_alloc <= engine->tasks) {
+        pthread_mutex_unlock(&(engine->lock));
+        igloo_ro_unref(engine);
+        free(task);
+        return NULL;
+    }
+    engine->tasks++;
+    pthread_mutex_unlock(&(engine->lock));
+
+    return task;
+}
+
+void                    coolmic_engine_task_free(coolmic_engine_task_t *task)
+{
+    coolmic_engine_t *engine;
+
+    if (!task)
+        return;
+
+    engine = task->engine;
+    coolmic_engine_task_cancel(task);
+
+    pthread_mutex_lock(&(engine->lock));
+    engine->tasks--;
+    pthread_mutex_unlock(&(engine->lock));
+
+    free(task);
+    igloo_ro_unref(engine);
+}
+
+void                    coolmic_engine_task_wake(coolmic_engine_task_t *task)
+{
+    coolmic_engine_t *engine;
+
+    if (!task)
+        return;
+
+    engine = task->engine;
+    pthread_mutex_lock(&(engine->lock));
+    switch (task->state) {
+        case TASK_IDLE:
+            __queue_task(engine, task, __current_worker(engine));
+        break;
+        case TASK_WAITING:
+            __waiting_remove(engine, task);
+            __queue_task(engine, task, __current_worker(engine));
+        break;
+        case TASK_RUNNING:
+            task->woken = 1;
+        break;
+        case TASK_QUEUED:
+        break;
+    }
+    pthread_mutex_unlock(&(engine->lock));
+}
+
+void                    coolmic_engine_task_join(coolmic_engine_task_t *task)
+{
+    coolmic_engine_t *engine;
+
+    if (!task)
+        return;
+
+    engine = task->engine;
+    pthread_mutex_lock(&(engine->lock));
+    while (task->state != TASK_IDLE)
+        pthread_cond_wait(&(engine->done), &(engine->lock));
+    pthread_mutex_unlock(&(engine->lock));
+}
+
+void                    coolmic_engine_task_cancel(coolmic_engine_task_t *task)
+{
+    coolmic_engine_t *engine;
+    size_t i;
+
+    if (!task)
+        return;
+
+    engine = task->engine;
+    pthread_mutex_lock(&(engine->lock));
+    switch (task->state) {
+        case TASK_IDLE:
+        break;
+        case TASK_WAITING:
+            __waiting_remove(engine, task);
+            task->state = TASK_IDLE;
+        break;
+        case TASK_QUEUED:
+            for (i = 0; i < engine->workers_len; i++) {
+                if (__queue_remove(&(engine->workers[i].queue), task)) {
+                    engine->pending--;
+                    task->state = TASK_IDLE;
+                    break;
+                }
+            }
+        break;
+        case TASK_RUNNING:
+            if (pthread_equal(task->runner, pthread_self())) {
+                /* we are called from the callback, the worker drops the task once it returns */
+                task->cancel = 1;
+                pthread_mutex_unlock(&(engine->lock));
+                return;
+            }
+        break;
+    }
+
+    /* the task is running, or a worker took it from it's queue already */
+    if (task->state != TASK_IDLE) {
+        task->cancel = 1;
+        while (task->state != TASK_IDLE)
+            pthread_cond_wait(&(engine->done), &(engine->lock));
+    }
+    pthread_mutex_unlock(&(engine->lock));
+}
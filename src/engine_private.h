@@ -0,0 +1,71 @@
+/*
+ *      Copyright (C) Jordan Erickson                     - 2014-2020,
+ *      Copyright (C) Löwenfelsen UG (haftungsbeschränkt) - 2015-2020
+ *       on behalf of Jordan Erickson.
+ */
+
+/*
+ * This file is part of Cool Mic.
+ * 
+ * Cool Mic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Cool Mic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Cool Mic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file defines the tasks of the engine used by the other parts of this library.
+ * A task is a callback doing a bounded amount of work without blocking.
+ * It is run again as requested by it's return value.
+ */
+
+#ifndef __COOLMIC_DSP_ENGINE_PRIVATE_H__
+#define __COOLMIC_DSP_ENGINE_PRIVATE_H__
+
+#include <coolmic-dsp/engine.h>
+
+typedef struct coolmic_engine_task coolmic_engine_task_t;
+
+/* Return values of a callback besides a delay */
+/* The task runs again when woken up or when it's file descriptor becomes readable. */
+#define COOLMIC_ENGINE_TASK_SLEEP   -1
+/* The task is finished. */
+#define COOLMIC_ENGINE_TASK_DONE    -2
+
+/* The callback of a task.
+ * It returns the time in [ms] after which it is to run again, 0 to run again right away,
+ * or one of the values above.
+ * If it sets *fd to a file descriptor the task also runs as soon as that becomes readable. *fd is -1 on entry.
+ */
+typedef int (*coolmic_engine_task_cb_t)(void *userdata, int *fd);
+
+/* This creates a new task. It does not run until it is woken up. */
+coolmic_engine_task_t  *coolmic_engine_task_new(coolmic_engine_t *engine, coolmic_engine_task_cb_t cb, void *userdata);
+
+/* This cancels and frees a task. This must not be called from the task's own callback. */
+void                    coolmic_engine_task_free(coolmic_engine_task_t *task);
+
+/* This makes the task run as soon as possible.
+ * If it is running right now it runs again right after. A finished task is started again.
+ */
+void                    coolmic_engine_task_wake(coolmic_engine_task_t *task);
+
+/* This waits until the task is finished.
+ * This must not be called from a task as it blocks the worker thread.
+ */
+void                    coolmic_engine_task_join(coolmic_engine_task_t *task);
+
+/* This stops the task. When this returns the callback is not running and is not called again until the task is woken up.
+ * If called from the task's own callback this does not wait.
+ */
+void                    coolmic_engine_task_cancel(coolmic_engine_task_t *task);
+
+#endif
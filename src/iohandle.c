@@ -24,6 +24,7 @@
 /* Please see the corresponding header file for details of this API. */
 
 #include <stdlib.h>
+#include <string.h>
 #include "types_private.h"
 #include <coolmic-dsp/iohandle.h>
 #include <coolmic-dsp/coolmic-dsp.h>
@@ -36,6 +37,23 @@ struct coolmic_iohandle {
     int     (*free)(void *userdata);
     ssize_t (*read)(void *userdata, void *buffer, size_t len);
     int     (*eof )(void *userdata);
+
+    /* optional zero-copy interface */
+    ssize_t (*peek)(void *userdata, const void **buffer, size_t len);
+    int     (*consume)(void *userdata, size_t len);
+    ssize_t (*peekv)(void *userdata, struct iovec *iov, size_t *iovcnt, size_t len);
+
+    /* optional readiness interface */
+    int     (*pollfd)(void *userdata);
+
+    /* stream format, all zero if unknown */
+    coolmic_iohandle_format_t format;
+
+    /* staging buffer used to emulate peek for backends without one and to carry partial frames */
+    void    *stage;
+    size_t  stage_len;
+    size_t  stage_offset;
+    size_t  stage_fill;
 };
 
 static void __free(igloo_ro_t self)
@@ -45,12 +63,67 @@ static void __free(igloo_ro_t self)
     if (iohandle->free) {
         iohandle->free(iohandle->userdata);
     }
+
+    free(iohandle->stage);
 }
 
 igloo_RO_PUBLIC_TYPE(coolmic_iohandle_t,
         igloo_RO_TYPEDECL_FREE(__free)
         );
 
+/* makes sure the staging buffer has space for len bytes starting at stage_offset */
+static int __stage_reserve(coolmic_iohandle_t *self, size_t len)
+{
+    void *stage_new;
+
+    if ((self->stage_offset + len) <= self->stage_len)
+        return COOLMIC_ERROR_NONE;
+
+    if (self->stage_fill && self->stage_offset)
+        memmove(self->stage, self->stage + self->stage_offset, self->stage_fill);
+    self->stage_offset = 0;
+
+    if (self->stage_len < len) {
+        stage_new = realloc(self->stage, len);
+        if (!stage_new)
+            return COOLMIC_ERROR_NOMEM;
+        self->stage = stage_new;
+        self->stage_len = len;
+    }
+
+    return COOLMIC_ERROR_NONE;
+}
+
+/* puts data back in front of the staging buffer so it is returned by the next read */
+static int __stage_unread(coolmic_iohandle_t *self, const void *buffer, size_t len)
+{
+    int ret;
+
+    if (self->stage_offset < len) {
+        ret = __stage_reserve(self, self->stage_fill + len);
+        if (ret != COOLMIC_ERROR_NONE)
+            return ret;
+        memmove(self->stage + len, self->stage + self->stage_offset, self->stage_fill);
+        self->stage_offset = len;
+    }
+
+    self->stage_offset -= len;
+    self->stage_fill   += len;
+    memcpy(self->stage + self->stage_offset, buffer, len);
+
+    return COOLMIC_ERROR_NONE;
+}
+
+static inline size_t __frame_size(coolmic_iohandle_t *self)
+{
+    switch (self->format.sample_format) {
+        case COOLMIC_IOHANDLE_SAMPLE_FORMAT_S16:
+            return 2 * self->format.channels;
+        default:
+            return 0;
+    }
+}
+
 coolmic_iohandle_t *coolmic_iohandle_new(const char *name, igloo_ro_t associated, void *userdata, int(*free)(void*), ssize_t(*read)(void*,void*,size_t), int(*eof)(void*))
 {
     coolmic_iohandle_t *ret;
@@ -83,6 +156,18 @@ ssize_t             coolmic_iohandle_read(coolmic_iohandle_t *self, void *buffer
     if (!self->read)
         return COOLMIC_ERROR_NOSYS;
 
+    /* hand out data already staged by coolmic_iohandle_peek() first */
+    if (self->stage_fill) {
+        ret = self->stage_fill < len ? self->stage_fill : len;
+        memcpy(buffer, self->stage + self->stage_offset, ret);
+        self->stage_offset += ret;
+        self->stage_fill   -= ret;
+
+        buffer += ret;
+        len    -= ret;
+        done   += ret;
+    }
+
     while (len) {
         ret = self->read(self->userdata, buffer, len);
         if (ret < 0) {
@@ -103,10 +188,266 @@ ssize_t             coolmic_iohandle_read(coolmic_iohandle_t *self, void *buffer
     return done;
 }
 
+int                 coolmic_iohandle_set_peek(coolmic_iohandle_t *self, ssize_t(*peek)(void*,const void**,size_t), int(*consume)(void*,size_t))
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+    if (!peek != !consume)
+        return COOLMIC_ERROR_INVAL;
+    if (self->stage_fill)
+        return COOLMIC_ERROR_BUSY;
+
+    self->peek = peek;
+    self->consume = consume;
+    if (!peek)
+        self->peekv = NULL;
+
+    return COOLMIC_ERROR_NONE;
+}
+
+ssize_t             coolmic_iohandle_peek(coolmic_iohandle_t *self, const void **buffer, size_t len)
+{
+    ssize_t ret;
+
+    if (!self || !buffer)
+        return COOLMIC_ERROR_FAULT;
+    if (!len)
+        return COOLMIC_ERROR_NONE;
+
+    if (self->peek && !self->stage_fill)
+        return self->peek(self->userdata, buffer, len);
+
+    /* Fallback: read into the staging buffer and hand out a pointer to it. */
+    if (self->stage_fill < len) {
+        ret = __stage_reserve(self, len);
+        if (ret != COOLMIC_ERROR_NONE)
+            return ret;
+
+        ret = self->read(self->userdata, self->stage + self->stage_offset + self->stage_fill, len - self->stage_fill);
+        if (ret > 0) {
+            self->stage_fill += ret;
+        } else if (!self->stage_fill) {
+            return ret;
+        }
+    }
+
+    *buffer = self->stage + self->stage_offset;
+    return self->stage_fill < len ? self->stage_fill : len;
+}
+
+int                 coolmic_iohandle_consume(coolmic_iohandle_t *self, size_t len)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    if (self->peek && !self->stage_fill)
+        return self->consume(self->userdata, len);
+
+    if (len > self->stage_fill)
+        return COOLMIC_ERROR_INVAL;
+
+    self->stage_offset += len;
+    self->stage_fill   -= len;
+    if (!self->stage_fill)
+        self->stage_offset = 0;
+
+    return COOLMIC_ERROR_NONE;
+}
+
+int                 coolmic_iohandle_set_peekv(coolmic_iohandle_t *self, ssize_t(*peekv)(void*,struct iovec*,size_t*,size_t))
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+    if (peekv && !self->peek)
+        return COOLMIC_ERROR_INVAL;
+
+    self->peekv = peekv;
+
+    return COOLMIC_ERROR_NONE;
+}
+
+ssize_t             coolmic_iohandle_peekv(coolmic_iohandle_t *self, struct iovec *iov, size_t *iovcnt, size_t len)
+{
+    const void *buffer;
+    ssize_t ret;
+
+    if (!self || !iov || !iovcnt)
+        return COOLMIC_ERROR_FAULT;
+    if (!*iovcnt)
+        return COOLMIC_ERROR_INVAL;
+    if (!len) {
+        *iovcnt = 0;
+        return COOLMIC_ERROR_NONE;
+    }
+
+    if (self->peekv && !self->stage_fill)
+        return self->peekv(self->userdata, iov, iovcnt, len);
+
+    ret = coolmic_iohandle_peek(self, &buffer, len);
+    if (ret < 1) {
+        *iovcnt = 0;
+        return ret;
+    }
+
+    iov[0].iov_base = (void*)buffer;
+    iov[0].iov_len = ret;
+    *iovcnt = 1;
+
+    return ret;
+}
+
+int                 coolmic_iohandle_set_pollfd(coolmic_iohandle_t *self, int(*pollfd)(void*))
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    self->pollfd = pollfd;
+
+    return COOLMIC_ERROR_NONE;
+}
+
+int                 coolmic_iohandle_get_pollfd(coolmic_iohandle_t *self)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+    if (!self->pollfd)
+        return COOLMIC_ERROR_NOSYS;
+
+    return self->pollfd(self->userdata);
+}
+
+int                 coolmic_iohandle_set_format(coolmic_iohandle_t *self, const coolmic_iohandle_format_t *format)
+{
+    if (!self || !format)
+        return COOLMIC_ERROR_FAULT;
+
+    if (!format->rate || !format->channels || format->sample_format != COOLMIC_IOHANDLE_SAMPLE_FORMAT_S16)
+        return COOLMIC_ERROR_INVAL;
+
+    self->format = *format;
+
+    return COOLMIC_ERROR_NONE;
+}
+
+int                 coolmic_iohandle_get_format(coolmic_iohandle_t *self, coolmic_iohandle_format_t *format)
+{
+    if (!self || !format)
+        return COOLMIC_ERROR_FAULT;
+
+    if (!__frame_size(self))
+        return COOLMIC_ERROR_INVAL;
+
+    *format = self->format;
+
+    return COOLMIC_ERROR_NONE;
+}
+
+int                 coolmic_iohandle_check_format(coolmic_iohandle_t *self, const coolmic_iohandle_format_t *format)
+{
+    if (!self || !format)
+        return COOLMIC_ERROR_FAULT;
+
+    if (!__frame_size(self))
+        return coolmic_iohandle_set_format(self, format);
+
+    if (self->format.rate != format->rate || self->format.channels != format->channels || self->format.sample_format != format->sample_format)
+        return COOLMIC_ERROR_INVAL;
+
+    return COOLMIC_ERROR_NONE;
+}
+
+ssize_t             coolmic_iohandle_read_frames(coolmic_iohandle_t *self, void *buffer, size_t frames)
+{
+    size_t framesize;
+    ssize_t ret;
+    size_t tail;
+
+    if (!self || !buffer)
+        return COOLMIC_ERROR_FAULT;
+
+    framesize = __frame_size(self);
+    if (!framesize)
+        return COOLMIC_ERROR_INVAL;
+
+    ret = coolmic_iohandle_read(self, buffer, frames * framesize);
+    if (ret < 1)
+        return ret;
+
+    /* keep partial frames for the next call */
+    tail = ret % framesize;
+    if (tail) {
+        if (__stage_unread(self, buffer + ret - tail, tail) != COOLMIC_ERROR_NONE)
+            return COOLMIC_ERROR_NOMEM;
+        ret -= tail;
+    }
+
+    return ret / framesize;
+}
+
+ssize_t             coolmic_iohandle_peek_frames(coolmic_iohandle_t *self, const void **buffer, size_t frames)
+{
+    size_t framesize;
+    ssize_t ret;
+    int err;
+
+    if (!self || !buffer)
+        return COOLMIC_ERROR_FAULT;
+
+    framesize = __frame_size(self);
+    if (!framesize)
+        return COOLMIC_ERROR_INVAL;
+    if (!frames)
+        return 0;
+
+    ret = coolmic_iohandle_peek(self, buffer, frames * framesize);
+    if (ret < 1 || (size_t)ret >= framesize)
+        return ret < 1 ? ret : ret / (ssize_t)framesize;
+
+    /* We only got a partial frame. Move it to the staging buffer and complete it there. */
+    if (self->peek && !self->stage_fill) {
+        err = __stage_reserve(self, framesize);
+        if (err != COOLMIC_ERROR_NONE)
+            return err;
+        memcpy(self->stage + self->stage_offset, *buffer, ret);
+        self->stage_fill = ret;
+        self->consume(self->userdata, ret);
+    } else {
+        err = __stage_reserve(self, framesize);
+        if (err != COOLMIC_ERROR_NONE)
+            return err;
+    }
+
+    while (self->stage_fill < framesize) {
+        ret = self->read(self->userdata, self->stage + self->stage_offset + self->stage_fill, framesize - self->stage_fill);
+        if (ret < 1)
+            return ret;
+        self->stage_fill += ret;
+    }
+
+    *buffer = self->stage + self->stage_offset;
+    return 1;
+}
+
+int                 coolmic_iohandle_consume_frames(coolmic_iohandle_t *self, size_t frames)
+{
+    size_t framesize;
+
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    framesize = __frame_size(self);
+    if (!framesize)
+        return COOLMIC_ERROR_INVAL;
+
+    return coolmic_iohandle_consume(self, frames * framesize);
+}
+
 int                 coolmic_iohandle_eof(coolmic_iohandle_t *self)
 {
     if (!self)
         return COOLMIC_ERROR_FAULT;
+    if (self->stage_fill)
+        return 0; /* bool */
     if (self->eof)
         return self->eof(self->userdata);
     return 0; /* bool */
@@ -0,0 +1,590 @@
+/*
+ *      Copyright (C) Jordan Erickson                     - 2014-2020,
+ *      Copyright (C) Löwenfelsen UG (haftungsbeschränkt) - 2015-2020
+ *       on behalf of Jordan Erickson.
+ */
+
+/*
+ * This file is part of Cool Mic.
+ * 
+ * Cool Mic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Cool Mic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Cool Mic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Please see the corresponding header file for details of this API. */
+
+#define COOLMIC_COMPONENT "libcoolmic-dsp/loudness"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "types_private.h"
+#include "simd_private.h"
+#include <coolmic-dsp/loudness.h>
+#include <coolmic-dsp/coolmic-dsp.h>
+#include <coolmic-dsp/logging.h>
+
+/* maximum amount of data processed per call in [Byte] */
+#define MAX_READ_LEN        (2*COOLMIC_DSP_LOUDNESS_MAX_CHANNELS*256)
+
+/* The SIMD filters process channels in groups of this size. */
+#define LANES               4
+
+/* Number of 100ms blocks in the momentary and short-term window. */
+#define MOMENTARY_BLOCKS    4
+#define SHORT_TERM_BLOCKS   30
+
+/* Gating is done using histograms with 0.1 LU bins from the absolute gate up to +10 LUFS.
+ * This avoids keeping a list of all blocks.
+ */
+#define ABSOLUTE_GATE       (-70.)
+#define INTEGRATED_GATE     (-10.)
+#define RANGE_GATE          (-20.)
+#define HISTOGRAM_STEP      10
+#define HISTOGRAM_BINS      800
+
+typedef struct {
+    uint64_t count[HISTOGRAM_BINS];
+    double energy[HISTOGRAM_BINS];
+} histogram_t;
+
+/* Biquad with a0 normalized to 1 */
+typedef struct {
+    float b0, b1, b2, a1, a2;
+} biquad_t;
+
+struct coolmic_loudness {
+    /* base type */
+    igloo_ro_base_t __base;
+
+    /* input IO handle */
+    coolmic_iohandle_t *in;
+
+    /* sample rate in [Hz] */
+    uint_least32_t rate;
+    /* number of channels */
+    unsigned int channels;
+
+    /* input format */
+    coolmic_iohandle_format_t format;
+
+    /* K-weighting: pre-filter (high shelf) and RLB filter (high pass) */
+    biquad_t pre;
+    biquad_t rlb;
+    /* filter state per channel */
+    float pre_state[2][COOLMIC_DSP_LOUDNESS_MAX_CHANNELS];
+    float rlb_state[2][COOLMIC_DSP_LOUDNESS_MAX_CHANNELS];
+
+    /* channel weights */
+    double weight[COOLMIC_DSP_LOUDNESS_MAX_CHANNELS];
+
+    /* current 100ms block */
+    size_t block_len;
+    size_t block_pos;
+    double sum[COOLMIC_DSP_LOUDNESS_MAX_CHANNELS];
+
+    /* mean square of the last blocks */
+    double block[SHORT_TERM_BLOCKS];
+    size_t block_index;
+    uint64_t blocks;
+
+    histogram_t integrated;
+    histogram_t range;
+
+    /* result */
+    coolmic_loudness_result_t result;
+};
+
+static void __free(igloo_ro_t self)
+{
+    coolmic_loudness_t *loudness = igloo_RO_TO_TYPE(self, coolmic_loudness_t);
+    igloo_ro_unref(loudness->in);
+}
+
+igloo_RO_PUBLIC_TYPE(coolmic_loudness_t,
+        igloo_RO_TYPEDECL_FREE(__free)
+        );
+
+/* Filter design as per ITU-R BS.1770 for any sample rate.
+ * The input scaling to full scale is included in the pre-filter.
+ */
+static void __setup_filters(coolmic_loudness_t *self)
+{
+    double f0, q, k, vh, vb, a0;
+
+    f0 = 1681.974450955533;
+    q  = 0.7071752369554196;
+    k  = tan(M_PI * f0 / (double)self->rate);
+    vh = pow(10., 3.999843853973347 / 20.);
+    vb = pow(vh, 0.4996667741545416);
+    a0 = 1. + k / q + k * k;
+    self->pre.b0 = (vh + vb * k / q + k * k) / a0 / 32768.;
+    self->pre.b1 = 2. * (k * k - vh) / a0 / 32768.;
+    self->pre.b2 = (vh - vb * k / q + k * k) / a0 / 32768.;
+    self->pre.a1 = 2. * (k * k - 1.) / a0;
+    self->pre.a2 = (1. - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q  = 0.5003270373238773;
+    k  = tan(M_PI * f0 / (double)self->rate);
+    a0 = 1. + k / q + k * k;
+    self->rlb.b0 = 1.;
+    self->rlb.b1 = -2.;
+    self->rlb.b2 = 1.;
+    self->rlb.a1 = 2. * (k * k - 1.) / a0;
+    self->rlb.a2 = (1. - k / q + k * k) / a0;
+}
+
+/* This filters the channels starting at first. This is also the reference implementation. */
+static void __filter_scalar(coolmic_loudness_t *self, const int16_t *in, size_t frames, unsigned int first)
+{
+    const unsigned int channels = self->channels;
+    const biquad_t pre = self->pre;
+    const biquad_t rlb = self->rlb;
+    unsigned int c;
+    size_t i;
+
+    for (c = first; c < channels; c++) {
+        float p1 = self->pre_state[0][c];
+        float p2 = self->pre_state[1][c];
+        float r1 = self->rlb_state[0][c];
+        float r2 = self->rlb_state[1][c];
+        double acc = 0.;
+        float x, y;
+
+        for (i = 0; i < frames; i++) {
+            x = in[i * channels + c];
+
+            /* pre-filter, transposed direct form II */
+            y  = pre.b0 * x + p1;
+            p1 = pre.b1 * x - pre.a1 * y + p2;
+            p2 = pre.b2 * x - pre.a2 * y;
+
+            /* RLB filter, b is (1, -2, 1) */
+            x  = y;
+            y  = x + r1;
+            r1 = r2 - 2.f * x - rlb.a1 * y;
+            r2 = x - rlb.a2 * y;
+
+            acc += y * y;
+        }
+
+        self->pre_state[0][c] = p1;
+        self->pre_state[1][c] = p2;
+        self->rlb_state[0][c] = r1;
+        self->rlb_state[1][c] = r2;
+        self->sum[c] += acc;
+    }
+}
+
+/* The SIMD code runs the filters of LANES channels in parallel. It only handles full groups of channels
+ * as partly used vectors are slower than the scalar code. Returns the number of channels processed.
+ */
+#if defined(HAVE_SIMD_SSE2)
+static unsigned int __filter_simd(coolmic_loudness_t *self, const int16_t *in, size_t frames)
+{
+    const unsigned int channels = self->channels;
+    const __m128 pre_b0 = _mm_set1_ps(self->pre.b0);
+    const __m128 pre_b1 = _mm_set1_ps(self->pre.b1);
+    const __m128 pre_b2 = _mm_set1_ps(self->pre.b2);
+    const __m128 pre_a1 = _mm_set1_ps(self->pre.a1);
+    const __m128 pre_a2 = _mm_set1_ps(self->pre.a2);
+    const __m128 rlb_a1 = _mm_set1_ps(self->rlb.a1);
+    const __m128 rlb_a2 = _mm_set1_ps(self->rlb.a2);
+    unsigned int first;
+    size_t i;
+
+    for (first = 0; (first + LANES) <= channels; first += LANES) {
+        __m128 p1 = _mm_loadu_ps(self->pre_state[0] + first);
+        __m128 p2 = _mm_loadu_ps(self->pre_state[1] + first);
+        __m128 r1 = _mm_loadu_ps(self->rlb_state[0] + first);
+        __m128 r2 = _mm_loadu_ps(self->rlb_state[1] + first);
+        __m128d acc_lo = _mm_setzero_pd();
+        __m128d acc_hi = _mm_setzero_pd();
+        __m128i v;
+        __m128 x, y;
+
+        for (i = 0; i < frames; i++) {
+            v = _mm_loadl_epi64((const __m128i*)(in + i * channels + first));
+            x = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+
+            /* pre-filter, transposed direct form II */
+            y  = _mm_add_ps(_mm_mul_ps(pre_b0, x), p1);
+            p1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(pre_b1, x), _mm_mul_ps(pre_a1, y)), p2);
+            p2 = _mm_sub_ps(_mm_mul_ps(pre_b2, x), _mm_mul_ps(pre_a2, y));
+
+            /* RLB filter, b is (1, -2, 1) */
+            x  = y;
+            y  = _mm_add_ps(x, r1);
+            r1 = _mm_sub_ps(_mm_sub_ps(r2, _mm_add_ps(x, x)), _mm_mul_ps(rlb_a1, y));
+            r2 = _mm_sub_ps(x, _mm_mul_ps(rlb_a2, y));
+
+            y = _mm_mul_ps(y, y);
+            acc_lo = _mm_add_pd(acc_lo, _mm_cvtps_pd(y));
+            acc_hi = _mm_add_pd(acc_hi, _mm_cvtps_pd(_mm_movehl_ps(y, y)));
+        }
+
+        _mm_storeu_ps(self->pre_state[0] + first, p1);
+        _mm_storeu_ps(self->pre_state[1] + first, p2);
+        _mm_storeu_ps(self->rlb_state[0] + first, r1);
+        _mm_storeu_ps(self->rlb_state[1] + first, r2);
+        _mm_storeu_pd(self->sum + first, _mm_add_pd(_mm_loadu_pd(self->sum + first), acc_lo));
+        _mm_storeu_pd(self->sum + first + 2, _mm_add_pd(_mm_loadu_pd(self->sum + first + 2), acc_hi));
+    }
+
+    return first;
+}
+#elif defined(HAVE_SIMD_NEON)
+static unsigned int __filter_simd(coolmic_loudness_t *self, const int16_t *in, size_t frames)
+{
+    const unsigned int channels = self->channels;
+    unsigned int first, c;
+    size_t i;
+
+    for (first = 0; (first + LANES) <= channels; first += LANES) {
+        float32x4_t p1 = vld1q_f32(self->pre_state[0] + first);
+        float32x4_t p2 = vld1q_f32(self->pre_state[1] + first);
+        float32x4_t r1 = vld1q_f32(self->rlb_state[0] + first);
+        float32x4_t r2 = vld1q_f32(self->rlb_state[1] + first);
+        /* At most MAX_READ_LEN is processed per call so a single precision sum is good enough here. */
+        float32x4_t acc = vdupq_n_f32(0.f);
+        float32x4_t x, y;
+        float sum[LANES];
+
+        for (i = 0; i < frames; i++) {
+            x = vcvtq_f32_s32(vmovl_s16(vld1_s16(in + i * channels + first)));
+
+            /* pre-filter, transposed direct form II */
+            y  = vmlaq_n_f32(p1, x, self->pre.b0);
+            p1 = vmlsq_n_f32(vmlaq_n_f32(p2, x, self->pre.b1), y, self->pre.a1);
+            p2 = vmlsq_n_f32(vmulq_n_f32(x, self->pre.b2), y, self->pre.a2);
+
+            /* RLB filter, b is (1, -2, 1) */
+            x  = y;
+            y  = vaddq_f32(x, r1);
+            r1 = vmlsq_n_f32(vsubq_f32(r2, vaddq_f32(x, x)), y, self->rlb.a1);
+            r2 = vmlsq_n_f32(x, y, self->rlb.a2);
+
+            acc = vmlaq_f32(acc, y, y);
+        }
+
+        vst1q_f32(self->pre_state[0] + first, p1);
+        vst1q_f32(self->pre_state[1] + first, p2);
+        vst1q_f32(self->rlb_state[0] + first, r1);
+        vst1q_f32(self->rlb_state[1] + first, r2);
+        vst1q_f32(sum, acc);
+        for (c = 0; c < LANES; c++)
+            self->sum[first + c] += sum[c];
+    }
+
+    return first;
+}
+#else
+static unsigned int __filter_simd(coolmic_loudness_t *self, const int16_t *in, size_t frames)
+{
+    (void)self, (void)in, (void)frames;
+    return 0;
+}
+#endif
+
+static inline double __loudness(double energy)
+{
+    if (energy <= 0.)
+        return -HUGE_VAL;
+    return -0.691 + 10. * log10(energy);
+}
+
+static inline double __histogram_value(size_t bin)
+{
+    return ABSOLUTE_GATE + ((double)bin + 0.5) / HISTOGRAM_STEP;
+}
+
+static void __histogram_add(histogram_t *histogram, double loudness, double energy)
+{
+    size_t bin;
+
+    if (!(loudness > ABSOLUTE_GATE))
+        return;
+
+    bin = (loudness - ABSOLUTE_GATE) * HISTOGRAM_STEP;
+    if (bin >= HISTOGRAM_BINS)
+        bin = HISTOGRAM_BINS - 1;
+
+    histogram->count[bin]++;
+    histogram->energy[bin] += energy;
+}
+
+/* Returns the first bin above the relative gate or HISTOGRAM_BINS if the histogram is empty. */
+static size_t __histogram_gate(const histogram_t *histogram, double relative_gate)
+{
+    uint64_t count = 0;
+    double energy = 0.;
+    double gate;
+    size_t i;
+
+    for (i = 0; i < HISTOGRAM_BINS; i++) {
+        count += histogram->count[i];
+        energy += histogram->energy[i];
+    }
+
+    if (!count)
+        return HISTOGRAM_BINS;
+
+    gate = __loudness(energy / count) + relative_gate;
+    if (gate <= ABSOLUTE_GATE)
+        return 0;
+
+    i = (gate - ABSOLUTE_GATE) * HISTOGRAM_STEP;
+    return i < HISTOGRAM_BINS ? i : HISTOGRAM_BINS - 1;
+}
+
+static double __integrated(const histogram_t *histogram)
+{
+    uint64_t count = 0;
+    double energy = 0.;
+    size_t i;
+
+    for (i = __histogram_gate(histogram, INTEGRATED_GATE); i < HISTOGRAM_BINS; i++) {
+        count += histogram->count[i];
+        energy += histogram->energy[i];
+    }
+
+    if (!count)
+        return -HUGE_VAL;
+
+    return __loudness(energy / count);
+}
+
+/* This is the difference between the 95th and the 10th percentile as per EBU Tech 3342. */
+static double __range(const histogram_t *histogram)
+{
+    const size_t gate = __histogram_gate(histogram, RANGE_GATE);
+    uint64_t count = 0;
+    uint64_t seen = 0;
+    size_t low = HISTOGRAM_BINS;
+    size_t i;
+
+    for (i = gate; i < HISTOGRAM_BINS; i++)
+        count += histogram->count[i];
+
+    if (!count)
+        return 0.;
+
+    for (i = gate; i < HISTOGRAM_BINS; i++) {
+        seen += histogram->count[i];
+        if (low == HISTOGRAM_BINS && seen * 100 > count * 10)
+            low = i;
+        if (seen * 100 > count * 95)
+            break;
+    }
+
+    return __histogram_value(i) - __histogram_value(low);
+}
+
+static double __window(coolmic_loudness_t *self, size_t blocks)
+{
+    double energy = 0.;
+    size_t index = self->block_index;
+    size_t i;
+
+    for (i = 0; i < blocks; i++) {
+        index = index ? index - 1 : SHORT_TERM_BLOCKS - 1;
+        energy += self->block[index];
+    }
+
+    return energy / blocks;
+}
+
+/* Called at the end of every 100ms block. The windows overlap by 75% (momentary) and 96.7% (short-term). */
+static void __block_done(coolmic_loudness_t *self)
+{
+    double energy = 0.;
+    unsigned int c;
+
+    for (c = 0; c < self->channels; c++) {
+        energy += self->weight[c] * self->sum[c];
+        self->sum[c] = 0.;
+    }
+
+    self->block[self->block_index] = energy / self->block_len;
+    self->block_index = (self->block_index + 1) % SHORT_TERM_BLOCKS;
+    self->blocks++;
+
+    if (self->blocks >= MOMENTARY_BLOCKS) {
+        energy = __window(self, MOMENTARY_BLOCKS);
+        self->result.momentary = __loudness(energy);
+        __histogram_add(&(self->integrated), self->result.momentary, energy);
+    }
+
+    if (self->blocks >= SHORT_TERM_BLOCKS) {
+        energy = __window(self, SHORT_TERM_BLOCKS);
+        self->result.short_term = __loudness(energy);
+        __histogram_add(&(self->range), self->result.short_term, energy);
+    }
+}
+
+coolmic_loudness_t *coolmic_loudness_new(const char *name, igloo_ro_t associated, uint_least32_t rate, unsigned int channels)
+{
+    coolmic_loudness_t *ret;
+    unsigned int c;
+
+    if (!rate || !channels || channels > COOLMIC_DSP_LOUDNESS_MAX_CHANNELS)
+        return NULL;
+
+    ret = igloo_ro_new_raw(coolmic_loudness_t, name, associated);
+    if (!ret)
+        return NULL;
+
+    ret->rate = rate;
+    ret->channels = channels;
+
+    ret->format.rate = rate;
+    ret->format.channels = channels;
+    ret->format.sample_format = COOLMIC_IOHANDLE_SAMPLE_FORMAT_S16;
+
+    ret->block_len = rate / 10;
+    if (!ret->block_len)
+        ret->block_len = 1;
+
+    for (c = 0; c < channels; c++)
+        ret->weight[c] = 1.;
+
+    if (channels == 6) {
+        /* Vorbis channel order: front left, center, front right, rear left, rear right, LFE */
+        ret->weight[3] = 1.41;
+        ret->weight[4] = 1.41;
+        ret->weight[5] = 0.;
+    }
+
+    __setup_filters(ret);
+    coolmic_loudness_reset(ret);
+
+    return ret;
+}
+
+int                 coolmic_loudness_reset(coolmic_loudness_t *self)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    memset(self->pre_state, 0, sizeof(self->pre_state));
+    memset(self->rlb_state, 0, sizeof(self->rlb_state));
+    memset(self->sum, 0, sizeof(self->sum));
+    memset(self->block, 0, sizeof(self->block));
+    memset(&(self->integrated), 0, sizeof(self->integrated));
+    memset(&(self->range), 0, sizeof(self->range));
+    self->block_pos = 0;
+    self->block_index = 0;
+    self->blocks = 0;
+
+    memset(&(self->result), 0, sizeof(self->result));
+    self->result.rate = self->rate;
+    self->result.channels = self->channels;
+    self->result.momentary = -HUGE_VAL;
+    self->result.short_term = -HUGE_VAL;
+    self->result.integrated = -HUGE_VAL;
+
+    return COOLMIC_ERROR_NONE;
+}
+
+int                 coolmic_loudness_set_channel_weight(coolmic_loudness_t *self, unsigned int channel, double weight)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+    if (channel >= self->channels || !(weight >= 0.))
+        return COOLMIC_ERROR_INVAL;
+
+    self->weight[channel] = weight;
+
+    return COOLMIC_ERROR_NONE;
+}
+
+int                 coolmic_loudness_attach_iohandle(coolmic_loudness_t *self, coolmic_iohandle_t *handle)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+    if (handle && coolmic_iohandle_check_format(handle, &(self->format)) != COOLMIC_ERROR_NONE)
+        return COOLMIC_ERROR_INVAL;
+    if (self->in)
+        igloo_ro_unref(self->in);
+    /* ignore errors here as handle is allowed to be NULL */
+    igloo_ro_ref(self->in = handle);
+    return COOLMIC_ERROR_NONE;
+}
+
+ssize_t             coolmic_loudness_read(coolmic_loudness_t *self, ssize_t maxlen)
+{
+    ssize_t ret;
+    size_t framesize;
+    size_t frames;
+    size_t done;
+    size_t len;
+    const void *data;
+
+    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Read request, maxlen=%zi", maxlen);
+
+    if (!self) {
+        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, COOLMIC_ERROR_FAULT, "Bad state, self=NULL");
+        return -1;
+    }
+
+    framesize = self->channels * 2;
+    frames = MAX_READ_LEN / framesize;
+    if (maxlen >= 0 && frames > ((size_t)maxlen / framesize))
+        frames = maxlen / framesize;
+
+    /* work directly on the data of the backend */
+    ret = coolmic_iohandle_peek_frames(self->in, &data, frames);
+    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Got %zi frames", ret);
+    if (ret < 0)
+        return -1;
+
+    frames = ret;
+
+    for (done = 0; done < frames; done += len) {
+        len = self->block_len - self->block_pos;
+        if (len > (frames - done))
+            len = frames - done;
+
+        __filter_scalar(self, (const int16_t*)data + done * self->channels, len,
+                __filter_simd(self, (const int16_t*)data + done * self->channels, len));
+
+        self->block_pos += len;
+        if (self->block_pos == self->block_len) {
+            self->block_pos = 0;
+            __block_done(self);
+        }
+    }
+
+    self->result.frames += frames;
+
+    if (frames)
+        coolmic_iohandle_consume_frames(self->in, frames);
+
+    return frames * framesize;
+}
+
+int                 coolmic_loudness_result(coolmic_loudness_t *self, coolmic_loudness_result_t *result)
+{
+    if (!self || !result)
+        return COOLMIC_ERROR_FAULT;
+
+    if (!self->result.frames)
+        return COOLMIC_ERROR_INVAL;
+
+    self->result.integrated = __integrated(&(self->integrated));
+    self->result.range = __range(&(self->range));
+
+    memcpy(result, &(self->result), sizeof(self->result));
+
+    return COOLMIC_ERROR_NONE;
+}
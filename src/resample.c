@@ -0,0 +1,411 @@
+/*
+ *      Copyright (C) Jordan Erickson                     - 2014-2020,
+ *      Copyright (C) Löwenfelsen UG (haftungsbeschränkt) - 2015-2020
+ *       on behalf of Jordan Erickson.
+ */
+
+/*
+ * This file is part of Cool Mic.
+ * 
+ * Cool Mic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Cool Mic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Cool Mic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This is the implementation of the sample rate converter.
+ * It is a rational polyphase resampler using a Kaiser windowed sinc filter.
+ */
+
+#define COOLMIC_COMPONENT "libcoolmic-dsp/resample"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "types_private.h"
+#include "simd_private.h"
+#include <coolmic-dsp/resample.h>
+#include <coolmic-dsp/coolmic-dsp.h>
+#include <coolmic-dsp/logging.h>
+
+/* Maximum number of filter phases. This limits the supported ratios. This allows 11025Hz to 192kHz. */
+#define MAX_PHASES      2560
+/* Maximum decimation factor, rounded up. This allows 192kHz to 8kHz. */
+#define MAX_DECIMATION  24
+/* Maximum number of taps, must be a multiple of 8.
+ * When decimating the taps of the preset are multiplied by the decimation factor
+ * so the transition band stays the same relative to the output rate.
+ */
+#define MAX_TAPS        (64 * MAX_DECIMATION)
+/* Number of input frames read at once */
+#define CHUNK_FRAMES    512
+/* Size of the per channel input buffer in [Frame] */
+#define BUFFER_FRAMES   (MAX_TAPS + CHUNK_FRAMES)
+
+typedef struct {
+    size_t taps;
+    double beta;
+    double rolloff;
+} preset_t;
+
+static const preset_t presets[] = {
+    [COOLMIC_RESAMPLE_QUALITY_LOW]      = {16,  6.0, 0.80},
+    [COOLMIC_RESAMPLE_QUALITY_MEDIUM]   = {32,  9.0, 0.85},
+    [COOLMIC_RESAMPLE_QUALITY_HIGH]     = {64, 10.5, 0.91}
+};
+
+struct coolmic_resample {
+    /* base type */
+    igloo_ro_base_t __base;
+
+    /* IO Handle */
+    coolmic_iohandle_t *io;
+    /* signal format of input and output */
+    coolmic_iohandle_format_t format_in;
+    coolmic_iohandle_format_t format_out;
+    /* signal number of channels */
+    unsigned int channels;
+
+    /* The output rate is L/M times the input rate. */
+    unsigned int L;
+    unsigned int M;
+    /* filter: L phases of taps coefficients */
+    size_t taps;
+    float *filter;
+
+    /* position of the next output: index of the first tap in the buffer and phase */
+    size_t start;
+    unsigned int phase;
+
+    /* per channel input buffer */
+    size_t fill;
+    float buffer[COOLMIC_DSP_RESAMPLE_MAX_CHANNELS][BUFFER_FRAMES];
+};
+
+static void __free_resample(igloo_ro_t self)
+{
+    coolmic_resample_t *resample = igloo_RO_TO_TYPE(self, coolmic_resample_t);
+
+    igloo_ro_unref(resample->io);
+    free(resample->filter);
+}
+
+igloo_RO_PUBLIC_TYPE(coolmic_resample_t,
+        igloo_RO_TYPEDECL_FREE(__free_resample)
+        );
+
+static unsigned int __gcd(unsigned int a, unsigned int b)
+{
+    unsigned int t;
+
+    while (b) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+/* modified Bessel function of the first kind, order 0 */
+static double __bessel_i0(double x)
+{
+    double sum = 1.;
+    double term = 1.;
+    unsigned int k;
+
+    for (k = 1; k < 64 && term > (sum * 1e-12); k++) {
+        term *= (x / (2. * k)) * (x / (2. * k));
+        sum += term;
+    }
+
+    return sum;
+}
+
+/* This builds the filter. Tap j of phase p is applied to the input sample at distance
+ * phase/L + taps/2 - 1 - j from the output position. Each phase is normalized to unity gain at DC.
+ */
+static void __setup_filter(coolmic_resample_t *self, const preset_t *preset)
+{
+    const double cutoff = 0.5 * preset->rolloff * (self->L < self->M ? (double)self->L / self->M : 1.);
+    const double half = self->taps / 2.;
+    double h[MAX_TAPS];
+    double sum, t, x;
+    unsigned int p;
+    size_t j;
+
+    for (p = 0; p < self->L; p++) {
+        sum = 0.;
+        for (j = 0; j < self->taps; j++) {
+            t = (double)p / self->L + half - 1. - j;
+            x = t / half;
+            h[j] = (x <= -1. || x >= 1.) ? 0. : __bessel_i0(preset->beta * sqrt(1. - x * x)) / __bessel_i0(preset->beta);
+            h[j] *= (t == 0.) ? 2. * cutoff : sin(2. * M_PI * cutoff * t) / (M_PI * t);
+            sum += h[j];
+        }
+        for (j = 0; j < self->taps; j++)
+            self->filter[p * self->taps + j] = h[j] / sum;
+    }
+}
+
+coolmic_resample_t    *coolmic_resample_new(const char *name, igloo_ro_t associated, uint_least32_t rate_in, uint_least32_t rate_out, unsigned int channels, coolmic_resample_quality_t quality)
+{
+    coolmic_resample_t *self;
+    unsigned int gcd;
+    unsigned int decimation;
+
+    if (!rate_in || !rate_out || !channels || channels > COOLMIC_DSP_RESAMPLE_MAX_CHANNELS)
+        return NULL;
+    if ((size_t)quality >= (sizeof(presets)/sizeof(*presets)))
+        return NULL;
+
+    gcd = __gcd(rate_in, rate_out);
+    decimation = ((uint64_t)rate_in + rate_out - 1) / rate_out;
+    if ((rate_out / gcd) > MAX_PHASES || decimation > MAX_DECIMATION) {
+        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, COOLMIC_ERROR_NOSYS, "Unsupported ratio: %lu to %lu Hz", (unsigned long int)rate_in, (unsigned long int)rate_out);
+        return NULL;
+    }
+
+    self = igloo_ro_new_raw(coolmic_resample_t, name, associated);
+
+    if (!self)
+        return NULL;
+
+    self->channels  = channels;
+    self->L         = rate_out / gcd;
+    self->M         = rate_in / gcd;
+    /* This also keeps the step between two outputs shorter than the filter, see __refill(). */
+    self->taps      = presets[quality].taps * decimation;
+
+    self->format_in.rate = rate_in;
+    self->format_in.channels = channels;
+    self->format_in.sample_format = COOLMIC_IOHANDLE_SAMPLE_FORMAT_S16;
+    self->format_out = self->format_in;
+    self->format_out.rate = rate_out;
+
+    self->filter = malloc(sizeof(*self->filter) * self->L * self->taps);
+    if (!self->filter) {
+        igloo_ro_unref(self);
+        return NULL;
+    }
+
+    __setup_filter(self, &(presets[quality]));
+
+    /* history before the first sample is silence, see __setup_filter() */
+    self->fill = self->taps / 2 - 1;
+
+    return self;
+}
+
+int                    coolmic_resample_attach_iohandle(coolmic_resample_t *self, coolmic_iohandle_t *handle)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+    if (handle && coolmic_iohandle_check_format(handle, &(self->format_in)) != COOLMIC_ERROR_NONE)
+        return COOLMIC_ERROR_INVAL;
+    if (self->io)
+        igloo_ro_unref(self->io);
+    /* ignore errors here as handle is allowed to be NULL */
+    igloo_ro_ref(self->io = handle);
+    return COOLMIC_ERROR_NONE;
+}
+
+static int __free(void *userdata)
+{
+    coolmic_resample_t *self = userdata;
+
+    return igloo_ro_unref(self);
+}
+
+static inline float __dot_scalar(const float *x, const float *h, size_t taps)
+{
+    float sum = 0.f;
+    size_t j;
+
+    for (j = 0; j < taps; j++)
+        sum += x[j] * h[j];
+
+    return sum;
+}
+
+#if defined(HAVE_SIMD_AVX2)
+static inline float __dot(const float *x, const float *h, size_t taps)
+{
+    __m256 acc = _mm256_setzero_ps();
+    __m128 sum;
+    size_t j;
+
+    for (j = 0; j < taps; j += 8)
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(x + j), _mm256_loadu_ps(h + j)));
+
+    sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+#elif defined(HAVE_SIMD_SSE2)
+static inline float __dot(const float *x, const float *h, size_t taps)
+{
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    __m128 sum;
+    size_t j;
+
+    for (j = 0; j < taps; j += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + j), _mm_loadu_ps(h + j)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + j + 4), _mm_loadu_ps(h + j + 4)));
+    }
+
+    sum = _mm_add_ps(acc0, acc1);
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+#elif defined(HAVE_SIMD_NEON)
+static inline float __dot(const float *x, const float *h, size_t taps)
+{
+    float32x4_t acc0 = vdupq_n_f32(0.f);
+    float32x4_t acc1 = vdupq_n_f32(0.f);
+    float32x2_t sum;
+    size_t j;
+
+    for (j = 0; j < taps; j += 8) {
+        acc0 = vmlaq_f32(acc0, vld1q_f32(x + j), vld1q_f32(h + j));
+        acc1 = vmlaq_f32(acc1, vld1q_f32(x + j + 4), vld1q_f32(h + j + 4));
+    }
+
+    acc0 = vaddq_f32(acc0, acc1);
+    sum = vadd_f32(vget_low_f32(acc0), vget_high_f32(acc0));
+    return vget_lane_f32(vpadd_f32(sum, sum), 0);
+}
+#else
+static inline float __dot(const float *x, const float *h, size_t taps)
+{
+    return __dot_scalar(x, h, taps);
+}
+#endif
+
+static inline int16_t __to_s16(float v)
+{
+    if (v >= 32767.f)
+        return 32767;
+    if (v <= -32768.f)
+        return -32768;
+    return lrintf(v);
+}
+
+/* This reads more input into the buffer. Returns the number of frames read or a COOLMIC_ERROR_*. */
+static ssize_t __refill(coolmic_resample_t *self)
+{
+    int16_t in[CHUNK_FRAMES * COOLMIC_DSP_RESAMPLE_MAX_CHANNELS];
+    const unsigned int channels = self->channels;
+    size_t frames;
+    ssize_t ret;
+    unsigned int c;
+    size_t i;
+
+    /* drop the data no longer needed. start is at most fill as an output steps by less than the filter length. */
+    if (self->start) {
+        for (c = 0; c < channels; c++)
+            memmove(self->buffer[c], self->buffer[c] + self->start, (self->fill - self->start) * sizeof(float));
+        self->fill -= self->start;
+        self->start = 0;
+    }
+
+    frames = BUFFER_FRAMES - self->fill;
+    if (frames > CHUNK_FRAMES)
+        frames = CHUNK_FRAMES;
+
+    ret = coolmic_iohandle_read_frames(self->io, in, frames);
+    if (ret < 1)
+        return ret;
+
+    for (i = 0; i < (size_t)ret; i++)
+        for (c = 0; c < channels; c++)
+            self->buffer[c][self->fill + i] = in[i * channels + c];
+
+    self->fill += ret;
+
+    return ret;
+}
+
+static ssize_t __read(void *userdata, void *buffer, size_t len)
+{
+    coolmic_resample_t *self = userdata;
+    const unsigned int channels = self->channels;
+    const size_t taps = self->taps;
+    const size_t step = self->M / self->L;
+    const unsigned int step_phase = self->M % self->L;
+    const size_t frames = len / (2 * channels);
+    int16_t *out = buffer;
+    const float *h;
+    size_t done = 0;
+    ssize_t ret;
+    unsigned int c;
+
+    if (!self->io)
+        return 0;
+
+    while (done < frames) {
+        if ((self->start + taps) > self->fill) {
+            ret = __refill(self);
+            if (ret < 1) {
+                if (done)
+                    break;
+                return ret;
+            }
+            continue;
+        }
+
+        h = self->filter + self->phase * taps;
+        for (c = 0; c < channels; c++)
+            *(out++) = __to_s16(__dot(self->buffer[c] + self->start, h, taps));
+
+        done++;
+        self->start += step;
+        self->phase += step_phase;
+        if (self->phase >= self->L) {
+            self->phase -= self->L;
+            self->start++;
+        }
+    }
+
+    return done * 2 * channels;
+}
+
+static int __eof(void *userdata)
+{
+    coolmic_resample_t *self = userdata;
+
+    /* If we do not have an IO handle this is EOF. */
+    if (!self->io)
+        return 1;
+
+    /* Just forward the question to the next layer. */
+    return coolmic_iohandle_eof(self->io);
+}
+
+coolmic_iohandle_t    *coolmic_resample_get_iohandle(coolmic_resample_t *self)
+{
+    coolmic_iohandle_t *ret;
+
+    if (igloo_ro_ref(self) != COOLMIC_ERROR_NONE)
+        return NULL;
+
+    ret = coolmic_iohandle_new(NULL, igloo_RO_NULL, self, __free, __read, __eof);
+    if (!ret) {
+        igloo_ro_unref(self);
+        return NULL;
+    }
+
+    coolmic_iohandle_set_format(ret, &(self->format_out));
+
+    return ret;
+}
@@ -0,0 +1,67 @@
+/*
+ *      Copyright (C) Jordan Erickson                     - 2014-2020,
+ *      Copyright (C) Löwenfelsen UG (haftungsbeschränkt) - 2015-2020
+ *       on behalf of Jordan Erickson.
+ */
+
+/*
+ * This file is part of Cool Mic.
+ * 
+ * Cool Mic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Cool Mic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Cool Mic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file implements a sequence lock to publish snapshots of data.
+ * There must only be one writer at a time. Readers never block the writer
+ * and the writer never blocks readers.
+ */
+
+#ifndef __COOLMIC_DSP_SEQLOCK_PRIVATE_H__
+#define __COOLMIC_DSP_SEQLOCK_PRIVATE_H__
+
+#include <string.h>
+#include <stdatomic.h>
+
+typedef atomic_uint seqlock_t;
+
+/* This publishes len bytes from src by copying them to dst. */
+static inline void __seqlock_write(seqlock_t *seq, void *dst, const void *src, size_t len)
+{
+    unsigned int s = atomic_load_explicit(seq, memory_order_relaxed);
+
+    atomic_store_explicit(seq, s + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(dst, src, len);
+    atomic_store_explicit(seq, s + 2, memory_order_release);
+}
+
+/* This reads the data published at src into dst.
+ * Returns the number of times data was published, 0 means dst was not updated.
+ */
+static inline unsigned int __seqlock_read(seqlock_t *seq, void *dst, const void *src, size_t len)
+{
+    unsigned int s;
+
+    do {
+        while ((s = atomic_load_explicit(seq, memory_order_acquire)) & 1);
+        if (!s)
+            return 0;
+        memcpy(dst, src, len);
+        atomic_thread_fence(memory_order_acquire);
+    } while (s != atomic_load_explicit(seq, memory_order_relaxed));
+
+    return s / 2;
+}
+
+#endif
@@ -25,12 +25,63 @@
 
 #define COOLMIC_COMPONENT "libcoolmic-dsp/shout"
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <shout/shout.h>
+#include <igloo/timing.h>
 #include "types_private.h"
 #include <coolmic-dsp/shout.h>
 #include <coolmic-dsp/coolmic-dsp.h>
 #include <coolmic-dsp/logging.h>
 
+/* minimum number of bytes to send per iteration, and the maximum size of a single send */
+#define SEND_LEN        1024
+#define SEND_MAX_LEN    65536
+/* maximum number of buffers (usually Ogg pages) fetched at once */
+#define SEND_IOV        16
+
+/* number of pages kept for mirrors. A mirror falling further behind is reconnected */
+#define MIRROR_RING         128
+/* number of bytes a mirror may have queued in libshout before it is considered slow */
+#define MIRROR_QUEUE_MAX    65536
+/* reconnect delay of mirrors in [ms], doubled on every failed attempt */
+#define MIRROR_RETRY_MIN    1000
+#define MIRROR_RETRY_MAX    32000
+
+/* initial number of pages the replay buffer can hold, it grows as needed */
+#define REPLAY_ALLOC        64
+
+/* size of the Ogg page header without the segment table */
+#define OGG_HEADER_LEN      27
+#define OGG_FLAG_BOS        0x02
+
+typedef struct coolmic_shout_page {
+    unsigned char *data;
+    size_t len;
+    size_t alloc;
+    /* only used by the replay buffer: time the page was read in [ms], and whether it is a header page */
+    uint64_t time;
+    int header;
+} coolmic_shout_page_t;
+
+typedef enum coolmic_shout_mirror_state {
+    MIRROR_DISCONNECTED = 0,
+    MIRROR_CONNECTING,
+    MIRROR_CONNECTED
+} coolmic_shout_mirror_state_t;
+
+typedef struct coolmic_shout_mirror {
+    shout_t *shout;
+    coolmic_shout_mirror_state_t state;
+    /* sequence number of the next page to send */
+    uint64_t next;
+    /* reconnect state */
+    uint64_t retry_at;
+    uint64_t retry_delay;
+    /* number of bytes passed to libshout */
+    uint64_t sent;
+} coolmic_shout_mirror_t;
+
 struct coolmic_shout {
     /* base type */
     igloo_ro_base_t __base;
@@ -38,11 +89,45 @@ struct coolmic_shout {
     shout_t *shout;
     coolmic_iohandle_t *in;
     int need_next_segment;
+    /* number of bytes passed to libshout */
+    uint64_t sent;
+    /* whether coolmic_shout_iter() paces the stream, see coolmic_shout_set_sync() */
+    int nosync;
+
+    /* mirrors, see coolmic_shout_add_config() */
+    coolmic_shout_mirror_t *mirrors;
+    size_t mirrors_len;
+    /* the stream split into pages, page number n is stored at ring[n % MIRROR_RING] */
+    coolmic_shout_page_t ring[MIRROR_RING];
+    uint64_t ring_next;
+    /* the page currently being assembled */
+    coolmic_shout_page_t partial;
+    /* the header pages of the current stream, sent first to every (re)connecting mirror */
+    coolmic_shout_page_t *headers;
+    size_t headers_len;
+    size_t headers_alloc;
+    int headers_open;
+
+    /* replay buffer, see coolmic_shout_set_replay().
+     * Page number n is stored at replay[n & (replay_alloc - 1)].
+     * Pages from replay_next up to replay_end are not yet sent.
+     */
+    uint64_t replay_backlog;
+    coolmic_shout_page_t *replay;
+    size_t replay_alloc;
+    uint64_t replay_first;
+    uint64_t replay_next;
+    uint64_t replay_end;
+    /* set when the connection was stopped, so the next one resumes the stream */
+    int replay_resume;
+    /* how far in [ms] the stream was sent ahead of real time when catching up */
+    uint64_t replay_ahead;
 };
 
 static void __free(igloo_ro_t self)
 {
     coolmic_shout_t *shout = igloo_RO_TO_TYPE(self, coolmic_shout_t);
+    size_t i;
 
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Asked to shut down.");
 
@@ -50,29 +135,57 @@ static void __free(igloo_ro_t self)
     shout_free(shout->shout);
     igloo_ro_unref(shout->in);
 
+    for (i = 0; i < shout->mirrors_len; i++) {
+        shout_close(shout->mirrors[i].shout);
+        shout_free(shout->mirrors[i].shout);
+        shout_shutdown();
+    }
+    free(shout->mirrors);
+
+    for (i = 0; i < MIRROR_RING; i++)
+        free(shout->ring[i].data);
+    for (i = 0; i < shout->headers_alloc; i++)
+        free(shout->headers[i].data);
+    free(shout->headers);
+    for (i = 0; i < shout->replay_alloc; i++)
+        free(shout->replay[i].data);
+    free(shout->replay);
+    free(shout->partial.data);
+
     shout_shutdown();
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "... and down.");
 }
 
-static int __new(igloo_ro_t self, const igloo_ro_type_t *type, va_list ap)
+static shout_t *__shout_new(void)
 {
-    coolmic_shout_t *shout = igloo_RO_TO_TYPE(self, coolmic_shout_t);
-
-    (void)type, (void)ap;
+    shout_t *shout;
 
     shout_init();
 
-    shout->shout = shout_new();
-    if (!shout->shout) {
+    shout = shout_new();
+    if (!shout) {
         shout_shutdown();
-        return -1;
+        return NULL;
     }
 
-    shout_set_nonblocking(shout->shout, SHOUT_BLOCKING_NONE);
+    shout_set_nonblocking(shout, SHOUT_BLOCKING_NONE);
 
     /* set some stuff that is always the same for all connections */
-    shout_set_protocol(shout->shout, SHOUT_PROTOCOL_HTTP);
-    shout_set_content_format(shout->shout, SHOUT_FORMAT_OGG, SHOUT_USAGE_AUDIO, NULL);
+    shout_set_protocol(shout, SHOUT_PROTOCOL_HTTP);
+    shout_set_content_format(shout, SHOUT_FORMAT_OGG, SHOUT_USAGE_AUDIO, NULL);
+
+    return shout;
+}
+
+static int __new(igloo_ro_t self, const igloo_ro_type_t *type, va_list ap)
+{
+    coolmic_shout_t *shout = igloo_RO_TO_TYPE(self, coolmic_shout_t);
+
+    (void)type, (void)ap;
+
+    shout->shout = __shout_new();
+    if (!shout->shout)
+        return -1;
 
     return 0;
 }
@@ -135,38 +248,35 @@ static int libshouterror2error(const int err) {
     }
 }
 
-static inline int libshout2error(coolmic_shout_t *self) {
-    return libshouterror2error(shout_get_errno(self->shout));
+static inline int libshout2error(shout_t *shout) {
+    return libshouterror2error(shout_get_errno(shout));
 }
 
-int              coolmic_shout_set_config(coolmic_shout_t *self, const coolmic_shout_config_t *conf)
+static int __configure(shout_t *shout, const coolmic_shout_config_t *conf)
 {
     char ua[256];
 
-    if (!self || !conf)
-        return COOLMIC_ERROR_FAULT;
-
-    if (shout_set_host(self->shout, conf->hostname) != SHOUTERR_SUCCESS)
-        return libshout2error(self);
+    if (shout_set_host(shout, conf->hostname) != SHOUTERR_SUCCESS)
+        return libshout2error(shout);
 
-    if (shout_set_port(self->shout, conf->port) != SHOUTERR_SUCCESS)
-        return libshout2error(self);
+    if (shout_set_port(shout, conf->port) != SHOUTERR_SUCCESS)
+        return libshout2error(shout);
 
 #ifdef SHOUT_TLS
-    if (shout_set_tls(self->shout, conf->tlsmode) != SHOUTERR_SUCCESS)
-        return libshout2error(self);
+    if (shout_set_tls(shout, conf->tlsmode) != SHOUTERR_SUCCESS)
+        return libshout2error(shout);
 
     if (conf->cadir)
-        if (shout_set_ca_directory(self->shout, conf->cadir) != SHOUTERR_SUCCESS)
-            return libshout2error(self);
+        if (shout_set_ca_directory(shout, conf->cadir) != SHOUTERR_SUCCESS)
+            return libshout2error(shout);
 
     if (conf->cafile)
-        if (shout_set_ca_file(self->shout, conf->cafile) != SHOUTERR_SUCCESS)
-            return libshout2error(self);
+        if (shout_set_ca_file(shout, conf->cafile) != SHOUTERR_SUCCESS)
+            return libshout2error(shout);
 
     if (conf->client_cert)
-        if (shout_set_client_certificate(self->shout, conf->client_cert) != SHOUTERR_SUCCESS)
-            return libshout2error(self);
+        if (shout_set_client_certificate(shout, conf->client_cert) != SHOUTERR_SUCCESS)
+            return libshout2error(shout);
 #else
     if (!(conf->tlsmode == 0 || conf->tlsmode == 1)) /* 0 = plain, 1 = auto (plain allowed) */
         return COOLMIC_ERROR_NOSYS;
@@ -174,15 +284,15 @@ int              coolmic_shout_set_config(coolmic_shout_t *self, const coolmic_s
         return COOLMIC_ERROR_NOSYS;
 #endif
 
-    if (shout_set_mount(self->shout, conf->mount) != SHOUTERR_SUCCESS)
-        return libshout2error(self);
+    if (shout_set_mount(shout, conf->mount) != SHOUTERR_SUCCESS)
+        return libshout2error(shout);
 
     if (conf->username)
-        if (shout_set_user(self->shout, conf->username) != SHOUTERR_SUCCESS)
-            return libshout2error(self);
+        if (shout_set_user(shout, conf->username) != SHOUTERR_SUCCESS)
+            return libshout2error(shout);
 
-    if (shout_set_password(self->shout, conf->password) != SHOUTERR_SUCCESS)
-        return libshout2error(self);
+    if (shout_set_password(shout, conf->password) != SHOUTERR_SUCCESS)
+        return libshout2error(shout);
 
     if (conf->software_name && conf->software_version && conf->software_comment) {
         snprintf(ua, sizeof(ua), "%s/%s (%s) libcoolmic-dsp libshout/%s", conf->software_name, conf->software_version, conf->software_comment, shout_version(NULL, NULL, NULL));
@@ -194,18 +304,63 @@ int              coolmic_shout_set_config(coolmic_shout_t *self, const coolmic_s
         snprintf(ua, sizeof(ua), "libcoolmic-dsp libshout/%s", shout_version(NULL, NULL, NULL));
     }
 
-    shout_set_agent(self->shout, ua);
+    shout_set_agent(shout, ua);
 
     return COOLMIC_ERROR_NONE;
 }
 
+int              coolmic_shout_set_config(coolmic_shout_t *self, const coolmic_shout_config_t *conf)
+{
+    if (!self || !conf)
+        return COOLMIC_ERROR_FAULT;
+
+    return __configure(self->shout, conf);
+}
+
+ssize_t          coolmic_shout_add_config(coolmic_shout_t *self, const coolmic_shout_config_t *conf)
+{
+    coolmic_shout_mirror_t *mirrors;
+    coolmic_shout_mirror_t *mirror;
+    int ret;
+
+    if (!self || !conf)
+        return COOLMIC_ERROR_FAULT;
+
+    mirrors = realloc(self->mirrors, sizeof(*mirrors) * (self->mirrors_len + 1));
+    if (!mirrors)
+        return COOLMIC_ERROR_NOMEM;
+    self->mirrors = mirrors;
+
+    mirror = &(mirrors[self->mirrors_len]);
+    memset(mirror, 0, sizeof(*mirror));
+    mirror->retry_delay = MIRROR_RETRY_MIN;
+
+    if ((mirror->shout = __shout_new()) == NULL)
+        return COOLMIC_ERROR_NOMEM;
+
+    if ((ret = __configure(mirror->shout, conf)) != COOLMIC_ERROR_NONE) {
+        shout_free(mirror->shout);
+        shout_shutdown();
+        return ret;
+    }
+
+    /* index 0 is the connection configured with coolmic_shout_set_config() */
+    return ++self->mirrors_len;
+}
+
 int              coolmic_shout_set_meta(coolmic_shout_t *self, const char *key, const char *value)
 {
+    size_t i;
+
     if (!self || !key || !value)
         return COOLMIC_ERROR_FAULT;
 
     if (shout_set_meta(self->shout, key, value) != SHOUTERR_SUCCESS)
-        return libshout2error(self);
+        return libshout2error(self->shout);
+
+    for (i = 0; i < self->mirrors_len; i++)
+        if (shout_set_meta(self->mirrors[i].shout, key, value) != SHOUTERR_SUCCESS)
+            return libshout2error(self->mirrors[i].shout);
 
     return COOLMIC_ERROR_NONE;
 }
@@ -216,74 +371,557 @@ int              coolmic_shout_attach_iohandle(coolmic_shout_t *self, coolmic_io
         return COOLMIC_ERROR_FAULT;
     if (self->in)
         igloo_ro_unref(self->in);
+    /* a new stream starts at a page boundary */
+    self->partial.len = 0;
     /* ignore errors here as handle is allowed to be NULL */
     igloo_ro_ref(self->in = handle);
     return COOLMIC_ERROR_NONE;
 }
 
-int              coolmic_shout_start(coolmic_shout_t *self)
+/* opens the connection. Returns COOLMIC_ERROR_RETRY or COOLMIC_ERROR_BUSY while still connecting */
+static int __open(shout_t *shout)
 {
     int ret;
 
-    if (!self)
-        return COOLMIC_ERROR_FAULT;
-
-    ret = shout_get_connected(self->shout);
+    ret = shout_get_connected(shout);
     if (ret == SHOUTERR_CONNECTED)
         return COOLMIC_ERROR_NONE;
     if (ret != SHOUTERR_UNCONNECTED)
         return libshouterror2error(ret);
 
-    if (shout_open(self->shout) != SHOUTERR_SUCCESS)
-        return libshout2error(self);
+    if (shout_open(shout) != SHOUTERR_SUCCESS)
+        return libshout2error(shout);
 
     return COOLMIC_ERROR_NONE;
 }
+
+int              coolmic_shout_start(coolmic_shout_t *self)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    return __open(self->shout);
+}
+
 int              coolmic_shout_stop(coolmic_shout_t *self)
 {
+    coolmic_shout_page_t *page;
+    ssize_t queued;
+
     if (!self)
         return COOLMIC_ERROR_FAULT;
 
+    /* the mirrors keep running, see coolmic_shout_stop_mirrors() */
+
     if (shout_get_connected(self->shout) == SHOUTERR_UNCONNECTED)
         return COOLMIC_ERROR_NONE;
 
+    if (self->replay_backlog) {
+        /* the data still queued in libshout never reached the server, so replay the pages it belongs to */
+        queued = shout_queuelen(self->shout);
+        while (queued > 0 && self->replay_next > self->replay_first) {
+            self->replay_next--;
+            page = &(self->replay[self->replay_next & (self->replay_alloc - 1)]);
+            queued -= (ssize_t)page->len;
+        }
+        self->replay_resume = 1;
+    }
+
     if (shout_close(self->shout) != SHOUTERR_SUCCESS)
-        return libshout2error(self);
+        return libshout2error(self->shout);
 
     return COOLMIC_ERROR_NONE;
 }
 
+int              coolmic_shout_stop_mirrors(coolmic_shout_t *self)
+{
+    size_t i;
+
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    /* mirrors are reconnected with the next session */
+    for (i = 0; i < self->mirrors_len; i++) {
+        shout_close(self->mirrors[i].shout);
+        self->mirrors[i].state = MIRROR_DISCONNECTED;
+        self->mirrors[i].retry_at = 0;
+        self->mirrors[i].retry_delay = MIRROR_RETRY_MIN;
+    }
+
+    if (!self->replay_backlog) {
+        self->headers_len = 0;
+        self->headers_open = 0;
+    }
+
+    return COOLMIC_ERROR_NONE;
+}
+
+/* appends data to the page, growing it as needed */
+static int __page_append(coolmic_shout_page_t *page, const unsigned char *data, size_t len)
+{
+    unsigned char *n;
+    size_t alloc;
+
+    if ((page->len + len) > page->alloc) {
+        alloc = page->alloc ? page->alloc : 4096;
+        while (alloc < (page->len + len))
+            alloc *= 2;
+        n = realloc(page->data, alloc);
+        if (!n)
+            return -1;
+        page->data = n;
+        page->alloc = alloc;
+    }
+
+    memcpy(page->data + page->len, data, len);
+    page->len += len;
+
+    return 0;
+}
+
+/* returns the length of the Ogg page starting at data, 0 if more data is needed, and -1 if data does not start with a page */
+static ssize_t __page_length(const unsigned char *data, size_t len)
+{
+    size_t segments;
+    size_t ret;
+    size_t i;
+
+    if (memcmp(data, "OggS", len < 4 ? len : 4) != 0)
+        return -1;
+    if (len < OGG_HEADER_LEN)
+        return 0;
+
+    segments = data[OGG_HEADER_LEN - 1];
+    if (len < (OGG_HEADER_LEN + segments))
+        return 0;
+
+    ret = OGG_HEADER_LEN + segments;
+    for (i = 0; i < segments; i++)
+        ret += data[OGG_HEADER_LEN + i];
+
+    return ret <= len ? (ssize_t)ret : 0;
+}
+
+/* drops pages older than the backlog from the replay buffer */
+static void __replay_expire(coolmic_shout_t *self, uint64_t now)
+{
+    while (self->replay_first < self->replay_end && (self->replay[self->replay_first & (self->replay_alloc - 1)].time + self->replay_backlog) < now)
+        self->replay_first++;
+
+    if (self->replay_next < self->replay_first) {
+        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_WARNING, COOLMIC_ERROR_NONE, "Replay buffer overrun, lost %llu pages", (long long unsigned int)(self->replay_first - self->replay_next));
+        self->replay_next = self->replay_first;
+    }
+}
+
+/* stores a page in the replay buffer, growing it as needed */
+static void __replay_store(coolmic_shout_t *self, const unsigned char *data, size_t len)
+{
+    coolmic_shout_page_t *replay;
+    coolmic_shout_page_t *page;
+    size_t alloc;
+    uint64_t i;
+
+    if ((self->replay_end - self->replay_first) == self->replay_alloc) {
+        alloc = self->replay_alloc ? self->replay_alloc * 2 : REPLAY_ALLOC;
+        replay = calloc(alloc, sizeof(*replay));
+        if (!replay) {
+            coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, COOLMIC_ERROR_NOMEM, "Can not grow replay buffer");
+            return;
+        }
+        for (i = self->replay_first; i < self->replay_end; i++)
+            replay[i & (alloc - 1)] = self->replay[i & (self->replay_alloc - 1)];
+        free(self->replay);
+        self->replay = replay;
+        self->replay_alloc = alloc;
+    }
+
+    page = &(self->replay[self->replay_end & (self->replay_alloc - 1)]);
+    page->len = 0;
+    page->time = igloo_timing_get_time();
+    page->header = self->headers_open;
+    if (__page_append(page, data, len) != 0) {
+        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, COOLMIC_ERROR_NOMEM, "Can not store page for replay");
+        page->len = 0;
+    }
+    self->replay_end++;
+
+    __replay_expire(self, page->time);
+}
+
+/* stores a complete page for the mirrors and the replay buffer, and keeps track of the header pages */
+static void __pages_store(coolmic_shout_t *self, const unsigned char *data, size_t len)
+{
+    coolmic_shout_page_t *page = &(self->ring[self->ring_next % MIRROR_RING]);
+    coolmic_shout_page_t *headers;
+    uint64_t granulepos = 0;
+    int i;
+
+    if (self->mirrors_len) {
+        page->len = 0;
+        if (__page_append(page, data, len) != 0) {
+            /* the mirrors will miss this page */
+            coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, COOLMIC_ERROR_NOMEM, "Can not store page for mirrors");
+            page->len = 0;
+        }
+        self->ring_next++;
+    }
+
+    for (i = 7; i >= 0; i--)
+        granulepos = (granulepos << 8) | data[6 + i];
+
+    /* The header pages are those from the BOS page up to the first page with audio.
+     * A new BOS page after audio starts a new stream (e.g. after a restart of the encoder).
+     */
+    if (data[5] & OGG_FLAG_BOS) {
+        if (!self->headers_open)
+            self->headers_len = 0;
+        self->headers_open = 1;
+    } else if (granulepos != 0 && granulepos != (uint64_t)-1) {
+        self->headers_open = 0;
+    }
+
+    if (self->replay_backlog)
+        __replay_store(self, data, len);
+
+    if (!self->headers_open)
+        return;
+
+    if (self->headers_len == self->headers_alloc) {
+        headers = realloc(self->headers, sizeof(*headers) * (self->headers_alloc + 4));
+        if (!headers) {
+            coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, COOLMIC_ERROR_NOMEM, "Can not store header page for mirrors");
+            return;
+        }
+        memset(headers + self->headers_alloc, 0, sizeof(*headers) * 4);
+        self->headers = headers;
+        self->headers_alloc += 4;
+    }
+
+    page = &(self->headers[self->headers_len]);
+    page->len = 0;
+    if (__page_append(page, data, len) == 0)
+        self->headers_len++;
+}
+
+/* splits the stream into pages for the mirrors and the replay buffer */
+static void __pages_feed(coolmic_shout_t *self, const unsigned char *data, size_t len)
+{
+    coolmic_shout_page_t *partial = &(self->partial);
+    size_t offset = 0;
+    ssize_t ret;
+
+    /* the encoder usually hands out whole pages, so those can be stored directly */
+    if (!partial->len && __page_length(data, len) == (ssize_t)len) {
+        __pages_store(self, data, len);
+        return;
+    }
+
+    if (__page_append(partial, data, len) != 0) {
+        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, COOLMIC_ERROR_NOMEM, "Can not buffer data for mirrors");
+        partial->len = 0;
+        return;
+    }
+
+    while (offset < partial->len) {
+        ret = __page_length(partial->data + offset, partial->len - offset);
+        if (ret < 0) {
+            /* not at a page boundary, resync */
+            offset++;
+            continue;
+        }
+        if (ret == 0)
+            break;
+        __pages_store(self, partial->data + offset, ret);
+        offset += ret;
+    }
+
+    memmove(partial->data, partial->data + offset, partial->len - offset);
+    partial->len -= offset;
+}
+
+static void __mirror_disconnect(coolmic_shout_mirror_t *mirror, int error, const char *reason)
+{
+    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_WARNING, error, "Mirror %p %s, retrying in %llu ms", mirror, reason, (long long unsigned int)mirror->retry_delay);
+
+    shout_close(mirror->shout);
+    mirror->state = MIRROR_DISCONNECTED;
+    mirror->retry_at = igloo_timing_get_time() + mirror->retry_delay;
+
+    mirror->retry_delay *= 2;
+    if (mirror->retry_delay > MIRROR_RETRY_MAX)
+        mirror->retry_delay = MIRROR_RETRY_MAX;
+}
+
+/* connects, and sends all pending pages to a mirror without blocking */
+static void __mirror_iter(coolmic_shout_t *self, coolmic_shout_mirror_t *mirror)
+{
+    coolmic_shout_page_t *page;
+    size_t i;
+    int ret;
+
+    if (mirror->state == MIRROR_DISCONNECTED) {
+        if (igloo_timing_get_time() < mirror->retry_at)
+            return;
+        mirror->state = MIRROR_CONNECTING;
+    }
+
+    if (mirror->state == MIRROR_CONNECTING) {
+        ret = __open(mirror->shout);
+        if (ret == COOLMIC_ERROR_RETRY || ret == COOLMIC_ERROR_BUSY)
+            return;
+        if (ret != COOLMIC_ERROR_NONE) {
+            __mirror_disconnect(mirror, ret, "can not connect");
+            return;
+        }
+
+        /* start at the current position of the stream, preceded by the headers */
+        for (i = 0; i < self->headers_len; i++) {
+            if ((ret = shout_send(mirror->shout, self->headers[i].data, self->headers[i].len)) != SHOUTERR_SUCCESS && ret != SHOUTERR_BUSY) {
+                __mirror_disconnect(mirror, libshouterror2error(ret), "lost connection");
+                return;
+            }
+            mirror->sent += self->headers[i].len;
+        }
+        mirror->next = self->ring_next;
+        mirror->state = MIRROR_CONNECTED;
+        mirror->retry_delay = MIRROR_RETRY_MIN;
+    }
+
+    if ((self->ring_next - mirror->next) > MIRROR_RING) {
+        __mirror_disconnect(mirror, COOLMIC_ERROR_NONE, "fell behind");
+        return;
+    }
+
+    /* a length of 0 just flushes the queue of libshout */
+    if ((ret = shout_send(mirror->shout, NULL, 0)) != SHOUTERR_SUCCESS && ret != SHOUTERR_BUSY) {
+        __mirror_disconnect(mirror, libshouterror2error(ret), "lost connection");
+        return;
+    }
+
+    while (mirror->next < self->ring_next && shout_queuelen(mirror->shout) < MIRROR_QUEUE_MAX) {
+        page = &(self->ring[mirror->next % MIRROR_RING]);
+        if (page->len) {
+            if ((ret = shout_send(mirror->shout, page->data, page->len)) != SHOUTERR_SUCCESS && ret != SHOUTERR_BUSY) {
+                __mirror_disconnect(mirror, libshouterror2error(ret), "lost connection");
+                return;
+            }
+            mirror->sent += page->len;
+        }
+        mirror->next++;
+    }
+}
+
+/* sends the pages not yet sent, e.g. after a reconnect. This does not pace the stream, so it catches up faster than real time */
+static int __replay_send(coolmic_shout_t *self)
+{
+    coolmic_shout_page_t *page;
+    uint64_t i;
+    int ret;
+
+    if (self->replay_resume) {
+        self->replay_resume = 0;
+        self->replay_ahead = 0;
+
+        /* The new connection must start with the headers of the stream the first page belongs to.
+         * If a new stream was started in the meantime the older one is dropped.
+         */
+        for (i = self->replay_next; i < self->replay_end; i++) {
+            page = &(self->replay[i & (self->replay_alloc - 1)]);
+            if (page->len > 5 && (page->data[5] & OGG_FLAG_BOS))
+                break;
+        }
+        if (i < self->replay_end) {
+            self->replay_next = i;
+        } else {
+            while (self->replay_next < self->replay_end && self->replay[self->replay_next & (self->replay_alloc - 1)].header)
+                self->replay_next++;
+            for (i = 0; i < self->headers_len; i++) {
+                if ((ret = shout_send(self->shout, self->headers[i].data, self->headers[i].len)) != SHOUTERR_SUCCESS)
+                    return ret;
+                self->sent += self->headers[i].len;
+            }
+        }
+
+        if (self->replay_next < self->replay_end) {
+            self->replay_ahead = igloo_timing_get_time() - self->replay[self->replay_next & (self->replay_alloc - 1)].time;
+            coolmic_logging_log(COOLMIC_LOGGING_LEVEL_INFO, COOLMIC_ERROR_NONE, "Replaying %llu pages (%llu ms)", (long long unsigned int)(self->replay_end - self->replay_next), (long long unsigned int)self->replay_ahead);
+        }
+    }
+
+    while (self->replay_next < self->replay_end) {
+        page = &(self->replay[self->replay_next & (self->replay_alloc - 1)]);
+        if (page->len) {
+            if ((ret = shout_send(self->shout, page->data, page->len)) != SHOUTERR_SUCCESS)
+                return ret;
+            self->sent += page->len;
+        }
+        self->replay_next++;
+    }
+
+    return SHOUTERR_SUCCESS;
+}
+
+/* returns the time in [ms] until libshout wants more data */
+static int __delay(coolmic_shout_t *self)
+{
+    /* libshout paces the stream from the start of the connection, so do not wait for the replayed part */
+    return shout_delay(self->shout) - (int)(self->replay_ahead > INT_MAX ? INT_MAX : self->replay_ahead);
+}
+
 int              coolmic_shout_iter(coolmic_shout_t *self)
 {
-    char buffer[1024];
+    struct iovec iov[SEND_IOV];
+    size_t iovcnt;
+    size_t i;
+    size_t done = 0;
     ssize_t ret;
     int shouterror = SHOUTERR_SUCCESS;
+    int delay;
 
     if (!self)
         return COOLMIC_ERROR_FAULT;
 
-    if (shout_get_connected(self->shout) == SHOUTERR_UNCONNECTED)
+    if (shout_get_connected(self->shout) == SHOUTERR_UNCONNECTED) {
+        /* a dead server must not hold back the mirrors */
+        coolmic_shout_buffer(self);
         return COOLMIC_ERROR_UNCONNECTED;
+    }
+
+    if (self->replay_backlog)
+        shouterror = __replay_send(self);
 
     if (self->in) {
-        ret = coolmic_iohandle_read(self->in, buffer, sizeof(buffer));
-        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Got %zi bytes from backend", ret);
-        if (ret > 0) {
-            shouterror = shout_send(self->shout, (void*)buffer, (size_t)ret);
+        /* send directly from the backend's buffers, at least SEND_LEN bytes per iteration.
+         * The encoder hands out whole Ogg pages so each page is passed to libshout with a single call.
+         */
+        while (done < SEND_LEN && shouterror == SHOUTERR_SUCCESS) {
+            iovcnt = SEND_IOV;
+            ret = coolmic_iohandle_peekv(self->in, iov, &iovcnt, SEND_MAX_LEN);
+            coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Got %zi bytes in %zu buffers from backend", ret, iovcnt);
+            if (ret < 1)
+                break;
+            if (self->replay_backlog) {
+                /* the data is sent from the replay buffer, so it is kept until it is sent */
+                for (i = 0; i < iovcnt; i++)
+                    __pages_feed(self, iov[i].iov_base, iov[i].iov_len);
+                shouterror = __replay_send(self);
+            } else {
+                for (i = 0; i < iovcnt && shouterror == SHOUTERR_SUCCESS; i++) {
+                    shouterror = shout_send(self->shout, iov[i].iov_base, iov[i].iov_len);
+                    if (shouterror == SHOUTERR_SUCCESS)
+                        self->sent += iov[i].iov_len;
+                }
+                if (self->mirrors_len)
+                    for (i = 0; i < iovcnt; i++)
+                        __pages_feed(self, iov[i].iov_base, iov[i].iov_len);
+            }
             coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "shout status: %i: %s", shouterror, shout_get_error(self->shout));
-            self->need_next_segment = 0;
-        } else {
-            self->need_next_segment = 1;
+            coolmic_iohandle_consume(self->in, ret);
+            done += ret;
         }
+        self->need_next_segment = done ? 0 : 1;
     } else {
         self->need_next_segment = 1;
     }
 
-    shout_sync(self->shout);
+    for (i = 0; i < self->mirrors_len; i++)
+        __mirror_iter(self, &(self->mirrors[i]));
+
+    if (!self->nosync && (delay = __delay(self)) > 0)
+        igloo_timing_sleep(delay);
 
     return libshouterror2error(shouterror);
 }
 
+int              coolmic_shout_set_sync(coolmic_shout_t *self, int sync)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    self->nosync = !sync;
+
+    return COOLMIC_ERROR_NONE;
+}
+
+int              coolmic_shout_get_delay(coolmic_shout_t *self)
+{
+    int delay;
+
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    if (shout_get_connected(self->shout) != SHOUTERR_CONNECTED)
+        return 0;
+
+    delay = __delay(self);
+
+    return delay > 0 ? delay : 0;
+}
+
+int              coolmic_shout_get_pollfd(coolmic_shout_t *self)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+    if (!self->in)
+        return COOLMIC_ERROR_NOSYS;
+
+    return coolmic_iohandle_get_pollfd(self->in);
+}
+
+int              coolmic_shout_buffer(coolmic_shout_t *self)
+{
+    struct iovec iov[SEND_IOV];
+    size_t iovcnt;
+    size_t i;
+    size_t done = 0;
+    ssize_t ret = 0;
+
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    if (!self->in)
+        return COOLMIC_ERROR_NONE;
+
+    /* without replay buffer and mirrors the data is dropped, so the source is not held back */
+    while (done < SEND_MAX_LEN) {
+        iovcnt = SEND_IOV;
+        ret = coolmic_iohandle_peekv(self->in, iov, &iovcnt, SEND_MAX_LEN);
+        if (ret < 1)
+            break;
+        if (self->replay_backlog || self->mirrors_len)
+            for (i = 0; i < iovcnt; i++)
+                __pages_feed(self, iov[i].iov_base, iov[i].iov_len);
+        coolmic_iohandle_consume(self->in, ret);
+        done += ret;
+    }
+
+    __replay_expire(self, igloo_timing_get_time());
+
+    for (i = 0; i < self->mirrors_len; i++)
+        __mirror_iter(self, &(self->mirrors[i]));
+
+    return ret < 0 ? (int)ret : COOLMIC_ERROR_NONE;
+}
+
+int              coolmic_shout_set_replay(coolmic_shout_t *self, uint64_t backlog)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    self->replay_backlog = backlog;
+
+    /* discard the buffered stream */
+    self->replay_first = self->replay_end;
+    self->replay_next = self->replay_end;
+    self->replay_resume = 0;
+    self->replay_ahead = 0;
+    self->headers_len = 0;
+    self->headers_open = 0;
+
+    return COOLMIC_ERROR_NONE;
+}
+
 int              coolmic_shout_need_next_segment(coolmic_shout_t *self, int *need)
 {
     if (!self || !need)
@@ -293,3 +931,21 @@ int              coolmic_shout_need_next_segment(coolmic_shout_t *self, int *nee
 
     return COOLMIC_ERROR_NONE;
 }
+
+int              coolmic_shout_get_stats(coolmic_shout_t *self, size_t *backlog, uint64_t *sent)
+{
+    ssize_t ret;
+
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    if (backlog) {
+        ret = shout_queuelen(self->shout);
+        *backlog = ret < 0 ? 0 : ret;
+    }
+
+    if (sent)
+        *sent = self->sent;
+
+    return COOLMIC_ERROR_NONE;
+}
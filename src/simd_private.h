@@ -0,0 +1,47 @@
+/*
+ *      Copyright (C) Jordan Erickson                     - 2014-2020,
+ *      Copyright (C) Löwenfelsen UG (haftungsbeschränkt) - 2015-2020
+ *       on behalf of Jordan Erickson.
+ */
+
+/*
+ * This file is part of Cool Mic.
+ * 
+ * Cool Mic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Cool Mic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Cool Mic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file selects the SIMD instruction sets used by this library.
+ * The selection is done at compile time based on the target.
+ * Define COOLMIC_DSP_NO_SIMD to use the portable code only.
+ */
+
+#ifndef __COOLMIC_DSP_SIMD_PRIVATE_H__
+#define __COOLMIC_DSP_SIMD_PRIVATE_H__
+
+#ifndef COOLMIC_DSP_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64)
+#define HAVE_SIMD_SSE2
+#include <emmintrin.h>
+#ifdef __AVX2__
+#define HAVE_SIMD_AVX2
+#include <immintrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_SIMD_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
+#endif
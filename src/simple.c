@@ -29,10 +29,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <poll.h>
 #include <time.h>
-#include <errno.h>
 #include <igloo/timing.h>
 #include "types_private.h"
+#include "seqlock_private.h"
+#include "abr_private.h"
+#include "engine_private.h"
 #include <coolmic-dsp/simple.h>
 #include <coolmic-dsp/iohandle.h>
 #include <coolmic-dsp/snddev.h>
@@ -42,11 +45,31 @@
 #include <coolmic-dsp/vumeter.h>
 #include <coolmic-dsp/metadata.h>
 #include <coolmic-dsp/transform.h>
+#include <coolmic-dsp/resample.h>
 #include <coolmic-dsp/coolmic-dsp.h>
 #include <coolmic-dsp/logging.h>
 
+/* number of Ogg pages the encoder may be ahead of the network */
+#define ENC_QUEUE_SIZE 32
+/* delays of the sender threads of additional outputs in [ms] */
+#define OUTPUT_IDLE_DELAY 32
+#define OUTPUT_RETRY_DELAY 1000
+/* delay in [ms] while keeping the pipeline running without a connection, if there was nothing to do */
+#define REPLAY_HOLD_DELAY 10
+
 #define RECON_PROFILE_DEFAULT "disabled"
 #define RECON_PROFILE_ENABLED "flat"
+/* reconnect delays in [ms] */
+#define RECON_FLAT_DELAY 10000
+#define RECON_BACKOFF_MIN 1000
+#define RECON_BACKOFF_MAX 60000
+/* interval in [ms] of COOLMIC_SIMPLE_EVENT_RECONNECT while waiting */
+#define RECON_EVENT_INTERVAL 250
+/* interval in [ms] of checking the state of a connection that is being established, doubled up to the maximum */
+#define CONNECT_POLL_MIN 1
+#define CONNECT_POLL_MAX 128
+/* upper bound in [ms] for the worker to sleep, this limits the latency of VU-Meter updates */
+#define WORKER_WAKE_MAX 100
 
 enum coolmic_simple_running {
     RUNNING_STOPPED = 0,
@@ -56,23 +79,94 @@ enum coolmic_simple_running {
     RUNNING_ERROR
 };
 
+/* states of the worker, see __worker_step() */
+enum coolmic_simple_worker_state {
+    WORKER_START = 0,
+    WORKER_SETUP,
+    WORKER_CONNECTING,
+    WORKER_STREAMING,
+    WORKER_DISCONNECT,
+    WORKER_RETRY,
+    WORKER_RECONNECT,
+    WORKER_LINGER,
+    WORKER_EXIT,
+    WORKER_DONE
+};
+
+/* An additional output, see coolmic_simple_add_output() */
+typedef struct coolmic_simple_output {
+    /* settings */
+    char *codec;
+    double quality;
+    long int bitrate;
+    coolmic_shout_t *shout;
+
+    /* objects of the current segment, protected by the lock of the coolmic_simple_t */
+    coolmic_enc_t *enc;
+    coolmic_resample_t *resample;
+    coolmic_iohandle_t *ogg;
+
+    /* sender thread, or task if running on an engine */
+    pthread_t thread;
+    int thread_needs_join;
+    coolmic_engine_task_t *task;
+    /* protects the members below and the IO handle of shout */
+    pthread_mutex_t lock;
+    int stop;
+    int connected;
+    /* poll interval in [ms] while connecting */
+    uint64_t interval;
+    /* the encoder feeding shout, and whether it must start a new stream as the connection was lost */
+    coolmic_enc_t *shout_enc;
+    int need_reset;
+} coolmic_simple_output_t;
+
 struct coolmic_simple {
     /* base type */
     igloo_ro_base_t __base;
 
     pthread_mutex_t lock;
+    /* signaled to interrupt the waits of the worker, e.g. when it is stopped */
+    pthread_cond_t wakeup;
     pthread_t thread;
     enum coolmic_simple_running running;
     int need_reset;
     int thread_needs_join;
 
+    /* engine running the worker instead of it's own thread, see coolmic_simple_set_engine() */
+    coolmic_engine_t *engine;
+    coolmic_engine_task_t *task;
+
+    /* state of the worker between it's steps, only used by the worker */
+    struct {
+        enum coolmic_simple_worker_state state;
+        enum coolmic_simple_running running;
+        coolmic_shout_t *shout;
+        coolmic_vumeter_t *vumeter;
+        unsigned int vumeter_serial;
+        size_t vumeter_interval;
+        uint64_t replay_backlog;
+        /* interval in [ms] of checking the state of the connection while connecting */
+        uint64_t interval;
+        /* time of the next reconnect, and whether the worker waited for it already */
+        uint64_t reconnect_at;
+        int reconnect_waited;
+    } worker;
+
     coolmic_simple_callback_t callback;
     void *callback_userdata;
 
     size_t vumeter_interval;
 
+    /* last VU-Meter result, see coolmic_simple_get_vumeter_result() */
+    seqlock_t vumeter_seq;
+    coolmic_vumeter_result_t vumeter_result;
+
     /* Reconnection profile */
     char *reconnection_profile;
+    /* number of reconnects since the last successful connect, and the state used for jitter */
+    unsigned int reconnect_attempts;
+    unsigned int reconnect_seed;
 
     /* Next segment to play. That is a filename or NULL for live. */
     coolmic_simple_segment_t *current_segment;
@@ -91,6 +185,22 @@ struct coolmic_simple {
     coolmic_iohandle_t *ogg;
     coolmic_metadata_t *metadata;
     coolmic_transform_t *transform;
+    coolmic_resample_t *resample;
+    coolmic_resample_quality_t resample_quality;
+
+    /* adaptive bitrate controller, see coolmic_simple_set_abr() */
+    int abr_enabled;
+    coolmic_abr_t abr;
+
+    /* additional outputs */
+    coolmic_simple_output_t *outputs;
+    size_t outputs_len;
+
+    /* number of mirrors of the main output, see coolmic_simple_add_mirror() */
+    size_t mirrors_len;
+
+    /* replay backlog in [ms], see coolmic_simple_set_replay() */
+    uint64_t replay_backlog;
 };
 
 /* emit an event */
@@ -147,17 +257,48 @@ static inline void __emit_error_unlocked(coolmic_simple_t *self, void *thread, i
     __emit_event(self, COOLMIC_SIMPLE_EVENT_ERROR, thread, &error, NULL, 0);
 }
 
+/* whether the sender of an output is running, see __outputs_start() */
+static inline int __output_running(coolmic_simple_output_t *output)
+{
+    return output->task || output->thread_needs_join;
+}
+
+static void __output_disconnect(coolmic_simple_output_t *output) {
+    pthread_mutex_lock(&(output->lock));
+    coolmic_shout_attach_iohandle(output->shout, NULL);
+    /* the encoder of the next segment starts a new stream anyway */
+    output->shout_enc = NULL;
+    output->need_reset = 0;
+    pthread_mutex_unlock(&(output->lock));
+
+    coolmic_enc_attach_iohandle(output->enc, NULL);
+    coolmic_resample_attach_iohandle(output->resample, NULL);
+
+    igloo_ro_unref(output->ogg);
+    igloo_ro_unref(output->enc);
+    igloo_ro_unref(output->resample);
+
+    output->ogg = NULL;
+    output->enc = NULL;
+    output->resample = NULL;
+}
+
 static int __segment_disconnect(coolmic_simple_t *self) {
     coolmic_simple_segment_pipeline_t pipeline;
+    size_t i;
 
     if (coolmic_simple_segment_get_pipeline(self->current_segment, &pipeline) == 0) {
         __emit_event_locked(self, COOLMIC_SIMPLE_EVENT_SEGMENT_DISCONNECT, &(self->thread),
                               &pipeline, NULL);
     }
 
+    for (i = 0; i < self->outputs_len; i++)
+        __output_disconnect(&(self->outputs[i]));
+
     coolmic_shout_attach_iohandle(self->shout, NULL);
     coolmic_vumeter_attach_iohandle(self->vumeter, NULL);
     coolmic_enc_attach_iohandle(self->enc, NULL);
+    coolmic_resample_attach_iohandle(self->resample, NULL);
     coolmic_transform_attach_iohandle(self->transform, NULL);
     coolmic_tee_attach_iohandle(self->tee, NULL);
 
@@ -165,6 +306,7 @@ static int __segment_disconnect(coolmic_simple_t *self) {
     igloo_ro_unref(self->enc);
     igloo_ro_unref(self->dev);
     igloo_ro_unref(self->transform);
+    igloo_ro_unref(self->resample);
     igloo_ro_unref(self->tee);
     igloo_ro_unref(self->vumeter);
     igloo_ro_unref(self->current_segment);
@@ -175,25 +317,100 @@ static int __segment_disconnect(coolmic_simple_t *self) {
     self->tee = NULL;
     self->vumeter = NULL;
     self->transform = NULL;
+    self->resample = NULL;
     self->current_segment = NULL;
 
     return 0;
 }
 
+/* lets an encoder run in the background, on the engine if there is one */
+static int __enc_set_async(coolmic_simple_t *self, coolmic_enc_t *enc)
+{
+    if (self->engine)
+        return coolmic_enc_set_async_engine(enc, ENC_QUEUE_SIZE, self->engine);
+    return coolmic_enc_set_async(enc, ENC_QUEUE_SIZE);
+}
+
+/* connects an additional output to a reader of the tee */
+static int __output_connect(coolmic_simple_t *self, coolmic_simple_output_t *output, size_t reader) {
+    coolmic_iohandle_t *handle;
+    uint_least32_t rate;
+    int ret;
+
+    if ((rate = coolmic_enc_get_native_rate(output->codec, self->rate)) == 0)
+        return -1;
+    if ((output->enc = coolmic_enc_new(NULL, igloo_RO_NULL, output->codec, rate, self->channels)) == NULL)
+        return -1;
+    if (__enc_set_async(self, output->enc) != COOLMIC_ERROR_NONE)
+        return -1;
+    if (coolmic_enc_ctl(output->enc, COOLMIC_ENC_OP_SET_QUALITY, output->quality) != COOLMIC_ERROR_NONE)
+        return -1;
+    if (coolmic_enc_ctl(output->enc, COOLMIC_ENC_OP_SET_BITRATE, output->bitrate) != COOLMIC_ERROR_NONE)
+        return -1;
+    if (coolmic_enc_ctl(output->enc, COOLMIC_ENC_OP_SET_METADATA, self->metadata) != COOLMIC_ERROR_NONE)
+        return -1;
+    if ((output->ogg = coolmic_enc_get_iohandle(output->enc)) == NULL)
+        return -1;
+
+    /* A stalled output must never hold back the others. */
+    if (coolmic_tee_set_reader_overflow_policy(self->tee, reader, COOLMIC_TEE_OVERFLOW_DROP) != COOLMIC_ERROR_NONE)
+        return -1;
+    if ((handle = coolmic_tee_get_iohandle(self->tee, reader)) == NULL)
+        return -1;
+    if (rate != self->rate) {
+        if ((output->resample = coolmic_resample_new(NULL, igloo_RO_NULL, self->rate, rate, self->channels, self->resample_quality)) == NULL) {
+            igloo_ro_unref(handle);
+            return -1;
+        }
+        ret = coolmic_resample_attach_iohandle(output->resample, handle);
+        igloo_ro_unref(handle);
+        if (ret != COOLMIC_ERROR_NONE)
+            return -1;
+        if ((handle = coolmic_resample_get_iohandle(output->resample)) == NULL)
+            return -1;
+    }
+    ret = coolmic_enc_attach_iohandle(output->enc, handle);
+    igloo_ro_unref(handle);
+    if (ret != COOLMIC_ERROR_NONE)
+        return -1;
+
+    pthread_mutex_lock(&(output->lock));
+    ret = coolmic_shout_attach_iohandle(output->shout, output->ogg);
+    output->shout_enc = output->enc;
+    pthread_mutex_unlock(&(output->lock));
+
+    return ret == COOLMIC_ERROR_NONE ? 0 : -1;
+}
+
 static int __segment_connect_live(coolmic_simple_t *self) {
     coolmic_iohandle_t *handle;
     const char *driver;
     const char *device;
     coolmic_iohandle_t *iohandle;
+    uint_least32_t rate;
+    size_t i;
 
     do {
         if (coolmic_simple_segment_get_driver_and_device(self->current_segment, &driver, &device, &iohandle) != COOLMIC_ERROR_NONE)
             break;
-        if ((self->enc = coolmic_enc_new(NULL, igloo_RO_NULL, self->codec, self->rate, self->channels)) == NULL)
+        if ((rate = coolmic_enc_get_native_rate(self->codec, self->rate)) == 0)
+            break;
+        if ((self->enc = coolmic_enc_new(NULL, igloo_RO_NULL, self->codec, rate, self->channels)) == NULL)
             break;
+        /* encode on a separate thread so network stalls do not delay encoding */
+        if (__enc_set_async(self, self->enc) != COOLMIC_ERROR_NONE)
+            break;
+        if (self->abr_enabled && coolmic_enc_ctl(self->enc, COOLMIC_ENC_OP_SET_BITRATE, self->abr.bitrate) != COOLMIC_ERROR_NONE)
+            break;
+        if (rate != self->rate) {
+            coolmic_logging_log(COOLMIC_LOGGING_LEVEL_INFO, COOLMIC_ERROR_NONE, "Resampling from %lu to %lu Hz", (unsigned long int)self->rate, (unsigned long int)rate);
+            if ((self->resample = coolmic_resample_new(NULL, igloo_RO_NULL, self->rate, rate, self->channels, self->resample_quality)) == NULL)
+                break;
+        }
         if (coolmic_enc_ctl(self->enc, COOLMIC_ENC_OP_SET_METADATA, self->metadata) != 0)
             break;
-        if ((self->tee = coolmic_tee_new(NULL, igloo_RO_NULL, 2)) == NULL)
+        /* reader 0 is the encoder, 1 the VU-Meter, and the rest are the additional outputs */
+        if ((self->tee = coolmic_tee_new(NULL, igloo_RO_NULL, 2 + self->outputs_len)) == NULL)
             break;
         if ((self->vumeter = coolmic_vumeter_new(NULL, igloo_RO_NULL, self->rate, self->channels)) == NULL)
             break;
@@ -219,9 +436,24 @@ static int __segment_connect_live(coolmic_simple_t *self) {
         igloo_ro_unref(handle);
         if ((handle = coolmic_tee_get_iohandle(self->tee, 0)) == NULL)
             break;
+        if (self->resample) {
+            if (coolmic_resample_attach_iohandle(self->resample, handle) != 0)
+                break;
+            igloo_ro_unref(handle);
+            if ((handle = coolmic_resample_get_iohandle(self->resample)) == NULL)
+                break;
+        }
         if (coolmic_enc_attach_iohandle(self->enc, handle) != 0)
             break;
         igloo_ro_unref(handle);
+        /* The VU-Meter must never hold back the encoder */
+        if (coolmic_tee_set_frame_size(self->tee, self->channels * 2) != COOLMIC_ERROR_NONE)
+            break;
+        if (coolmic_tee_set_reader_overflow_policy(self->tee, 1, COOLMIC_TEE_OVERFLOW_DROP) != COOLMIC_ERROR_NONE)
+            break;
+        /* ...nor pull data from the input itself, the encoder's thread drives the capture */
+        if (coolmic_tee_set_reader_blocking(self->tee, 1, 0) != COOLMIC_ERROR_NONE)
+            break;
         if ((handle = coolmic_tee_get_iohandle(self->tee, 1)) == NULL)
             break;
         if (coolmic_vumeter_attach_iohandle(self->vumeter, handle) != 0)
@@ -229,6 +461,11 @@ static int __segment_connect_live(coolmic_simple_t *self) {
         igloo_ro_unref(handle);
         if (coolmic_shout_attach_iohandle(self->shout, self->ogg) != 0)
             break;
+        for (i = 0; i < self->outputs_len; i++)
+            if (__output_connect(self, &(self->outputs[i]), 2 + i) != 0)
+                break;
+        if (i != self->outputs_len)
+            break;
         return 0;
     } while (0);
 
@@ -244,6 +481,7 @@ static int __segment_connect_file(coolmic_simple_t *self) {
     self->tee = NULL;
     self->vumeter = NULL;
     self->transform = NULL;
+    self->resample = NULL;
 
     do {
         if (coolmic_simple_segment_get_driver_and_device(self->current_segment, &driver, &device, &iohandle) != COOLMIC_ERROR_NONE)
@@ -315,9 +553,15 @@ static void __stop_locked(coolmic_simple_t *self)
     }
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Stopping worker thread.");
     self->running = RUNNING_STOPPING;
+    pthread_cond_broadcast(&(self->wakeup));
+    coolmic_engine_task_wake(self->task);
     __emit_event_locked(self, COOLMIC_SIMPLE_EVENT_THREAD_STOP, NULL, &(self->thread), NULL);
     pthread_mutex_unlock(&(self->lock));
-    pthread_join(self->thread, NULL);
+    if (self->task) {
+        coolmic_engine_task_join(self->task);
+    } else {
+        pthread_join(self->thread, NULL);
+    }
     pthread_mutex_lock(&(self->lock));
     self->thread_needs_join = 0;
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Stopped worker thread.");
@@ -326,6 +570,7 @@ static void __stop_locked(coolmic_simple_t *self)
 static void __free(igloo_ro_t self)
 {
     coolmic_simple_t *simple = igloo_RO_TO_TYPE(self, coolmic_simple_t);
+    size_t i;
 
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Freeing self=%p", simple);
 
@@ -338,10 +583,19 @@ static void __free(igloo_ro_t self)
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Starting unref-ing, self=%p", simple);
     igloo_ro_unref(simple->shout);
     igloo_ro_unref(simple->metadata);
+    coolmic_engine_task_free(simple->task);
+    igloo_ro_unref(simple->engine);
 
     igloo_ro_unref(simple->segment_list);
 
+    for (i = 0; i < simple->outputs_len; i++) {
+        igloo_ro_unref(simple->outputs[i].shout);
+        free(simple->outputs[i].codec);
+        pthread_mutex_destroy(&(simple->outputs[i].lock));
+    }
+
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Starting free-ing, self=%p", simple);
+    free(simple->outputs);
     free(simple->reconnection_profile);
     free(simple->codec);
 
@@ -349,6 +603,7 @@ static void __free(igloo_ro_t self)
     pthread_mutex_unlock(&(simple->lock));
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Destroying mutex, self=%p, mutex=%p", simple, &(simple->lock));
     pthread_mutex_destroy(&(simple->lock));
+    pthread_cond_destroy(&(simple->wakeup));
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Done, self=%p", simple);
 }
 
@@ -359,6 +614,7 @@ igloo_RO_PUBLIC_TYPE(coolmic_simple_t,
 coolmic_simple_t   *coolmic_simple_new(const char *name, igloo_ro_t associated, const char *codec, uint_least32_t rate, unsigned int channels, ssize_t buffer, const coolmic_shout_config_t *conf)
 {
     coolmic_simple_t *ret = igloo_ro_new_raw(coolmic_simple_t, name, associated);
+    pthread_condattr_t condattr;
 
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Config: codec=%s, rate=%llu, channels=%u, buffer=%lli, conf=%p; ret=%p", codec, (long long unsigned int)rate, channels, (long long int)buffer, conf, ret);
 
@@ -366,8 +622,16 @@ coolmic_simple_t   *coolmic_simple_new(const char *name, igloo_ro_t associated,
         return NULL;
 
     pthread_mutex_init(&(ret->lock), NULL);
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(ret->wakeup), &condattr);
+    pthread_condattr_destroy(&condattr);
+
+    /* different instances must not use the same jitter */
+    ret->reconnect_seed = (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)ret;
 
-    ret->vumeter_interval = 20;
+    ret->vumeter_interval = 100;
+    ret->resample_quality = COOLMIC_RESAMPLE_QUALITY_MEDIUM;
     ret->rate = rate;
     ret->channels = channels;
     ret->buffer = buffer;
@@ -383,6 +647,9 @@ coolmic_simple_t   *coolmic_simple_new(const char *name, igloo_ro_t associated,
             break;
         if (coolmic_shout_set_config(ret->shout, conf) != 0)
             break;
+        /* the worker waits for data itself, see __worker_poll() */
+        if (coolmic_shout_set_sync(ret->shout, 0) != COOLMIC_ERROR_NONE)
+            break;
         if ((ret->metadata = igloo_ro_new(coolmic_metadata_t)) == NULL)
             break;
         return ret;
@@ -395,220 +662,644 @@ coolmic_simple_t   *coolmic_simple_new(const char *name, igloo_ro_t associated,
 /* reset internal objects */
 static inline int __reset(coolmic_simple_t *self)
 {
+    size_t i;
+
     coolmic_enc_reset(self->enc);
+    /* outputs still running from before the main connection was lost just continue their streams */
+    for (i = 0; i < self->outputs_len; i++)
+        if (!__output_running(&(self->outputs[i])))
+            coolmic_enc_reset(self->outputs[i].enc);
+    /* the stream starts over, so there is nothing to replay */
+    coolmic_shout_set_replay(self->shout, self->replay_backlog);
     self->need_reset = 0;
     return COOLMIC_ERROR_NONE;
 }
 
-/* worker */
-static inline void __worker_inner(coolmic_simple_t *self)
+/* runs the adaptive bitrate controller, must be called locked */
+static inline void __abr_update(coolmic_simple_t *self, coolmic_shout_t *shout)
 {
-    enum coolmic_simple_running running;
-    coolmic_shout_t *shout;
-    coolmic_vumeter_t *vumeter;
-    size_t vumeter_iter = 1;
-    size_t vumeter_interval = 4;
-    ssize_t ret;
-    coolmic_vumeter_result_t vumeter_result;
+    coolmic_simple_abr_decision_t decision;
+    size_t backlog;
+    uint64_t sent;
+    ssize_t queue_fill;
+    int ret;
+
+    if (!self->abr_enabled || !self->enc)
+        return;
+
+    if (coolmic_shout_get_stats(shout, &backlog, &sent) != COOLMIC_ERROR_NONE)
+        return;
+
+    queue_fill = coolmic_enc_get_queue_fill(self->enc);
+    if (queue_fill < 0)
+        queue_fill = 0;
+
+    if (!coolmic_abr_update(&(self->abr), igloo_timing_get_time(), sent, backlog, (double)queue_fill / ENC_QUEUE_SIZE, &decision))
+        return;
+
+    if ((ret = coolmic_enc_ctl(self->enc, COOLMIC_ENC_OP_SET_BITRATE, decision.bitrate_new)) != COOLMIC_ERROR_NONE) {
+        /* keep the controller in line with the bitrate actually used */
+        self->abr.bitrate = decision.bitrate_old;
+        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_WARNING, ret, "Can not change bitrate to %li bit/s", decision.bitrate_new);
+        return;
+    }
+
+    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_INFO, COOLMIC_ERROR_NONE, "Bitrate %li -> %li bit/s (backlog %zu byte, throughput %li bit/s)",
+            decision.bitrate_old, decision.bitrate_new, decision.backlog, decision.throughput);
+    __emit_event_locked(self, COOLMIC_SIMPLE_EVENT_BITRATE_CHANGED, &(self->thread), &decision, NULL);
+}
+
+/* one step of the sender of an additional output, returns like a callback of a task, see coolmic_engine_task_cb_t */
+static int __output_step(void *userdata, int *fd)
+{
+    coolmic_simple_output_t *output = userdata;
+    int need_next_segment;
+    int delay;
     int error;
 
+    pthread_mutex_lock(&(output->lock));
+    if (output->stop) {
+        pthread_mutex_unlock(&(output->lock));
+        return COOLMIC_ENGINE_TASK_DONE;
+    }
+
+    if (!output->connected) {
+        error = coolmic_shout_start(output->shout);
+        if (error == COOLMIC_ERROR_RETRY || error == COOLMIC_ERROR_BUSY) {
+            /* libshout does not expose it's socket, so check back with an increasing interval */
+            delay = output->interval;
+            output->interval = delay * 2 > CONNECT_POLL_MAX ? CONNECT_POLL_MAX : delay * 2;
+            pthread_mutex_unlock(&(output->lock));
+            return delay;
+        }
+        output->interval = CONNECT_POLL_MIN;
+        if (error == COOLMIC_ERROR_NONE) {
+            output->connected = 1;
+            /* the server expects a new stream, so drop what was encoded for the old connection and start over with the headers */
+            if (output->need_reset && output->shout_enc)
+                coolmic_enc_reset(output->shout_enc);
+            output->need_reset = 0;
+            pthread_mutex_unlock(&(output->lock));
+            return 0;
+        }
+        pthread_mutex_unlock(&(output->lock));
+        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_WARNING, error, "Output %p can not connect, retrying", output);
+        return OUTPUT_RETRY_DELAY;
+    } else if ((error = coolmic_shout_iter(output->shout)) == COOLMIC_ERROR_NONE) {
+        if (coolmic_shout_need_next_segment(output->shout, &need_next_segment) == COOLMIC_ERROR_NONE && need_next_segment) {
+            /* nothing to send right now, e.g. while a file segment is played */
+            pthread_mutex_unlock(&(output->lock));
+            return OUTPUT_IDLE_DELAY;
+        }
+        delay = coolmic_shout_get_delay(output->shout);
+        if (delay <= 0 && (*fd = coolmic_shout_get_pollfd(output->shout)) >= 0)
+            delay = OUTPUT_IDLE_DELAY;
+        pthread_mutex_unlock(&(output->lock));
+        return delay > 0 ? delay : 0;
+    } else {
+        coolmic_shout_stop(output->shout);
+        output->connected = 0;
+        output->need_reset = 1;
+    }
+    pthread_mutex_unlock(&(output->lock));
+
+    /* the other outputs keep running, so just retry later */
+    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_WARNING, error, "Output %p lost its connection, reconnecting", output);
+    return OUTPUT_RETRY_DELAY;
+}
+
+/* sender thread of an additional output */
+static void *__output_worker(void *userdata)
+{
+    struct pollfd fds;
+    int delay;
+
+    while (1) {
+        fds.fd = -1;
+        delay = __output_step(userdata, &(fds.fd));
+        if (delay == COOLMIC_ENGINE_TASK_DONE)
+            break;
+        if (delay == 0)
+            continue;
+
+        if (fds.fd >= 0) {
+            fds.events = POLLIN;
+            fds.revents = 0;
+            poll(&fds, 1, delay);
+        } else {
+            igloo_timing_sleep(delay);
+        }
+    }
+
+    return NULL;
+}
+
+/* starts the senders of all additional outputs not yet running, must be called locked */
+static void __outputs_start(coolmic_simple_t *self)
+{
+    coolmic_simple_output_t *output;
+    size_t i;
+
+    for (i = 0; i < self->outputs_len; i++) {
+        output = &(self->outputs[i]);
+        if (__output_running(output))
+            continue;
+        output->stop = 0;
+        output->interval = CONNECT_POLL_MIN;
+        if (self->engine) {
+            if ((output->task = coolmic_engine_task_new(self->engine, __output_step, output)) != NULL) {
+                coolmic_engine_task_wake(output->task);
+                continue;
+            }
+        } else if (pthread_create(&(output->thread), NULL, __output_worker, output) == 0) {
+            output->thread_needs_join = 1;
+            continue;
+        }
+        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, COOLMIC_ERROR_NOMEM, "Can not start sender for output %zu", i + 1);
+    }
+}
+
+/* stops the senders of all additional outputs at the end of the session, must be called unlocked */
+static void __outputs_stop(coolmic_simple_t *self)
+{
+    coolmic_simple_output_t *output;
+    size_t i;
+
+    for (i = 0; i < self->outputs_len; i++) {
+        output = &(self->outputs[i]);
+        if (output->task) {
+            /* this may be called from a task, so do not wait for the sender to notice */
+            coolmic_engine_task_free(output->task);
+            output->task = NULL;
+        } else if (output->thread_needs_join) {
+            pthread_mutex_lock(&(output->lock));
+            output->stop = 1;
+            pthread_mutex_unlock(&(output->lock));
+            pthread_join(output->thread, NULL);
+            output->thread_needs_join = 0;
+        }
+
+        pthread_mutex_lock(&(output->lock));
+        if (output->connected) {
+            coolmic_shout_stop(output->shout);
+            output->connected = 0;
+        }
+        pthread_mutex_unlock(&(output->lock));
+    }
+}
+
+/* waits up to timeout ms or until the worker is woken up, must be called locked */
+static void __worker_wait(coolmic_simple_t *self, uint64_t timeout)
+{
+    struct timespec deadline;
+
+    if (self->running == RUNNING_STOPPING)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_cond_timedwait(&(self->wakeup), &(self->lock), &deadline);
+}
+
+/* keeps the pipeline running while not connected so the replay buffer catches the audio, and the mirrors and outputs keep running.
+ * Must be called unlocked.
+ * Returns the time in [ms] to wait before the next call.
+ */
+static int __worker_hold(coolmic_shout_t *shout, coolmic_vumeter_t *vumeter)
+{
+    uint64_t start = igloo_timing_get_time();
+
+    coolmic_shout_buffer(shout);
+    if (vumeter)
+        while (coolmic_vumeter_read(vumeter, -1) > 0);
+
+    /* do not spin if there was nothing to do */
+    return igloo_timing_get_time() == start ? REPLAY_HOLD_DELAY : 0;
+}
+
+/* whether the worker keeps the pipeline running while the main connection is down */
+static inline int __worker_holds(coolmic_simple_t *self)
+{
+    /* all are only changed while the worker is not running */
+    return self->replay_backlog || self->mirrors_len || self->outputs_len;
+}
+
+/* worker */
+/* The worker is a state machine so it can run on it's own thread as well as a task of an engine.
+ * Each step is called unlocked and returns like a callback of a task, see coolmic_engine_task_cb_t.
+ */
+
+/* begin of a connection */
+static int __worker_setup(coolmic_simple_t *self)
+{
+    pthread_mutex_lock(&(self->lock));
     if (self->need_reset) {
         if (__reset(self) != 0) {
             self->running = RUNNING_ERROR;
-            return;
+            pthread_mutex_unlock(&(self->lock));
+            self->worker.state = WORKER_RETRY;
+            return 0;
         }
     }
 
-    running = self->running;
-    igloo_ro_ref(shout = self->shout);
-    igloo_ro_ref(vumeter = self->vumeter);
+    self->worker.running = self->running;
+    igloo_ro_ref(self->worker.shout = self->shout);
+    igloo_ro_ref(self->worker.vumeter = self->vumeter);
+    self->worker.vumeter_serial = 0;
+    self->worker.vumeter_interval = self->vumeter_interval;
+    self->worker.replay_backlog = self->replay_backlog;
+    coolmic_vumeter_set_interval(self->worker.vumeter, self->worker.vumeter_interval);
+    __outputs_start(self);
     pthread_mutex_unlock(&(self->lock));
 
     __emit_cs_unlocked(self, &(self->thread), COOLMIC_SIMPLE_CS_CONNECTING, COOLMIC_ERROR_NONE);
 
-    do {
-        error = coolmic_shout_start(shout);
+    self->worker.interval = CONNECT_POLL_MIN;
+    self->worker.state = WORKER_CONNECTING;
+    return 0;
+}
+
+static int __worker_connecting(coolmic_simple_t *self)
+{
+    uint64_t interval;
+    int error;
+
+    error = coolmic_shout_start(self->worker.shout);
+    if (error == COOLMIC_ERROR_RETRY || error == COOLMIC_ERROR_BUSY) {
         pthread_mutex_lock(&(self->lock));
-        running = self->running;
+        self->worker.running = self->running;
         pthread_mutex_unlock(&(self->lock));
-        igloo_timing_sleep(32);
-    } while ((error == COOLMIC_ERROR_RETRY || error == COOLMIC_ERROR_BUSY) && running == RUNNING_STARTED);
+        if (self->worker.running == RUNNING_STARTED) {
+            if (__worker_holds(self))
+                return __worker_hold(self->worker.shout, self->worker.vumeter);
+            /* libshout does not expose it's socket, so check back with an increasing interval */
+            interval = self->worker.interval;
+            self->worker.interval = interval * 2 > CONNECT_POLL_MAX ? CONNECT_POLL_MAX : interval * 2;
+            return interval;
+        }
+    }
 
     if (error != COOLMIC_ERROR_NONE) {
-        running = RUNNING_STOPPED;
+        self->worker.running = RUNNING_STOPPED;
         __emit_error_unlocked(self, &(self->thread), error);
         __emit_cs_unlocked(self, &(self->thread), COOLMIC_SIMPLE_CS_CONNECTIONERROR, error);
+        self->worker.state = WORKER_DISCONNECT;
     } else {
+        self->reconnect_attempts = 0;
         __emit_cs_unlocked(self, &(self->thread), COOLMIC_SIMPLE_CS_CONNECTED, COOLMIC_ERROR_NONE);
+        self->worker.state = WORKER_STREAMING;
     }
 
-    while (running == RUNNING_STARTED) {
-        int need_next_segment;
+    return 0;
+}
+
+static int __worker_streaming(coolmic_simple_t *self, int *fd)
+{
+    coolmic_shout_t *shout = self->worker.shout;
+    coolmic_vumeter_result_t vumeter_result;
+    unsigned int serial;
+    int need_next_segment;
+    int timeout;
+    int delay;
+    ssize_t ret;
+    int error;
+
+    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Still running");
 
-        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Still running");
+    self->worker.state = WORKER_DISCONNECT;
 
-        if ((error = coolmic_shout_iter(shout)) != COOLMIC_ERROR_NONE) {
-            __emit_error_unlocked(self, &(self->thread), error);
-            __emit_cs_unlocked(self, &(self->thread), COOLMIC_SIMPLE_CS_CONNECTIONERROR, error);
-            break;
-        }
+    /* ahead of time, only keep the VU-Meter going */
+    if (coolmic_shout_get_delay(shout) == 0 && (error = coolmic_shout_iter(shout)) != COOLMIC_ERROR_NONE) {
+        __emit_error_unlocked(self, &(self->thread), error);
+        __emit_cs_unlocked(self, &(self->thread), COOLMIC_SIMPLE_CS_CONNECTIONERROR, error);
+        return 0;
+    }
 
-        if (coolmic_shout_need_next_segment(shout, &need_next_segment) != COOLMIC_ERROR_NONE) {
-            need_next_segment = 0;
-        }
+    if (coolmic_shout_need_next_segment(shout, &need_next_segment) != COOLMIC_ERROR_NONE) {
+        need_next_segment = 0;
+    }
 
-        if (need_next_segment && self->enc) {
-            if (!coolmic_iohandle_eof(self->ogg)) {
-                need_next_segment = 0;
-            } else {
-            }
+    if (need_next_segment && self->enc) {
+        if (!coolmic_iohandle_eof(self->ogg)) {
+            need_next_segment = 0;
+        } else {
         }
+    }
 
-        if (need_next_segment) {
-            pthread_mutex_lock(&(self->lock));
-            __segment_disconnect(self);
-            __segment_connect(self);
-            igloo_ro_unref(vumeter);
-            igloo_ro_ref(vumeter = self->vumeter);
-            pthread_mutex_unlock(&(self->lock));
-        }
+    if (need_next_segment) {
+        pthread_mutex_lock(&(self->lock));
+        __segment_disconnect(self);
+        __segment_connect(self);
+        igloo_ro_unref(self->worker.vumeter);
+        igloo_ro_ref(self->worker.vumeter = self->vumeter);
+        coolmic_vumeter_set_interval(self->worker.vumeter, self->worker.vumeter_interval);
+        self->worker.vumeter_serial = 0;
+        pthread_mutex_unlock(&(self->lock));
+    }
 
-        if (vumeter) {
-            ret = coolmic_vumeter_read(vumeter, -1);
+    if (self->worker.vumeter) {
+        /* drain everything captured since the last iteration */
+        do {
+            ret = coolmic_vumeter_read(self->worker.vumeter, -1);
             coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "VUmeter returned: %zi", ret);
-            if (ret < 0) {
-                __emit_error_unlocked(self, &(self->thread), COOLMIC_ERROR_GENERIC);
+            if (ret < 0)
                 break;
-            } else if (ret > 0) {
-                vumeter_iter++;
-            }
 
-            if (vumeter_interval && vumeter_iter == vumeter_interval) {
-                vumeter_iter = 0;
-                if (coolmic_vumeter_result(vumeter, &vumeter_result) == 0) {
-                    __emit_event_unlocked(self, COOLMIC_SIMPLE_EVENT_VUMETER_RESULT, &(self->thread), &vumeter_result, NULL);
-                }
+            /* the VU-Meter publishes a new snapshot every vumeter_interval ms of audio */
+            if (coolmic_vumeter_get_snapshot(self->worker.vumeter, &vumeter_result, &serial) == COOLMIC_ERROR_NONE && serial != self->worker.vumeter_serial) {
+                self->worker.vumeter_serial = serial;
+                __seqlock_write(&(self->vumeter_seq), &(self->vumeter_result), &vumeter_result, sizeof(vumeter_result));
+                __emit_event_unlocked(self, COOLMIC_SIMPLE_EVENT_VUMETER_RESULT, &(self->thread), &vumeter_result, NULL);
             }
-        }
+        } while (ret > 0);
 
-        pthread_mutex_lock(&(self->lock));
-        if (vumeter_interval != self->vumeter_interval) {
-            vumeter_interval = self->vumeter_interval;
-            if (vumeter_interval)
-                vumeter_iter = vumeter_interval - 1;
+        if (ret < 0) {
+            __emit_error_unlocked(self, &(self->thread), COOLMIC_ERROR_GENERIC);
+            return 0;
         }
-        if (self->need_reset)
-            if (__reset(self) != 0)
-                self->running = RUNNING_ERROR;
-        running = self->running;
-        pthread_mutex_unlock(&(self->lock));
     }
 
+    pthread_mutex_lock(&(self->lock));
+    if (self->worker.vumeter_interval != self->vumeter_interval) {
+        self->worker.vumeter_interval = self->vumeter_interval;
+        coolmic_vumeter_set_interval(self->worker.vumeter, self->worker.vumeter_interval);
+    }
+    if (self->need_reset)
+        if (__reset(self) != 0)
+            self->running = RUNNING_ERROR;
+    __abr_update(self, shout);
+    self->worker.running = self->running;
+    pthread_mutex_unlock(&(self->lock));
+
+    if (self->worker.running != RUNNING_STARTED)
+        return 0;
+
+    self->worker.state = WORKER_STREAMING;
+
+    /* wait until there is new data to send, the stream is due to be paced, or for the next VU-Meter result */
+    timeout = self->worker.vumeter_interval && self->worker.vumeter_interval < WORKER_WAKE_MAX ? (int)self->worker.vumeter_interval : WORKER_WAKE_MAX;
+    if ((delay = coolmic_shout_get_delay(shout)) > 0)
+        return delay < timeout ? delay : timeout;
+
+    /* without a descriptor the IO handle blocks itself on the next read */
+    if ((*fd = coolmic_shout_get_pollfd(shout)) < 0) {
+        *fd = -1;
+        return 0;
+    }
+
+    return timeout;
+}
+
+/* end of a connection */
+static int __worker_disconnect(coolmic_simple_t *self)
+{
+    /* the additional outputs and mirrors do not depend on the main connection */
     pthread_mutex_lock(&(self->lock));
     if (self->running != RUNNING_STOPPING)
         self->running = RUNNING_LOST;
-    self->need_reset = 1;
+    /* with the replay buffer the stream is resumed after reconnecting */
+    if (!self->worker.replay_backlog)
+        self->need_reset = 1;
     __emit_cs_locked(self, &(self->thread), COOLMIC_SIMPLE_CS_DISCONNECTING, COOLMIC_ERROR_NONE);
-    coolmic_shout_stop(shout);
+    coolmic_shout_stop(self->worker.shout);
     __emit_cs_locked(self, &(self->thread), COOLMIC_SIMPLE_CS_DISCONNECTED, COOLMIC_ERROR_NONE);
-    igloo_ro_unref(shout);
-    igloo_ro_unref(vumeter);
-    return;
+    igloo_ro_unref(self->worker.shout);
+    igloo_ro_unref(self->worker.vumeter);
+    self->worker.shout = NULL;
+    self->worker.vumeter = NULL;
+    pthread_mutex_unlock(&(self->lock));
+
+    self->worker.state = WORKER_RETRY;
+    return 0;
 }
 
-static inline struct timespec __min_ts (struct timespec a, struct timespec b)
+static inline void __ms_to_ts(struct timespec *ts, uint64_t ms)
 {
-    if (a.tv_sec <= b.tv_sec) {
-        if (a.tv_nsec <= b.tv_nsec) {
-            return a;
-        } else {
-            return b;
-        }
-    } else {
-        return b;
-    }
+    ts->tv_sec = ms / 1000;
+    ts->tv_nsec = (ms % 1000) * 1000000;
 }
 
-static inline struct timespec __sub_ts (struct timespec a, struct timespec b)
+/* returns the delay in [ms] before the next reconnect, or -1 if the profile does not reconnect */
+static int64_t __reconnect_delay(coolmic_simple_t *self)
 {
-    if (b.tv_nsec > a.tv_nsec) {
-        a.tv_sec--;
-        a.tv_nsec += 1000000000;
+    const char *profile = self->reconnection_profile;
+    unsigned int attempt = self->reconnect_attempts++;
+    uint64_t delay;
+
+    if (!strcmp(profile, "flat"))
+        return RECON_FLAT_DELAY;
+
+    if (!strcmp(profile, "immediate")) {
+        /* the first reconnect is done right away, the following ones like "jittered" */
+        if (attempt == 0)
+            return 0;
+        attempt--;
+    } else if (strcmp(profile, "exponential") && strcmp(profile, "jittered")) {
+        return -1;
     }
 
-    a.tv_nsec -= b.tv_nsec;
-    a.tv_sec  -= b.tv_sec;
-    return a;
-}
+    delay = (uint64_t)RECON_BACKOFF_MIN << (attempt < 16 ? attempt : 16);
+    if (delay > RECON_BACKOFF_MAX)
+        delay = RECON_BACKOFF_MAX;
 
-static inline int __isnonzero_ts (struct timespec a)
-{
-    return a.tv_sec || a.tv_nsec;
+    /* spread the reconnects of many clients so they do not hit the server at the same time */
+    if (strcmp(profile, "exponential"))
+        delay = delay / 2 + rand_r(&(self->reconnect_seed)) % (delay / 2 + 1);
+
+    return delay;
 }
 
-static void __worker_sleep(coolmic_simple_t *self)
+/* decides whether to reconnect after a connection ended */
+static int __worker_retry(coolmic_simple_t *self)
 {
-    struct timespec to_sleep, req, rem;
-    int ret;
-    const struct timespec max_sleep = {
-        .tv_sec = 0,
-        .tv_nsec = 250000000
-    };
+    struct timespec to_sleep;
+    int64_t delay;
 
-    if (!self->reconnection_profile)
-        return;
+    pthread_mutex_lock(&(self->lock));
+    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Inner worker terminated, self->running=%i", (int)self->running);
 
-    memset(&to_sleep, 0, sizeof(to_sleep));
+    self->worker.state = WORKER_EXIT;
+    if (self->running == RUNNING_STOPPED || self->running == RUNNING_STOPPING) {
+        pthread_mutex_unlock(&(self->lock));
+        return 0;
+    }
 
-    if (!strcmp(self->reconnection_profile, "flat")) {
-        to_sleep.tv_sec = 10;
-    } else {
-        /* TODO: FIXME: implement error handling here */
-        self->running = RUNNING_STOPPED;
-        return;
+    delay = self->reconnection_profile ? __reconnect_delay(self) : -1;
+    if (delay < 0) {
+        if (self->mirrors_len || self->outputs_len) {
+            /* the main connection is not reconnected but the mirrors and outputs keep running until the worker is stopped */
+            self->running = RUNNING_LOST;
+            self->worker.state = WORKER_LINGER;
+        } else if (self->reconnection_profile) {
+            /* TODO: FIXME: implement error handling here */
+            self->running = RUNNING_STOPPED;
+        }
+        pthread_mutex_unlock(&(self->lock));
+        return 0;
     }
 
+    self->running = RUNNING_STARTED;
+
+    self->worker.reconnect_at = igloo_timing_get_time() + delay;
+    self->worker.reconnect_waited = 0;
+    __ms_to_ts(&to_sleep, delay);
     __emit_event_locked(self, COOLMIC_SIMPLE_EVENT_RECONNECT, &(self->thread), &to_sleep, NULL);
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Entering reconnect sleep loop.");
-    while (self->running != RUNNING_STOPPING && __isnonzero_ts(to_sleep)) {
-        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Sill need sleep before reconnect");
-        req = __min_ts(to_sleep, max_sleep);
-        pthread_mutex_unlock(&(self->lock));
-        ret = nanosleep(&req, &rem);
-        pthread_mutex_lock(&(self->lock));
+    pthread_mutex_unlock(&(self->lock));
 
-        if (ret == -1 && errno == EINTR) {
-            req = __sub_ts(req, rem);
-        }
+    self->worker.state = WORKER_RECONNECT;
+    return 0;
+}
 
-        to_sleep = __sub_ts(to_sleep, req);
+/* waits for the reconnect */
+static int __worker_reconnect(coolmic_simple_t *self)
+{
+    struct timespec to_sleep;
+    coolmic_shout_t *shout;
+    coolmic_vumeter_t *vumeter;
+    uint64_t end = self->worker.reconnect_at;
+    uint64_t now = igloo_timing_get_time();
+    int delay;
+
+    pthread_mutex_lock(&(self->lock));
+    if (self->worker.reconnect_waited) {
+        __ms_to_ts(&to_sleep, now < end ? end - now : 0);
         __emit_event_locked(self, COOLMIC_SIMPLE_EVENT_RECONNECT, &(self->thread), &to_sleep, NULL);
     }
-    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Left reconnect sleep loop.");
+
+    if (self->running == RUNNING_STOPPING || now >= end) {
+        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Left reconnect sleep loop.");
+        self->worker.state = self->running == RUNNING_STARTED ? WORKER_SETUP : WORKER_EXIT;
+        pthread_mutex_unlock(&(self->lock));
+        return 0;
+    }
+
+    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Sill need sleep before reconnect");
+    self->worker.reconnect_waited = 1;
+    if (__worker_holds(self)) {
+        igloo_ro_ref(shout = self->shout);
+        igloo_ro_ref(vumeter = self->vumeter);
+        pthread_mutex_unlock(&(self->lock));
+        delay = __worker_hold(shout, vumeter);
+        igloo_ro_unref(shout);
+        igloo_ro_unref(vumeter);
+        return delay;
+    }
+    pthread_mutex_unlock(&(self->lock));
+
+    return (end - now) < RECON_EVENT_INTERVAL ? (end - now) : RECON_EVENT_INTERVAL;
 }
 
-static void *__worker(void *userdata)
+/* keeps the pipeline running after the main connection ended for good, until the worker is stopped */
+static int __worker_linger(coolmic_simple_t *self)
 {
-    coolmic_simple_t *self = userdata;
+    coolmic_shout_t *shout;
+    coolmic_vumeter_t *vumeter;
+    int delay;
 
     pthread_mutex_lock(&(self->lock));
-    __emit_event_locked(self, COOLMIC_SIMPLE_EVENT_THREAD_POST_START, &(self->thread), NULL, NULL);
-    while (1) {
-        __worker_inner(self);
+    if (self->running == RUNNING_STOPPING) {
+        self->worker.state = WORKER_EXIT;
+        pthread_mutex_unlock(&(self->lock));
+        return 0;
+    }
+    igloo_ro_ref(shout = self->shout);
+    igloo_ro_ref(vumeter = self->vumeter);
+    pthread_mutex_unlock(&(self->lock));
 
-        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Inner worker terminated, self->running=%i", (int)self->running);
+    delay = __worker_hold(shout, vumeter);
+    igloo_ro_unref(shout);
+    igloo_ro_unref(vumeter);
 
-        if (self->running == RUNNING_STOPPED || self->running == RUNNING_STOPPING || !self->reconnection_profile)
-            break;
+    return delay;
+}
 
-        self->running = RUNNING_STARTED;
-        __worker_sleep(self);
-        if (self->running != RUNNING_STARTED)
-            break;
+static int __worker_step(void *userdata, int *fd)
+{
+    coolmic_simple_t *self = userdata;
+
+    switch (self->worker.state) {
+        case WORKER_START:
+            pthread_mutex_lock(&(self->lock));
+            __emit_event_locked(self, COOLMIC_SIMPLE_EVENT_THREAD_POST_START, &(self->thread), NULL, NULL);
+            pthread_mutex_unlock(&(self->lock));
+            self->worker.state = WORKER_SETUP;
+            return 0;
+        break;
+        case WORKER_SETUP:
+            return __worker_setup(self);
+        break;
+        case WORKER_CONNECTING:
+            return __worker_connecting(self);
+        break;
+        case WORKER_STREAMING:
+            return __worker_streaming(self, fd);
+        break;
+        case WORKER_DISCONNECT:
+            return __worker_disconnect(self);
+        break;
+        case WORKER_RETRY:
+            return __worker_retry(self);
+        break;
+        case WORKER_RECONNECT:
+            return __worker_reconnect(self);
+        break;
+        case WORKER_LINGER:
+            return __worker_linger(self);
+        break;
+        case WORKER_EXIT:
+        break;
+        case WORKER_DONE:
+            /* woken up after the worker ended on it's own */
+            return COOLMIC_ENGINE_TASK_DONE;
+        break;
     }
+
+    /* the session ends here */
+    __outputs_stop(self);
+    pthread_mutex_lock(&(self->lock));
+    coolmic_shout_stop_mirrors(self->shout);
+    /* the next start begins a new stream */
+    self->need_reset = 1;
     __emit_event_locked(self, COOLMIC_SIMPLE_EVENT_THREAD_PRE_STOP, &(self->thread), NULL, NULL);
     pthread_mutex_unlock(&(self->lock));
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Outer worker terminated");
+    self->worker.state = WORKER_DONE;
+    return COOLMIC_ENGINE_TASK_DONE;
+}
+
+/* the worker on it's own thread */
+static void *__worker(void *userdata)
+{
+    coolmic_simple_t *self = userdata;
+    struct pollfd fds;
+    int delay;
+
+    while (1) {
+        fds.fd = -1;
+        delay = __worker_step(self, &(fds.fd));
+        if (delay == COOLMIC_ENGINE_TASK_DONE)
+            break;
+        if (delay == 0)
+            continue;
+
+        if (fds.fd >= 0) {
+            fds.events = POLLIN;
+            fds.revents = 0;
+            poll(&fds, 1, delay);
+        } else {
+            pthread_mutex_lock(&(self->lock));
+            __worker_wait(self, delay);
+            pthread_mutex_unlock(&(self->lock));
+        }
+    }
+
     return NULL;
 }
 
@@ -616,15 +1307,27 @@ static void *__worker(void *userdata)
 int                 coolmic_simple_start(coolmic_simple_t *self)
 {
     enum coolmic_simple_running running;
+    int started;
 
     if (!self)
         return COOLMIC_ERROR_FAULT;
     pthread_mutex_lock(&(self->lock));
     if (self->running == RUNNING_STOPPED) {
-        if (pthread_create(&(self->thread), NULL, __worker, self) == 0) {
+        self->reconnect_attempts = 0;
+        self->worker.state = WORKER_START;
+        if (self->engine) {
+            if (!self->task)
+                self->task = coolmic_engine_task_new(self->engine, __worker_step, self);
+            started = self->task != NULL;
+        } else {
+            started = pthread_create(&(self->thread), NULL, __worker, self) == 0;
+        }
+        if (started) {
             self->running = RUNNING_STARTED;
             self->thread_needs_join = 1;
             __emit_event_locked(self, COOLMIC_SIMPLE_EVENT_THREAD_START, NULL, &(self->thread), NULL);
+            /* the worker must not run before the event was emitted */
+            coolmic_engine_task_wake(self->task);
         }
     }
     running = self->running;
@@ -675,6 +1378,17 @@ ssize_t             coolmic_simple_get_vumeter_interval(coolmic_simple_t *self)
     return ret;
 }
 
+int                 coolmic_simple_get_vumeter_result(coolmic_simple_t *self, coolmic_vumeter_result_t *result)
+{
+    if (!self || !result)
+        return COOLMIC_ERROR_FAULT;
+
+    if (!__seqlock_read(&(self->vumeter_seq), result, &(self->vumeter_result), sizeof(*result)))
+        return COOLMIC_ERROR_INVAL;
+
+    return COOLMIC_ERROR_NONE;
+}
+
 int                 coolmic_simple_set_quality(coolmic_simple_t *self, double quality)
 {
     int ret;
@@ -707,6 +1421,209 @@ double              coolmic_simple_get_quality(coolmic_simple_t *self)
     return quality;
 }
 
+int                 coolmic_simple_set_bitrate(coolmic_simple_t *self, long int bitrate)
+{
+    int ret;
+
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    pthread_mutex_lock(&(self->lock));
+    ret = coolmic_enc_ctl(self->enc, COOLMIC_ENC_OP_SET_BITRATE, bitrate);
+    pthread_mutex_unlock(&(self->lock));
+
+    return ret;
+}
+
+int                 coolmic_simple_get_bitrate(coolmic_simple_t *self, long int *bitrate)
+{
+    int ret;
+
+    if (!self || !bitrate)
+        return COOLMIC_ERROR_FAULT;
+
+    pthread_mutex_lock(&(self->lock));
+    ret = coolmic_enc_ctl(self->enc, COOLMIC_ENC_OP_GET_BITRATE, bitrate);
+    pthread_mutex_unlock(&(self->lock));
+
+    return ret;
+}
+
+int                 coolmic_simple_set_abr(coolmic_simple_t *self, long int min_bitrate, long int max_bitrate)
+{
+    int ret = COOLMIC_ERROR_NONE;
+
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+    if (max_bitrate && (min_bitrate < 1 || min_bitrate > max_bitrate))
+        return COOLMIC_ERROR_INVAL;
+    /* the codec must apply each step while running */
+    if (max_bitrate && !coolmic_enc_can_update_bitrate(self->codec))
+        return COOLMIC_ERROR_NOSYS;
+
+    pthread_mutex_lock(&(self->lock));
+    if (max_bitrate) {
+        coolmic_abr_init(&(self->abr), min_bitrate, max_bitrate);
+        self->abr_enabled = 1;
+        if (self->enc)
+            ret = coolmic_enc_ctl(self->enc, COOLMIC_ENC_OP_SET_BITRATE, max_bitrate);
+    } else if (self->abr_enabled) {
+        /* go back to the quality level */
+        self->abr_enabled = 0;
+        if (self->enc)
+            ret = coolmic_enc_ctl(self->enc, COOLMIC_ENC_OP_SET_BITRATE, 0L);
+    }
+    pthread_mutex_unlock(&(self->lock));
+
+    return ret;
+}
+
+int                 coolmic_simple_get_abr(coolmic_simple_t *self, long int *min_bitrate, long int *max_bitrate)
+{
+    if (!self || !min_bitrate || !max_bitrate)
+        return COOLMIC_ERROR_FAULT;
+
+    pthread_mutex_lock(&(self->lock));
+    if (self->abr_enabled) {
+        *min_bitrate = self->abr.min_bitrate;
+        *max_bitrate = self->abr.max_bitrate;
+    } else {
+        *min_bitrate = 0;
+        *max_bitrate = 0;
+    }
+    pthread_mutex_unlock(&(self->lock));
+
+    return COOLMIC_ERROR_NONE;
+}
+
+int                 coolmic_simple_set_engine(coolmic_simple_t *self, coolmic_engine_t *engine)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    pthread_mutex_lock(&(self->lock));
+    if (self->thread_needs_join) {
+        pthread_mutex_unlock(&(self->lock));
+        return COOLMIC_ERROR_BUSY;
+    }
+
+    if (engine && igloo_ro_ref(engine) != 0) {
+        pthread_mutex_unlock(&(self->lock));
+        return COOLMIC_ERROR_GENERIC;
+    }
+
+    coolmic_engine_task_free(self->task);
+    self->task = NULL;
+    igloo_ro_unref(self->engine);
+    self->engine = engine;
+    pthread_mutex_unlock(&(self->lock));
+
+    return COOLMIC_ERROR_NONE;
+}
+
+ssize_t             coolmic_simple_add_mirror(coolmic_simple_t *self, const coolmic_shout_config_t *conf)
+{
+    ssize_t ret;
+
+    if (!self || !conf)
+        return COOLMIC_ERROR_FAULT;
+
+    pthread_mutex_lock(&(self->lock));
+    if (self->thread_needs_join) {
+        ret = COOLMIC_ERROR_BUSY;
+    } else {
+        ret = coolmic_shout_add_config(self->shout, conf);
+        if (ret > 0)
+            self->mirrors_len = ret;
+    }
+    pthread_mutex_unlock(&(self->lock));
+
+    return ret;
+}
+
+ssize_t             coolmic_simple_add_output(coolmic_simple_t *self, const char *codec, double quality, long int bitrate, const coolmic_shout_config_t *conf)
+{
+    coolmic_simple_output_t *outputs;
+    coolmic_simple_output_t *output;
+    ssize_t ret;
+
+    if (!self || !codec || !conf)
+        return COOLMIC_ERROR_FAULT;
+    if (bitrate < 0)
+        return COOLMIC_ERROR_INVAL;
+
+    pthread_mutex_lock(&(self->lock));
+    if (self->thread_needs_join) {
+        pthread_mutex_unlock(&(self->lock));
+        return COOLMIC_ERROR_BUSY;
+    }
+
+    outputs = realloc(self->outputs, sizeof(*outputs) * (self->outputs_len + 1));
+    if (!outputs) {
+        pthread_mutex_unlock(&(self->lock));
+        return COOLMIC_ERROR_NOMEM;
+    }
+    self->outputs = outputs;
+
+    output = &(outputs[self->outputs_len]);
+    memset(output, 0, sizeof(*output));
+    output->quality = quality;
+    output->bitrate = bitrate;
+
+    do {
+        if ((output->codec = strdup(codec)) == NULL)
+            break;
+        if ((output->shout = igloo_ro_new(coolmic_shout_t)) == NULL)
+            break;
+        if (coolmic_shout_set_config(output->shout, conf) != COOLMIC_ERROR_NONE)
+            break;
+        /* the sender waits for data itself, see __output_step() */
+        if (coolmic_shout_set_sync(output->shout, 0) != COOLMIC_ERROR_NONE)
+            break;
+
+        pthread_mutex_init(&(output->lock), NULL);
+        /* index 0 is the main output */
+        ret = ++self->outputs_len;
+        pthread_mutex_unlock(&(self->lock));
+        return ret;
+    } while (0);
+
+    igloo_ro_unref(output->shout);
+    free(output->codec);
+    pthread_mutex_unlock(&(self->lock));
+    return COOLMIC_ERROR_GENERIC;
+}
+
+int                 coolmic_simple_set_replay(coolmic_simple_t *self, uint64_t backlog)
+{
+    int ret;
+
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    pthread_mutex_lock(&(self->lock));
+    if (self->thread_needs_join) {
+        ret = COOLMIC_ERROR_BUSY;
+    } else if ((ret = coolmic_shout_set_replay(self->shout, backlog)) == COOLMIC_ERROR_NONE) {
+        self->replay_backlog = backlog;
+    }
+    pthread_mutex_unlock(&(self->lock));
+
+    return ret;
+}
+
+int                 coolmic_simple_get_replay(coolmic_simple_t *self, uint64_t *backlog)
+{
+    if (!self || !backlog)
+        return COOLMIC_ERROR_FAULT;
+
+    pthread_mutex_lock(&(self->lock));
+    *backlog = self->replay_backlog;
+    pthread_mutex_unlock(&(self->lock));
+
+    return COOLMIC_ERROR_NONE;
+}
+
 int                 coolmic_simple_set_meta(coolmic_simple_t *self, const char *key, const char *value, int replace)
 {
     int ret;
@@ -729,6 +1646,7 @@ int                 coolmic_simple_set_meta(coolmic_simple_t *self, const char *
 
 int                 coolmic_simple_set_station_meta(coolmic_simple_t *self, const char *key, const char *value)
 {
+    size_t i;
     int ret;
 
     if (!self || !key || !value)
@@ -736,6 +1654,8 @@ int                 coolmic_simple_set_station_meta(coolmic_simple_t *self, cons
 
     pthread_mutex_lock(&(self->lock));
     ret = coolmic_shout_set_meta(self->shout, key, value);
+    for (i = 0; ret == COOLMIC_ERROR_NONE && i < self->outputs_len; i++)
+        ret = coolmic_shout_set_meta(self->outputs[i].shout, key, value);
     pthread_mutex_unlock(&(self->lock));
 
     return ret;
@@ -743,6 +1663,7 @@ int                 coolmic_simple_set_station_meta(coolmic_simple_t *self, cons
 
 int                 coolmic_simple_restart_encoder(coolmic_simple_t *self)
 {
+    size_t i;
     int ret;
 
     if (!self)
@@ -751,6 +1672,9 @@ int                 coolmic_simple_restart_encoder(coolmic_simple_t *self)
     pthread_mutex_lock(&(self->lock));
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Restart enc: %p", self->enc);
     ret = coolmic_enc_ctl(self->enc, COOLMIC_ENC_OP_RESTART);
+    for (i = 0; ret == COOLMIC_ERROR_NONE && i < self->outputs_len; i++)
+        if (self->outputs[i].enc)
+            ret = coolmic_enc_ctl(self->outputs[i].enc, COOLMIC_ENC_OP_RESTART);
     pthread_mutex_unlock(&(self->lock));
 
     return ret;
@@ -765,6 +1689,32 @@ coolmic_transform_t *coolmic_simple_get_transform(coolmic_simple_t *self)
     return self->transform;
 }
 
+int                 coolmic_simple_set_resample_quality(coolmic_simple_t *self, coolmic_resample_quality_t quality)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+    if (quality != COOLMIC_RESAMPLE_QUALITY_LOW && quality != COOLMIC_RESAMPLE_QUALITY_MEDIUM && quality != COOLMIC_RESAMPLE_QUALITY_HIGH)
+        return COOLMIC_ERROR_INVAL;
+
+    pthread_mutex_lock(&(self->lock));
+    self->resample_quality = quality;
+    pthread_mutex_unlock(&(self->lock));
+
+    return COOLMIC_ERROR_NONE;
+}
+
+int                 coolmic_simple_get_resample_quality(coolmic_simple_t *self, coolmic_resample_quality_t *quality)
+{
+    if (!self || !quality)
+        return COOLMIC_ERROR_FAULT;
+
+    pthread_mutex_lock(&(self->lock));
+    *quality = self->resample_quality;
+    pthread_mutex_unlock(&(self->lock));
+
+    return COOLMIC_ERROR_NONE;
+}
+
 int                 coolmic_simple_set_reconnection_profile(coolmic_simple_t *self, const char *profile)
 {
     char *n;
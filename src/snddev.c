@@ -63,6 +63,8 @@ struct coolmic_snddev {
 
     /* driver */
     coolmic_snddev_driver_t driver;
+    /* format of the device */
+    coolmic_iohandle_format_t format;
     /* IO Handles */
     coolmic_iohandle_t *tx; /* Handle -data-> Device */
     /* Buffer for TX */
@@ -137,6 +139,10 @@ coolmic_snddev_t   *coolmic_snddev_new(const char *name, igloo_ro_t associated,
         return NULL;
     }
 
+    ret->format.rate = rate;
+    ret->format.channels = channels;
+    ret->format.sample_format = COOLMIC_IOHANDLE_SAMPLE_FORMAT_S16;
+
     return ret;
 }
 
@@ -160,12 +166,17 @@ static int __free_snddev_iohandle(void *arg)
 
 coolmic_iohandle_t *coolmic_snddev_get_iohandle(coolmic_snddev_t *self)
 {
+    coolmic_iohandle_t *ret;
+
     if (!self)
         return NULL;
     //if (flags & COOLMIC_DSP_SNDDEV_RX) {
     //
     igloo_ro_ref(self);
-    return coolmic_iohandle_new(NULL, igloo_RO_NULL, self, __free_snddev_iohandle, __read, NULL);
+    ret = coolmic_iohandle_new(NULL, igloo_RO_NULL, self, __free_snddev_iohandle, __read, NULL);
+    if (ret)
+        coolmic_iohandle_set_format(ret, &(self->format));
+    return ret;
 }
 
 static inline int __flush_buffer(coolmic_snddev_t *self)
@@ -25,124 +25,410 @@
 
 #define COOLMIC_COMPONENT "libcoolmic-dsp/tee"
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <pthread.h>
 #include "types_private.h"
 #include <coolmic-dsp/tee.h>
 #include <coolmic-dsp/iohandle.h>
 #include <coolmic-dsp/coolmic-dsp.h>
 #include <coolmic-dsp/logging.h>
 
-#define MAX_READERS 4
+/* default and limits for the size of the ring buffer in [Byte] */
+#define DEFAULT_BUFFER_LEN  8192
+#define MIN_BUFFER_LEN      64
+
+/* Minimum size of a read from the input in [Byte].
+ * This must be at least the size of one frame as frame based inputs can not return less.
+ */
+#define MIN_PHY_READ        64
+
+/* The ring is split into (1 << BLOCK_BITS) blocks. For each block we count the readers
+ * positioned within it. This allows finding the slowest reader without looking at all readers.
+ * There are twice as many counters as blocks as the readers may span one more block than the ring has.
+ */
+#define BLOCK_BITS          4
+#define BLOCK_COUNTERS      (2 << BLOCK_BITS)
 
 typedef struct {
     /* reference back to the parent object */
     coolmic_tee_t *parent;
 
-    /* index of the current handle */
+    /* index of the reader */
     size_t index;
-} backpointer_t;
+
+    /* whether this reader is attached, that is it is taken into account for buffer management */
+    int attached;
+
+    /* whether reads return early if there is no data instead of waiting or reading from the input */
+    int nonblocking;
+
+    /* what to do if the reader falls behind by more than the buffer size */
+    coolmic_tee_overflow_policy_t policy;
+
+    /* set while data returned by a peek is in use, the reader then holds back the input regardless of it's policy */
+    int pinned;
+
+    /* number of bytes skipped because of overflows */
+    uint64_t dropped;
+
+    /* number of IO handles using this reader */
+    size_t handles;
+
+    /* absolute stream position of this reader */
+    uint64_t offset;
+} reader_t;
 
 struct coolmic_tee {
     /* base type */
     igloo_ro_base_t __base;
 
+    /* lock protecting all members but the content of the buffer */
+    pthread_mutex_t lock;
+    /* signaled when new data has been written or the state changed */
+    pthread_cond_t cond_data;
+    /* signaled when readers consumed data */
+    pthread_cond_t cond_space;
+
+    /* whether the tee is in concurrent mode, see coolmic_tee_set_concurrent() */
+    int concurrent;
+    /* set when the input reached EOF (concurrent mode only) */
+    int eof;
+    /* set while a thread is writing into the buffer */
+    int producing;
+    /* number of threads waiting on cond_space */
+    size_t producer_waiting;
+    /* number of threads accessing the buffer without holding the lock */
+    size_t busy;
+
+    /* readers */
+    reader_t **reader;
     /* number of readers */
     size_t readers;
+    /* number of allocated elements in reader */
+    size_t readers_len;
+    /* number of attached readers */
+    size_t attached;
+    /* number of readers holding back the input, see __reader_holds_input() */
+    size_t blocking;
 
-    /* index of next reader for requests using coolmic_tee_get_iohandle(self, -1) */
-    ssize_t next_reader;
+    /* frame size in [Byte], readers only drop full frames */
+    size_t frame_size;
 
-    /* IO buffer length */
+    /* IO buffer length, always a power of two */
     size_t buffer_len;
 
-    /* IO buffer fill */
-    size_t buffer_fill;
-
     /* IO buffer */
     void *buffer;
 
+    /* Absolute stream position of the next byte to be written to the buffer.
+     * Positions are absolute and are mapped into the buffer with position & (buffer_len - 1).
+     */
+    uint64_t head;
+    /* Absolute stream position up to which the buffer may currently be written.
+     * This is larger than head while a thread is writing into the buffer.
+     * Readers not holding back the input use this to validate their data.
+     */
+    uint64_t head_write;
+
+    /* block accounting, see BLOCK_BITS */
+    unsigned int block_shift;
+    size_t block_count[BLOCK_COUNTERS];
+    /* lowest block that may still hold a reader */
+    uint64_t tail_block;
+
     /* input IO handle */
     coolmic_iohandle_t *in;
-
-    /* offsets of IO handles into buffer */
-    size_t offset[MAX_READERS];
 };
 
 static void __free(igloo_ro_t self)
 {
     coolmic_tee_t *tee = igloo_RO_TO_TYPE(self, coolmic_tee_t);
+    size_t i;
 
     igloo_ro_unref(tee->in);
+
+    for (i = 0; i < tee->readers; i++)
+        free(tee->reader[i]);
+
+    free(tee->reader);
     free(tee->buffer);
+
+    pthread_cond_destroy(&(tee->cond_space));
+    pthread_cond_destroy(&(tee->cond_data));
+    pthread_mutex_destroy(&(tee->lock));
 }
 
 igloo_RO_PUBLIC_TYPE(coolmic_tee_t,
         igloo_RO_TYPEDECL_FREE(__free)
         );
 
-static void __readjust_buffer(coolmic_tee_t *self, size_t len_request)
+static inline size_t __round_buffer_len(size_t len)
 {
-    void *buffer_new;
-    size_t i;
-    size_t min_offset;
+    size_t ret = MIN_BUFFER_LEN;
 
-    /* request a new buffer if needed
-     * We limit this to range of 1024 to 8192 to avoid both short buffers (performance)
-     * as well as long buffers (likely invalid reads).
-     */
-    if (len_request < 1024) {
-        len_request = 1024;
-    } else if (len_request > 8192) {
-        len_request = 8192;
-    }
+    while (ret < len && ret < (((size_t)-1) >> 1) + 1)
+        ret <<= 1;
 
-    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Buffer adjustment for %zu bytes", len_request);
+    return ret;
+}
 
-    if (len_request > self->buffer_len) {
-        buffer_new = realloc(self->buffer, len_request);
-        if (buffer_new) {
-            self->buffer = buffer_new;
-            self->buffer_len = len_request;
-        } else {
-            coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, COOLMIC_ERROR_NONE, "Can not allocate new buffer");
-        }
+static inline size_t *__block_counter(coolmic_tee_t *self, uint64_t pos)
+{
+    return &(self->block_count[(pos >> self->block_shift) & (BLOCK_COUNTERS - 1)]);
+}
+
+static inline void __wakeup(coolmic_tee_t *self)
+{
+    pthread_cond_broadcast(&(self->cond_data));
+    pthread_cond_broadcast(&(self->cond_space));
+}
+
+/* returns whether the reader holds back the input, only those readers are in the block accounting */
+static inline int __reader_holds_input(const reader_t *reader)
+{
+    return reader->attached && (reader->policy == COOLMIC_TEE_OVERFLOW_BLOCK || reader->pinned);
+}
+
+/* updates the block accounting after the state of a reader changed */
+static inline void __reader_update(coolmic_tee_t *self, reader_t *reader, int held_input)
+{
+    const uint64_t block = reader->offset >> self->block_shift;
+
+    if (__reader_holds_input(reader) == held_input)
+        return;
+
+    if (held_input) {
+        (*__block_counter(self, reader->offset))--;
+        self->blocking--;
+        return;
     }
 
-    if (!self->buffer) {
-        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, COOLMIC_ERROR_NONE, "Unabled to allocate any buffer");
+    (*__block_counter(self, reader->offset))++;
+    if (!self->blocking++ || block < self->tail_block)
+        self->tail_block = block;
+}
+
+static inline void __reader_attach(coolmic_tee_t *self, reader_t *reader)
+{
+    if (reader->attached)
+        return;
+
+    reader->attached = 1;
+    reader->offset = self->head;
+    self->attached++;
+
+    __reader_update(self, reader, 0);
+}
+
+static inline void __reader_detach(coolmic_tee_t *self, reader_t *reader)
+{
+    int held_input = __reader_holds_input(reader);
+
+    if (!reader->attached)
         return;
+
+    reader->attached = 0;
+    self->attached--;
+
+    __reader_update(self, reader, held_input);
+
+    __wakeup(self);
+}
+
+static inline void __reader_advance(coolmic_tee_t *self, reader_t *reader, size_t len)
+{
+    uint64_t offset = reader->offset + len;
+
+    if (__reader_holds_input(reader) && (offset >> self->block_shift) != (reader->offset >> self->block_shift)) {
+        (*__block_counter(self, reader->offset))--;
+        (*__block_counter(self, offset))++;
     }
 
-    /* look up the common (minimum) offset of all reads into the buffer */
-    min_offset = self->buffer_fill;
+    reader->offset = offset;
+
+    if (self->producer_waiting)
+        pthread_cond_signal(&(self->cond_space));
+}
+
+/* returns the absolute position of the slowest reader.
+ * If holding_only is set only readers holding back the input are considered.
+ * This runs in O(readers) and is only used for rare operations.
+ */
+static uint64_t __tail(coolmic_tee_t *self, int holding_only)
+{
+    uint64_t tail = self->head;
+    size_t i;
+
     for (i = 0; i < self->readers; i++) {
-        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Reader %zu's offset is %zu byte", i, self->offset[i]);
-        if (self->offset[i] < min_offset) {
-            min_offset = self->offset[i];
+        if (holding_only && !__reader_holds_input(self->reader[i]))
+            continue;
+        if (self->reader[i]->attached && self->reader[i]->offset < tail) {
+            tail = self->reader[i]->offset;
         }
     }
 
-    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Buffer's minimum offset is %zu byte", min_offset);
+    return tail;
+}
+
+/* returns a lower bound of the absolute position of the slowest reader holding back the input.
+ * The value is off by at most one block. This runs in amortised O(1).
+ */
+static uint64_t __tail_fast(coolmic_tee_t *self)
+{
+    const uint64_t head_block = self->head >> self->block_shift;
+
+    if (!self->blocking)
+        return self->head;
+
+    while (self->tail_block < head_block && !self->block_count[self->tail_block & (BLOCK_COUNTERS - 1)])
+        self->tail_block++;
+
+    return self->tail_block << self->block_shift;
+}
+
+/* rebuilds the block accounting, used when the buffer size changes */
+static void __rebuild_blocks(coolmic_tee_t *self)
+{
+    size_t i;
 
-    /* if we got a minimum offset > 0 we can move what we have to the begin of the buffer */
-    if (min_offset > 0) {
-        memmove(self->buffer, self->buffer + min_offset, self->buffer_fill - min_offset);
-        self->buffer_fill -= min_offset;
+    self->block_shift = 0;
+    while (((size_t)1 << (self->block_shift + BLOCK_BITS)) < self->buffer_len)
+        self->block_shift++;
 
-        for (i = 0; i < self->readers; i++)
-            self->offset[i] -= min_offset;
+    memset(self->block_count, 0, sizeof(self->block_count));
+    for (i = 0; i < self->readers; i++)
+        if (__reader_holds_input(self->reader[i]))
+            (*__block_counter(self, self->reader[i]->offset))++;
+
+    self->tail_block = __tail(self, 1) >> self->block_shift;
+}
+
+/* copies len bytes starting at absolute position pos out of the ring */
+static inline void __copy_out(const void *buffer, size_t buffer_len, uint64_t pos, void *out, size_t len)
+{
+    size_t offset = pos & (buffer_len - 1);
+    size_t first = buffer_len - offset;
+
+    if (first >= len) {
+        memcpy(out, buffer + offset, len);
+    } else {
+        memcpy(out, buffer + offset, first);
+        memcpy(out + first, buffer, len - first);
+    }
+}
+
+/* Checks whether a reader not holding back the input has been overrun and applies it's policy.
+ * Returns true if the reader is still attached.
+ */
+static int __reader_check_overflow(coolmic_tee_t *self, reader_t *reader)
+{
+    uint64_t offset;
+
+    if (!reader->attached || __reader_holds_input(reader))
+        return reader->attached;
+
+    if ((reader->offset + self->buffer_len) >= self->head_write)
+        return 1;
+
+    if (reader->policy == COOLMIC_TEE_OVERFLOW_DETACH) {
+        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_WARNING, COOLMIC_ERROR_NONE, "Reader %zu overrun, detaching", reader->index);
+        reader->dropped += self->head - reader->offset;
+        __reader_detach(self, reader);
+        return 0;
+    }
+
+    /* Skip to the oldest data that is safe from the producer for a while, that is keep 3/4 of the buffer. */
+    offset = self->head_write - self->buffer_len + self->buffer_len / 4;
+    if (offset > self->head)
+        offset = self->head;
+    offset -= offset % self->frame_size;
+    if (offset < reader->offset)
+        offset += self->frame_size;
+    if (offset > self->head)
+        offset = self->head;
+
+    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_WARNING, COOLMIC_ERROR_NONE, "Reader %zu overrun, dropping %llu bytes", reader->index, (long long unsigned int)(offset - reader->offset));
+    reader->dropped += offset - reader->offset;
+    reader->offset = offset;
+
+    return 1;
+}
+
+/* returns the amount of free space in the buffer */
+static inline size_t __space_total(coolmic_tee_t *self)
+{
+    uint64_t tail = __tail_fast(self);
+
+    /* A reader may be a full buffer behind, e.g. after it started holding back the input.
+     * The lower bound is then below the end of the buffer and we need the exact position.
+     */
+    if ((self->head - tail) >= self->buffer_len)
+        tail = __tail(self, 1);
+
+    if ((self->head - tail) >= self->buffer_len)
+        return 0;
+
+    return self->buffer_len - (size_t)(self->head - tail);
+}
+
+/* returns the amount of space that can be written in one go at the head of the buffer */
+static inline size_t __space(coolmic_tee_t *self)
+{
+    size_t offset = self->head & (self->buffer_len - 1);
+    size_t ret;
+
+    ret = __space_total(self);
+    if (ret > (self->buffer_len - offset))
+        ret = self->buffer_len - offset;
+
+    return ret;
+}
+
+/* copies len bytes into the ring starting at absolute position pos */
+static inline void __copy_in(void *buffer, size_t buffer_len, uint64_t pos, const void *in, size_t len)
+{
+    size_t offset = pos & (buffer_len - 1);
+    size_t first = buffer_len - offset;
+
+    if (first >= len) {
+        memcpy(buffer + offset, in, len);
+    } else {
+        memcpy(buffer + offset, in, first);
+        memcpy(buffer, in + first, len - first);
     }
 }
 
+/* Reads from the input into the buffer.
+ * Must be called locked. The lock is released while reading from the input.
+ */
 static ssize_t __read_phy(coolmic_tee_t *self, size_t len_request)
 {
+    coolmic_iohandle_t *in;
+    char bounce[MIN_PHY_READ];
+    void *buffer;
+    uint64_t pos;
     size_t iter;
+    size_t total;
     ssize_t ret;
 
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Physical read request, len_request=%zu", len_request);
-    __readjust_buffer(self, len_request);
 
-    iter = self->buffer_len - self->buffer_fill;
+    if (len_request < MIN_PHY_READ)
+        len_request = MIN_PHY_READ;
+
+    /* The free space is what is not yet consumed by the slowest reader.
+     * We only read up to the physical end of the buffer so the backend can write directly into it.
+     * If that is too small we read into a bounce buffer and copy around the end of the buffer.
+     */
+    iter = __space(self);
+    total = __space_total(self);
+    if (iter < MIN_PHY_READ && total > iter) {
+        iter = total < MIN_PHY_READ ? total : MIN_PHY_READ;
+        buffer = bounce;
+    } else {
+        buffer = self->buffer + (self->head & (self->buffer_len - 1));
+    }
 
     /* check if there is some kind of problem with the buffer */
     if (!self->buffer || !iter) {
@@ -153,82 +439,374 @@ static ssize_t __read_phy(coolmic_tee_t *self, size_t len_request)
     if (iter > len_request)
         iter = len_request;
 
-    ret = coolmic_iohandle_read(self->in, self->buffer + self->buffer_fill, iter);
+    /* The region behind head is neither visible to readers nor reclaimed, so we can write to it unlocked. */
+    in = self->in;
+    if (igloo_ro_ref(in) != COOLMIC_ERROR_NONE)
+        return -1;
+    pos = self->head;
+    self->head_write = self->head + iter;
+    self->producing = 1;
+    self->busy++;
+    pthread_mutex_unlock(&(self->lock));
+    ret = coolmic_iohandle_read(in, buffer, iter);
+    if (ret > 0 && buffer == bounce)
+        __copy_in(self->buffer, self->buffer_len, pos, bounce, ret);
+    pthread_mutex_lock(&(self->lock));
+    self->busy--;
+    self->producing = 0;
+
     if (ret < 1) {
+        self->head_write = self->head;
+        if (self->concurrent && coolmic_iohandle_eof(in) == 1)
+            self->eof = 1;
+        igloo_ro_unref(in);
+        pthread_cond_broadcast(&(self->cond_data));
         coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, COOLMIC_ERROR_NONE, "Physical read on backend failed");
         return ret;
     }
 
-    self->buffer_fill += ret;
+    igloo_ro_unref(in);
+
+    self->head += ret;
+    self->head_write = self->head;
+    pthread_cond_broadcast(&(self->cond_data));
 
     return ret;
 }
 
+/* Waits until there is data available for the reader. Must be called locked.
+ * If may_block is false we do not wait in concurrent mode.
+ * Returns the number of bytes available, 0 if there is no data,
+ * COOLMIC_ERROR_UNCONNECTED if the reader is detached or -1 on error.
+ */
+static ssize_t __reader_wait(coolmic_tee_t *self, reader_t *reader, size_t len, int may_block)
+{
+    ssize_t ret;
+
+    while (1) {
+        if (!__reader_check_overflow(self, reader)) {
+            coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, COOLMIC_ERROR_UNCONNECTED, "Read on detached reader %zu", reader->index);
+            return COOLMIC_ERROR_UNCONNECTED;
+        }
+
+        if (self->head != reader->offset)
+            return self->head - reader->offset;
+
+        if (self->concurrent) {
+            /* in concurrent mode we never read from the input but wait for the producer */
+            if (self->eof || reader->nonblocking || !may_block)
+                return 0;
+            pthread_cond_wait(&(self->cond_data), &(self->lock));
+        } else if (reader->nonblocking) {
+            /* only get the data read by the other readers */
+            return 0;
+        } else if (self->producing) {
+            /* another thread is currently reading from the input */
+            pthread_cond_wait(&(self->cond_data), &(self->lock));
+        } else {
+            ret = __read_phy(self, len);
+            if (ret < 1)
+                return ret;
+        }
+    }
+}
+
+/* releases the data of an outstanding peek. Must be called locked. */
+static void __reader_unpin(coolmic_tee_t *self, reader_t *reader)
+{
+    int held_input = __reader_holds_input(reader);
+
+    if (!reader->pinned)
+        return;
+
+    reader->pinned = 0;
+    self->busy--;
+    __reader_update(self, reader, held_input);
+}
+
 static ssize_t __read(void *userdata, void *buffer, size_t len)
 {
-    backpointer_t *backpointer = userdata;
-    coolmic_tee_t *self = backpointer->parent;
+    reader_t *reader = userdata;
+    coolmic_tee_t *self = reader->parent;
+    const void *data;
+    size_t data_len;
+    uint64_t offset;
     ssize_t ret = 0;
+    ssize_t avail;
     size_t iter;
 
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Read request, buffer=%p, len=%zu", buffer, len);
 
-    do {
-        iter = self->buffer_fill - self->offset[backpointer->index];
-        if (!iter) {
-            if (__read_phy(self, len) < 1) {
-                coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Read request satisfied, ret=%zu", ret);
-                return ret;
-            }
-            iter = self->buffer_fill - self->offset[backpointer->index];
+    pthread_mutex_lock(&(self->lock));
+    __reader_unpin(self, reader);
+    while (len) {
+        avail = __reader_wait(self, reader, len, !ret);
+        if (avail < 1) {
+            if (!ret && avail == COOLMIC_ERROR_UNCONNECTED)
+                ret = avail;
+            break;
         }
 
+        iter = avail;
         if (iter > len)
             iter = len;
 
-        memcpy(buffer, self->buffer + self->offset[backpointer->index], iter);
+        /* The region between reader and head is not overwritten while we are attached, so we can copy unlocked. */
+        data = self->buffer;
+        data_len = self->buffer_len;
+        offset = reader->offset;
+        self->busy++;
+        pthread_mutex_unlock(&(self->lock));
+        __copy_out(data, data_len, offset, buffer, iter);
+        pthread_mutex_lock(&(self->lock));
+        self->busy--;
 
-        ret += iter;
-        self->offset[backpointer->index] += iter;
+        /* The producer may have overwritten the data while we copied it if we do not hold back the input. */
+        if (reader->attached && !__reader_holds_input(reader) && (offset + data_len) < self->head_write)
+            continue;
 
-        if (iter == len) {
-            coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Read request satisfied, ret=%zu", ret);
-            return ret;
-        }
+        ret += iter;
+        __reader_advance(self, reader, iter);
 
         buffer += iter;
         len -= iter;
-    } while (iter);
+    }
+    pthread_mutex_unlock(&(self->lock));
+
+    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Read request satisfied, ret=%zi", ret);
+
+    return ret;
+}
+
+static ssize_t __peek(void *userdata, const void **buffer, size_t len)
+{
+    reader_t *reader = userdata;
+    coolmic_tee_t *self = reader->parent;
+    ssize_t ret;
+    size_t offset;
+    int held_input;
+
+    pthread_mutex_lock(&(self->lock));
+    __reader_unpin(self, reader);
+
+    ret = __reader_wait(self, reader, len, 1);
+    if (ret < 1) {
+        pthread_mutex_unlock(&(self->lock));
+        return ret;
+    }
+
+    /* we can only return the contiguous part */
+    offset = reader->offset & (self->buffer_len - 1);
+    if ((size_t)ret > (self->buffer_len - offset))
+        ret = self->buffer_len - offset;
+    if ((size_t)ret > len)
+        ret = len;
+
+    /* Pin the reader so the data is neither overwritten nor moved until consumed. */
+    held_input = __reader_holds_input(reader);
+    reader->pinned = 1;
+    self->busy++;
+    __reader_update(self, reader, held_input);
+
+    *buffer = self->buffer + offset;
+    pthread_mutex_unlock(&(self->lock));
+
+    return ret;
+}
 
-    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Read request satisfied, ret=%zu", ret);
+static int __consume(void *userdata, size_t len)
+{
+    reader_t *reader = userdata;
+    coolmic_tee_t *self = reader->parent;
+    int ret = COOLMIC_ERROR_NONE;
+
+    pthread_mutex_lock(&(self->lock));
+    if (!reader->pinned) {
+        ret = COOLMIC_ERROR_INVAL;
+    } else if (!reader->attached) {
+        ret = COOLMIC_ERROR_UNCONNECTED;
+    } else if (len > (self->head - reader->offset)) {
+        ret = COOLMIC_ERROR_INVAL;
+    } else {
+        __reader_advance(self, reader, len);
+    }
+    __reader_unpin(self, reader);
+    pthread_mutex_unlock(&(self->lock));
 
     return ret;
 }
 
 static int __eof(void *userdata)
 {
-    backpointer_t *backpointer = userdata;
-    coolmic_tee_t *self = backpointer->parent;
+    reader_t *reader = userdata;
+    coolmic_tee_t *self = reader->parent;
+    coolmic_iohandle_t *in;
+    int ret;
+
+    pthread_mutex_lock(&(self->lock));
+    if (!reader->attached) {
+        ret = 1; /* bool */
+    } else if (reader->offset < self->head) {
+        ret = 0; /* bool */
+    } else if (self->concurrent) {
+        ret = self->eof;
+    } else {
+        in = self->in;
+        igloo_ro_ref(in);
+        pthread_mutex_unlock(&(self->lock));
+        ret = coolmic_iohandle_eof(in);
+        igloo_ro_unref(in);
+        return ret;
+    }
+    pthread_mutex_unlock(&(self->lock));
+
+    return ret;
+}
+
+/* adds a new reader and returns it's index */
+static ssize_t __reader_new(coolmic_tee_t *self)
+{
+    reader_t **reader_new;
+    reader_t *reader;
+    size_t len_new;
+
+    if (self->readers == self->readers_len) {
+        len_new = self->readers_len ? self->readers_len * 2 : 4;
+        reader_new = realloc(self->reader, sizeof(*reader_new) * len_new);
+        if (!reader_new)
+            return -1;
+        self->reader = reader_new;
+        self->readers_len = len_new;
+    }
+
+    reader = calloc(1, sizeof(reader_t));
+    if (!reader)
+        return -1;
 
-    if (self->offset[backpointer->index] < self->buffer_fill)
-        return 0; /* bool */
+    reader->parent = self;
+    reader->index = self->readers;
+    self->reader[self->readers] = reader;
 
-    return coolmic_iohandle_eof(self->in);
+    __reader_attach(self, reader);
+
+    return self->readers++;
 }
 
 /* Management of the tee object */
 coolmic_tee_t      *coolmic_tee_new(const char *name, igloo_ro_t associated, size_t readers)
 {
     coolmic_tee_t *ret;
-
-    if (readers < 1 || readers > MAX_READERS)
-        return NULL;
+    size_t i;
 
     ret = igloo_ro_new_raw(coolmic_tee_t, name, associated);
     if (!ret)
         return NULL;
 
-    ret->readers = readers;
+    pthread_mutex_init(&(ret->lock), NULL);
+    pthread_cond_init(&(ret->cond_data), NULL);
+    pthread_cond_init(&(ret->cond_space), NULL);
+
+    ret->frame_size = 1;
+
+    if (coolmic_tee_set_buffer_size(ret, DEFAULT_BUFFER_LEN) != COOLMIC_ERROR_NONE) {
+        igloo_ro_unref(ret);
+        return NULL;
+    }
+
+    for (i = 0; i < readers; i++) {
+        if (__reader_new(ret) < 0) {
+            igloo_ro_unref(ret);
+            return NULL;
+        }
+    }
+
+    return ret;
+}
+
+int                 coolmic_tee_set_buffer_size(coolmic_tee_t *self, size_t size)
+{
+    uint64_t tail;
+    uint64_t tail_all;
+    size_t used;
+    void *buffer_new;
+    size_t len_new;
+    size_t offset;
+    size_t first;
+
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    len_new = __round_buffer_len(size);
+
+    pthread_mutex_lock(&(self->lock));
+    tail = __tail(self, 1);
+    used = self->head - tail;
+
+    if (len_new < used || self->busy) {
+        pthread_mutex_unlock(&(self->lock));
+        return COOLMIC_ERROR_BUSY;
+    }
+
+    if (len_new == self->buffer_len) {
+        pthread_mutex_unlock(&(self->lock));
+        return COOLMIC_ERROR_NONE;
+    }
+
+    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Buffer adjustment for %zu bytes (requested %zu bytes)", len_new, size);
+
+    buffer_new = malloc(len_new);
+    if (!buffer_new) {
+        pthread_mutex_unlock(&(self->lock));
+        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_ERROR, COOLMIC_ERROR_NOMEM, "Can not allocate new buffer");
+        return COOLMIC_ERROR_NOMEM;
+    }
+
+    /* Readers not holding back the input keep as much of their data as still valid and fits the new buffer.
+     * If they are further behind they will notice the overflow on their next read.
+     */
+    tail_all = __tail(self, 0);
+    if ((self->head - tail_all) > self->buffer_len)
+        tail_all = self->head - self->buffer_len;
+    if ((self->head - tail_all) > len_new)
+        tail_all = self->head - len_new;
+    if (tail_all < tail) {
+        tail = tail_all;
+        used = self->head - tail;
+    }
+
+    /* move the data not yet consumed by all readers to the same absolute positions within the new buffer */
+    if (used) {
+        offset = tail & (len_new - 1);
+        first = len_new - offset;
+        if (first >= used) {
+            __copy_out(self->buffer, self->buffer_len, tail, buffer_new + offset, used);
+        } else {
+            __copy_out(self->buffer, self->buffer_len, tail, buffer_new + offset, first);
+            __copy_out(self->buffer, self->buffer_len, tail + first, buffer_new, used - first);
+        }
+    }
+
+    free(self->buffer);
+    self->buffer = buffer_new;
+    self->buffer_len = len_new;
+
+    __rebuild_blocks(self);
+    __wakeup(self);
+    pthread_mutex_unlock(&(self->lock));
+
+    return COOLMIC_ERROR_NONE;
+}
+
+size_t              coolmic_tee_get_buffer_size(coolmic_tee_t *self)
+{
+    size_t ret;
+
+    if (!self)
+        return 0;
+
+    pthread_mutex_lock(&(self->lock));
+    ret = self->buffer_len;
+    pthread_mutex_unlock(&(self->lock));
 
     return ret;
 }
@@ -238,20 +816,32 @@ int                 coolmic_tee_attach_iohandle(coolmic_tee_t *self, coolmic_ioh
 {
     if (!self)
         return COOLMIC_ERROR_FAULT;
+    pthread_mutex_lock(&(self->lock));
     if (self->in)
         igloo_ro_unref(self->in);
     /* ignore errors here as handle is allowed to be NULL */
     igloo_ro_ref(self->in = handle);
+    self->eof = 0;
+    __wakeup(self);
+    pthread_mutex_unlock(&(self->lock));
     return COOLMIC_ERROR_NONE;
 }
 
-static int __free_backpointer(void *arg)
+static int __free_reader_iohandle(void *arg)
 {
-    backpointer_t *backpointer = arg;
-
-    igloo_ro_unref(backpointer->parent);
+    reader_t *reader = arg;
+    coolmic_tee_t *self = reader->parent;
+
+    /* the last handle going away detaches the reader so it no longer holds back the others */
+    pthread_mutex_lock(&(self->lock));
+    reader->handles--;
+    if (!reader->handles) {
+        __reader_unpin(self, reader);
+        __reader_detach(self, reader);
+    }
+    pthread_mutex_unlock(&(self->lock));
 
-    free(backpointer);
+    igloo_ro_unref(self);
 
     return 0;
 }
@@ -259,31 +849,221 @@ static int __free_backpointer(void *arg)
 /* This function is to get the IO Handles users can read from */
 coolmic_iohandle_t *coolmic_tee_get_iohandle(coolmic_tee_t *self, ssize_t index)
 {
-    backpointer_t *backpointer;
+    reader_t *reader;
     coolmic_iohandle_t *ret;
+    coolmic_iohandle_format_t format;
+    size_t i;
 
     if (!self)
         return NULL;
-    if (index == -1)
-        index = self->next_reader;
-    if (index < 0 || index >= MAX_READERS)
+
+    pthread_mutex_lock(&(self->lock));
+    if (index == -1) {
+        /* use the first reader without a IO handle. This includes readers no longer in use. */
+        for (i = 0; i < self->readers; i++) {
+            if (!self->reader[i]->handles) {
+                index = i;
+                break;
+            }
+        }
+
+        if (index == -1)
+            index = __reader_new(self);
+    }
+
+    if (index < 0 || (size_t)index >= self->readers) {
+        pthread_mutex_unlock(&(self->lock));
         return NULL;
+    }
+
+    reader = self->reader[index];
 
-    self->next_reader = index + 1;
+    if (igloo_ro_ref(self) != COOLMIC_ERROR_NONE) {
+        pthread_mutex_unlock(&(self->lock));
+        return NULL;
+    }
 
-    backpointer = calloc(1, sizeof(backpointer_t));
-    if (!backpointer)
+    ret = coolmic_iohandle_new(NULL, igloo_RO_NULL, reader, __free_reader_iohandle, __read, __eof);
+    if (!ret) {
+        pthread_mutex_unlock(&(self->lock));
+        igloo_ro_unref(self);
         return NULL;
+    }
+    coolmic_iohandle_set_peek(ret, __peek, __consume);
+    if (self->in && coolmic_iohandle_get_format(self->in, &format) == COOLMIC_ERROR_NONE)
+        coolmic_iohandle_set_format(ret, &format);
 
+    reader->handles++;
+    __reader_attach(self, reader);
+    pthread_mutex_unlock(&(self->lock));
 
-    igloo_ro_ref(self);
-    backpointer->parent = self;
-    backpointer->index = index;
+    return ret;
+}
 
-    ret = coolmic_iohandle_new(NULL, igloo_RO_NULL, backpointer, __free_backpointer, __read, __eof);
+int                 coolmic_tee_detach_reader(coolmic_tee_t *self, size_t index)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
 
-    if (!ret)
-        __free_backpointer(backpointer);
+    pthread_mutex_lock(&(self->lock));
+    if (index >= self->readers) {
+        pthread_mutex_unlock(&(self->lock));
+        return COOLMIC_ERROR_INVAL;
+    }
+
+    __reader_detach(self, self->reader[index]);
+    pthread_mutex_unlock(&(self->lock));
+
+    return COOLMIC_ERROR_NONE;
+}
+
+size_t              coolmic_tee_get_readers(coolmic_tee_t *self)
+{
+    size_t ret;
+
+    if (!self)
+        return 0;
+
+    pthread_mutex_lock(&(self->lock));
+    ret = self->attached;
+    pthread_mutex_unlock(&(self->lock));
 
     return ret;
 }
+
+int                 coolmic_tee_set_concurrent(coolmic_tee_t *self, int concurrent)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    pthread_mutex_lock(&(self->lock));
+    self->concurrent = concurrent ? 1 : 0;
+    __wakeup(self);
+    pthread_mutex_unlock(&(self->lock));
+
+    return COOLMIC_ERROR_NONE;
+}
+
+int                 coolmic_tee_set_reader_blocking(coolmic_tee_t *self, size_t index, int blocking)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    pthread_mutex_lock(&(self->lock));
+    if (index >= self->readers) {
+        pthread_mutex_unlock(&(self->lock));
+        return COOLMIC_ERROR_INVAL;
+    }
+
+    self->reader[index]->nonblocking = blocking ? 0 : 1;
+    __wakeup(self);
+    pthread_mutex_unlock(&(self->lock));
+
+    return COOLMIC_ERROR_NONE;
+}
+
+int                 coolmic_tee_iter(coolmic_tee_t *self)
+{
+    ssize_t ret;
+    size_t len;
+
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    pthread_mutex_lock(&(self->lock));
+    if (!self->concurrent || self->producing) {
+        pthread_mutex_unlock(&(self->lock));
+        return COOLMIC_ERROR_BUSY;
+    }
+
+    if (self->eof) {
+        pthread_mutex_unlock(&(self->lock));
+        return COOLMIC_ERROR_NONE;
+    }
+
+    /* wait for the readers to make room */
+    while (!__space(self) && self->concurrent) {
+        self->producer_waiting++;
+        pthread_cond_wait(&(self->cond_space), &(self->lock));
+        self->producer_waiting--;
+    }
+
+    if (!self->concurrent) {
+        pthread_mutex_unlock(&(self->lock));
+        return COOLMIC_ERROR_BUSY;
+    }
+
+    /* We read at most a quarter of the buffer at once to keep latency low. */
+    len = self->buffer_len / 4;
+    ret = __read_phy(self, len);
+    pthread_mutex_unlock(&(self->lock));
+
+    if (ret < 0)
+        return COOLMIC_ERROR_GENERIC;
+
+    return COOLMIC_ERROR_NONE;
+}
+
+int                 coolmic_tee_set_reader_overflow_policy(coolmic_tee_t *self, size_t index, coolmic_tee_overflow_policy_t policy)
+{
+    reader_t *reader;
+    int held_input;
+
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    if (policy != COOLMIC_TEE_OVERFLOW_BLOCK && policy != COOLMIC_TEE_OVERFLOW_DROP && policy != COOLMIC_TEE_OVERFLOW_DETACH)
+        return COOLMIC_ERROR_INVAL;
+
+    pthread_mutex_lock(&(self->lock));
+    if (index >= self->readers) {
+        pthread_mutex_unlock(&(self->lock));
+        return COOLMIC_ERROR_INVAL;
+    }
+
+    reader = self->reader[index];
+
+    /* resolve any pending overflow before the reader starts holding back the input again */
+    __reader_check_overflow(self, reader);
+
+    held_input = __reader_holds_input(reader);
+    reader->policy = policy;
+    __reader_update(self, reader, held_input);
+
+    __wakeup(self);
+    pthread_mutex_unlock(&(self->lock));
+
+    return COOLMIC_ERROR_NONE;
+}
+
+int                 coolmic_tee_get_reader_dropped(coolmic_tee_t *self, size_t index, uint64_t *dropped)
+{
+    if (!self || !dropped)
+        return COOLMIC_ERROR_FAULT;
+
+    pthread_mutex_lock(&(self->lock));
+    if (index >= self->readers) {
+        pthread_mutex_unlock(&(self->lock));
+        return COOLMIC_ERROR_INVAL;
+    }
+
+    *dropped = self->reader[index]->dropped;
+    pthread_mutex_unlock(&(self->lock));
+
+    return COOLMIC_ERROR_NONE;
+}
+
+int                 coolmic_tee_set_frame_size(coolmic_tee_t *self, size_t frame_size)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    if (!frame_size)
+        return COOLMIC_ERROR_INVAL;
+
+    pthread_mutex_lock(&(self->lock));
+    self->frame_size = frame_size;
+    pthread_mutex_unlock(&(self->lock));
+
+    return COOLMIC_ERROR_NONE;
+}
@@ -0,0 +1,365 @@
+/*
+ *      Copyright (C) Jordan Erickson                     - 2014-2020,
+ *      Copyright (C) Löwenfelsen UG (haftungsbeschränkt) - 2015-2020
+ *       on behalf of Jordan Erickson.
+ */
+
+/*
+ * This file is part of Cool Mic.
+ * 
+ * Cool Mic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Cool Mic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Cool Mic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This stress tests the engine with many tasks and many coolmic_simple_t instances on one engine
+ * and reports the number of threads and the CPU time used, compared to one thread per instance.
+ * The instances stream to an Icecast server, by default on localhost:8000 with the default password.
+ * If no server can be reached the tests of the instances are skipped.
+ * Build with: make test-engine
+ * Usage: test-engine [host [port [password [instances]]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <igloo/timing.h>
+#include "engine_private.h"
+#include <coolmic-dsp/simple.h>
+#include <coolmic-dsp/iohandle.h>
+#include <coolmic-dsp/coolmic-dsp.h>
+
+/* number of worker threads of the engine */
+#define THREADS         4
+/* number of raw tasks and how often each runs */
+#define TASKS           1000
+#define TASK_RUNS       30
+/* the instances get this long to connect, then they are measured for MEASURE seconds */
+#define SETTLE          2
+#define MEASURE         5
+
+#define RATE            48000
+#define CHANNELS        2
+
+/* The number of threads of this process or -1 if unknown */
+static long int __threads(void)
+{
+    char line[128];
+    long int ret = -1;
+    FILE *file;
+
+    if ((file = fopen("/proc/self/status", "r")) == NULL)
+        return -1;
+
+    while (fgets(line, sizeof(line), file))
+        if (strncmp(line, "Threads:", 8) == 0)
+            ret = atol(line + 8);
+
+    fclose(file);
+    return ret;
+}
+
+/* The CPU time used by this process in [s] */
+static double __cpu_time(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/* Whether a server accepts connections at host and port */
+static int __server_reachable(const char *host, int port)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *cur;
+    char service[16];
+    int reachable = 0;
+    int fd;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%i", port);
+
+    if (getaddrinfo(host, service, &hints, &res) != 0)
+        return 0;
+
+    for (cur = res; cur && !reachable; cur = cur->ai_next) {
+        if ((fd = socket(cur->ai_family, cur->ai_socktype, cur->ai_protocol)) < 0)
+            continue;
+        reachable = connect(fd, cur->ai_addr, cur->ai_addrlen) == 0;
+        close(fd);
+    }
+
+    freeaddrinfo(res);
+    return reachable;
+}
+
+/* A task runs TASK_RUNS times. It alternates between running again right away,
+ * after a delay, and when a file descriptor is readable.
+ */
+typedef struct {
+    coolmic_engine_task_t *task;
+    int fd;
+    unsigned int runs;
+    unsigned int concurrent;
+} task_t;
+
+static int __task_cb(void *userdata, int *fd)
+{
+    task_t *task = userdata;
+    unsigned int run;
+
+    /* the engine must never run a task on two workers at the same time */
+    if (__atomic_fetch_add(&(task->concurrent), 1, __ATOMIC_SEQ_CST) != 0)
+        return COOLMIC_ENGINE_TASK_DONE;
+
+    run = ++task->runs;
+
+    __atomic_fetch_sub(&(task->concurrent), 1, __ATOMIC_SEQ_CST);
+
+    if (run >= TASK_RUNS)
+        return COOLMIC_ENGINE_TASK_DONE;
+
+    switch (run % 3) {
+        case 0:
+            return 0;
+        case 1:
+            return 1;
+        default:
+            *fd = task->fd;
+            return COOLMIC_ENGINE_TASK_SLEEP;
+    }
+}
+
+static int test_tasks(coolmic_engine_t *engine)
+{
+    static task_t tasks[TASKS];
+    int fds[2];
+    double cpu;
+    long int threads;
+    size_t i;
+    int ret = 0;
+
+    /* the pipe is always readable */
+    if (pipe(fds) != 0 || write(fds[1], "x", 1) != 1)
+        return -1;
+
+    cpu = __cpu_time();
+    for (i = 0; i < TASKS; i++) {
+        tasks[i].fd = fds[0];
+        tasks[i].runs = 0;
+        tasks[i].concurrent = 0;
+        if ((tasks[i].task = coolmic_engine_task_new(engine, __task_cb, &(tasks[i]))) == NULL) {
+            fprintf(stderr, "FAIL: can not create task %zu\n", i);
+            ret = -1;
+            break;
+        }
+        coolmic_engine_task_wake(tasks[i].task);
+    }
+    threads = __threads();
+
+    while (i--) {
+        coolmic_engine_task_join(tasks[i].task);
+        if (tasks[i].runs != TASK_RUNS) {
+            fprintf(stderr, "FAIL: task %zu ran %u times, expected %u\n", i, tasks[i].runs, (unsigned int)TASK_RUNS);
+            ret = -1;
+        }
+        coolmic_engine_task_free(tasks[i].task);
+    }
+    cpu = __cpu_time() - cpu;
+
+    if (coolmic_engine_get_tasks(engine) != 0) {
+        fprintf(stderr, "FAIL: %zi tasks left after all tasks were freed\n", coolmic_engine_get_tasks(engine));
+        ret = -1;
+    }
+
+    printf("tasks:  %u tasks with %u runs each: %ld threads, %.2f s CPU\n", (unsigned int)TASKS, (unsigned int)TASK_RUNS, threads, cpu);
+
+    close(fds[0]);
+    close(fds[1]);
+
+    return ret;
+}
+
+/* An instance is fed by a source producing silence in real time. The source does not block. */
+typedef struct {
+    coolmic_simple_t *simple;
+    uint64_t start;
+    uint64_t produced;
+    int connected;
+} instance_t;
+
+static pthread_mutex_t instances_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ssize_t __source_read(void *userdata, void *buffer, size_t len)
+{
+    instance_t *instance = userdata;
+    uint64_t due = (igloo_timing_get_time() - instance->start) * (RATE / 1000) * CHANNELS * 2;
+
+    if (len > (due - instance->produced))
+        len = due - instance->produced;
+    len -= len % (CHANNELS * 2);
+
+    memset(buffer, 0, len);
+    instance->produced += len;
+
+    return len;
+}
+
+static int __callback(coolmic_simple_t *inst, void *userdata, coolmic_simple_event_t event, void *thread, void *arg0, void *arg1)
+{
+    instance_t *instance = userdata;
+
+    (void)inst;
+    (void)thread;
+    (void)arg1;
+
+    if (event != COOLMIC_SIMPLE_EVENT_STREAMSTATE)
+        return 0;
+
+    pthread_mutex_lock(&instances_lock);
+    instance->connected = *(const coolmic_simple_connectionstate_t*)arg0 == COOLMIC_SIMPLE_CS_CONNECTED;
+    pthread_mutex_unlock(&instances_lock);
+
+    return 0;
+}
+
+static int __instance_start(instance_t *instance, size_t index, coolmic_engine_t *engine, const coolmic_shout_config_t *conf)
+{
+    coolmic_shout_config_t instance_conf = *conf;
+    char mount[64];
+    coolmic_iohandle_t *handle;
+    coolmic_simple_segment_t *segment;
+    int ret;
+
+    snprintf(mount, sizeof(mount), "/test-engine-%zu.ogg", index);
+    instance_conf.mount = mount;
+
+    instance->start = igloo_timing_get_time();
+    instance->produced = 0;
+    instance->connected = 0;
+
+    if ((instance->simple = coolmic_simple_new(NULL, igloo_RO_NULL, COOLMIC_DSP_CODEC_OPUS, RATE, CHANNELS, -1, &instance_conf)) == NULL)
+        return -1;
+
+    coolmic_simple_set_callback(instance->simple, __callback, instance);
+    if (engine && coolmic_simple_set_engine(instance->simple, engine) != COOLMIC_ERROR_NONE)
+        return -1;
+
+    handle = coolmic_iohandle_new(NULL, igloo_RO_NULL, instance, NULL, __source_read, NULL);
+    segment = coolmic_simple_segment_new(NULL, igloo_RO_NULL, COOLMIC_SIMPLE_SP_LIVE, NULL, NULL, handle);
+    igloo_ro_unref(handle);
+    ret = coolmic_simple_queue_segment(instance->simple, segment);
+    igloo_ro_unref(segment);
+    if (ret != COOLMIC_ERROR_NONE)
+        return -1;
+
+    return coolmic_simple_start(instance->simple);
+}
+
+/* Streams with the given number of instances, on the engine if not NULL or with threads of their own otherwise. */
+static int test_simple(coolmic_engine_t *engine, size_t count, const coolmic_shout_config_t *conf)
+{
+    instance_t *instances = calloc(count, sizeof(*instances));
+    size_t connected = 0;
+    long int threads;
+    double cpu;
+    size_t i;
+    int ret = 0;
+
+    if (!instances)
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        if (__instance_start(&(instances[i]), i, engine, conf) != COOLMIC_ERROR_NONE) {
+            fprintf(stderr, "FAIL: can not start instance %zu\n", i);
+            ret = -1;
+            break;
+        }
+    }
+
+    sleep(SETTLE);
+    cpu = __cpu_time();
+    sleep(MEASURE);
+    cpu = __cpu_time() - cpu;
+    threads = __threads();
+
+    pthread_mutex_lock(&instances_lock);
+    for (i = 0; i < count; i++)
+        connected += instances[i].connected;
+    pthread_mutex_unlock(&instances_lock);
+
+    for (i = 0; i < count; i++) {
+        if (!instances[i].simple)
+            break;
+        coolmic_simple_stop(instances[i].simple);
+        igloo_ro_unref(instances[i].simple);
+    }
+    free(instances);
+
+    if (engine && coolmic_engine_get_tasks(engine) != 0) {
+        fprintf(stderr, "FAIL: %zi tasks left after all instances were stopped\n", coolmic_engine_get_tasks(engine));
+        ret = -1;
+    }
+
+    printf("%s: %zu instances, %zu connected: %ld threads, %.2f s CPU per %u s\n", engine ? "engine" : "thread", count, connected, threads, cpu, (unsigned int)MEASURE);
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    coolmic_shout_config_t conf;
+    coolmic_engine_t *engine;
+    size_t count = 200;
+    int ret = EXIT_SUCCESS;
+
+    memset(&conf, 0, sizeof(conf));
+    conf.hostname = argc > 1 ? argv[1] : "localhost";
+    conf.port = argc > 2 ? atoi(argv[2]) : 8000;
+    conf.username = "source";
+    conf.password = argc > 3 ? argv[3] : "hackme";
+    if (argc > 4)
+        count = strtoul(argv[4], NULL, 10);
+
+    if ((engine = coolmic_engine_new(NULL, igloo_RO_NULL, THREADS)) == NULL) {
+        fprintf(stderr, "FAIL: can not create engine\n");
+        return EXIT_FAILURE;
+    }
+
+    if (test_tasks(engine) != 0)
+        ret = EXIT_FAILURE;
+
+    if (!__server_reachable(conf.hostname, conf.port)) {
+        printf("simple: no server at %s:%i, skipped\n", conf.hostname, conf.port);
+    } else {
+        if (test_simple(NULL, count, &conf) != 0)
+            ret = EXIT_FAILURE;
+
+        if (test_simple(engine, count, &conf) != 0)
+            ret = EXIT_FAILURE;
+    }
+
+    igloo_ro_unref(engine);
+
+    return ret;
+}
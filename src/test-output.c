@@ -0,0 +1,489 @@
+/*
+ *      Copyright (C) Jordan Erickson                     - 2014-2020,
+ *      Copyright (C) Löwenfelsen UG (haftungsbeschränkt) - 2015-2020
+ *       on behalf of Jordan Erickson.
+ */
+
+/*
+ * This file is part of Cool Mic.
+ * 
+ * Cool Mic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Cool Mic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Cool Mic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This tests reconnecting after a lost connection:
+ * An additional output reconnects and starts over with a new stream while the main connection keeps running.
+ * The main connection reconnects by it's reconnection profile while the output keeps running.
+ * Stopping does not wait for the delay before the next reconnect.
+ * The server is a stub on the loopback interface that accepts any request and closes connections to one mount point.
+ * All tests are run with threads of their own and with an engine.
+ * Build with: make test-output
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <igloo/timing.h>
+#include <coolmic-dsp/engine.h>
+#include <coolmic-dsp/simple.h>
+#include <coolmic-dsp/iohandle.h>
+#include <coolmic-dsp/coolmic-dsp.h>
+
+#define RATE            48000
+#define CHANNELS        2
+
+/* connections are closed after this many bytes of the stream */
+#define DROP_AFTER      4096
+/* time in [ms] to reconnect and send the start of the new stream */
+#define TIMEOUT         10000
+/* time in [ms] coolmic_simple_stop() may take while waiting to reconnect, much less than the delay of "exponential" */
+#define STOP_TIMEOUT    500
+
+#define MAX_CONNECTIONS 16
+
+/* A connection to the stub server */
+typedef struct {
+    int fd;
+    /* the request, until the empty line ending it was read */
+    char request[2048];
+    size_t request_len;
+    int streaming;
+    /* set for connections to the mount point whose connections are closed */
+    int dropping;
+    /* the stream as far as it is needed to check the start of it */
+    unsigned char head[6];
+    size_t bytes;
+} connection_t;
+
+typedef struct {
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int stop;
+    connection_t connections[MAX_CONNECTIONS];
+    size_t connections_len;
+    /* the mount point whose first drops connections are closed, and the number of connections closed so far */
+    const char *drop;
+    unsigned int drops;
+    unsigned int dropped;
+} server_t;
+
+/* whether the stream of the connection starts with the first page of an Ogg stream */
+static int __starts_stream(const connection_t *connection)
+{
+    return memcmp(connection->head, "OggS", 4) == 0 && (connection->head[5] & 0x02);
+}
+
+/* whether the request line is for the given mount point */
+static int __is_mount(const char *request, const char *mount)
+{
+    const char *path = strchr(request, ' ');
+    size_t len = strlen(mount);
+
+    return path && strncmp(path + 1, mount, len) == 0 && path[len + 1] == ' ';
+}
+
+/* reads from a connection, must be called locked */
+static void __connection_read(server_t *server, connection_t *connection)
+{
+    static const char response[] = "HTTP/1.0 200 OK\r\n\r\n";
+    unsigned char buffer[4096];
+    size_t offset = 0;
+    size_t len;
+    ssize_t ret;
+
+    ret = read(connection->fd, buffer, sizeof(buffer));
+    if (ret < 1) {
+        close(connection->fd);
+        connection->fd = -1;
+        return;
+    }
+    len = ret;
+
+    if (!connection->streaming) {
+        /* the request is copied byte by byte, so the stream following the empty line is not touched */
+        while (!connection->streaming && offset < len && connection->request_len < (sizeof(connection->request) - 1)) {
+            connection->request[connection->request_len++] = buffer[offset++];
+            connection->request[connection->request_len] = 0;
+            connection->streaming = strstr(connection->request, "\r\n\r\n") != NULL;
+        }
+        if (!connection->streaming)
+            return;
+
+        /* keep the request line only */
+        *strstr(connection->request, "\r\n") = 0;
+        connection->dropping = __is_mount(connection->request, server->drop);
+        if (write(connection->fd, response, sizeof(response) - 1) != (ssize_t)(sizeof(response) - 1)) {
+            close(connection->fd);
+            connection->fd = -1;
+            return;
+        }
+    }
+
+    for (; offset < len; offset++) {
+        if (connection->bytes < sizeof(connection->head))
+            connection->head[connection->bytes] = buffer[offset];
+        connection->bytes++;
+    }
+
+    if (connection->dropping && connection->bytes >= DROP_AFTER && server->dropped < server->drops) {
+        close(connection->fd);
+        connection->fd = -1;
+        server->dropped++;
+    }
+}
+
+static void *__server_run(void *userdata)
+{
+    server_t *server = userdata;
+    struct pollfd fds[MAX_CONNECTIONS + 1];
+    connection_t *map[MAX_CONNECTIONS + 1];
+    connection_t *connection;
+    size_t count;
+    size_t i;
+    int fd;
+
+    pthread_mutex_lock(&(server->lock));
+    while (!server->stop) {
+        fds[0].fd = server->fd;
+        fds[0].events = POLLIN;
+        count = 1;
+        for (i = 0; i < server->connections_len; i++) {
+            if (server->connections[i].fd < 0)
+                continue;
+            fds[count].fd = server->connections[i].fd;
+            fds[count].events = POLLIN;
+            map[count] = &(server->connections[i]);
+            count++;
+        }
+        pthread_mutex_unlock(&(server->lock));
+
+        poll(fds, count, 100);
+
+        pthread_mutex_lock(&(server->lock));
+        if (fds[0].revents & POLLIN) {
+            if ((fd = accept(server->fd, NULL, NULL)) >= 0) {
+                if (server->connections_len == MAX_CONNECTIONS) {
+                    close(fd);
+                } else {
+                    connection = &(server->connections[server->connections_len++]);
+                    memset(connection, 0, sizeof(*connection));
+                    connection->fd = fd;
+                }
+            }
+        }
+        for (i = 1; i < count; i++)
+            if (fds[i].revents & (POLLIN|POLLERR|POLLHUP))
+                __connection_read(server, map[i]);
+    }
+    pthread_mutex_unlock(&(server->lock));
+
+    return NULL;
+}
+
+/* starts the stub server on a free port of the loopback interface and returns the port or -1 */
+static int __server_start(server_t *server, const char *drop, unsigned int drops)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+
+    memset(server, 0, sizeof(*server));
+    pthread_mutex_init(&(server->lock), NULL);
+    server->drop = drop;
+    server->drops = drops;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    if ((server->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (bind(server->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(server->fd, MAX_CONNECTIONS) != 0 ||
+        getsockname(server->fd, (struct sockaddr*)&addr, &addr_len) != 0 ||
+        pthread_create(&(server->thread), NULL, __server_run, server) != 0) {
+        close(server->fd);
+        return -1;
+    }
+
+    return ntohs(addr.sin_port);
+}
+
+static void __server_stop(server_t *server)
+{
+    size_t i;
+
+    pthread_mutex_lock(&(server->lock));
+    server->stop = 1;
+    pthread_mutex_unlock(&(server->lock));
+    pthread_join(server->thread, NULL);
+
+    for (i = 0; i < server->connections_len; i++)
+        if (server->connections[i].fd >= 0)
+            close(server->connections[i].fd);
+    close(server->fd);
+    pthread_mutex_destroy(&(server->lock));
+}
+
+/* The source produces silence in real time. */
+typedef struct {
+    uint64_t start;
+    uint64_t produced;
+} source_t;
+
+static ssize_t __source_read(void *userdata, void *buffer, size_t len)
+{
+    source_t *source = userdata;
+    uint64_t due = (igloo_timing_get_time() - source->start) * (RATE / 1000) * CHANNELS * 2;
+
+    if (len > (due - source->produced))
+        len = due - source->produced;
+    len -= len % (CHANNELS * 2);
+
+    memset(buffer, 0, len);
+    source->produced += len;
+
+    return len;
+}
+
+/* starts streaming to /main and an additional output to /output of the stub server */
+static coolmic_simple_t *__simple_start(coolmic_engine_t *engine, int port, const char *profile, source_t *source)
+{
+    coolmic_shout_config_t conf;
+    coolmic_simple_t *simple;
+    coolmic_iohandle_t *handle;
+    coolmic_simple_segment_t *segment;
+    int ret;
+
+    memset(&conf, 0, sizeof(conf));
+    conf.hostname = "127.0.0.1";
+    conf.port = port;
+    conf.mount = "/main";
+    conf.username = "source";
+    conf.password = "hackme";
+
+    source->start = igloo_timing_get_time();
+    source->produced = 0;
+
+    if ((simple = coolmic_simple_new(NULL, igloo_RO_NULL, COOLMIC_DSP_CODEC_OPUS, RATE, CHANNELS, -1, &conf)) == NULL)
+        return NULL;
+
+    do {
+        if (engine && coolmic_simple_set_engine(simple, engine) != COOLMIC_ERROR_NONE)
+            break;
+        if (profile && coolmic_simple_set_reconnection_profile(simple, profile) != COOLMIC_ERROR_NONE)
+            break;
+        conf.mount = "/output";
+        if (coolmic_simple_add_output(simple, COOLMIC_DSP_CODEC_OPUS, 0.5, 0, &conf) < 1)
+            break;
+
+        handle = coolmic_iohandle_new(NULL, igloo_RO_NULL, source, NULL, __source_read, NULL);
+        segment = coolmic_simple_segment_new(NULL, igloo_RO_NULL, COOLMIC_SIMPLE_SP_LIVE, NULL, NULL, handle);
+        igloo_ro_unref(handle);
+        ret = coolmic_simple_queue_segment(simple, segment);
+        igloo_ro_unref(segment);
+        if (ret != COOLMIC_ERROR_NONE || coolmic_simple_start(simple) != COOLMIC_ERROR_NONE)
+            break;
+
+        return simple;
+    } while (0);
+
+    igloo_ro_unref(simple);
+    return NULL;
+}
+
+/* checks the connections, returns 1 once all connections were dropped and reconnected, 0 to wait, or -1 on failure */
+static int __check(server_t *server)
+{
+    const connection_t *last = NULL;
+    size_t dropping_connections = 0;
+    size_t other_connections = 0;
+    size_t i;
+    int ret = 0;
+
+    for (i = 0; i < server->connections_len; i++) {
+        if (!server->connections[i].streaming)
+            continue;
+        if (server->connections[i].dropping) {
+            last = &(server->connections[i]);
+            dropping_connections++;
+        } else {
+            other_connections++;
+        }
+        if (server->connections[i].bytes >= sizeof(server->connections[i].head) && !__starts_stream(&(server->connections[i]))) {
+            fprintf(stderr, "FAIL: connection %zu to %s does not start with a new stream\n", i, server->connections[i].request);
+            ret = -1;
+        }
+    }
+
+    if (other_connections > 1) {
+        fprintf(stderr, "FAIL: a connection to a mount point other than %s was restarted\n", server->drop);
+        ret = -1;
+    }
+
+    /* done once the stream of the last connection was checked */
+    if (ret == 0 && dropping_connections > server->drops && last->bytes >= sizeof(last->head))
+        ret = 1;
+
+    return ret;
+}
+
+/* closes the first drops connections to the mount point drop and waits for reconnects */
+static int test_reconnect(coolmic_engine_t *engine, const char *drop, unsigned int drops, const char *profile)
+{
+    coolmic_simple_t *simple;
+    source_t source;
+    server_t server;
+    uint64_t end;
+    int port;
+    int ret = 0;
+
+    if ((port = __server_start(&server, drop, drops)) < 0) {
+        fprintf(stderr, "FAIL: can not start stub server\n");
+        return -1;
+    }
+
+    if ((simple = __simple_start(engine, port, profile, &source)) == NULL) {
+        fprintf(stderr, "FAIL: can not start streaming\n");
+        ret = -1;
+    }
+
+    end = igloo_timing_get_time() + TIMEOUT;
+    while (ret == 0 && igloo_timing_get_time() < end) {
+        igloo_timing_sleep(100);
+        pthread_mutex_lock(&(server.lock));
+        ret = __check(&server);
+        pthread_mutex_unlock(&(server.lock));
+    }
+    if (ret == 0)
+        fprintf(stderr, "FAIL: %s did not reconnect %u times within %u ms\n", drop, drops, (unsigned int)TIMEOUT);
+    ret = ret == 1 ? 0 : -1;
+
+    if (simple) {
+        coolmic_simple_stop(simple);
+        igloo_ro_unref(simple);
+    }
+    __server_stop(&server);
+
+    printf("%s: reconnect %s %u times: %s\n", engine ? "engine" : "thread", drop, drops, ret == 0 ? "ok" : "failed");
+
+    return ret;
+}
+
+/* sets the flag passed as userdata once a reconnect is scheduled */
+static int __reconnect_callback(coolmic_simple_t *inst, void *userdata, coolmic_simple_event_t event, void *thread, void *arg0, void *arg1)
+{
+    (void)inst;
+    (void)thread;
+    (void)arg0;
+    (void)arg1;
+
+    if (event == COOLMIC_SIMPLE_EVENT_RECONNECT)
+        __atomic_store_n((int*)userdata, 1, __ATOMIC_SEQ_CST);
+
+    return 0;
+}
+
+/* stops while the main connection waits to reconnect */
+static int test_stop(coolmic_engine_t *engine)
+{
+    coolmic_simple_t *simple;
+    source_t source;
+    server_t server;
+    uint64_t end;
+    uint64_t duration = 0;
+    int waiting = 0;
+    int port;
+    int ret = -1;
+
+    if ((port = __server_start(&server, "/main", 1)) < 0) {
+        fprintf(stderr, "FAIL: can not start stub server\n");
+        return -1;
+    }
+
+    if ((simple = __simple_start(engine, port, "exponential", &source)) == NULL) {
+        fprintf(stderr, "FAIL: can not start streaming\n");
+    } else {
+        coolmic_simple_set_callback(simple, __reconnect_callback, &waiting);
+
+        end = igloo_timing_get_time() + TIMEOUT;
+        while (!__atomic_load_n(&waiting, __ATOMIC_SEQ_CST) && igloo_timing_get_time() < end)
+            igloo_timing_sleep(10);
+
+        duration = igloo_timing_get_time();
+        coolmic_simple_stop(simple);
+        duration = igloo_timing_get_time() - duration;
+        igloo_ro_unref(simple);
+
+        if (!waiting) {
+            fprintf(stderr, "FAIL: no reconnect was scheduled within %u ms\n", (unsigned int)TIMEOUT);
+        } else if (duration > STOP_TIMEOUT) {
+            fprintf(stderr, "FAIL: stopping took %llu ms\n", (long long unsigned int)duration);
+        } else {
+            ret = 0;
+        }
+    }
+    __server_stop(&server);
+
+    printf("%s: stop while waiting to reconnect: %s (%llu ms)\n", engine ? "engine" : "thread", ret == 0 ? "ok" : "failed", (long long unsigned int)duration);
+
+    return ret;
+}
+
+static int test_all(coolmic_engine_t *engine)
+{
+    int ret = 0;
+
+    if (test_reconnect(engine, "/output", 1, NULL) != 0)
+        ret = -1;
+    /* the first reconnect is done right away, the second one after up to a second */
+    if (test_reconnect(engine, "/main", 2, "immediate") != 0)
+        ret = -1;
+    if (test_stop(engine) != 0)
+        ret = -1;
+
+    return ret;
+}
+
+int main(void)
+{
+    coolmic_engine_t *engine;
+    int ret = EXIT_SUCCESS;
+
+    /* the server closes connections while they are written to */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (test_all(NULL) != 0)
+        ret = EXIT_FAILURE;
+
+    if ((engine = coolmic_engine_new(NULL, igloo_RO_NULL, 2)) == NULL) {
+        fprintf(stderr, "FAIL: can not create engine\n");
+        return EXIT_FAILURE;
+    }
+
+    if (test_all(engine) != 0)
+        ret = EXIT_FAILURE;
+
+    igloo_ro_unref(engine);
+
+    return ret;
+}
@@ -0,0 +1,154 @@
+/*
+ *      Copyright (C) Jordan Erickson                     - 2014-2020,
+ *      Copyright (C) Löwenfelsen UG (haftungsbeschränkt) - 2015-2020
+ *       on behalf of Jordan Erickson.
+ */
+
+/*
+ * This file is part of Cool Mic.
+ * 
+ * Cool Mic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Cool Mic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Cool Mic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This tests the sample rate converter between all common rates.
+ * A tone in the pass band must pass, a tone above the output's Nyquist frequency must not alias.
+ * Build with: make test-resample
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <coolmic-dsp/resample.h>
+#include <coolmic-dsp/iohandle.h>
+#include <coolmic-dsp/coolmic-dsp.h>
+
+/* length of the test signal in [s] */
+#define SECONDS         0.5
+/* the start of the output is not measured as the filter needs to settle */
+#define SETTLE          0.05
+/* amplitude of the test tones */
+#define AMPLITUDE       16384.
+
+/* minimum attenuation of a tone above the output's Nyquist frequency in [dB] */
+#define MIN_STOP_BAND   50.
+/* maximum deviation of a tone in the pass band in [dB] */
+#define MAX_PASS_BAND   0.5
+
+static const uint_least32_t rates[] = {8000, 11025, 16000, 22050, 32000, 44100, 48000, 88200, 96000, 176400, 192000};
+
+typedef struct {
+    uint_least32_t rate;
+    double frequency;
+    size_t frame;
+    size_t frames;
+} source_t;
+
+static ssize_t __source_read(void *userdata, void *buffer, size_t len)
+{
+    source_t *source = userdata;
+    int16_t *out = buffer;
+    size_t frames = len / 2;
+    size_t i;
+
+    if (frames > (source->frames - source->frame))
+        frames = source->frames - source->frame;
+
+    for (i = 0; i < frames; i++, source->frame++)
+        out[i] = lrint(AMPLITUDE * sin(2. * M_PI * source->frequency * source->frame / source->rate));
+
+    return frames * 2;
+}
+
+/* Resamples a tone and returns the level of the output relative to the input in [dB].
+ * Returns NAN if the number of output frames is wrong.
+ */
+static double __run(uint_least32_t rate_in, uint_least32_t rate_out, coolmic_resample_quality_t quality, double frequency)
+{
+    int16_t buffer[1024];
+    source_t source = {.rate = rate_in, .frequency = frequency, .frame = 0, .frames = SECONDS * rate_in};
+    const size_t expected = (size_t)(SECONDS * rate_out);
+    const size_t settle = SETTLE * rate_out;
+    coolmic_resample_t *resample;
+    coolmic_iohandle_t *handle;
+    size_t frames = 0;
+    double power = 0.;
+    ssize_t ret;
+    size_t i;
+
+    if ((resample = coolmic_resample_new(NULL, igloo_RO_NULL, rate_in, rate_out, 1, quality)) == NULL)
+        return NAN;
+
+    handle = coolmic_iohandle_new(NULL, igloo_RO_NULL, &source, NULL, __source_read, NULL);
+    coolmic_resample_attach_iohandle(resample, handle);
+    igloo_ro_unref(handle);
+
+    handle = coolmic_resample_get_iohandle(resample);
+    while ((ret = coolmic_iohandle_read_frames(handle, buffer, sizeof(buffer)/sizeof(*buffer))) > 0) {
+        for (i = 0; i < (size_t)ret; i++, frames++)
+            if (frames >= settle && frames < (expected - settle))
+                power += (double)buffer[i] * (double)buffer[i];
+    }
+
+    igloo_ro_unref(handle);
+    igloo_ro_unref(resample);
+
+    /* the filter delays the output by half it's length */
+    if (frames > expected || (frames + (expected / 10)) < expected)
+        return NAN;
+
+    power /= expected - 2 * settle;
+
+    return 10. * log10(fmax(power, 1e-3) / (AMPLITUDE * AMPLITUDE / 2.));
+}
+
+int main(void)
+{
+    static const char *quality_name[] = {"low", "medium", "high"};
+    coolmic_resample_quality_t quality;
+    uint_least32_t rate_in, rate_out;
+    double level;
+    size_t i, o;
+    int ret = EXIT_SUCCESS;
+
+    for (quality = COOLMIC_RESAMPLE_QUALITY_LOW; quality <= COOLMIC_RESAMPLE_QUALITY_HIGH; quality++) {
+        for (i = 0; i < (sizeof(rates)/sizeof(*rates)); i++) {
+            for (o = 0; o < (sizeof(rates)/sizeof(*rates)); o++) {
+                rate_in = rates[i];
+                rate_out = rates[o];
+                if (rate_in == rate_out)
+                    continue;
+
+                level = __run(rate_in, rate_out, quality, 0.1 * (rate_in < rate_out ? rate_in : rate_out));
+                if (!(fabs(level) <= MAX_PASS_BAND)) {
+                    fprintf(stderr, "FAIL: %s quality, %lu to %lu Hz: pass band tone at %.1f dB\n", quality_name[quality], (unsigned long int)rate_in, (unsigned long int)rate_out, level);
+                    ret = EXIT_FAILURE;
+                }
+
+                /* only decimation can alias, the tone must also be representable at the input rate */
+                if ((0.6 * rate_out) > (0.45 * rate_in))
+                    continue;
+
+                level = __run(rate_in, rate_out, quality, 0.6 * rate_out);
+                if (!(level <= -MIN_STOP_BAND)) {
+                    fprintf(stderr, "FAIL: %s quality, %lu to %lu Hz: tone above Nyquist aliased at %.1f dB\n", quality_name[quality], (unsigned long int)rate_in, (unsigned long int)rate_out, level);
+                    ret = EXIT_FAILURE;
+                }
+            }
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,187 @@
+/*
+ *      Copyright (C) Jordan Erickson                     - 2014-2020,
+ *      Copyright (C) Löwenfelsen UG (haftungsbeschränkt) - 2015-2020
+ *       on behalf of Jordan Erickson.
+ */
+
+/*
+ * This file is part of Cool Mic.
+ * 
+ * Cool Mic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Cool Mic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Cool Mic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This tests the buffer management of the tee module with readers that do not hold back the input.
+ * Build with: make test-tee
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <coolmic-dsp/tee.h>
+#include <coolmic-dsp/iohandle.h>
+#include <coolmic-dsp/coolmic-dsp.h>
+
+#define BUFFER_LEN  64
+
+/* The input returns a counting byte pattern. It returns no more than source_allow bytes in total. */
+static size_t source_allow;
+static unsigned char source_next;
+
+static ssize_t __source_read(void *userdata, void *buffer, size_t len)
+{
+    unsigned char *out = buffer;
+    size_t i;
+
+    (void)userdata;
+
+    if (len > source_allow)
+        len = source_allow;
+    source_allow -= len;
+
+    for (i = 0; i < len; i++)
+        out[i] = source_next++;
+
+    return len;
+}
+
+/* checks that data holds the pattern starting at first */
+static int __check_pattern(const unsigned char *data, size_t len, unsigned char first)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        if (data[i] != (unsigned char)(first + i))
+            return -1;
+
+    return 0;
+}
+
+static int __read_all(coolmic_iohandle_t *handle, size_t len)
+{
+    unsigned char buffer[BUFFER_LEN];
+
+    return coolmic_iohandle_read(handle, buffer, len) == (ssize_t)len ? 0 : -1;
+}
+
+/* Sets up a tee with a blocking reader 0 at the head and a dropping, non-blocking reader 1
+ * exactly one buffer behind it at a position not aligned to the internal blocks.
+ */
+static coolmic_tee_t *__setup(coolmic_iohandle_t **fast, coolmic_iohandle_t **slow)
+{
+    coolmic_iohandle_t *source;
+    coolmic_tee_t *tee;
+
+    source_next = 0;
+
+    if ((tee = coolmic_tee_new(NULL, igloo_RO_NULL, 2)) == NULL)
+        return NULL;
+    source = coolmic_iohandle_new(NULL, igloo_RO_NULL, NULL, NULL, __source_read, NULL);
+    coolmic_tee_attach_iohandle(tee, source);
+    igloo_ro_unref(source);
+
+    if (coolmic_tee_set_buffer_size(tee, BUFFER_LEN) != COOLMIC_ERROR_NONE ||
+        coolmic_tee_set_reader_overflow_policy(tee, 1, COOLMIC_TEE_OVERFLOW_DROP) != COOLMIC_ERROR_NONE ||
+        coolmic_tee_set_reader_blocking(tee, 1, 0) != COOLMIC_ERROR_NONE) {
+        igloo_ro_unref(tee);
+        return NULL;
+    }
+
+    *fast = coolmic_tee_get_iohandle(tee, 0);
+    *slow = coolmic_tee_get_iohandle(tee, 1);
+
+    /* fill the buffer, move reader 1 off the block boundary, then add 2 more bytes */
+    source_allow = BUFFER_LEN;
+    if (__read_all(*fast, 2) != 0 || __read_all(*slow, 2) != 0 || __read_all(*fast, BUFFER_LEN - 2) != 0)
+        return tee;
+    source_allow = 2;
+    __read_all(*fast, 2);
+
+    /* from now on the input would overwrite anything it is allowed to */
+    source_allow = BUFFER_LEN;
+
+    return tee;
+}
+
+static void __teardown(coolmic_tee_t *tee, coolmic_iohandle_t *fast, coolmic_iohandle_t *slow)
+{
+    igloo_ro_unref(fast);
+    igloo_ro_unref(slow);
+    igloo_ro_unref(tee);
+}
+
+/* A dropping reader one buffer behind switches to blocking, it must keep all of it's data. */
+static int test_policy_switch(void)
+{
+    unsigned char buffer[BUFFER_LEN];
+    coolmic_iohandle_t *fast = NULL;
+    coolmic_iohandle_t *slow = NULL;
+    coolmic_tee_t *tee;
+    int ret = -1;
+
+    if ((tee = __setup(&fast, &slow)) == NULL)
+        return -1;
+
+    if (coolmic_tee_set_reader_overflow_policy(tee, 1, COOLMIC_TEE_OVERFLOW_BLOCK) == COOLMIC_ERROR_NONE) {
+        /* reader 0 must not be able to get more data now */
+        coolmic_iohandle_read(fast, buffer, BUFFER_LEN);
+        if (coolmic_iohandle_read(slow, buffer, BUFFER_LEN) == BUFFER_LEN && __check_pattern(buffer, BUFFER_LEN, 2) == 0)
+            ret = 0;
+    }
+
+    __teardown(tee, fast, slow);
+    return ret;
+}
+
+/* A peek pins a dropping reader one buffer behind, the peeked data must stay valid until consumed. */
+static int test_peek_pinned(void)
+{
+    unsigned char buffer[BUFFER_LEN];
+    coolmic_iohandle_t *fast = NULL;
+    coolmic_iohandle_t *slow = NULL;
+    coolmic_tee_t *tee;
+    const void *data;
+    ssize_t len;
+    int ret = -1;
+
+    if ((tee = __setup(&fast, &slow)) == NULL)
+        return -1;
+
+    len = coolmic_iohandle_peek(slow, &data, BUFFER_LEN);
+    if (len > 0) {
+        /* reader 0 must not be able to overwrite the peeked data */
+        coolmic_iohandle_read(fast, buffer, BUFFER_LEN);
+        if (__check_pattern(data, len, 2) == 0 && coolmic_iohandle_consume(slow, len) == COOLMIC_ERROR_NONE)
+            ret = 0;
+    }
+
+    __teardown(tee, fast, slow);
+    return ret;
+}
+
+int main(void)
+{
+    int ret = EXIT_SUCCESS;
+
+    if (test_policy_switch() != 0) {
+        fprintf(stderr, "FAIL: switching a dropping reader one buffer behind to blocking\n");
+        ret = EXIT_FAILURE;
+    }
+
+    if (test_peek_pinned() != 0) {
+        fprintf(stderr, "FAIL: peeking a dropping reader one buffer behind\n");
+        ret = EXIT_FAILURE;
+    }
+
+    return ret;
+}
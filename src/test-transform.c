@@ -0,0 +1,177 @@
+/*
+ *      Copyright (C) Jordan Erickson                     - 2014-2020,
+ *      Copyright (C) Löwenfelsen UG (haftungsbeschränkt) - 2015-2020
+ *       on behalf of Jordan Erickson.
+ */
+
+/*
+ * This file is part of Cool Mic.
+ * 
+ * Cool Mic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Cool Mic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Cool Mic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This tests the master gain of the transform module is bit-exact with the scalar reference
+ * for all 16 bit sample values. The SIMD kernel in use is selected when the library is built.
+ * Build with: make test-transform
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <coolmic-dsp/transform.h>
+#include <coolmic-dsp/iohandle.h>
+#include <coolmic-dsp/coolmic-dsp.h>
+
+/* every channel gets every sample value once */
+#define FRAMES      65536
+
+/* read sizes in [Frame], chosen to hit all SIMD block and channel alignments */
+static const size_t read_frames[] = {1, 7, 31, 1000, 3, 4096};
+
+static const uint16_t scales[] = {1, 2, 3, 100, 255, 256, 257, 1000, 32767, 32768, 65535};
+
+typedef struct {
+    unsigned int channels;
+    size_t frame;
+} source_t;
+
+static inline int16_t __sample(size_t frame, unsigned int channel)
+{
+    return (int16_t)(uint16_t)(frame + channel * 7919);
+}
+
+static ssize_t __source_read(void *userdata, void *buffer, size_t len)
+{
+    source_t *source = userdata;
+    int16_t *out = buffer;
+    size_t frames = len / (2 * source->channels);
+    size_t i;
+    unsigned int c;
+
+    if (frames > (FRAMES - source->frame))
+        frames = FRAMES - source->frame;
+
+    for (i = 0; i < frames; i++, source->frame++)
+        for (c = 0; c < source->channels; c++)
+            *out++ = __sample(source->frame, c);
+
+    return frames * 2 * source->channels;
+}
+
+/* This is the scalar reference, the same as the portable code of the library. */
+static int16_t __reference(int16_t sample, uint16_t gain, uint16_t scale)
+{
+    int64_t tmp = sample;
+
+    tmp *= gain;
+    tmp /= scale;
+    if (tmp >= 32767) {
+        tmp = 32767;
+    } else if (tmp <= -32768) {
+        tmp = -32768;
+    }
+
+    return tmp;
+}
+
+/* Runs all sample values through a transform and compares the result with the reference.
+ * Returns the number of mismatching samples or -1 on error.
+ */
+static ssize_t __run(unsigned int channels, uint16_t scale, const uint16_t *gain)
+{
+    int16_t buffer[4096 * COOLMIC_DSP_TRANSFORM_MAX_CHANNELS];
+    source_t source = {.channels = channels, .frame = 0};
+    coolmic_transform_t *transform;
+    coolmic_iohandle_t *handle;
+    size_t frame = 0;
+    size_t round = 0;
+    ssize_t errors = 0;
+    ssize_t ret;
+    size_t i;
+    unsigned int c;
+
+    if ((transform = coolmic_transform_new(NULL, igloo_RO_NULL, 48000, channels)) == NULL)
+        return -1;
+
+    handle = coolmic_iohandle_new(NULL, igloo_RO_NULL, &source, NULL, __source_read, NULL);
+    coolmic_transform_attach_iohandle(transform, handle);
+    igloo_ro_unref(handle);
+
+    coolmic_transform_set_master_gain(transform, channels, scale, gain);
+
+    handle = coolmic_transform_get_iohandle(transform);
+    while (frame < FRAMES) {
+        ret = coolmic_iohandle_read_frames(handle, buffer, read_frames[round++ % (sizeof(read_frames)/sizeof(*read_frames))]);
+        if (ret < 1) {
+            errors = -1;
+            break;
+        }
+
+        for (i = 0; i < (size_t)ret; i++, frame++)
+            for (c = 0; c < channels; c++)
+                if (buffer[i * channels + c] != __reference(__sample(frame, c), gain[c], scale))
+                    errors++;
+    }
+
+    igloo_ro_unref(handle);
+    igloo_ro_unref(transform);
+
+    return errors;
+}
+
+int main(void)
+{
+    uint16_t gain[COOLMIC_DSP_TRANSFORM_MAX_CHANNELS];
+    unsigned int channels;
+    unsigned int variant;
+    unsigned int c;
+    size_t s;
+    uint16_t scale;
+    ssize_t errors;
+    int ret = EXIT_SUCCESS;
+
+    for (channels = 1; channels <= COOLMIC_DSP_TRANSFORM_MAX_CHANNELS; channels++) {
+        for (s = 0; s < (sizeof(scales)/sizeof(*scales)); s++) {
+            scale = scales[s];
+
+            /* all unity, all the same, and different gains per channel including the extremes */
+            for (variant = 0; variant < 3; variant++) {
+                for (c = 0; c < channels; c++) {
+                    switch (variant) {
+                        case 0: gain[c] = scale; break;
+                        case 1: gain[c] = scale / 2 + 1; break;
+                        default:
+                            switch (c % 5) {
+                                case 0: gain[c] = 0; break;
+                                case 1: gain[c] = 65535; break;
+                                case 2: gain[c] = scale; break;
+                                case 3: gain[c] = scale - 1; break;
+                                default: gain[c] = (uint16_t)(scale * 3 + 12345 * c); break;
+                            }
+                        break;
+                    }
+                }
+
+                errors = __run(channels, scale, gain);
+                if (errors) {
+                    fprintf(stderr, "FAIL: channels=%u, scale=%u, variant=%u: %zi mismatching samples\n", channels, (unsigned int)scale, variant, errors);
+                    ret = EXIT_FAILURE;
+                }
+            }
+        }
+    }
+
+    return ret;
+}
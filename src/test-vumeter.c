@@ -0,0 +1,322 @@
+/*
+ *      Copyright (C) Jordan Erickson                     - 2014-2020,
+ *      Copyright (C) Löwenfelsen UG (haftungsbeschränkt) - 2015-2020
+ *       on behalf of Jordan Erickson.
+ */
+
+/*
+ * This file is part of Cool Mic.
+ * 
+ * Cool Mic is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Cool Mic is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Cool Mic.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This tests the results of the VU-Meter are identical to the scalar reference for 1 to 16 channels
+ * and benchmarks the VU-Meter against the reference.
+ * The kernel in use is selected when the library is built.
+ * Build with: make test-vumeter
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <coolmic-dsp/vumeter.h>
+#include <coolmic-dsp/iohandle.h>
+#include <coolmic-dsp/coolmic-dsp.h>
+
+/* length of the test signal in [Frame] */
+#define FRAMES          48000
+/* length of the benchmark signal in [Sample] and the number of passes over it */
+#define BENCH_SAMPLES   (1 << 20)
+#define BENCH_PASSES    64
+
+typedef struct {
+    const int16_t *data;
+    size_t len;
+    size_t offset;
+    size_t peeked;
+} source_t;
+
+/* The source serves a buffer in memory, directly to the VU-Meter's peek. */
+static ssize_t __source_read(void *userdata, void *buffer, size_t len)
+{
+    source_t *source = userdata;
+
+    if (len > (source->len - source->offset))
+        len = source->len - source->offset;
+
+    memcpy(buffer, (const char*)source->data + source->offset, len);
+    source->offset += len;
+
+    return len;
+}
+
+static ssize_t __source_peek(void *userdata, const void **buffer, size_t len)
+{
+    source_t *source = userdata;
+
+    if (len > (source->len - source->offset))
+        len = source->len - source->offset;
+
+    *buffer = (const char*)source->data + source->offset;
+    source->peeked = len;
+
+    return len;
+}
+
+static int __source_consume(void *userdata, size_t len)
+{
+    source_t *source = userdata;
+
+    if (len > source->peeked)
+        return COOLMIC_ERROR_INVAL;
+
+    source->offset += len;
+    source->peeked = 0;
+
+    return COOLMIC_ERROR_NONE;
+}
+
+static coolmic_vumeter_t *__vumeter_new(source_t *source, const int16_t *data, size_t samples, unsigned int channels)
+{
+    coolmic_vumeter_t *vumeter;
+    coolmic_iohandle_t *handle;
+
+    source->data = data;
+    source->len = samples * 2;
+    source->offset = 0;
+    source->peeked = 0;
+
+    if ((vumeter = coolmic_vumeter_new(NULL, igloo_RO_NULL, 48000, channels)) == NULL)
+        return NULL;
+
+    handle = coolmic_iohandle_new(NULL, igloo_RO_NULL, source, NULL, __source_read, NULL);
+    coolmic_iohandle_set_peek(handle, __source_peek, __source_consume);
+    coolmic_vumeter_attach_iohandle(vumeter, handle);
+    igloo_ro_unref(handle);
+
+    return vumeter;
+}
+
+/* This is the scalar reference, the same as the portable code of the library. */
+typedef struct {
+    unsigned int channels;
+    size_t frames;
+    int16_t global_peak;
+    int16_t channel_peak[COOLMIC_DSP_VUMETER_MAX_CHANNELS];
+    int64_t power[COOLMIC_DSP_VUMETER_MAX_CHANNELS];
+} reference_t;
+
+static void __reference_scan(reference_t *ref, const int16_t *in, size_t frames)
+{
+    size_t i;
+    unsigned int channel = 0;
+
+    for (i = 0; i < frames * ref->channels; i++) {
+        if (abs(*in) > abs(ref->channel_peak[channel])) {
+            ref->channel_peak[channel] = *in;
+            if (abs(*in) > abs(ref->global_peak)) {
+                ref->global_peak = *in;
+            }
+        }
+
+        ref->power[channel] += ((int64_t)*in) * ((int64_t)*in);
+
+        in++;
+        if (++channel == ref->channels)
+            channel = 0;
+    }
+
+    ref->frames += frames;
+}
+
+static double __reference_power(int64_t power, uint64_t samples)
+{
+    double p = (double)(power / (int64_t)samples);
+
+    p = 20.*log10(sqrt(p) / 32768.);
+    return fmin(p, 0.);
+}
+
+/* compares a result with the reference and resets the reference. Returns 0 if they are identical. */
+static int __reference_compare(reference_t *ref, const coolmic_vumeter_result_t *result)
+{
+    int64_t p_all = 0;
+    unsigned int c;
+    int ret = 0;
+
+    if (result->frames != ref->frames || result->channels != ref->channels || result->global_peak != ref->global_peak)
+        ret = -1;
+
+    for (c = 0; c < ref->channels; c++) {
+        p_all += ref->power[c];
+        if (result->channel_peak[c] != ref->channel_peak[c] || result->channel_power[c] != __reference_power(ref->power[c], ref->frames))
+            ret = -1;
+    }
+
+    if (result->global_power != __reference_power(p_all, ref->frames * ref->channels))
+        ret = -1;
+
+    memset(ref, 0, sizeof(*ref));
+    ref->channels = result->channels;
+
+    return ret;
+}
+
+/* xorshift, so the test is the same on all platforms */
+static uint32_t __random(void)
+{
+    static uint32_t state = 2463534242U;
+
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    return state;
+}
+
+/* A signal with peaks growing over time and occasional full scale samples, so new peaks are found all the time. */
+static void __signal(int16_t *data, size_t samples)
+{
+    size_t i;
+    int32_t amplitude;
+
+    for (i = 0; i < samples; i++) {
+        amplitude = 1 + (int32_t)((i * 32768) / samples);
+        data[i] = (int16_t)((int32_t)(__random() % (2 * amplitude)) - amplitude);
+        if (!(__random() % 10007))
+            data[i] = (__random() & 1) ? 32767 : -32768;
+    }
+}
+
+static int test_reference(const int16_t *data)
+{
+    coolmic_vumeter_result_t result;
+    coolmic_vumeter_t *vumeter;
+    source_t source;
+    reference_t ref;
+    unsigned int channels;
+    size_t frames;
+    size_t done;
+    ssize_t ret;
+    int failed = 0;
+
+    for (channels = 1; channels <= COOLMIC_DSP_VUMETER_MAX_CHANNELS; channels++) {
+        if ((vumeter = __vumeter_new(&source, data, FRAMES * channels, channels)) == NULL)
+            return -1;
+
+        memset(&ref, 0, sizeof(ref));
+        ref.channels = channels;
+
+        /* random read sizes, and results taken at random points */
+        done = 0;
+        while (done < FRAMES) {
+            frames = 1 + __random() % 1500;
+            ret = coolmic_vumeter_read(vumeter, frames * channels * 2);
+            if (ret < 1)
+                break;
+
+            __reference_scan(&ref, data + done * channels, ret / (channels * 2));
+            done += ret / (channels * 2);
+
+            if (!(__random() % 8) || done == FRAMES) {
+                if (coolmic_vumeter_result(vumeter, &result) != COOLMIC_ERROR_NONE || __reference_compare(&ref, &result) != 0) {
+                    fprintf(stderr, "FAIL: channels=%u, result at frame %zu differs from the reference\n", channels, done);
+                    failed = 1;
+                    break;
+                }
+            }
+        }
+
+        if (done != FRAMES && !failed) {
+            fprintf(stderr, "FAIL: channels=%u, read stopped at frame %zu\n", channels, done);
+            failed = 1;
+        }
+
+        igloo_ro_unref(vumeter);
+    }
+
+    return failed ? -1 : 0;
+}
+
+static double __now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const int16_t *data, unsigned int channels)
+{
+    const size_t frames = BENCH_SAMPLES / channels;
+    coolmic_vumeter_result_t result;
+    coolmic_vumeter_t *vumeter;
+    source_t source;
+    reference_t ref;
+    double start, vumeter_time, ref_time;
+    size_t pass;
+
+    if ((vumeter = __vumeter_new(&source, data, frames * channels, channels)) == NULL)
+        return;
+
+    start = __now();
+    for (pass = 0; pass < BENCH_PASSES; pass++) {
+        source.offset = 0;
+        while (coolmic_vumeter_read(vumeter, -1) > 0);
+        coolmic_vumeter_result(vumeter, &result);
+    }
+    vumeter_time = __now() - start;
+
+    memset(&ref, 0, sizeof(ref));
+    ref.channels = channels;
+    start = __now();
+    for (pass = 0; pass < BENCH_PASSES; pass++)
+        __reference_scan(&ref, data, frames);
+    ref_time = __now() - start;
+
+    printf("channels=%2u: VU-Meter %7.1f Msamples/s, scalar reference %7.1f Msamples/s, speedup %.2f\n", channels,
+            (frames * channels * BENCH_PASSES) / vumeter_time / 1e6,
+            (frames * channels * BENCH_PASSES) / ref_time / 1e6,
+            ref_time / vumeter_time);
+
+    /* keep the reference from being optimised away */
+    if (ref.global_peak == 1)
+        printf("\n");
+
+    igloo_ro_unref(vumeter);
+}
+
+int main(void)
+{
+    static int16_t data[BENCH_SAMPLES];
+    static const unsigned int bench_channels[] = {1, 2, 6, 16};
+    size_t i;
+    int ret = EXIT_SUCCESS;
+
+    __signal(data, FRAMES * COOLMIC_DSP_VUMETER_MAX_CHANNELS);
+
+    if (test_reference(data) != 0)
+        ret = EXIT_FAILURE;
+
+    __signal(data, BENCH_SAMPLES);
+    for (i = 0; i < (sizeof(bench_channels)/sizeof(*bench_channels)); i++)
+        bench(data, bench_channels[i]);
+
+    return ret;
+}
@@ -27,11 +27,37 @@
 #define COOLMIC_COMPONENT "libcoolmic-dsp/transform"
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include "types_private.h"
+#include "simd_private.h"
 #include <coolmic-dsp/transform.h>
 #include <coolmic-dsp/coolmic-dsp.h>
 #include <coolmic-dsp/logging.h>
 
+/* The SIMD code processes blocks of this many samples. The per lane gains repeat every lcm(channels, SIMD_LANES) samples. */
+#define SIMD_LANES 16
+
+/* flag in master_gain_latest telling the state has not yet been picked up by the audio path */
+#define GAIN_DIRTY 0x4U
+
+/* A master gain setting as used by the audio path */
+typedef struct {
+    /* gain, the gain is gain/scale. A scale of 0 disables the gain. */
+    uint16_t scale;
+    uint16_t gain[COOLMIC_DSP_TRANSFORM_MAX_CHANNELS];
+    /* gain as ratio */
+    float ratio[COOLMIC_DSP_TRANSFORM_MAX_CHANNELS];
+    /* length of the ramp towards this setting in [Frame] */
+    size_t ramp;
+    /* Precomputed values, see __prepare_gain() */
+    int unity;
+    uint32_t magic;
+    unsigned int shift;
+    size_t lanes;
+    uint32_t lane[SIMD_LANES*COOLMIC_DSP_TRANSFORM_MAX_CHANNELS];
+} gain_t;
+
 /* forward declare internally used structures */
 struct coolmic_transform {
     /* base type */
@@ -39,34 +65,57 @@ struct coolmic_transform {
 
     /* IO Handle */
     coolmic_iohandle_t *io;
-    /* iobuffer */
-    char iobuffer[2*COOLMIC_DSP_TRANSFORM_MAX_CHANNELS-1];
-    size_t iobuffer_fill;
+    /* signal format */
+    coolmic_iohandle_format_t format;
     /* signal sample rate */
     uint_least32_t rate;
     /* signal number of channels */
     unsigned int channels;
-    /* Master gain */
-    uint16_t master_gain_scale;
-    uint16_t master_gain_gain[COOLMIC_DSP_TRANSFORM_MAX_CHANNELS];
+
+    /* Master gain
+     * The settings are passed from the control threads to the audio path using a triple buffer.
+     * The control threads write to master_gain[master_gain_back] and swap it with master_gain_latest.
+     * The audio path swaps master_gain_front with master_gain_latest if it is flagged GAIN_DIRTY.
+     * This way the audio path never waits for a lock.
+     */
+    gain_t master_gain[3];
+    atomic_uint master_gain_latest;
+    /* lock for the control threads */
+    pthread_mutex_t master_gain_lock;
+    unsigned int master_gain_back;
+    unsigned int master_gain_ramp;
+    /* state of the audio path */
+    unsigned int master_gain_front;
+    size_t ramp_len;
+    size_t ramp_pos;
+    size_t ramp_lanes;
+    float ramp_from[COOLMIC_DSP_TRANSFORM_MAX_CHANNELS];
+    float ramp_delta[COOLMIC_DSP_TRANSFORM_MAX_CHANNELS];
+    /* per lane ramp, see __ramp_start() */
+    float ramp_lane_base[SIMD_LANES*COOLMIC_DSP_TRANSFORM_MAX_CHANNELS];
+    float ramp_lane_delta[SIMD_LANES*COOLMIC_DSP_TRANSFORM_MAX_CHANNELS];
 };
 
 static void __free_transform(igloo_ro_t self)
 {
     coolmic_transform_t *transform = igloo_RO_TO_TYPE(self, coolmic_transform_t);
     igloo_ro_unref(transform->io);
+    pthread_mutex_destroy(&(transform->master_gain_lock));
 }
 
 igloo_RO_PUBLIC_TYPE(coolmic_transform_t,
         igloo_RO_TYPEDECL_FREE(__free_transform)
         );
 
+static void __prepare_gain(gain_t *gain, unsigned int channels);
+
 /* Management of the encoder object */
 coolmic_transform_t   *coolmic_transform_new(const char *name, igloo_ro_t associated, uint_least32_t rate, unsigned int channels)
 {
     coolmic_transform_t *self;
+    size_t i;
 
-    if (!rate || !channels)
+    if (!rate || !channels || channels > COOLMIC_DSP_TRANSFORM_MAX_CHANNELS)
         return NULL;
 
     self = igloo_ro_new_raw(coolmic_transform_t, name, associated);
@@ -77,6 +126,17 @@ coolmic_transform_t   *coolmic_transform_new(const char *name, igloo_ro_t associ
     self->rate      = rate;
     self->channels  = channels;
 
+    self->format.rate = rate;
+    self->format.channels = channels;
+    self->format.sample_format = COOLMIC_IOHANDLE_SAMPLE_FORMAT_S16;
+
+    pthread_mutex_init(&(self->master_gain_lock), NULL);
+    for (i = 0; i < (sizeof(self->master_gain)/sizeof(*self->master_gain)); i++)
+        __prepare_gain(&(self->master_gain[i]), channels);
+    self->master_gain_front = 0;
+    atomic_init(&(self->master_gain_latest), 1);
+    self->master_gain_back = 2;
+
     return self;
 }
 
@@ -84,6 +144,8 @@ int                 coolmic_transform_attach_iohandle(coolmic_transform_t *self,
 {   
     if (!self) 
         return COOLMIC_ERROR_FAULT;
+    if (handle && coolmic_iohandle_check_format(handle, &(self->format)) != COOLMIC_ERROR_NONE)
+        return COOLMIC_ERROR_INVAL;
     if (self->io)
         igloo_ro_unref(self->io);
     /* ignore errors here as handle is allowed to be NULL */
@@ -98,83 +160,463 @@ static int __free(void *userdata)
     return igloo_ro_unref(self);
 }
 
-static void __process(coolmic_transform_t *self, int16_t *samples, size_t frames)
+/* Prepares the master gain for processing.
+ * The division by the scale is done using a multiplication by a fixed-point reciprocal
+ * m = ceil(2^(31+l)/scale) with 2^(l-1) < scale <= 2^l. For all n < 2^31 this gives
+ * floor(n/scale) = (n*m) >> (31+l) exactly. As |sample*gain| < 2^31 the result is bit-exact
+ * with the integer division.
+ */
+static void __prepare_gain(gain_t *gain, unsigned int channels)
 {
-    size_t frame;
-    size_t channel;
-    int64_t tmp;
+    const uint64_t scale = gain->scale;
+    unsigned int l = 0;
+    size_t i;
+
+    gain->unity = 1;
+    for (i = 0; i < channels; i++) {
+        gain->ratio[i] = scale ? (float)gain->gain[i] / (float)scale : 1.f;
+        if (scale && gain->gain[i] != gain->scale)
+            gain->unity = 0;
+    }
 
-    if (!self->master_gain_scale)
+    if (!scale)
         return;
 
-    for (frame = 0; frame < frames; frame++) {
-        for (channel = 0; channel < self->channels; channel++) {
-            tmp = *samples;
-            tmp *= self->master_gain_gain[channel];
-            tmp /= self->master_gain_scale;
-            if (tmp >= 32767) {
-                tmp = 32767;
-            } else if (tmp <= -32768) {
-                tmp = -32768;
-            }
-            *samples = tmp;
-            samples++;
+    while (((uint64_t)1 << l) < scale)
+        l++;
+
+    gain->magic = ((((uint64_t)1) << (31 + l)) + scale - 1) / scale;
+    gain->shift = 31 + l;
+
+    /* lcm(channels, SIMD_LANES) */
+    gain->lanes = SIMD_LANES;
+    while (gain->lanes % channels)
+        gain->lanes += SIMD_LANES;
+
+    for (i = 0; i < gain->lanes; i++)
+        gain->lane[i] = gain->gain[i % channels];
+}
+
+/* This is the reference implementation. channel is the channel of the first sample. */
+static void __process_scalar(const gain_t *gain, unsigned int channels, int16_t *samples, size_t count, size_t channel)
+{
+    size_t i;
+    int64_t tmp;
+
+    for (i = 0; i < count; i++) {
+        tmp = *samples;
+        tmp *= gain->gain[channel];
+        tmp /= gain->scale;
+        if (tmp >= 32767) {
+            tmp = 32767;
+        } else if (tmp <= -32768) {
+            tmp = -32768;
         }
+        *samples = tmp;
+        samples++;
+
+        if (++channel == channels)
+            channel = 0;
     }
 }
 
-static ssize_t __read(void *userdata, void *buffer, size_t len)
+/* Processes count samples of a ramp. The first sample is the first sample of frame ramp_pos.
+ * The gain for frame k of the ramp is ramp_from + ramp_delta * (k + 1).
+ */
+static void __process_ramp_scalar(coolmic_transform_t *self, int16_t *samples, size_t count, size_t offset)
 {
-    coolmic_transform_t *self = userdata;
-    const size_t framesize = 2 * self->channels;
-    size_t done, tmp;
-    ssize_t ret;
+    size_t i;
+    size_t channel = offset % self->channels;
+    size_t frame = self->ramp_pos + offset / self->channels;
+    float tmp;
+
+    for (i = 0; i < count; i++) {
+        tmp = *samples * (self->ramp_from[channel] + self->ramp_delta[channel] * (float)(frame + 1));
+        if (tmp >= 32767.f) {
+            tmp = 32767.f;
+        } else if (tmp <= -32768.f) {
+            tmp = -32768.f;
+        }
+        *samples = tmp;
+        samples++;
 
-    tmp = len % framesize;
-    len -= tmp;
+        if (++channel == self->channels) {
+            channel = 0;
+            frame++;
+        }
+    }
+}
 
-    if (!len)
-        return 0;
+#if defined(HAVE_SIMD_AVX2)
+static inline __m256i __gain_avx2(__m256i v, __m256i gain, __m256i magic, __m128i shift)
+{
+    const __m256i sign = _mm256_srai_epi32(v, 31);
+    const __m256i n = _mm256_sub_epi32(_mm256_xor_si256(v, sign), sign);
+    const __m256i p = _mm256_mullo_epi32(n, gain);
+    const __m256i q_even = _mm256_srl_epi64(_mm256_mul_epu32(p, magic), shift);
+    const __m256i q_odd = _mm256_srl_epi64(_mm256_mul_epu32(_mm256_srli_epi64(p, 32), magic), shift);
+    const __m256i q = _mm256_or_si256(q_even, _mm256_slli_epi64(q_odd, 32));
+
+    return _mm256_sub_epi32(_mm256_xor_si256(q, sign), sign);
+}
+
+static size_t __process_simd(const gain_t *gain, int16_t *samples, size_t count)
+{
+    const __m256i magic = _mm256_set1_epi32(gain->magic);
+    const __m128i shift = _mm_cvtsi32_si128(gain->shift);
+    size_t lane = 0;
+    size_t i;
+    __m256i x, lo, hi;
+
+    for (i = 0; (i + SIMD_LANES) <= count; i += SIMD_LANES) {
+        x = _mm256_loadu_si256((const __m256i*)(samples + i));
+        lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(x));
+        hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(x, 1));
+        lo = __gain_avx2(lo, _mm256_loadu_si256((const __m256i*)(gain->lane + lane)), magic, shift);
+        hi = __gain_avx2(hi, _mm256_loadu_si256((const __m256i*)(gain->lane + lane + 8)), magic, shift);
+        /* packs works per 128 bit lane, so we need to restore the order */
+        x = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+        _mm256_storeu_si256((__m256i*)(samples + i), x);
+
+        lane += SIMD_LANES;
+        if (lane == gain->lanes)
+            lane = 0;
+    }
+
+    return i;
+}
+
+static inline __m256i __ramp_avx2(__m256i v, const float *base, const float *delta, __m256 frame)
+{
+    const __m256 min = _mm256_set1_ps(-32768.f);
+    const __m256 max = _mm256_set1_ps(32767.f);
+    const __m256 gain = _mm256_add_ps(_mm256_loadu_ps(base), _mm256_mul_ps(_mm256_loadu_ps(delta), frame));
+    __m256 x = _mm256_mul_ps(_mm256_cvtepi32_ps(v), gain);
+
+    x = _mm256_min_ps(_mm256_max_ps(x, min), max);
+
+    return _mm256_cvttps_epi32(x);
+}
 
-    done = 0;
+static size_t __process_ramp_simd(coolmic_transform_t *self, int16_t *samples, size_t count)
+{
+    const size_t lanes = self->ramp_lanes;
+    float frame = self->ramp_pos;
+    size_t lane = 0;
+    size_t i;
+    __m256i x, lo, hi;
+
+    for (i = 0; (i + SIMD_LANES) <= count; i += SIMD_LANES) {
+        x = _mm256_loadu_si256((const __m256i*)(samples + i));
+        lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(x));
+        hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(x, 1));
+        lo = __ramp_avx2(lo, self->ramp_lane_base + lane, self->ramp_lane_delta + lane, _mm256_set1_ps(frame));
+        hi = __ramp_avx2(hi, self->ramp_lane_base + lane + 8, self->ramp_lane_delta + lane + 8, _mm256_set1_ps(frame));
+        x = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+        _mm256_storeu_si256((__m256i*)(samples + i), x);
+
+        lane += SIMD_LANES;
+        if (lane == lanes) {
+            lane = 0;
+            frame += lanes / self->channels;
+        }
+    }
 
-    if (self->iobuffer_fill) {
-        /* As the iobuffer only holds unaligned data and the target buffer has at least space for one slot of aligned data
-         * there is no need to check it's size at this point.
-         */
-        memcpy(buffer, self->iobuffer, self->iobuffer_fill);
-        done = self->iobuffer_fill;
-        self->iobuffer_fill = 0;
+    return i;
+}
+#elif defined(HAVE_SIMD_SSE2)
+static inline __m128i __gain_sse2(__m128i v, __m128i gain, __m128i magic, __m128i shift)
+{
+    const __m128i sign = _mm_srai_epi32(v, 31);
+    const __m128i n = _mm_sub_epi32(_mm_xor_si128(v, sign), sign);
+    /* SSE2 has no 32 bit multiply, so we do even and odd lanes with 64 bit results */
+    const __m128i p_even = _mm_mul_epu32(n, gain);
+    const __m128i p_odd = _mm_mul_epu32(_mm_srli_epi64(n, 32), _mm_srli_epi64(gain, 32));
+    const __m128i q_even = _mm_srl_epi64(_mm_mul_epu32(p_even, magic), shift);
+    const __m128i q_odd = _mm_srl_epi64(_mm_mul_epu32(p_odd, magic), shift);
+    const __m128i q = _mm_or_si128(q_even, _mm_slli_epi64(q_odd, 32));
+
+    return _mm_sub_epi32(_mm_xor_si128(q, sign), sign);
+}
+
+static size_t __process_simd(const gain_t *gain, int16_t *samples, size_t count)
+{
+    const __m128i magic = _mm_set1_epi32(gain->magic);
+    const __m128i shift = _mm_cvtsi32_si128(gain->shift);
+    size_t lane = 0;
+    size_t i;
+    size_t j;
+    __m128i x, lo, hi;
+
+    for (i = 0; (i + SIMD_LANES) <= count; i += SIMD_LANES) {
+        for (j = 0; j < SIMD_LANES; j += 8) {
+            x = _mm_loadu_si128((const __m128i*)(samples + i + j));
+            lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+            hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+            lo = __gain_sse2(lo, _mm_loadu_si128((const __m128i*)(gain->lane + lane + j)), magic, shift);
+            hi = __gain_sse2(hi, _mm_loadu_si128((const __m128i*)(gain->lane + lane + j + 4)), magic, shift);
+            _mm_storeu_si128((__m128i*)(samples + i + j), _mm_packs_epi32(lo, hi));
+        }
+
+        lane += SIMD_LANES;
+        if (lane == gain->lanes)
+            lane = 0;
     }
 
-    ret = coolmic_iohandle_read(self->io, buffer + done, len - done);
-    if (ret > 0) {
-        done += ret;
+    return i;
+}
+
+static inline __m128i __ramp_sse2(__m128i v, const float *base, const float *delta, __m128 frame)
+{
+    const __m128 min = _mm_set1_ps(-32768.f);
+    const __m128 max = _mm_set1_ps(32767.f);
+    const __m128 gain = _mm_add_ps(_mm_loadu_ps(base), _mm_mul_ps(_mm_loadu_ps(delta), frame));
+    __m128 x = _mm_mul_ps(_mm_cvtepi32_ps(v), gain);
+
+    x = _mm_min_ps(_mm_max_ps(x, min), max);
+
+    return _mm_cvttps_epi32(x);
+}
+
+static size_t __process_ramp_simd(coolmic_transform_t *self, int16_t *samples, size_t count)
+{
+    const size_t lanes = self->ramp_lanes;
+    __m128 frame = _mm_set1_ps(self->ramp_pos);
+    size_t lane = 0;
+    size_t i;
+    size_t j;
+    __m128i x, lo, hi;
+
+    for (i = 0; (i + SIMD_LANES) <= count; i += SIMD_LANES) {
+        for (j = 0; j < SIMD_LANES; j += 8) {
+            x = _mm_loadu_si128((const __m128i*)(samples + i + j));
+            lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+            hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+            lo = __ramp_sse2(lo, self->ramp_lane_base + lane + j, self->ramp_lane_delta + lane + j, frame);
+            hi = __ramp_sse2(hi, self->ramp_lane_base + lane + j + 4, self->ramp_lane_delta + lane + j + 4, frame);
+            _mm_storeu_si128((__m128i*)(samples + i + j), _mm_packs_epi32(lo, hi));
+        }
+
+        lane += SIMD_LANES;
+        if (lane == lanes) {
+            lane = 0;
+            frame = _mm_add_ps(frame, _mm_set1_ps(lanes / self->channels));
+        }
     }
 
-    tmp = done % framesize;
-    if (tmp) {
-        memcpy(self->iobuffer, buffer + done - tmp, tmp);
-        self->iobuffer_fill = tmp;
-        done -= tmp;
+    return i;
+}
+#elif defined(HAVE_SIMD_NEON)
+static inline int32x4_t __gain_neon(int32x4_t v, uint32x4_t gain, uint32x2_t magic, int64x2_t shift)
+{
+    const int32x4_t sign = vshrq_n_s32(v, 31);
+    const uint32x4_t p = vmulq_u32(vreinterpretq_u32_s32(vabsq_s32(v)), gain);
+    const uint64x2_t q_lo = vshlq_u64(vmull_u32(vget_low_u32(p), magic), shift);
+    const uint64x2_t q_hi = vshlq_u64(vmull_u32(vget_high_u32(p), magic), shift);
+    const int32x4_t q = vreinterpretq_s32_u32(vcombine_u32(vmovn_u64(q_lo), vmovn_u64(q_hi)));
+
+    return vsubq_s32(veorq_s32(q, sign), sign);
+}
+
+static size_t __process_simd(const gain_t *gain, int16_t *samples, size_t count)
+{
+    const uint32x2_t magic = vdup_n_u32(gain->magic);
+    const int64x2_t shift = vdupq_n_s64(-(int64_t)gain->shift);
+    size_t lane = 0;
+    size_t i;
+    size_t j;
+    int16x8_t x;
+    int32x4_t lo, hi;
+
+    for (i = 0; (i + SIMD_LANES) <= count; i += SIMD_LANES) {
+        for (j = 0; j < SIMD_LANES; j += 8) {
+            x = vld1q_s16(samples + i + j);
+            lo = vmovl_s16(vget_low_s16(x));
+            hi = vmovl_s16(vget_high_s16(x));
+            lo = __gain_neon(lo, vld1q_u32(gain->lane + lane + j), magic, shift);
+            hi = __gain_neon(hi, vld1q_u32(gain->lane + lane + j + 4), magic, shift);
+            vst1q_s16(samples + i + j, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+        }
+
+        lane += SIMD_LANES;
+        if (lane == gain->lanes)
+            lane = 0;
     }
 
-    __process(self, buffer, done/framesize);
+    return i;
+}
+
+static inline int32x4_t __ramp_neon(int32x4_t v, const float *base, const float *delta, float32x4_t frame)
+{
+    const float32x4_t gain = vmlaq_f32(vld1q_f32(base), vld1q_f32(delta), frame);
+    float32x4_t x = vmulq_f32(vcvtq_f32_s32(v), gain);
+
+    x = vminq_f32(vmaxq_f32(x, vdupq_n_f32(-32768.f)), vdupq_n_f32(32767.f));
 
-    return done;
+    return vcvtq_s32_f32(x);
 }
 
-static int __eof(void *userdata)
+static size_t __process_ramp_simd(coolmic_transform_t *self, int16_t *samples, size_t count)
+{
+    const size_t lanes = self->ramp_lanes;
+    float32x4_t frame = vdupq_n_f32(self->ramp_pos);
+    size_t lane = 0;
+    size_t i;
+    size_t j;
+    int16x8_t x;
+    int32x4_t lo, hi;
+
+    for (i = 0; (i + SIMD_LANES) <= count; i += SIMD_LANES) {
+        for (j = 0; j < SIMD_LANES; j += 8) {
+            x = vld1q_s16(samples + i + j);
+            lo = vmovl_s16(vget_low_s16(x));
+            hi = vmovl_s16(vget_high_s16(x));
+            lo = __ramp_neon(lo, self->ramp_lane_base + lane + j, self->ramp_lane_delta + lane + j, frame);
+            hi = __ramp_neon(hi, self->ramp_lane_base + lane + j + 4, self->ramp_lane_delta + lane + j + 4, frame);
+            vst1q_s16(samples + i + j, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+        }
+
+        lane += SIMD_LANES;
+        if (lane == lanes) {
+            lane = 0;
+            frame = vaddq_f32(frame, vdupq_n_f32(lanes / self->channels));
+        }
+    }
+
+    return i;
+}
+#else
+static size_t __process_simd(const gain_t *gain, int16_t *samples, size_t count)
+{
+    (void)gain, (void)samples, (void)count;
+    return 0;
+}
+
+static size_t __process_ramp_simd(coolmic_transform_t *self, int16_t *samples, size_t count)
+{
+    (void)self, (void)samples, (void)count;
+    return 0;
+}
+#endif
+
+/* Starts a ramp from the current gain towards the gain in master_gain_front. Called from the audio path only. */
+static void __ramp_start(coolmic_transform_t *self, const float *from)
+{
+    const gain_t *gain = &(self->master_gain[self->master_gain_front]);
+    size_t lanes = SIMD_LANES;
+    size_t i;
+    size_t c;
+
+    self->ramp_pos = 0;
+    self->ramp_len = gain->ramp;
+
+    if (!self->ramp_len)
+        return;
+
+    for (c = 0; c < self->channels; c++) {
+        self->ramp_from[c] = from[c];
+        self->ramp_delta[c] = (gain->ratio[c] - from[c]) / (float)self->ramp_len;
+    }
+
+    /* The gain of lane i of a SIMD block is ramp_lane_base[i] + ramp_lane_delta[i] * frame
+     * with frame being the frame of the ramp at the start of the repeating lane pattern.
+     */
+    while (lanes % self->channels)
+        lanes += SIMD_LANES;
+    self->ramp_lanes = lanes;
+
+    for (i = 0; i < lanes; i++) {
+        c = i % self->channels;
+        self->ramp_lane_base[i] = self->ramp_from[c] + self->ramp_delta[c] * (float)(i / self->channels + 1);
+        self->ramp_lane_delta[i] = self->ramp_delta[c];
+    }
+}
+
+/* picks up new gain settings from the control threads. Called from the audio path only. */
+static void __update_gain(coolmic_transform_t *self)
+{
+    float from[COOLMIC_DSP_TRANSFORM_MAX_CHANNELS];
+    size_t c;
+
+    if (!(atomic_load_explicit(&(self->master_gain_latest), memory_order_relaxed) & GAIN_DIRTY))
+        return;
+
+    /* the gain we are at right now */
+    for (c = 0; c < self->channels; c++) {
+        if (self->ramp_len) {
+            from[c] = self->ramp_from[c] + self->ramp_delta[c] * (float)self->ramp_pos;
+        } else {
+            from[c] = self->master_gain[self->master_gain_front].ratio[c];
+        }
+    }
+
+    self->master_gain_front = atomic_exchange_explicit(&(self->master_gain_latest), self->master_gain_front, memory_order_acq_rel) & ~GAIN_DIRTY;
+
+    __ramp_start(self, from);
+}
+
+static void __process(coolmic_transform_t *self, int16_t *samples, size_t frames)
+{
+    const gain_t *gain;
+    size_t count;
+    size_t done;
+
+    __update_gain(self);
+
+    if (self->ramp_len) {
+        count = self->ramp_len - self->ramp_pos;
+        if (count > frames)
+            count = frames;
+
+        frames -= count;
+        count *= self->channels;
+
+        done = __process_ramp_simd(self, samples, count);
+        __process_ramp_scalar(self, samples + done, count - done, done);
+
+        self->ramp_pos += count / self->channels;
+        if (self->ramp_pos == self->ramp_len)
+            self->ramp_len = 0;
+
+        samples += count;
+    }
+
+    gain = &(self->master_gain[self->master_gain_front]);
+    if (!frames || !gain->scale || gain->unity)
+        return;
+
+    count = frames * self->channels;
+    done = __process_simd(gain, samples, count);
+    __process_scalar(gain, self->channels, samples + done, count - done, done % self->channels);
+}
+
+static ssize_t __read(void *userdata, void *buffer, size_t len)
 {
     coolmic_transform_t *self = userdata;
+    const size_t framesize = 2 * self->channels;
+    ssize_t ret;
+
+    if (!self->io)
+        return 0;
 
-    /* we do not need to check iobuffer here because it only holds unaligned data and requires more backend reads anyway. */
+    ret = coolmic_iohandle_read_frames(self->io, buffer, len / framesize);
+    if (ret < 1)
+        return ret;
+
+    __process(self, buffer, ret);
+
+    return ret * framesize;
+}
+
+static int __eof(void *userdata)
+{
+    coolmic_transform_t *self = userdata;
 
-    /* There is no data in the buffer. If we do not have an IO handle this is EOF. */
+    /* If we do not have an IO handle this is EOF. */
     if (!self->io)
         return 1;
 
-    /* We have no data in the buffer but an IO handle. Just forward the question to the next layer. */
+    /* Just forward the question to the next layer. */
     return coolmic_iohandle_eof(self->io);
 }
 
@@ -186,37 +628,76 @@ coolmic_iohandle_t *coolmic_transform_get_iohandle(coolmic_transform_t *self)
         return NULL;
 
     ret = coolmic_iohandle_new(NULL, igloo_RO_NULL, self, __free, __read, __eof);
-    if (!ret)
+    if (!ret) {
         igloo_ro_unref(self);
+        return NULL;
+    }
+
+    coolmic_iohandle_set_format(ret, &(self->format));
 
     return ret;
 }
 
 int                    coolmic_transform_set_master_gain(coolmic_transform_t *self, unsigned int channels, uint16_t scale, const uint16_t *gain)
 {
+    gain_t *next;
+
     if (!self)
         return COOLMIC_ERROR_FAULT;
 
-    if (!channels || !scale || !gain) {
-        self->master_gain_scale = 0;
-        return COOLMIC_ERROR_NONE;
-    }
+    pthread_mutex_lock(&(self->master_gain_lock));
+    next = &(self->master_gain[self->master_gain_back]);
 
-    if (channels == self->channels) {
-        self->master_gain_scale = scale;
-        memcpy(self->master_gain_gain, gain, sizeof(*gain)*channels);
-        return COOLMIC_ERROR_NONE;
+    if (!channels || !scale || !gain) {
+        next->scale = 0;
+    } else if (channels == self->channels) {
+        next->scale = scale;
+        memcpy(next->gain, gain, sizeof(*gain)*channels);
     } else if (channels == 1) {
-        self->master_gain_scale = scale;
+        next->scale = scale;
         for (channels = 0; channels < self->channels; channels++)
-            self->master_gain_gain[channels] = *gain;
-        return COOLMIC_ERROR_NONE;
+            next->gain[channels] = *gain;
     } else if (channels == 2 && self->channels == 1) {
-        self->master_gain_scale = scale;
-        self->master_gain_gain[0] = ((uint32_t)gain[0] + (uint32_t)gain[1]) / (uint32_t)2;
-        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "gain: scale=%u, gain[0]=%u (in: %u, %u)", (unsigned int)self->master_gain_scale, (unsigned int)self->master_gain_gain[0], (unsigned int)gain[0], (unsigned int)gain[1]);
-        return COOLMIC_ERROR_NONE;
+        next->scale = scale;
+        next->gain[0] = ((uint32_t)gain[0] + (uint32_t)gain[1]) / (uint32_t)2;
+        coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "gain: scale=%u, gain[0]=%u (in: %u, %u)", (unsigned int)next->scale, (unsigned int)next->gain[0], (unsigned int)gain[0], (unsigned int)gain[1]);
     } else {
+        pthread_mutex_unlock(&(self->master_gain_lock));
         return COOLMIC_ERROR_INVAL;
     }
+
+    next->ramp = (size_t)self->master_gain_ramp * (size_t)self->rate / (size_t)1000;
+    __prepare_gain(next, self->channels);
+
+    /* publish */
+    self->master_gain_back = atomic_exchange_explicit(&(self->master_gain_latest), self->master_gain_back | GAIN_DIRTY, memory_order_acq_rel) & ~GAIN_DIRTY;
+    pthread_mutex_unlock(&(self->master_gain_lock));
+
+    return COOLMIC_ERROR_NONE;
+}
+
+int                    coolmic_transform_set_master_gain_ramp(coolmic_transform_t *self, unsigned int ramp)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    pthread_mutex_lock(&(self->master_gain_lock));
+    self->master_gain_ramp = ramp;
+    pthread_mutex_unlock(&(self->master_gain_lock));
+
+    return COOLMIC_ERROR_NONE;
+}
+
+unsigned int           coolmic_transform_get_master_gain_ramp(coolmic_transform_t *self)
+{
+    unsigned int ret;
+
+    if (!self)
+        return 0;
+
+    pthread_mutex_lock(&(self->master_gain_lock));
+    ret = self->master_gain_ramp;
+    pthread_mutex_unlock(&(self->master_gain_lock));
+
+    return ret;
 }
@@ -28,10 +28,34 @@
 #include <stdlib.h>
 #include <string.h>
 #include "types_private.h"
+#include "simd_private.h"
+#include "seqlock_private.h"
 #include <coolmic-dsp/vumeter.h>
 #include <coolmic-dsp/coolmic-dsp.h>
 #include <coolmic-dsp/logging.h>
 
+/* maximum amount of data processed per call in [Byte] */
+#define MAX_READ_LEN    (2*COOLMIC_DSP_VUMETER_MAX_CHANNELS*256)
+
+/* The SIMD code processes blocks of this many samples. Lanes map to channels with a period of lcm(channels, SIMD_LANES) samples. */
+#define SIMD_LANES      8
+#define MAX_PATTERN     (SIMD_LANES*COOLMIC_DSP_VUMETER_MAX_CHANNELS)
+
+/* True peak: 4x oversampling using the 48 tap polyphase filter from ITU-R BS.1770-4 Annex 2.
+ * The coefficients are multiples of 2^-13 so they are stored as integers.
+ */
+#define TP_PHASES       4
+#define TP_TAPS         12
+#define TP_SCALE        (8192.*32768.)
+#define TP_MAX_FRAMES   (MAX_READ_LEN/2)
+
+static const int16_t true_peak_filter[TP_PHASES][TP_TAPS] = {
+    {   14,   90, -161,  272,  -487, 1125, 7964,  -838,  390, -218,  122,  -68},
+    { -239,  240, -424,  730, -1364, 3810, 6388, -1641,  832, -477,  271, -155},
+    { -155,  271, -477,  832, -1641, 6388, 3810, -1364,  730, -424,  240, -239},
+    {  -68,  122, -218,  390,  -838, 7964, 1125,  -487,  272, -161,   90,   14}
+};
+
 struct coolmic_vumeter {
     /* base type */
     igloo_ro_base_t __base;
@@ -44,16 +68,30 @@ struct coolmic_vumeter {
     /* number of channels */
     unsigned int channels;
 
-    /* buffer for calculation */
-    char buffer[2*COOLMIC_DSP_VUMETER_MAX_CHANNELS*32];
-    /* how much data we have in the buffer in [Byte] */
-    size_t buffer_fill;
+    /* input format */
+    coolmic_iohandle_format_t format;
+
+    /* lcm(channels, SIMD_LANES) */
+    size_t pattern;
 
     /* Storage for per channel power values */
     int64_t power[COOLMIC_DSP_VUMETER_MAX_CHANNELS];
 
+    /* true peak state, the maximum is in units of TP_SCALE */
+    int true_peak;
+    float true_peak_max[COOLMIC_DSP_VUMETER_MAX_CHANNELS];
+    int16_t true_peak_history[COOLMIC_DSP_VUMETER_MAX_CHANNELS][TP_TAPS - 1];
+
     /* result */
     coolmic_vumeter_result_t result;
+
+    /* interval in [ms] and [frame] to publish snapshots at, 0 if disabled */
+    unsigned int interval;
+    size_t interval_frames;
+
+    /* last published result */
+    seqlock_t snapshot_seq;
+    coolmic_vumeter_result_t snapshot;
 };
 
 static void __free(igloo_ro_t self)
@@ -70,7 +108,7 @@ coolmic_vumeter_t  *coolmic_vumeter_new(const char *name, igloo_ro_t associated,
 {
     coolmic_vumeter_t *ret;
 
-    if (!rate || !channels)
+    if (!rate || !channels || channels > COOLMIC_DSP_VUMETER_MAX_CHANNELS)
         return NULL;
 
     ret = igloo_ro_new_raw(coolmic_vumeter_t, name, associated);
@@ -80,6 +118,14 @@ coolmic_vumeter_t  *coolmic_vumeter_new(const char *name, igloo_ro_t associated,
     ret->rate = rate;
     ret->channels = channels;
 
+    ret->pattern = SIMD_LANES;
+    while (ret->pattern % channels)
+        ret->pattern += SIMD_LANES;
+
+    ret->format.rate = rate;
+    ret->format.channels = channels;
+    ret->format.sample_format = COOLMIC_IOHANDLE_SAMPLE_FORMAT_S16;
+
     coolmic_vumeter_reset(ret);
 
     return ret;
@@ -91,6 +137,7 @@ int                 coolmic_vumeter_reset(coolmic_vumeter_t *self)
         return COOLMIC_ERROR_FAULT;
 
     memset(&(self->power), 0, sizeof(self->power));
+    memset(&(self->true_peak_max), 0, sizeof(self->true_peak_max));
     memset(&(self->result), 0, sizeof(self->result));
     self->result.rate = self->rate;
     self->result.channels = self->channels;
@@ -98,10 +145,66 @@ int                 coolmic_vumeter_reset(coolmic_vumeter_t *self)
     return COOLMIC_ERROR_NONE;
 }
 
+int                 coolmic_vumeter_set_true_peak(coolmic_vumeter_t *self, int enable)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    if (enable && !self->true_peak)
+        memset(&(self->true_peak_history), 0, sizeof(self->true_peak_history));
+
+    self->true_peak = enable ? 1 : 0;
+
+    return COOLMIC_ERROR_NONE;
+}
+
+int                 coolmic_vumeter_get_true_peak(coolmic_vumeter_t *self)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+    return self->true_peak;
+}
+
+int                 coolmic_vumeter_set_interval(coolmic_vumeter_t *self, unsigned int interval)
+{
+    if (!self)
+        return COOLMIC_ERROR_FAULT;
+
+    self->interval = interval;
+    self->interval_frames = ((uint64_t)self->rate * interval) / 1000;
+    if (interval && !self->interval_frames)
+        self->interval_frames = 1;
+
+    return COOLMIC_ERROR_NONE;
+}
+
+ssize_t             coolmic_vumeter_get_interval(coolmic_vumeter_t *self)
+{
+    if (!self)
+        return -1;
+    return self->interval;
+}
+
+int                 coolmic_vumeter_get_snapshot(coolmic_vumeter_t *self, coolmic_vumeter_result_t *result, unsigned int *serial)
+{
+    unsigned int ret;
+
+    if (!self || !result)
+        return COOLMIC_ERROR_FAULT;
+
+    ret = __seqlock_read(&(self->snapshot_seq), result, &(self->snapshot), sizeof(*result));
+    if (serial)
+        *serial = ret;
+
+    return ret ? COOLMIC_ERROR_NONE : COOLMIC_ERROR_INVAL;
+}
+
 int                 coolmic_vumeter_attach_iohandle(coolmic_vumeter_t *self, coolmic_iohandle_t *handle)
 {
     if (!self)
         return COOLMIC_ERROR_FAULT;
+    if (handle && coolmic_iohandle_check_format(handle, &(self->format)) != COOLMIC_ERROR_NONE)
+        return COOLMIC_ERROR_INVAL;
     if (self->in)
         igloo_ro_unref(self->in);
     /* ignore errors here as handle is allowed to be NULL */
@@ -109,30 +212,309 @@ int                 coolmic_vumeter_attach_iohandle(coolmic_vumeter_t *self, coo
     return COOLMIC_ERROR_NONE;
 }
 
-static ssize_t      coolmic_vumeter_read_phy(coolmic_vumeter_t *self, ssize_t maxlen)
+/* This is the reference implementation. channel is the channel of the first sample. */
+static void __scan_scalar(coolmic_vumeter_t *self, const int16_t *in, size_t count, size_t channel)
 {
-    size_t len;
-    ssize_t ret;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (abs(*in) > abs(self->result.channel_peak[channel])) {
+            self->result.channel_peak[channel] = *in;
+            if (abs(*in) > abs(self->result.global_peak)) {
+                self->result.global_peak = *in;
+            }
+        }
 
-    len = sizeof(self->buffer) - self->buffer_fill;
+        self->power[channel] += ((int64_t)*in) * ((int64_t)*in);
 
-    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Physical read request, maxlen=%zi, len=%zu", maxlen, len);
+        /* go to next value */
+        in++;
+        if (++channel == self->channels)
+            channel = 0;
+    }
+}
 
-    if (maxlen >= 0 && len > (size_t)maxlen)
-        len = maxlen;
+#if defined(HAVE_SIMD_SSE2) || defined(HAVE_SIMD_NEON)
+/* Scans whole patterns of samples. The SIMD kernels only calculate the per lane maximum of the absolute values
+ * and the per lane sum of squares. The peak values including their sign are then found by a scalar rescan.
+ * As the peaks rarely increase this rescan is rare. Returns the number of samples processed.
+ */
+static size_t __scan_simd(coolmic_vumeter_t *self, const int16_t *in, size_t count)
+{
+    const size_t pattern = self->pattern;
+    uint16_t lane_peak[MAX_PATTERN];
+    uint64_t lane_power[MAX_PATTERN];
+    unsigned int peak[COOLMIC_DSP_VUMETER_MAX_CHANNELS];
+    unsigned int global = 0;
+    size_t done;
+    size_t i, c;
+#if defined(HAVE_SIMD_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16(-32768);
+    const __m128i mask_even = _mm_set1_epi32(0x0000FFFF);
+    const __m128i mask_odd = _mm_set1_epi32(0xFFFF0000);
+    __m128i acc_peak[MAX_PATTERN/SIMD_LANES];
+    __m128i acc_power[MAX_PATTERN/SIMD_LANES][4];
+    __m128i x, sign, a, even, odd;
+    size_t v;
+
+    count -= count % pattern;
+    if (!count)
+        return 0;
 
-    ret = coolmic_iohandle_read(self->in, self->buffer + self->buffer_fill, len);
-    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Physical read on iohandle returned %zi bytes", ret);
+    for (v = 0; v < (pattern / SIMD_LANES); v++) {
+        /* maximum is done on biased values as SSE2 has no unsigned 16 bit maximum */
+        acc_peak[v] = bias;
+        acc_power[v][0] = acc_power[v][1] = acc_power[v][2] = acc_power[v][3] = zero;
+    }
 
-    if (ret == -1 && !self->buffer_fill) {
-        return -1;
-    } else if (ret == -1) {
+    for (done = 0; done < count; done += pattern) {
+        for (v = 0; v < (pattern / SIMD_LANES); v++) {
+            x = _mm_loadu_si128((const __m128i*)(in + done + v * SIMD_LANES));
+            /* |x| as unsigned, this also works for -32768 */
+            sign = _mm_srai_epi16(x, 15);
+            a = _mm_sub_epi16(_mm_xor_si128(x, sign), sign);
+            acc_peak[v] = _mm_max_epi16(acc_peak[v], _mm_xor_si128(a, bias));
+            /* squares of even and odd lanes as 32 bit values */
+            even = _mm_madd_epi16(x, _mm_and_si128(x, mask_even));
+            odd = _mm_madd_epi16(x, _mm_and_si128(x, mask_odd));
+            acc_power[v][0] = _mm_add_epi64(acc_power[v][0], _mm_unpacklo_epi32(even, zero));
+            acc_power[v][1] = _mm_add_epi64(acc_power[v][1], _mm_unpackhi_epi32(even, zero));
+            acc_power[v][2] = _mm_add_epi64(acc_power[v][2], _mm_unpacklo_epi32(odd, zero));
+            acc_power[v][3] = _mm_add_epi64(acc_power[v][3], _mm_unpackhi_epi32(odd, zero));
+        }
+    }
+
+    for (v = 0; v < (pattern / SIMD_LANES); v++) {
+        uint64_t tmp[4][2];
+
+        _mm_storeu_si128((__m128i*)(lane_peak + v * SIMD_LANES), _mm_xor_si128(acc_peak[v], bias));
+        for (i = 0; i < 4; i++)
+            _mm_storeu_si128((__m128i*)tmp[i], acc_power[v][i]);
+        /* even: lanes 0, 2 and 4, 6; odd: lanes 1, 3 and 5, 7 */
+        lane_power[v * SIMD_LANES + 0] = tmp[0][0];
+        lane_power[v * SIMD_LANES + 2] = tmp[0][1];
+        lane_power[v * SIMD_LANES + 4] = tmp[1][0];
+        lane_power[v * SIMD_LANES + 6] = tmp[1][1];
+        lane_power[v * SIMD_LANES + 1] = tmp[2][0];
+        lane_power[v * SIMD_LANES + 3] = tmp[2][1];
+        lane_power[v * SIMD_LANES + 5] = tmp[3][0];
+        lane_power[v * SIMD_LANES + 7] = tmp[3][1];
+    }
+#elif defined(HAVE_SIMD_NEON)
+    uint16x8_t acc_peak[MAX_PATTERN/SIMD_LANES];
+    uint64x2_t acc_power[MAX_PATTERN/SIMD_LANES][4];
+    int16x8_t x;
+    uint32x4_t lo, hi;
+    size_t v;
+
+    count -= count % pattern;
+    if (!count)
         return 0;
+
+    for (v = 0; v < (pattern / SIMD_LANES); v++) {
+        acc_peak[v] = vdupq_n_u16(0);
+        acc_power[v][0] = acc_power[v][1] = acc_power[v][2] = acc_power[v][3] = vdupq_n_u64(0);
+    }
+
+    for (done = 0; done < count; done += pattern) {
+        for (v = 0; v < (pattern / SIMD_LANES); v++) {
+            x = vld1q_s16(in + done + v * SIMD_LANES);
+            /* vabsq_s16() wraps -32768 to itself, which is 32768 as unsigned */
+            acc_peak[v] = vmaxq_u16(acc_peak[v], vreinterpretq_u16_s16(vabsq_s16(x)));
+            lo = vreinterpretq_u32_s32(vmull_s16(vget_low_s16(x), vget_low_s16(x)));
+            hi = vreinterpretq_u32_s32(vmull_s16(vget_high_s16(x), vget_high_s16(x)));
+            acc_power[v][0] = vaddw_u32(acc_power[v][0], vget_low_u32(lo));
+            acc_power[v][1] = vaddw_u32(acc_power[v][1], vget_high_u32(lo));
+            acc_power[v][2] = vaddw_u32(acc_power[v][2], vget_low_u32(hi));
+            acc_power[v][3] = vaddw_u32(acc_power[v][3], vget_high_u32(hi));
+        }
     }
 
-    self->buffer_fill += ret;
+    for (v = 0; v < (pattern / SIMD_LANES); v++) {
+        vst1q_u16(lane_peak + v * SIMD_LANES, acc_peak[v]);
+        for (i = 0; i < 4; i++)
+            vst1q_u64(lane_power + v * SIMD_LANES + i * 2, acc_power[v][i]);
+    }
+#endif
 
-    return ret;
+    for (c = 0; c < self->channels; c++)
+        peak[c] = 0;
+
+    for (i = 0; i < pattern; i++) {
+        c = i % self->channels;
+        self->power[c] += lane_power[i];
+        if (lane_peak[i] > peak[c])
+            peak[c] = lane_peak[i];
+    }
+
+    /* rescan for the first sample with the new peak value */
+    for (c = 0; c < self->channels; c++) {
+        if (peak[c] > global)
+            global = peak[c];
+
+        if (peak[c] > (unsigned int)abs(self->result.channel_peak[c])) {
+            for (i = c; i < count; i += self->channels) {
+                if ((unsigned int)abs(in[i]) == peak[c]) {
+                    self->result.channel_peak[c] = in[i];
+                    break;
+                }
+            }
+        }
+    }
+
+    if (global > (unsigned int)abs(self->result.global_peak)) {
+        for (i = 0; i < count; i++) {
+            if ((unsigned int)abs(in[i]) == global) {
+                self->result.global_peak = in[i];
+                break;
+            }
+        }
+    }
+
+    return count;
+}
+#else
+static size_t __scan_simd(coolmic_vumeter_t *self, const int16_t *in, size_t count)
+{
+    (void)self, (void)in, (void)count;
+    return 0;
+}
+#endif
+
+/* Oversamples the signal of a single channel and returns the maximum absolute value.
+ * x points to the first new sample and is preceded by TP_TAPS - 1 samples of history.
+ * This is the reference implementation, start is the first sample to process.
+ */
+static float __true_peak_scalar(const int16_t *x, size_t start, size_t count)
+{
+    float max = 0.f;
+    int32_t y;
+    size_t i, k, p;
+
+    for (i = start; i < count; i++) {
+        for (p = 0; p < TP_PHASES; p++) {
+            y = 0;
+            for (k = 0; k < TP_TAPS; k++)
+                y += (int32_t)true_peak_filter[p][k] * x[(ssize_t)i - (ssize_t)k];
+            if (fabsf((float)y) > max)
+                max = fabsf((float)y);
+        }
+    }
+
+    return max;
+}
+
+/* The SIMD kernels compute 8 outputs per phase at once, the sums are exact.
+ * They return the number of samples processed and update *max.
+ */
+#if defined(HAVE_SIMD_SSE2)
+static size_t __true_peak_simd(const int16_t *x, size_t count, float *max)
+{
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    __m128i coef[TP_PHASES][TP_TAPS / 2];
+    __m128i acc[TP_PHASES][2];
+    __m128i a, b, lo, hi;
+    __m128 peak = _mm_setzero_ps();
+    float tmp[4];
+    size_t i, k, p;
+
+    /* pairs of taps, matching the interleaved samples below */
+    for (p = 0; p < TP_PHASES; p++)
+        for (k = 0; k < TP_TAPS; k += 2)
+            coef[p][k / 2] = _mm_set1_epi32((uint16_t)true_peak_filter[p][k] | ((uint32_t)(uint16_t)true_peak_filter[p][k + 1] << 16));
+
+    for (i = 0; (i + 8) <= count; i += 8) {
+        for (p = 0; p < TP_PHASES; p++)
+            acc[p][0] = acc[p][1] = _mm_setzero_si128();
+
+        for (k = 0; k < TP_TAPS; k += 2) {
+            a = _mm_loadu_si128((const __m128i*)(x + (ssize_t)i - (ssize_t)k));
+            b = _mm_loadu_si128((const __m128i*)(x + (ssize_t)i - (ssize_t)k - 1));
+            lo = _mm_unpacklo_epi16(a, b);
+            hi = _mm_unpackhi_epi16(a, b);
+            for (p = 0; p < TP_PHASES; p++) {
+                acc[p][0] = _mm_add_epi32(acc[p][0], _mm_madd_epi16(lo, coef[p][k / 2]));
+                acc[p][1] = _mm_add_epi32(acc[p][1], _mm_madd_epi16(hi, coef[p][k / 2]));
+            }
+        }
+
+        for (p = 0; p < TP_PHASES; p++) {
+            peak = _mm_max_ps(peak, _mm_and_ps(_mm_cvtepi32_ps(acc[p][0]), abs_mask));
+            peak = _mm_max_ps(peak, _mm_and_ps(_mm_cvtepi32_ps(acc[p][1]), abs_mask));
+        }
+    }
+
+    _mm_storeu_ps(tmp, peak);
+    for (k = 0; k < 4; k++)
+        if (tmp[k] > *max)
+            *max = tmp[k];
+
+    return i;
+}
+#elif defined(HAVE_SIMD_NEON)
+static size_t __true_peak_simd(const int16_t *x, size_t count, float *max)
+{
+    int32x4_t acc[TP_PHASES][2];
+    int16x8_t a;
+    float32x4_t peak = vdupq_n_f32(0.f);
+    float tmp[4];
+    size_t i, k, p;
+
+    for (i = 0; (i + 8) <= count; i += 8) {
+        for (p = 0; p < TP_PHASES; p++)
+            acc[p][0] = acc[p][1] = vdupq_n_s32(0);
+
+        for (k = 0; k < TP_TAPS; k++) {
+            a = vld1q_s16(x + (ssize_t)i - (ssize_t)k);
+            for (p = 0; p < TP_PHASES; p++) {
+                acc[p][0] = vmlal_n_s16(acc[p][0], vget_low_s16(a), true_peak_filter[p][k]);
+                acc[p][1] = vmlal_n_s16(acc[p][1], vget_high_s16(a), true_peak_filter[p][k]);
+            }
+        }
+
+        for (p = 0; p < TP_PHASES; p++) {
+            peak = vmaxq_f32(peak, vabsq_f32(vcvtq_f32_s32(acc[p][0])));
+            peak = vmaxq_f32(peak, vabsq_f32(vcvtq_f32_s32(acc[p][1])));
+        }
+    }
+
+    vst1q_f32(tmp, peak);
+    for (k = 0; k < 4; k++)
+        if (tmp[k] > *max)
+            *max = tmp[k];
+
+    return i;
+}
+#else
+static size_t __true_peak_simd(const int16_t *x, size_t count, float *max)
+{
+    (void)x, (void)count, (void)max;
+    return 0;
+}
+#endif
+
+static void __true_peak(coolmic_vumeter_t *self, const int16_t *in, size_t frames)
+{
+    int16_t buffer[TP_TAPS - 1 + TP_MAX_FRAMES];
+    int16_t *x = buffer + TP_TAPS - 1;
+    float max;
+    unsigned int c;
+    size_t i, done;
+
+    for (c = 0; c < self->channels; c++) {
+        /* deinterleave into a linear buffer behind the history of the last call */
+        memcpy(buffer, self->true_peak_history[c], sizeof(self->true_peak_history[c]));
+        for (i = 0; i < frames; i++)
+            x[i] = in[i * self->channels + c];
+
+        max = self->true_peak_max[c];
+        done = __true_peak_simd(x, frames, &max);
+        max = fmaxf(max, __true_peak_scalar(x, done, frames));
+        self->true_peak_max[c] = max;
+
+        memcpy(self->true_peak_history[c], buffer + frames, sizeof(self->true_peak_history[c]));
+    }
 }
 
 ssize_t             coolmic_vumeter_read(coolmic_vumeter_t *self, ssize_t maxlen)
@@ -140,8 +522,9 @@ ssize_t             coolmic_vumeter_read(coolmic_vumeter_t *self, ssize_t maxlen
     ssize_t ret;
     size_t framesize;
     size_t frames;
-    size_t f, c;
-    int16_t *in;
+    size_t count;
+    size_t done;
+    const void *data;
 
     coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Read request, maxlen=%zi", maxlen);
 
@@ -150,40 +533,43 @@ ssize_t             coolmic_vumeter_read(coolmic_vumeter_t *self, ssize_t maxlen
         return -1;
     }
 
-    ret = coolmic_vumeter_read_phy(self, maxlen);
-    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Got %zi byte", ret);
-
-    in = (int16_t*)(self->buffer);
-
     framesize = self->channels * 2;
-    frames = self->buffer_fill / framesize;
-
-    for (f = 0; f < frames; f++) {
-        for (c = 0; c < self->channels; c++) {
-            if (abs(*in) > abs(self->result.channel_peak[c])) {
-                self->result.channel_peak[c] = *in;
-                if (abs(*in) > abs(self->result.global_peak)) {
-                    self->result.global_peak = *in;
-                }
-            }
+    frames = MAX_READ_LEN / framesize;
+    if (maxlen >= 0 && frames > ((size_t)maxlen / framesize))
+        frames = maxlen / framesize;
+
+    /* do not read past the end of the current interval */
+    if (self->interval_frames && self->result.frames < self->interval_frames && frames > (self->interval_frames - self->result.frames))
+        frames = self->interval_frames - self->result.frames;
+
+    /* work directly on the data of the backend */
+    ret = coolmic_iohandle_peek_frames(self->in, &data, frames);
+    coolmic_logging_log(COOLMIC_LOGGING_LEVEL_DEBUG, COOLMIC_ERROR_NONE, "Got %zi frames", ret);
+    if (ret < 0)
+        return -1;
 
-            self->power[c] += ((int64_t)*in) * ((int64_t)*in);
+    frames = ret;
+    count = frames * self->channels;
 
-            /* go to next value */
-            in++;
-        }
-    }
+    done = __scan_simd(self, data, count);
+    __scan_scalar(self, (const int16_t*)data + done, count - done, done % self->channels);
+
+    if (self->true_peak)
+        __true_peak(self, data, frames);
 
     self->result.frames += frames;
 
-    if ((frames * framesize) < self->buffer_fill) {
-        memmove(self->buffer, self->buffer + (frames * framesize), self->buffer_fill - (frames * framesize));
-        self->buffer_fill -= frames * framesize;
-    } else {
-        self->buffer_fill = 0;
+    if (frames)
+        coolmic_iohandle_consume_frames(self->in, frames);
+
+    if (self->interval_frames && self->result.frames >= self->interval_frames) {
+        coolmic_vumeter_result_t result;
+
+        if (coolmic_vumeter_result(self, &result) == COOLMIC_ERROR_NONE)
+            __seqlock_write(&(self->snapshot_seq), &(self->snapshot), &result, sizeof(result));
     }
 
-    return ret;
+    return frames * framesize;
 }
 
 int                 coolmic_vumeter_result(coolmic_vumeter_t *self, coolmic_vumeter_result_t *result)
@@ -211,6 +597,17 @@ int                 coolmic_vumeter_result(coolmic_vumeter_t *self, coolmic_vume
     p = fmin(p, 0.);
     self->result.global_power = p;
 
+    self->result.global_true_peak = -HUGE_VAL;
+    for (c = 0; c < self->channels; c++) {
+        if (self->true_peak && self->true_peak_max[c] > 0.f) {
+            p = 20.*log10(self->true_peak_max[c] / TP_SCALE);
+        } else {
+            p = -HUGE_VAL;
+        }
+        self->result.channel_true_peak[c] = p;
+        self->result.global_true_peak = fmax(self->result.global_true_peak, p);
+    }
+
     memcpy(result, &(self->result), sizeof(self->result));
     coolmic_vumeter_reset(self);
 